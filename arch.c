@@ -0,0 +1,371 @@
+/*
+
+module: arch.c
+
+purpose: TAR command, server side, and ustar header helpers
+         the tree is walked with getdents64() and openat() relative to the
+         directory fds (no full path lookup per file, no symlink following) and
+         every body goes out with sendfile(), without copies in user space.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "ratelimit.h"
+#include "pathidx.h"
+#include "arch.h"
+
+#define ARCH_DENTS 8192 /* getdents64() buffer, one per directory level. */
+
+extern char *prog_name;
+
+/* Layout of the records returned by getdents64(). */
+struct arch_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct arch_walk
+{
+	int connfd;
+	struct rl_conn *rl;
+	const char *pattern; /* NULL = every file of the tree */
+	int maxdepth;
+	char path[ARCH_MAXPATH]; /* name of the current entry inside the archive */
+	long files;
+	long long bytes;
+};
+
+static const unsigned char arch_zero[ARCH_BLOCK];
+
+/* Writes v in a numeric field of len bytes: octal, or base-256 (GNU) if it does not fit. */
+static void arch_number(unsigned char *field, size_t len, uint64_t v)
+{
+	int i;
+
+	if (len < 12 || v < (1ULL << (3 * (len - 1))))
+		snprintf((char *)field, len, "%0*llo", (int)len - 1, (unsigned long long)v);
+	else
+	{
+		for (i = len - 1; i > 0; i--, v >>= 8)
+			field[i] = v & 0xff;
+		field[0] = 0x80;
+	}
+}
+
+static uint64_t arch_getnumber(const unsigned char *field, size_t len)
+{
+	uint64_t v = 0;
+	size_t i;
+
+	if (field[0] & 0x80)
+	{
+		for (i = 1; i < len; i++)
+			v = (v << 8) | field[i];
+		return v;
+	}
+	for (i = 0; i < len && field[i] == ' '; i++)
+		;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		v = (v << 3) | (field[i] - '0');
+	return v;
+}
+
+/* Builds a ustar header. name must fit in 100 bytes (see arch_entry_header()). */
+void arch_header(unsigned char *block, const char *name, char type, uint64_t size, uint64_t mtime, unsigned int mode)
+{
+	unsigned int sum = 0;
+	int i;
+
+	memset(block, 0, ARCH_BLOCK);
+	strncpy((char *)block, name, 100);
+	arch_number(block + 100, 8, mode & 07777);
+	arch_number(block + 108, 8, 0);
+	arch_number(block + 116, 8, 0);
+	arch_number(block + 124, 12, size);
+	arch_number(block + 136, 12, mtime);
+	block[156] = type;
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+
+	memset(block + 148, ' ', 8);
+	for (i = 0; i < ARCH_BLOCK; i++)
+		sum += block[i];
+	snprintf((char *)block + 148, 8, "%06o", sum);
+	block[155] = ' ';
+}
+
+/* Returns 1 if block is a header, 0 if it is a zero block, -1 if the checksum is wrong. */
+int arch_parse(const unsigned char *block, struct arch_entry *e)
+{
+	unsigned int sum = 0;
+	int i;
+
+	if (memcmp(block, arch_zero, ARCH_BLOCK) == 0)
+		return 0;
+
+	for (i = 0; i < ARCH_BLOCK; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : block[i];
+	if (sum != arch_getnumber(block + 148, 8))
+		return -1;
+
+	memcpy(e->name, block, 100);
+	e->name[100] = '\0';
+	/* ustar prefix field */
+	if (block[345] != '\0' && memcmp(block + 257, "ustar", 5) == 0)
+		snprintf(e->name, sizeof(e->name), "%.155s/%.100s", (const char *)block + 345, (const char *)block);
+	e->type = block[156] == '\0' ? '0' : block[156];
+	e->mode = arch_getnumber(block + 100, 8);
+	e->size = arch_getnumber(block + 124, 12);
+	e->mtime = arch_getnumber(block + 136, 12);
+	return 1;
+}
+
+static int arch_pad(int connfd, uint64_t size)
+{
+	size_t pad = (ARCH_BLOCK - size % ARCH_BLOCK) % ARCH_BLOCK;
+
+	return (pad == 0 || sendn(connfd, arch_zero, pad, MSG_NOSIGNAL) == (ssize_t)pad) ? 0 : -1;
+}
+
+/* Header of w->path; names longer than 100 bytes are preceded by a GNU 'L' entry. */
+static int arch_entry_header(struct arch_walk *w, char type, uint64_t size, uint64_t mtime, unsigned int mode)
+{
+	unsigned char block[ARCH_BLOCK];
+	size_t len = strlen(w->path);
+
+	if (len >= 100)
+	{
+		arch_header(block, "././@LongLink", 'L', len + 1, 0, 0);
+		if (sendn(w->connfd, block, ARCH_BLOCK, MSG_NOSIGNAL | MSG_MORE) != ARCH_BLOCK ||
+			sendn(w->connfd, w->path, len + 1, MSG_NOSIGNAL | MSG_MORE) != (ssize_t)(len + 1) ||
+			arch_pad(w->connfd, len + 1) < 0)
+			return -1;
+	}
+	arch_header(block, w->path, type, size, mtime, mode);
+	return sendn(w->connfd, block, ARCH_BLOCK, MSG_NOSIGNAL | MSG_MORE) == ARCH_BLOCK ? 0 : -1;
+}
+
+/* Sends one regular file. Returns -1 only if the connection failed. */
+static int arch_file(struct arch_walk *w, int dirfd, const char *name)
+{
+	struct stat st;
+	uint64_t sent = 0;
+	ssize_t n;
+	size_t len;
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW)) < 0)
+		return 0; /* vanished or not readable: skip it */
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return 0;
+	}
+
+	if (arch_entry_header(w, '0', st.st_size, st.st_mtime, st.st_mode) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	while (sent < (uint64_t)st.st_size)
+	{
+		len = st.st_size - sent < ARCH_CHUNK ? st.st_size - sent : ARCH_CHUNK;
+		rl_acquire(w->rl, len);
+		if ((n = sendfilen(w->connfd, fd, sent, len)) < 0)
+		{
+			close(fd);
+			return -1;
+		}
+		if (n == 0)
+		{
+			/* Truncated while being sent: the size is already in the header, fill with zeros. */
+			err_msg("(%s) error - '%s' shrank while being archived", prog_name, w->path);
+			for (; sent < (uint64_t)st.st_size; sent += len)
+			{
+				len = st.st_size - sent < ARCH_BLOCK ? st.st_size - sent : ARCH_BLOCK;
+				if (sendn(w->connfd, arch_zero, len, MSG_NOSIGNAL) != (ssize_t)len)
+				{
+					close(fd);
+					return -1;
+				}
+			}
+			break;
+		}
+		sent += n;
+	}
+	close(fd);
+
+	w->files++;
+	w->bytes += st.st_size;
+	return arch_pad(w->connfd, st.st_size);
+}
+
+/* Walks the directory dirfd, whose entries are named w->path[0..plen) + name. */
+static int arch_dir(struct arch_walk *w, int dirfd, size_t plen, int depth)
+{
+	char buf[ARCH_DENTS];
+	struct arch_dirent64 *d;
+	struct stat st;
+	unsigned char type;
+	long n, off;
+	size_t len;
+	int fd, rc;
+
+	while ((n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0)
+	{
+		for (off = 0; off < n; off += d->d_reclen)
+		{
+			d = (struct arch_dirent64 *)(buf + off);
+			if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+				continue;
+
+			len = strlen(d->d_name);
+			if (plen + len + 2 > ARCH_MAXPATH)
+				continue;
+			memcpy(w->path + plen, d->d_name, len + 1);
+
+			type = d->d_type;
+			if (type == DT_UNKNOWN) /* some filesystems do not fill d_type */
+			{
+				if (fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+					continue;
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+			}
+
+			if (type == DT_REG && (w->pattern == NULL || fnmatch(w->pattern, w->path, FNM_PATHNAME | FNM_PERIOD) == 0))
+			{
+				if (arch_file(w, dirfd, d->d_name) < 0)
+					return -1;
+			}
+			else if (type == DT_DIR && depth < w->maxdepth)
+			{
+				if ((fd = openat(dirfd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0)
+					continue;
+
+				/* Directory entries only when the whole tree is sent, so empty ones are kept. */
+				if (w->pattern == NULL && fstat(fd, &st) == 0)
+				{
+					w->path[plen + len] = '/';
+					w->path[plen + len + 1] = '\0';
+					if (arch_entry_header(w, '5', 0, st.st_mtime, st.st_mode) < 0)
+					{
+						close(fd);
+						return -1;
+					}
+				}
+				w->path[plen + len] = '/';
+				rc = arch_dir(w, fd, plen + len + 1, depth + 1);
+				close(fd);
+				if (rc < 0)
+					return -1;
+			}
+		}
+	}
+	w->path[plen] = '\0';
+	return 0;
+}
+
+/* Serves "TAR pattern". Returns 0 if the connection can go on, -1 if it must be closed. */
+int arch_serve(int connfd, struct rl_conn *rl, const char *pattern, const char *peer)
+{
+	struct arch_walk w;
+	char base[ARCH_MAXPATH];
+	const char *wild, *slash;
+	struct stat st;
+	int dirfd, i;
+
+	if (pattern == NULL || *pattern == '\0' || strlen(pattern) >= ARCH_MAXPATH)
+	{
+		err_msg("(%s) error - illegal TAR command from client [%s]", prog_name, peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	printf("(%s) --- client [%s] asked to send archive of '%s'\n", prog_name, peer, pattern);
+
+	memset(&w, 0, sizeof(w));
+	w.connfd = connfd;
+	w.rl = rl;
+	w.maxdepth = ARCH_MAXDEPTH;
+
+	/* The directory part ends at the last '/' before the first wildcard. */
+	wild = strpbrk(pattern, "*?[");
+	if (wild == NULL && stat(pattern, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		/* Directory: whole tree, names start with its last component. */
+		snprintf(base, sizeof(base), "%s", pattern);
+		for (i = strlen(base); i > 1 && base[i - 1] == '/'; i--)
+			base[i - 1] = '\0';
+		slash = strrchr(base, '/');
+		snprintf(w.path, sizeof(w.path), "%s/", slash != NULL ? slash + 1 : base);
+	}
+	else
+	{
+		for (slash = wild != NULL ? wild : pattern + strlen(pattern); slash > pattern && *slash != '/'; slash--)
+			;
+		if (*slash == '/')
+		{
+			snprintf(base, sizeof(base), "%.*s", (int)(slash - pattern) + 1, pattern);
+			w.pattern = slash + 1;
+		}
+		else
+		{
+			strcpy(base, ".");
+			w.pattern = pattern;
+		}
+		/* "*" does not cross '/': no need to go deeper than the pattern. */
+		for (w.maxdepth = 0, wild = w.pattern; (wild = strchr(wild, '/')) != NULL; wild++)
+			w.maxdepth++;
+	}
+
+	if ((dirfd = pi_open(base, O_RDONLY | O_DIRECTORY)) < 0)
+	{
+		err_ret("(%s) error - cannot open directory '%s' for client [%s]", prog_name, base, peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	if (sendn(connfd, "+OK\r\n", 5, MSG_NOSIGNAL | MSG_MORE) != 5)
+	{
+		close(dirfd);
+		return -1;
+	}
+
+	/* Directory mode: the root itself is the first entry. */
+	if (w.pattern == NULL && arch_entry_header(&w, '5', 0, st.st_mtime, st.st_mode) < 0)
+	{
+		close(dirfd);
+		return -1;
+	}
+
+	i = arch_dir(&w, dirfd, strlen(w.path), 0);
+	close(dirfd);
+	if (i < 0 || sendn(connfd, arch_zero, ARCH_BLOCK, MSG_NOSIGNAL | MSG_MORE) != ARCH_BLOCK ||
+		sendn(connfd, arch_zero, ARCH_BLOCK, MSG_NOSIGNAL) != ARCH_BLOCK)
+	{
+		err_ret("(%s) error - sending archive of '%s' failed with client [%s]", prog_name, pattern, peer);
+		return -1;
+	}
+
+	printf("(%s) --- sent archive of '%s' (%ld files, %lld bytes) to client [%s]\n", prog_name, pattern, w.files, w.bytes, peer);
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*
+
+module: arch.h
+
+purpose: definitions of the TAR command (arch.c)
+
+         request:  "TAR pattern\r\n", where pattern is a directory (whole tree),
+                   a file, or a glob; the wildcards are matched with fnmatch()
+                   (FNM_PATHNAME) on the path below the directory part
+         response: "+OK\r\n" followed by a ustar archive of the matching files
+                   (names relative to the directory part of the pattern; GNU
+                   long names and base-256 sizes when the ustar fields are too
+                   small), terminated by two zero blocks; "-ERR\r\n" if the
+                   directory part cannot be opened
+
+*/
+
+#ifndef _ARCH_H
+
+#define _ARCH_H
+
+#include <stdint.h>
+
+#define MSG_TAR "TAR "
+#define ARCH_BLOCK 512		  /* tar block. */
+#define ARCH_MAXPATH 4096	  /* Longest name inside the archive. */
+#define ARCH_MAXDEPTH 64	  /* Deepest directory level walked. */
+#define ARCH_CHUNK (1 << 20)	  /* Bytes per sendfile() call (rate limiter granularity). */
+
+/* Header fields the client needs to extract an entry. */
+struct arch_entry
+{
+	char name[ARCH_MAXPATH];
+	char type; /* '0' file, '5' directory, 'L' GNU long name of the next entry */
+	uint64_t size;
+	uint64_t mtime;
+	unsigned int mode;
+};
+
+struct rl_conn;
+
+void arch_header(unsigned char *block, const char *name, char type, uint64_t size, uint64_t mtime, unsigned int mode);
+
+int arch_parse(const unsigned char *block, struct arch_entry *e);
+
+int arch_serve(int connfd, struct rl_conn *rl, const char *pattern, const char *peer);
+
+#endif
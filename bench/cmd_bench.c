@@ -0,0 +1,186 @@
+/*
+
+module: cmd_bench.c
+
+purpose: costo dell'analisi di GET in pipeline, senza disco né rete.
+         In memoria: cs_scan() con ogni implementazione (avx2, sse2, swar,
+         memchr) e il vecchio percorso (strncmp() + un byte alla volta fino
+         a '\n' + strtok()) sullo stesso buffer. Su una socketpair: i
+         comandi presi dal server con recv() di 4 byte e readline_unbuffered()
+         oppure a raffiche con cs_next().
+
+         cmd_bench [comandi] [ripetizioni]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../cmdscan.h"
+
+#define BENCH_NAME 64 /* Lunghezza massima dei nomi generati. */
+
+char *prog_name;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Raffica di GET con nomi di lunghezza variabile, come "GET dir07/file00042.dat\r\n". */
+static char *make_burst(int ncmd, size_t *len)
+{
+	char *buf = malloc((size_t)ncmd * (BENCH_NAME + 8));
+	size_t n = 0;
+	int i;
+
+	if (buf == NULL)
+		err_sys("(%s) error - malloc() failed", prog_name);
+	for (i = 0; i < ncmd; i++)
+		n += sprintf(buf + n, "GET dir%02d/%.*sfile%05d.dat\r\n", i % 100, i % 23, "abcdefghijklmnopqrstuvw", i);
+	*len = n;
+	return buf;
+}
+
+static void report(const char *what, int ncmd, int reps, double secs, unsigned long check)
+{
+	printf("%-26s %8.2f ns/cmd  %8.2f Mcmd/s  (%lu)\n", what, secs * 1e9 / ((double)ncmd * reps),
+	       (double)ncmd * reps / secs / 1e6, check);
+}
+
+/* In memoria: tutte le righe di ogni raffica con cs_scan(). */
+static void bench_scan(const char *impl, const char *burst, size_t len, int ncmd, int reps)
+{
+	static struct cs_cmd cmd[CS_BATCH];
+	char *buf = malloc(len);
+	unsigned long check = 0;
+	size_t off, used, n, i;
+	double t;
+	int r;
+
+	if (buf == NULL || cs_set_impl(impl) < 0)
+	{
+		free(buf);
+		return;
+	}
+	memcpy(buf, burst, len);
+
+	t = now();
+	for (r = 0; r < reps; r++)
+		for (off = 0; off < len; off += used)
+		{
+			n = cs_scan(buf + off, len - off, cmd, CS_BATCH, &used);
+			for (i = 0; i < n; i++)
+				check += cmd[i].namelen;
+		}
+	report(impl, ncmd, reps, now() - t, check);
+	free(buf);
+}
+
+/* In memoria: il percorso di prima, un comando alla volta. */
+static void bench_bytewise(const char *burst, size_t len, int ncmd, int reps)
+{
+	char line[4096], *token;
+	unsigned long check = 0;
+	size_t off, n;
+	double t;
+	int r;
+
+	t = now();
+	for (r = 0; r < reps; r++)
+		for (off = 0; off + 4 <= len;)
+		{
+			if (strncmp(burst + off, "GET ", 4) != 0)
+				break;
+			off += 4;
+			for (n = 0; off < len && n < sizeof(line) - 1; n++)
+				if ((line[n] = burst[off++]) == '\n')
+				{
+					n++;
+					break;
+				}
+			line[n] = '\0';
+			if ((token = strtok(line, "\r")) != NULL)
+				check += strlen(token);
+		}
+	report("bytewise (old)", ncmd, reps, now() - t, check);
+}
+
+/* Socketpair: il client scrive la raffica, il "server" la legge con il vecchio
+   percorso (old = 1) o con cs_next(). */
+static void bench_socket(int old, const char *burst, size_t len, int ncmd, int reps)
+{
+	char buffer[4096];
+	unsigned long check = 0;
+	struct cs_cmd *cmd;
+	int sv[2], r, i, bufsize = 4 << 20;
+	double t, secs = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+		err_sys("(%s) error - socketpair() failed", prog_name);
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+	for (r = 0; r < reps; r++)
+	{
+		/* La raffica è già tutta nella socket, come dopo un RTT di un client in pipeline. */
+		if (writen(sv[0], burst, len) != (ssize_t)len)
+			err_sys("(%s) error - write() on the socketpair failed", prog_name);
+		cs_reset();
+
+		t = now();
+		for (i = 0; i < ncmd; i++)
+			if (old)
+			{
+				if (recv(sv[1], buffer, 4, 0) != 4 || readline_unbuffered(sv[1], buffer, sizeof(buffer)) <= 0)
+					err_quit("(%s) error - short burst", prog_name);
+				check += strlen(strtok(buffer, "\r"));
+			}
+			else
+			{
+				if ((cmd = cs_next(sv[1])) == NULL)
+					err_quit("(%s) error - short burst", prog_name);
+				check += cmd->namelen;
+			}
+		secs += now() - t;
+	}
+	report(old ? "socket, recv() per byte" : "socket, cs_next()", ncmd, reps, secs, check);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+int main(int argc, char *argv[])
+{
+	int ncmd = argc > 1 ? atoi(argv[1]) : 1000;
+	int reps = argc > 2 ? atoi(argv[2]) : 1000;
+	const char *impls[] = {"avx2", "sse2", "swar", "memchr"};
+	size_t len, i;
+	char *burst;
+
+	prog_name = argv[0];
+	if (ncmd < 1 || reps < 1)
+		err_quit("usage: %s [commands] [repetitions]", prog_name);
+
+	burst = make_burst(ncmd, &len);
+	printf("%d GET, %.1f byte/comando, default %s\n", ncmd, (double)len / ncmd, cs_impl());
+
+	for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+		bench_scan(impls[i], burst, len, ncmd, reps);
+	bench_bytewise(burst, len, ncmd, reps);
+
+	/* Con le system call bastano meno ripetizioni. */
+	bench_socket(1, burst, len, ncmd, reps / 100 + 1);
+	bench_socket(0, burst, len, ncmd, reps / 100 + 1);
+
+	free(burst);
+	return 0;
+}
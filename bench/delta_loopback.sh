@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Benchmark su loopback: aggiornamento di una copia locale con GET (file intero)
+# e con DGET (-D, solo le differenze), dopo qualche modifica sparsa al file del
+# server (byte sostituiti, inseriti e tolti). Da lanciare dalla directory con
+# server2 e client1 compilati.
+#
+#     bench/delta_loopback.sh [MiB del file] [banda del server, es. 117m]
+#
+# Senza limite di banda il confronto è con la memoria; con -r 117m il server
+# invia come su una LAN a 1 Gb/s.
+
+SIZE=${1:-256}
+RATE=${2:-}
+PORT=9600
+DIR=$(mktemp -d)
+BIN=$(pwd)
+
+trap 'kill $SRV 2>/dev/null; rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/srv" "$DIR/out"
+head -c $((SIZE << 20)) /dev/urandom > "$DIR/srv/file"
+
+"$BIN/server2" ${RATE:+-r $RATE} $PORT > "$DIR/server.log" 2>&1 &
+SRV=$!
+sleep 0.3
+
+# Copia locale iniziale, poi le modifiche sul server.
+(cd "$DIR/out" && "$BIN/client1" 127.0.0.1 $PORT "$DIR/srv/file" > /dev/null 2>&1)
+cp "$DIR/out/file" "$DIR/base"
+for off in 1 7 19 42 77 91; do
+	printf 'modifica' | dd of="$DIR/srv/file" bs=1 seek=$((SIZE * off * 10486)) conv=notrunc 2> /dev/null
+done
+# A metà file 4 KiB tolti e 8 byte inseriti: i blocchi successivi si spostano.
+{ head -c $((SIZE << 19)) "$DIR/srv/file"; printf 'inserito'; tail -c +$(((SIZE << 19) + 4097)) "$DIR/srv/file"; } > "$DIR/tmp"
+mv "$DIR/tmp" "$DIR/srv/file"
+
+run()
+{
+	name=$1; copts=$2
+	cp "$DIR/base" "$DIR/out/file"
+	sync
+	start=$(date +%s.%N)
+	(cd "$DIR/out" && "$BIN/client1" $copts 127.0.0.1 $PORT "$DIR/srv/file" > "$DIR/$name.log" 2>&1) || echo "$name: transfer failed"
+	end=$(date +%s.%N)
+	cmp -s "$DIR/srv/file" "$DIR/out/file" || echo "$name: file differs"
+	awk -v n="$name" -v a=$start -v b=$end 'BEGIN { printf "%-6s %8.3f s\n", n, b - a }'
+	grep "^Delta" "$DIR/$name.log"
+}
+
+run get ""
+run dget "-D"
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Prova su loopback della distribuzione multicast: N client1 -M ricevono gli
+# stessi file da un solo invio di server2 -M sul gruppo, con una perdita
+# simulata sui ricevitori; quello che la FEC non ricostruisce arriva con RGET.
+# Da lanciare dalla directory con server2 e client1 compilati.
+#
+#     bench/mcast_loopback.sh [ricevitori] [MiB per file] [perdita %] [banda, es. 50m]
+#
+# Per ogni ricevitore: byte arrivati dal gruppo, ricostruiti con la FEC e
+# chiesti al server con RGET; alla fine i byte inviati dal server su TCP
+# rispetto a quelli che N GET avrebbero richiesto.
+
+N=${1:-8}
+SIZE=${2:-16}
+LOSS=${3:-2}
+RATE=${4:-50m}
+PORT=9700
+GROUP=239.255.70.1:9701:127.0.0.1
+DIR=$(mktemp -d)
+BIN=$(pwd)
+
+trap 'kill $SRV 2>/dev/null; rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/srv"
+head -c $((SIZE << 20)) /dev/urandom > "$DIR/srv/uno"
+head -c $((SIZE << 19)) /dev/urandom > "$DIR/srv/due"
+head -c 1000 /dev/urandom > "$DIR/srv/tre"
+
+# I ricevitori entrano nel gruppo prima dell'annuncio.
+PIDS=
+i=1
+while [ $i -le $N ]; do
+	mkdir "$DIR/r$i"
+	(cd "$DIR/r$i" && exec "$BIN/client1" -M $GROUP:$LOSS 127.0.0.1 $PORT "$DIR/srv/uno" "$DIR/srv/due" "$DIR/srv/tre" > "$DIR/r$i.log" 2>&1) &
+	PIDS="$PIDS $!"
+	i=$((i + 1))
+done
+sleep 0.2
+
+start=$(date +%s.%N)
+"$BIN/server2" -M $GROUP:$RATE $PORT "$DIR/srv/uno" "$DIR/srv/due" "$DIR/srv/tre" > "$DIR/server.log" 2>&1 &
+SRV=$!
+
+fail=0
+for p in $PIDS; do
+	wait $p || fail=$((fail + 1))
+done
+end=$(date +%s.%N)
+
+i=1
+while [ $i -le $N ]; do
+	for f in uno due tre; do
+		cmp -s "$DIR/srv/$f" "$DIR/r$i/$f" || { echo "r$i: $f differs"; fail=$((fail + 1)); }
+	done
+	awk -v r=r$i '/^Multicast/ { a += $2; b += $5; c += $9 } END { printf "%-4s %10d B dal gruppo %9d B con la FEC %9d B con RGET\n", r, a, b, c }' "$DIR/r$i.log"
+	i=$((i + 1))
+done
+
+total=$(cat "$DIR/srv/uno" "$DIR/srv/due" "$DIR/srv/tre" | wc -c)
+awk -v n=$N -v t=$total -v a=$start -v b=$end -v f=$fail '/^Multicast/ { c += $9 } END {
+	printf "%d ricevitori in %.2f s, %d errori; TCP: %d B contro %d B con N GET\n", n, b - a, f, c, n * t }' "$DIR"/r*.log
+[ $fail -eq 0 ]
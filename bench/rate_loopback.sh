@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Verifica del limite di banda per connessione (-r) sulla stessa macchina:
+# lo stesso file con CGET su TCP (pacing nel kernel) e su socket AF_UNIX
+# (token bucket in user space, il kernel lì non rallenta l'invio). Da lanciare
+# dalla directory con server2 e client1 compilati.
+#
+#     bench/rate_loopback.sh [MiB] [banda, es. 1m]
+#
+# Esce con errore se un trasferimento finisce in meno dell'80% del tempo
+# atteso (byte / banda).
+
+SIZE=${1:-4}
+RATE=${2:-1m}
+PORT=9720
+DIR=$(mktemp -d)
+BIN=$(pwd)
+
+trap 'kill $SRV1 $SRV2 2>/dev/null; rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/srv" "$DIR/tcp" "$DIR/unix"
+head -c $((SIZE << 20)) /dev/urandom > "$DIR/srv/file"
+
+"$BIN/server2" -r $RATE $PORT > "$DIR/tcp.log" 2>&1 &
+SRV1=$!
+"$BIN/server2" -r $RATE -U "$DIR/sock" > "$DIR/unix.log" 2>&1 &
+SRV2=$!
+sleep 0.3
+
+# Suffissi come rl_parse(): potenze di 1024.
+BYTES=$(awk -v r=$RATE 'BEGIN { m = 1; s = tolower(substr(r, length(r)));
+	if (s == "k") m = 1024; else if (s == "m") m = 1024 ^ 2; else if (s == "g") m = 1024 ^ 3; print r * m }')
+fail=0
+
+run()
+{
+	name=$1; shift
+	start=$(date +%s.%N)
+	(cd "$DIR/$name" && "$BIN/client1" -C "$@" "$DIR/srv/file" > "$DIR/$name.out" 2>&1) || { echo "$name: transfer failed"; fail=1; }
+	end=$(date +%s.%N)
+	cmp -s "$DIR/srv/file" "$DIR/$name/file" || { echo "$name: file differs"; fail=1; }
+	awk -v n=$name -v a=$start -v b=$end -v s=$((SIZE << 20)) -v r=$BYTES 'BEGIN {
+		t = b - a; e = s / r; printf "%-5s %7.2f s (attesi %.2f s)\n", n, t, e; exit t < 0.8 * e }' || { echo "$name: rate not enforced"; fail=1; }
+}
+
+run tcp 127.0.0.1 $PORT
+run unix -U "$DIR/sock"
+
+[ $fail -eq 0 ]
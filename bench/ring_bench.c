@@ -0,0 +1,139 @@
+/*
+
+module: ring_bench.c
+
+purpose: latenza e throughput di GET ripetute sulla stessa connessione via TCP,
+         AF_UNIX e anelli in memoria condivisa, per file da 64 B a 1 MiB.
+         Lanciato da bench/ring_loopback.sh, che avvia i server e crea i file.
+
+         ring_bench <host> <port> <socket_path> <iterazioni> <file1> <file2> ...
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../shmring.h"
+
+#define BENCH_MAXFILE (1 << 20)
+
+char *prog_name;
+
+static char body[BENCH_MAXFILE + 8];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Una GET sulla socket: restituisce la dimensione del file. */
+static uint32_t get_sock(int sockfd, const char *name)
+{
+	char req[4096];
+	uint32_t size;
+
+	snprintf(req, sizeof(req), "GET %s\r\n", name);
+	Writen(sockfd, req, strlen(req));
+	if (Readn(sockfd, body, 9) != 9 || strncmp(body, "+OK\r\n", 5) != 0)
+		err_quit("(%s) error - GET '%s' failed", prog_name, name);
+	memcpy(&size, body + 5, 4);
+	size = ntohl(size);
+	if (size > BENCH_MAXFILE || Readn(sockfd, body, size + 4) != (ssize_t)size + 4)
+		err_quit("(%s) error - GET '%s' failed", prog_name, name);
+	return size;
+}
+
+/* La stessa GET sugli anelli. */
+static uint32_t get_ring(struct shm_chan *c, const char *name)
+{
+	char req[4096];
+	uint32_t size;
+
+	snprintf(req, sizeof(req), "GET %s\r\n", name);
+	if (shm_write(c, req, strlen(req)) < 0 || shm_read(c, body, 9) != 9 || strncmp(body, "+OK\r\n", 5) != 0)
+		err_quit("(%s) error - GET '%s' failed", prog_name, name);
+	memcpy(&size, body + 5, 4);
+	size = ntohl(size);
+	if (size > BENCH_MAXFILE || shm_read(c, body, size + 4) != (ssize_t)size + 4)
+		err_quit("(%s) error - GET '%s' failed", prog_name, name);
+	return size;
+}
+
+static int ring_open(const char *path, struct shm_chan *c)
+{
+	char buf[5];
+	int sockfd, fd;
+	ssize_t n;
+
+	sockfd = unix_connect(path);
+	Writen(sockfd, MSG_RING "\r\n", 6);
+	if ((n = Read_fd(sockfd, buf, 5, &fd)) < 5 || strncmp(buf, "+OK\r\n", 5) != 0 || fd < 0 || shm_attach(c, sockfd, fd) < 0)
+		err_quit("(%s) error - ring negotiation failed", prog_name);
+	close(fd);
+	return sockfd;
+}
+
+static void report(const char *transport, uint32_t size, int iter, double secs)
+{
+	printf("%-6s %8u B  %9.2f us/GET  %9.1f MiB/s\n", transport, size, secs * 1e6 / iter,
+	       (double)size * iter / secs / (1 << 20));
+}
+
+int main(int argc, char *argv[])
+{
+	struct shm_chan c;
+	int tcpfd, unixfd, ringfd, iter, i, j;
+	uint32_t size = 0;
+	double t;
+
+	prog_name = argv[0];
+	if (argc < 6)
+		err_quit("usage: %s <host> <port> <socket_path> <iterations> <file1> ...", prog_name);
+	iter = atoi(argv[4]);
+
+	/* TCP_NODELAY: le risposte sono scritte in più pezzi. */
+	tcp_set_profile("latency");
+	tcpfd = tcp_connect(argv[1], argv[2]);
+	unixfd = unix_connect(argv[3]);
+	ringfd = ring_open(argv[3], &c);
+
+	for (i = 5; i < argc; i++)
+	{
+		/* Primo giro a vuoto: file in page cache e pagine dei buffer toccate. */
+		for (j = 0; j < iter / 10 + 1; j++)
+		{
+			get_sock(tcpfd, argv[i]);
+			get_sock(unixfd, argv[i]);
+			get_ring(&c, argv[i]);
+		}
+
+		t = now();
+		for (j = 0; j < iter; j++)
+			size = get_sock(tcpfd, argv[i]);
+		report("tcp", size, iter, now() - t);
+
+		t = now();
+		for (j = 0; j < iter; j++)
+			size = get_sock(unixfd, argv[i]);
+		report("unix", size, iter, now() - t);
+
+		t = now();
+		for (j = 0; j < iter; j++)
+			size = get_ring(&c, argv[i]);
+		report("ring", size, iter, now() - t);
+	}
+
+	shm_close(&c);
+	close(ringfd);
+	close(unixfd);
+	close(tcpfd);
+	return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Benchmark sulla stessa macchina: GET ripetute via TCP, AF_UNIX e anelli in
+# memoria condivisa (-R), con file da 64 B a 1 MiB. Da lanciare dalla directory
+# con server2 e ring_bench compilati.
+#
+#     bench/ring_loopback.sh [iterazioni]
+#
+# server2 perché ring_bench tiene aperte due connessioni AF_UNIX insieme (GET e
+# RING); due istanze, una sulla porta TCP e una sulla socket AF_UNIX, perché
+# ogni server ascolta su una sola delle due. TCP con il profilo latency
+# (TCP_NODELAY), altrimenti Nagle e ACK ritardati dominano i file piccoli.
+
+ITER=${1:-2000}
+PORT=9500
+DIR=$(mktemp -d)
+BIN=$(pwd)
+
+trap 'kill $TCP $UNIX 2>/dev/null; rm -rf "$DIR"' EXIT
+
+for s in 64 1024 16384 262144 1048576; do
+	head -c $s /dev/urandom > "$DIR/f$s"
+done
+
+"$BIN/server2" -t latency $PORT > /dev/null 2>&1 &
+TCP=$!
+"$BIN/server2" -U "$DIR/sock" > /dev/null 2>&1 &
+UNIX=$!
+sleep 0.3
+
+"$BIN/ring_bench" 127.0.0.1 $PORT "$DIR/sock" $ITER \
+	"$DIR/f64" "$DIR/f1024" "$DIR/f16384" "$DIR/f262144" "$DIR/f1048576"
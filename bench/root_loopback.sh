@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Verifica della radice servita (-R) quando cambia un antenato: server1 e
+# server2 tengono aperte le directory già usate e ricordano i nomi mancanti;
+# dopo "mv a a.old" e la creazione di un nuovo a/b/ lo stesso nome deve
+# portare ai file nuovi, sia per un file già servito sia per uno che prima
+# mancava. Da lanciare dalla directory con server1, server2 e client1 compilati.
+#
+#     bench/root_loopback.sh
+
+PORT=9730
+DIR=$(mktemp -d)
+BIN=$(pwd)
+
+trap 'kill $SRV1 $SRV2 2>/dev/null; rm -rf "$DIR"' EXIT
+
+mkdir -p "$DIR/root/a/b" "$DIR/c"
+echo vecchio > "$DIR/root/a/b/file"
+
+"$BIN/server1" -R "$DIR/root" $PORT > "$DIR/server1.log" 2>&1 &
+SRV1=$!
+"$BIN/server2" -R "$DIR/root" $((PORT + 1)) > "$DIR/server2.log" 2>&1 &
+SRV2=$!
+sleep 0.3
+
+fail=0
+
+# get <porta> <nome> <contenuto atteso, vuoto = deve mancare>
+get()
+{
+	rm -f "$DIR/c/file" "$DIR/c/nuovo"
+	(cd "$DIR/c" && "$BIN/client1" 127.0.0.1 $1 $2 > /dev/null 2>&1)
+	got=$(cat "$DIR/c/${2##*/}" 2>/dev/null)
+	[ "$got" = "$3" ] || { echo "porta $1: $2 = '$got', atteso '$3'"; fail=1; }
+}
+
+for p in $PORT $((PORT + 1)); do
+	rm -rf "$DIR/root/a" "$DIR/root/a.old"
+	mkdir -p "$DIR/root/a/b"
+	echo vecchio > "$DIR/root/a/b/file"
+
+	get $p a/b/file vecchio
+	get $p a/b/nuovo ""
+
+	mv "$DIR/root/a" "$DIR/root/a.old"
+	mkdir -p "$DIR/root/a/b"
+	echo nuovo > "$DIR/root/a/b/file"
+	echo nuovo > "$DIR/root/a/b/nuovo"
+
+	get $p a/b/file nuovo
+	get $p a/b/nuovo nuovo
+	get $p a.old/b/file vecchio
+done
+
+[ $fail -eq 0 ] && echo "ok"
+[ $fail -eq 0 ]
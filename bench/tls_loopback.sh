@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Benchmark su loopback: throughput di un GET in chiaro, con TLS in user space
+# (relay, -K) e con kTLS. Da lanciare dalla directory con server1 e client1 compilati.
+#
+#     bench/tls_loopback.sh [MiB del file] [ripetizioni]
+#
+# Per kTLS serve il modulo del kernel (modprobe tls): senza, la riga "ktls"
+# ripiega sul relay in user space e il server lo segnala nel log.
+
+SIZE=${1:-256}
+RUNS=${2:-3}
+PORT=9400
+DIR=$(mktemp -d)
+BIN=$(pwd)
+
+trap 'kill $SRV 2>/dev/null; rm -rf "$DIR"' EXIT
+
+openssl req -x509 -newkey rsa:2048 -nodes -keyout "$DIR/key.pem" -out "$DIR/cert.pem" -days 1 \
+	-subj /CN=localhost -addext "subjectAltName=IP:127.0.0.1" 2>/dev/null || exit 1
+head -c $((SIZE << 20)) /dev/urandom > "$DIR/file"
+mkdir "$DIR/out"
+
+run()
+{
+	name=$1; sopts=$2; copts=$3
+	PORT=$((PORT + 1))
+	"$BIN/server1" $sopts $PORT > "$DIR/$name.log" 2>&1 &
+	SRV=$!
+	sleep 0.3
+	# Prima richiesta a vuoto: il file entra in page cache.
+	(cd "$DIR/out" && "$BIN/client1" $copts 127.0.0.1 $PORT "$DIR/file" > /dev/null 2>&1)
+	start=$(date +%s.%N)
+	i=0
+	while [ $i -lt $RUNS ]; do
+		(cd "$DIR/out" && "$BIN/client1" $copts 127.0.0.1 $PORT "$DIR/file" > /dev/null 2>&1) || echo "$name: transfer failed"
+		i=$((i + 1))
+	done
+	end=$(date +%s.%N)
+	cmp -s "$DIR/file" "$DIR/out/file" || echo "$name: file differs"
+	kill $SRV; wait $SRV 2>/dev/null
+	mode=$(grep -o "kTLS$\|user space relay$" "$DIR/$name.log" | tail -1)
+	awk -v n="$name" -v s=$SIZE -v r=$RUNS -v a=$start -v b=$end -v m="${mode:-plaintext}" \
+		'BEGIN { printf "%-10s %8.1f MiB/s  (%s)\n", n, s * r / (b - a), m }'
+}
+
+run plain "" ""
+run tls-user "-T $DIR/cert.pem:$DIR/key.pem -K" "-T $DIR/cert.pem -K"
+run ktls "-T $DIR/cert.pem:$DIR/key.pem" "-T $DIR/cert.pem"
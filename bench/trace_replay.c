@@ -0,0 +1,439 @@
+/*
+
+module: trace_replay.c
+
+purpose: riproduce contro un server una traccia catturata con -w (trace.c):
+         le stesse connessioni, aperte agli stessi istanti, con le stesse
+         GET/CGET agli stessi istanti e le richieste in pipeline inviate
+         senza attendere la risposta precedente. I tempi si possono
+         accelerare (-s 10 = dieci volte più veloce) o ignorare (-s max:
+         ogni connessione parte subito e invia appena ha la risposta).
+
+         Alla fine stampa una riga "nome valore" per metrica (throughput,
+         percentili e istogramma delle latenze), da confrontare con diff
+         tra due build o due server.
+
+         trace_replay [-s velocità|max] [-t profilo] (<host> <porta> | -U percorso) <traccia>
+         trace_replay -l <traccia>
+
+         Le altre richieste (MGET, TAR, PUT, DGET, v2, ...) dipendono da
+         stato che la traccia non contiene e vengono contate come saltate.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../trace.h"
+
+#define REPLAY_BUFL (64 * 1024)
+#define REPLAY_STACK (256 * 1024)
+#define REPLAY_BUCKETS 40 /* istogramma: [2^k, 2^(k+1)) microsecondi */
+
+char *prog_name;
+
+struct req
+{
+	char cmd[4];
+	uint16_t flags;
+	uint64_t t_us;
+	char *name;
+};
+
+struct conn
+{
+	uint64_t open_us;
+	int opened;
+	int nreq, cap;
+	struct req *req;
+	pthread_t tid;
+};
+
+static struct conn *conns;
+static uint32_t nconns;
+static uint64_t first_us = UINT64_MAX;
+
+static double speed = 1.0; /* 0 = max */
+static double t0;
+static const char *host, *port, *unix_path;
+
+/* Risultati, aggiornati da tutti i thread. */
+static pthread_mutex_t st_lock = PTHREAD_MUTEX_INITIALIZER;
+static double *lat, *ttfb;
+static int nlat, caplat;
+static unsigned long long st_bytes, st_errors, st_skipped, st_conns;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Attende l'istante t_us della traccia, riscalato con la velocità. */
+static void wait_until(uint64_t t_us)
+{
+	struct timespec ts;
+	double t;
+
+	if (speed == 0)
+		return;
+	t = t0 + (t_us - first_us) / 1e6 / speed;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void load(const char *path, int list)
+{
+	struct tr_header h;
+	struct tr_record r;
+	char name[TR_MAXNAME];
+	struct conn *c;
+	int fd, n;
+
+	if ((fd = tr_open(path, &h)) < 0)
+		err_sys("(%s) error - '%s' is not a trace", prog_name, path);
+
+	while ((n = tr_read(fd, &r, name)) > 0)
+	{
+		if (list)
+		{
+			printf("%8u %12.3f ms  %.4s %c %10llu B %10u us  %s\n", r.conn, r.t_us / 1e3, r.cmd,
+			       (r.flags & TR_QUEUED) ? 'P' : '-', (unsigned long long)r.bytes, r.service_us, name);
+			continue;
+		}
+
+		/* I numeri di connessione sono consecutivi: tabella indicizzata. */
+		if (r.conn >= nconns)
+		{
+			uint32_t size = r.conn + 1024;
+
+			if ((conns = realloc(conns, size * sizeof(*conns))) == NULL)
+				err_sys("(%s) error - out of memory", prog_name);
+			memset(conns + nconns, 0, (size - nconns) * sizeof(*conns));
+			nconns = size;
+		}
+		c = &conns[r.conn];
+		if (memcmp(r.cmd, TR_CLOSE, 4) == 0)
+			continue;
+		if (!c->opened)
+		{
+			c->opened = 1;
+			c->open_us = r.t_us;
+			if (r.t_us < first_us)
+				first_us = r.t_us;
+		}
+		if (memcmp(r.cmd, TR_OPEN, 4) == 0)
+			continue;
+
+		if (c->nreq == c->cap)
+		{
+			c->cap = c->cap ? 2 * c->cap : 16;
+			if ((c->req = realloc(c->req, c->cap * sizeof(struct req))) == NULL)
+				err_sys("(%s) error - out of memory", prog_name);
+		}
+		memcpy(c->req[c->nreq].cmd, r.cmd, 4);
+		c->req[c->nreq].flags = r.flags;
+		c->req[c->nreq].t_us = r.t_us;
+		if ((c->req[c->nreq].name = strdup(name)) == NULL)
+			err_sys("(%s) error - out of memory", prog_name);
+		c->nreq++;
+	}
+	if (n < 0)
+		err_msg("(%s) error - trace '%s' truncated, replaying what was read", prog_name, path);
+	close(fd);
+}
+
+static int replay_connect(void)
+{
+	struct sockaddr_un sun;
+	int sockfd;
+
+	if (unix_path == NULL)
+		return tcp_connect_try(host, port);
+
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, unix_path, sizeof(sun.sun_path) - 1);
+	if (connect(sockfd, (SA *)&sun, SUN_LEN(&sun)) != 0)
+	{
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+/* Legge la risposta a una GET/CGET inviata all'istante sent.
+   Restituisce la dimensione del file, -1 se la richiesta è fallita. */
+static long long response(int sockfd, const struct req *q, double sent, char *buf)
+{
+	uint32_t size, left;
+	double first;
+	ssize_t n;
+
+	if (readn(sockfd, buf, 5) != 5 || memcmp(buf, "+OK\r\n", 5) != 0 || readn(sockfd, &size, 4) != 4)
+		return -1;
+	first = now();
+	for (left = size = ntohl(size); left > 0; left -= n)
+		if ((n = readn(sockfd, buf, left < REPLAY_BUFL ? left : REPLAY_BUFL)) <= 0)
+			return -1;
+	/* Timestamp, e per CGET il CRC32C. */
+	if (readn(sockfd, buf, q->cmd[0] == 'C' ? 8 : 4) != (q->cmd[0] == 'C' ? 8 : 4))
+		return -1;
+
+	pthread_mutex_lock(&st_lock);
+	if (nlat == caplat)
+	{
+		caplat = caplat ? 2 * caplat : 4096;
+		if ((lat = realloc(lat, caplat * sizeof(double))) == NULL || (ttfb = realloc(ttfb, caplat * sizeof(double))) == NULL)
+			err_sys("(%s) error - out of memory", prog_name);
+	}
+	lat[nlat] = (now() - sent) * 1e6;
+	ttfb[nlat] = (first - sent) * 1e6;
+	nlat++;
+	st_bytes += size;
+	pthread_mutex_unlock(&st_lock);
+	return size;
+}
+
+static void count(unsigned long long *counter, int n)
+{
+	pthread_mutex_lock(&st_lock);
+	*counter += n;
+	pthread_mutex_unlock(&st_lock);
+}
+
+/* Una connessione della traccia. */
+static void *replay_conn(void *arg)
+{
+	struct conn *c = arg;
+	char req[TR_MAXNAME + 16];
+	char *buf;
+	double *sent = NULL;
+	int *pend = NULL, head = 0, tail = 0, sockfd = -1, i, len;
+
+	if ((buf = malloc(REPLAY_BUFL)) == NULL || (sent = malloc(c->nreq * sizeof(double))) == NULL ||
+	    (pend = malloc(c->nreq * sizeof(int))) == NULL)
+		err_sys("(%s) error - out of memory", prog_name);
+
+	for (i = 0; i <= c->nreq; i++)
+	{
+		struct req *q = &c->req[i];
+
+		/* Senza pipeline il client aveva atteso le risposte prima di inviare. */
+		if (i == c->nreq || !(q->flags & TR_QUEUED))
+		{
+			for (; head < tail; head++)
+				if (response(sockfd, &c->req[pend[head]], sent[pend[head]], buf) < 0)
+				{
+					/* Dopo -ERR il server chiude: le richieste in volo sono perse. */
+					count(&st_errors, tail - head);
+					head = tail;
+					close(sockfd);
+					sockfd = -1;
+					break;
+				}
+			if (i == c->nreq)
+				break;
+			wait_until(q->t_us);
+		}
+
+		if ((memcmp(q->cmd, "GET ", 4) != 0 && memcmp(q->cmd, "CGET", 4) != 0) || q->name[0] == '\0')
+		{
+			count(&st_skipped, 1);
+			continue;
+		}
+		if (sockfd < 0)
+		{
+			if ((sockfd = replay_connect()) < 0)
+			{
+				count(&st_errors, 1);
+				continue;
+			}
+			count(&st_conns, 1);
+		}
+
+		len = snprintf(req, sizeof(req), q->cmd[0] == 'C' ? "CGET %s\r\n" : "GET %s\r\n", q->name);
+		sent[i] = now();
+		if (sendn(sockfd, req, len, MSG_NOSIGNAL) != len)
+		{
+			count(&st_errors, tail - head + 1);
+			head = tail;
+			close(sockfd);
+			sockfd = -1;
+			continue;
+		}
+		pend[tail++] = i;
+	}
+
+	if (sockfd >= 0)
+		close(sockfd);
+	free(pend);
+	free(sent);
+	free(buf);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_open(const void *a, const void *b)
+{
+	const struct conn *x = *(struct conn *const *)a, *y = *(struct conn *const *)b;
+
+	return x->open_us < y->open_us ? -1 : x->open_us > y->open_us;
+}
+
+static double pct(const double *v, int n, double p)
+{
+	int i = (int)ceil(p * n) - 1;
+
+	return n == 0 ? 0 : v[i < 0 ? 0 : i];
+}
+
+static void report_dist(const char *what, double *v, int n)
+{
+	static const double p[] = {0.5, 0.9, 0.99, 0.999};
+	static const char *pname[] = {"p50", "p90", "p99", "p999"};
+	char key[64];
+	double sum = 0;
+	int i;
+
+	qsort(v, n, sizeof(double), cmp_double);
+	for (i = 0; i < n; i++)
+		sum += v[i];
+	for (i = 0; i < 4; i++)
+	{
+		snprintf(key, sizeof(key), "%s_us_%s", what, pname[i]);
+		printf("%-28s %.1f\n", key, pct(v, n, p[i]));
+	}
+	snprintf(key, sizeof(key), "%s_us_max", what);
+	printf("%-28s %.1f\n", key, n > 0 ? v[n - 1] : 0);
+	snprintf(key, sizeof(key), "%s_us_mean", what);
+	printf("%-28s %.1f\n", key, n > 0 ? sum / n : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int hist[REPLAY_BUCKETS];
+	pthread_attr_t attr;
+	struct conn **order;
+	uint32_t i, n;
+	double elapsed;
+	int opt, list = 0, k;
+
+	prog_name = argv[0];
+
+	while ((opt = getopt(argc, argv, "s:t:U:l")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			/* Velocità: 1 = tempi originali, 10 = dieci volte più veloce, max = senza attese. */
+			if (strcmp(optarg, "max") == 0)
+				speed = 0;
+			else if ((speed = atof(optarg)) <= 0)
+				err_quit("(%s) error - invalid speed '%s'", prog_name, optarg);
+			break;
+		case 't':
+			if (tcp_set_profile(optarg) < 0)
+				err_quit("(%s) error - unknown tcp profile '%s' (%s)", prog_name, optarg, TCP_PROFILES);
+			break;
+		case 'U':
+			unix_path = optarg;
+			break;
+		case 'l':
+			/* Solo elenco dei record. */
+			list = 1;
+			break;
+		default:
+			err_quit("usage: %s [-s speed|max] [-t %s] (<host> <port> | -U socket_path) <trace> | -l <trace>", prog_name, TCP_PROFILES);
+		}
+	}
+	if (argc - optind != (list || unix_path != NULL ? 1 : 3))
+		err_quit("usage: %s [-s speed|max] [-t %s] (<host> <port> | -U socket_path) <trace> | -l <trace>", prog_name, TCP_PROFILES);
+	if (!list && unix_path == NULL)
+	{
+		host = argv[optind];
+		port = argv[optind + 1];
+	}
+
+	load(argv[argc - 1], list);
+	if (list)
+		return 0;
+
+	/* Stack piccoli: una traccia può avere migliaia di connessioni aperte insieme. */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, REPLAY_STACK);
+
+	/* Le connessioni partono nell'ordine dei loro istanti di apertura. */
+	if ((order = malloc(nconns * sizeof(*order) + 1)) == NULL)
+		err_sys("(%s) error - out of memory", prog_name);
+	for (i = 0, n = 0; i < nconns; i++)
+		if (conns[i].nreq > 0)
+			order[n++] = &conns[i];
+	qsort(order, n, sizeof(*order), cmp_open);
+
+	t0 = now();
+	for (i = 0; i < n; i++)
+	{
+		wait_until(order[i]->open_us);
+		if ((errno = pthread_create(&order[i]->tid, &attr, replay_conn, order[i])) != 0)
+			err_sys("(%s) error - pthread_create() failed", prog_name);
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(order[i]->tid, NULL);
+	elapsed = now() - t0;
+
+	printf("%-28s %s\n", "trace", argv[argc - 1]);
+	if (speed == 0)
+		printf("%-28s %s\n", "speed", "max");
+	else
+		printf("%-28s %g\n", "speed", speed);
+	printf("%-28s %llu\n", "connections", st_conns);
+	printf("%-28s %d\n", "requests", nlat);
+	printf("%-28s %llu\n", "errors", st_errors);
+	printf("%-28s %llu\n", "skipped", st_skipped);
+	printf("%-28s %llu\n", "bytes", st_bytes);
+	printf("%-28s %.3f\n", "elapsed_s", elapsed);
+	printf("%-28s %.2f\n", "throughput_MiB_s", st_bytes / elapsed / (1 << 20));
+	printf("%-28s %.1f\n", "requests_s", nlat / elapsed);
+	report_dist("ttfb", ttfb, nlat);
+	report_dist("latency", lat, nlat);
+
+	/* Istogramma logaritmico delle latenze: una riga per potenza di due. */
+	memset(hist, 0, sizeof(hist));
+	for (k = 0; k < nlat; k++)
+	{
+		int b = lat[k] < 1 ? 0 : (int)log2(lat[k]);
+
+		hist[b < REPLAY_BUCKETS ? b : REPLAY_BUCKETS - 1]++;
+	}
+	for (k = 0; k < REPLAY_BUCKETS; k++)
+		if (hist[k] > 0)
+		{
+			char key[64];
+
+			snprintf(key, sizeof(key), "latency_us_lt_%llu", 2ULL << k);
+			printf("%-28s %u\n", key, hist[k]);
+		}
+	return 0;
+}
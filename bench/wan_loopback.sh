@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# Benchmark sulla stessa macchina attraverso wan_proxy: 16 file da 16 KiB
+# scaricati con una connessione per file, con MGET, con il protocollo v2 e con
+# 4 client in parallelo, al variare dell'RTT. Da lanciare dalla directory con
+# server2, client1 e wan_proxy compilati.
+#
+#     bench/wan_loopback.sh [RTT in ms ...] [-- opzioni di wan_proxy]
+#
+# Es. bench/wan_loopback.sh 20 80 -- -j 5 -l 0.01 aggiunge jitter e perdite.
+
+PORT=9600
+DIR=$(mktemp -d)
+BIN=$(pwd)
+RTTS=""
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+	RTTS="$RTTS $1"
+	shift
+done
+[ "$1" = "--" ] && shift
+RTTS=${RTTS:-0 10 50 100}
+
+trap 'kill $SRV $PX 2>/dev/null; rm -rf "$DIR"' EXIT
+
+i=1
+while [ $i -le 16 ]; do
+	head -c 16384 /dev/urandom > "$DIR/f$i"
+	FILES="$FILES $DIR/f$i"
+	i=$((i + 1))
+done
+mkdir "$DIR/out"
+
+"$BIN/server2" $PORT > /dev/null 2>&1 &
+SRV=$!
+sleep 0.3
+
+# Tempo in ms di un comando eseguito nella directory di output.
+run()
+{
+	start=$(date +%s.%N)
+	(cd "$DIR/out" && eval "$@") > /dev/null 2>&1 || echo "transfer failed: $*" >&2
+	awk -v a=$start -v b=$(date +%s.%N) 'BEGIN { printf "%d", (b - a) * 1000 }'
+}
+
+printf "%8s %10s %10s %10s %10s\n" "RTT ms" "per file" "MGET" "v2" "4 client"
+for rtt in $RTTS; do
+	P=$((PORT + 1 + rtt))
+	"$BIN/wan_proxy" -d $(awk -v r=$rtt 'BEGIN { print r / 2 }') "$@" $P 127.0.0.1 $PORT > /dev/null 2>&1 &
+	PX=$!
+	sleep 0.2
+
+	seq=$(run 'for f in '"$FILES"'; do "'"$BIN"'/client1" 127.0.0.1 '$P' $f || exit 1; done')
+	mget=$(run '"'"$BIN"'/client1" 127.0.0.1 '$P' '"$FILES")
+	v2=$(run '"'"$BIN"'/client1" -2 127.0.0.1 '$P' '"$FILES")
+	par=$(run 'set -- '"$FILES"'; for g in 1 2 3 4; do "'"$BIN"'/client1" 127.0.0.1 '$P' $1 $2 $3 $4 & shift 4; done; wait')
+
+	kill $PX
+	wait $PX 2>/dev/null
+	printf "%8s %10s %10s %10s %10s\n" $rtt $seq $mget $v2 $par
+done
+
+for f in $FILES; do
+	cmp -s "$f" "$DIR/out/$(basename "$f")" || echo "$(basename "$f") differs"
+done
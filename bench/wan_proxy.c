@@ -0,0 +1,411 @@
+/*
+
+module: wan_proxy.c
+
+purpose: proxy TCP in user space che simula una rete geografica tra client e
+         server sulla stessa macchina, senza root né netem: ritardo e jitter
+         per direzione, banda massima, perdite, stalli periodici e un client
+         "slow loris" che invia la richiesta pochi byte alla volta.
+
+         wan_proxy [-d ms] [-j ms] [-r rate[:burst]] [-l perdita[:rto_ms]]
+                   [-s ogni_ms:durata_ms] [-L byte:intervallo_ms] [-t profilo]
+                   <porta> <host_server> <porta_server>
+
+         Ogni connessione accettata ne apre una verso il server; ciascuna
+         direzione ha un thread che legge e uno che scrive, separati da una
+         coda di blocchi con l'istante in cui possono uscire:
+
+             uscita = max(uscita precedente, arrivo + ritardo + U(0, jitter))
+
+         così l'ordine dei byte resta quello di TCP. Una perdita non si può
+         simulare scartando byte (la connessione è affidabile): un segmento
+         perso trattiene lui e tutto quello che segue per il tempo della
+         ritrasmissione, di default un RTT (fast retransmit), o rto_ms per
+         simulare la scadenza del timer. La coda è limitata, quindi un lato lento frena
+         l'altro come una finestra piena.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../ratelimit.h"
+
+#define PX_READ (64 * 1024)	/* Byte letti alla volta. */
+#define PX_QUEUE (4 << 20)	/* Memoria in coda per direzione, blocchi interi (la "finestra"). */
+#define PX_MSS 1448		/* Dimensione di un segmento per le perdite. */
+#define PX_RTO_MS 200		/* Ritrasmissione senza -d: RTO minimo di Linux. */
+#define PX_STACK (256 * 1024)
+
+char *prog_name;
+
+/* Parametri della rete simulata. */
+static double delay, jitter;	     /* secondi, per direzione */
+static double rate, burst;	     /* byte/s per direzione, 0 = illimitata */
+static double loss, rto = -1;	      /* -1 = un RTT (fast retransmit) */
+static double stall_every, stall_len; /* secondi */
+static int loris_bytes;		      /* client -> server a loris_bytes alla volta */
+static double loris_gap;
+static double t_start;
+
+struct chunk
+{
+	struct chunk *next;
+	double release; /* istante di uscita */
+	size_t len;	/* 0 = fine del flusso */
+	char data[];
+};
+
+/* Memoria di un blocco in coda: con letture brevi conta anche l'intestazione. */
+static size_t chunk_size(const struct chunk *ck)
+{
+	return sizeof(*ck) + ck->len;
+}
+
+struct direction
+{
+	int src, dst;
+	int upstream; /* client -> server */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct chunk *head, *tail;
+	size_t queued;
+	double last_release;
+	unsigned short seed[3];
+	unsigned long long bytes;
+	struct conn *conn;
+};
+
+struct conn
+{
+	int id;
+	int cfd, sfd;
+	struct direction dir[2];
+	pthread_mutex_t lock;
+	int threads; /* ancora in esecuzione */
+	double opened;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Thread finito: l'ultimo chiude la connessione. */
+static void conn_release(struct conn *c)
+{
+	int last;
+
+	pthread_mutex_lock(&c->lock);
+	last = --c->threads == 0;
+	pthread_mutex_unlock(&c->lock);
+	if (!last)
+		return;
+
+	printf("(%s) --- connection %d closed after %.3f s: %llu bytes to the server, %llu to the client\n", prog_name, c->id,
+	       now() - c->opened, c->dir[0].bytes, c->dir[1].bytes);
+	close(c->cfd);
+	close(c->sfd);
+	free(c);
+}
+
+static void *reader(void *arg)
+{
+	struct direction *d = arg;
+	struct chunk *ck, *small;
+	double t, segs;
+	ssize_t n;
+
+	for (;;)
+	{
+		if ((ck = malloc(sizeof(*ck) + PX_READ)) == NULL)
+			err_sys("(%s) error - out of memory", prog_name);
+
+		/* Coda piena: non leggiamo, e il mittente si ferma sulla sua finestra TCP. */
+		pthread_mutex_lock(&d->lock);
+		while (d->queued >= PX_QUEUE)
+			pthread_cond_wait(&d->cond, &d->lock);
+		pthread_mutex_unlock(&d->lock);
+
+		while ((n = read(d->src, ck->data, PX_READ)) < 0 && errno == EINTR)
+			;
+		ck->len = n > 0 ? n : 0;
+		ck->next = NULL;
+
+		/* Lettura breve: il blocco torna alla dimensione dei dati, che è quella contata in coda. */
+		if (ck->len < PX_READ && (small = realloc(ck, chunk_size(ck))) != NULL)
+			ck = small;
+
+		pthread_mutex_lock(&d->lock);
+		t = now() + delay + jitter * erand48(d->seed);
+		if (t < d->last_release)
+			t = d->last_release;
+
+		/* Almeno un segmento perso: il blocco (e quelli dietro) aspetta la ritrasmissione. */
+		segs = ck->len > 0 ? ceil((double)ck->len / PX_MSS) : 0;
+		if (loss > 0 && erand48(d->seed) < 1 - pow(1 - loss, segs))
+			t += rto;
+
+		ck->release = d->last_release = t;
+		if (d->tail != NULL)
+			d->tail->next = ck;
+		else
+			d->head = ck;
+		d->tail = ck;
+		d->queued += chunk_size(ck);
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+
+		if (n <= 0)
+			break;
+	}
+	conn_release(d->conn);
+	return NULL;
+}
+
+/* Finestre di stallo: per durata_ms ogni ogni_ms non esce nulla. */
+static void stall(void)
+{
+	double t, phase;
+
+	if (stall_every <= 0)
+		return;
+	t = now();
+	phase = fmod(t - t_start, stall_every);
+	if (phase < stall_len)
+		sleep_until(t + stall_len - phase);
+}
+
+static void *writer(void *arg)
+{
+	struct direction *d = arg;
+	struct chunk *ck;
+	double tokens = burst, last = now(), t;
+	size_t off, piece;
+	int fail = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&d->lock);
+		while (d->head == NULL)
+			pthread_cond_wait(&d->cond, &d->lock);
+		ck = d->head;
+		pthread_mutex_unlock(&d->lock);
+
+		sleep_until(ck->release);
+		if (ck->len == 0)
+			break;
+
+		for (off = 0; off < ck->len && !fail; off += piece)
+		{
+			piece = ck->len - off;
+			if (d->upstream && loris_bytes > 0)
+			{
+				if (off > 0)
+					sleep_until(now() + loris_gap);
+				if (piece > (size_t)loris_bytes)
+					piece = loris_bytes;
+			}
+			else if (rate > 0 && piece > burst)
+				piece = burst;
+			stall();
+
+			/* Token bucket: il pezzo esce quando ci sono abbastanza token. */
+			if (rate > 0)
+			{
+				t = now();
+				tokens += (t - last) * rate;
+				if (tokens > burst)
+					tokens = burst;
+				last = t;
+				if (tokens < piece)
+				{
+					sleep_until(t + (piece - tokens) / rate);
+					tokens = piece;
+					last = now();
+				}
+				tokens -= piece;
+			}
+			fail = writen(d->dst, ck->data + off, piece) != (ssize_t)piece;
+			d->bytes += fail ? 0 : piece;
+		}
+
+		pthread_mutex_lock(&d->lock);
+		if ((d->head = ck->next) == NULL)
+			d->tail = NULL;
+		d->queued -= chunk_size(ck);
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+		free(ck);
+
+		if (fail)
+		{
+			/* L'altro capo ha chiuso: fermiamo anche chi legge. */
+			shutdown(d->src, SHUT_RD);
+			break;
+		}
+	}
+	shutdown(d->dst, SHUT_WR);
+
+	/* Scarta quanto resta in coda (il lettore ha già messo la fine del flusso o la metterà). */
+	for (;;)
+	{
+		pthread_mutex_lock(&d->lock);
+		while (d->head == NULL)
+			pthread_cond_wait(&d->cond, &d->lock);
+		ck = d->head;
+		if ((d->head = ck->next) == NULL)
+			d->tail = NULL;
+		d->queued -= chunk_size(ck);
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+		piece = ck->len;
+		free(ck);
+		if (piece == 0)
+			break;
+	}
+	conn_release(d->conn);
+	return NULL;
+}
+
+static void start(pthread_attr_t *attr, void *(*fn)(void *), void *arg)
+{
+	pthread_t tid;
+
+	if ((errno = pthread_create(&tid, attr, fn, arg)) != 0)
+		err_sys("(%s) error - pthread_create() failed", prog_name);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_attr_t attr;
+	struct conn *c;
+	int listenfd, cfd, sfd, opt, id = 0, i;
+	double every_ms, len_ms;
+
+	prog_name = argv[0];
+
+	while ((opt = getopt(argc, argv, "d:j:r:l:s:L:t:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			/* Ritardo in una direzione: l'RTT aggiunto è il doppio. */
+			delay = atof(optarg) / 1e3;
+			break;
+		case 'j':
+			jitter = atof(optarg) / 1e3;
+			break;
+		case 'r':
+			/* Banda per direzione, "rate[:burst]" in byte/s (suffissi k, m, g). */
+			if (rl_parse(optarg, &rate, &burst) < 0 || rate <= 0)
+				err_quit("(%s) error - invalid rate '%s'", prog_name, optarg);
+			break;
+		case 'l':
+			/* Probabilità di perdita di un segmento e RTO della ritrasmissione. */
+			if (sscanf(optarg, "%lf:%lf", &loss, &rto) < 1 || loss < 0 || loss >= 1)
+				err_quit("(%s) error - invalid loss '%s'", prog_name, optarg);
+			if (strchr(optarg, ':') != NULL)
+				rto /= 1e3;
+			break;
+		case 's':
+			if (sscanf(optarg, "%lf:%lf", &every_ms, &len_ms) != 2 || every_ms <= 0 || len_ms < 0 || len_ms >= every_ms)
+				err_quit("(%s) error - invalid stall '%s'", prog_name, optarg);
+			stall_every = every_ms / 1e3;
+			stall_len = len_ms / 1e3;
+			break;
+		case 'L':
+			/* Slow loris: le richieste arrivano al server loris_bytes alla volta. */
+			if (sscanf(optarg, "%d:%lf", &loris_bytes, &loris_gap) != 2 || loris_bytes < 1 || loris_gap < 0)
+				err_quit("(%s) error - invalid slow loris setting '%s'", prog_name, optarg);
+			loris_gap /= 1e3;
+			break;
+		case 't':
+			if (tcp_set_profile(optarg) < 0)
+				err_quit("(%s) error - unknown tcp profile '%s' (%s)", prog_name, optarg, TCP_PROFILES);
+			break;
+		default:
+			err_quit("usage: %s [-d delay_ms] [-j jitter_ms] [-r rate[:burst]] [-l loss[:rto_ms]] [-s every_ms:stall_ms] [-L bytes:interval_ms] [-t %s] <port> <server_host> <server_port>", prog_name, TCP_PROFILES);
+		}
+	}
+	if (rto < 0)
+		rto = delay > 0 ? 2 * delay + jitter : PX_RTO_MS / 1e3;
+	if (argc - optind != 3)
+		err_quit("usage: %s [-d delay_ms] [-j jitter_ms] [-r rate[:burst]] [-l loss[:rto_ms]] [-s every_ms:stall_ms] [-L bytes:interval_ms] [-t %s] <port> <server_host> <server_port>", prog_name, TCP_PROFILES);
+
+	setvbuf(stdout, NULL, _IOLBF, 0); /* Log leggibile anche rediretto su file. */
+	Signal(SIGPIPE, SIG_IGN);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PX_STACK);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	listenfd = tcp_listen(NULL, argv[optind], NULL);
+	t_start = now();
+	printf("(%s) --- delay %.1f ms (+%.1f jitter) each way, rate %.0f B/s, loss %.4f (rto %.0f ms), stall %.0f/%.0f ms, slow loris %d B/%.0f ms\n",
+	       prog_name, delay * 1e3, jitter * 1e3, rate, loss, rto * 1e3, stall_len * 1e3, stall_every * 1e3, loris_bytes, loris_gap * 1e3);
+
+	for (;;)
+	{
+		if ((cfd = accept(listenfd, NULL, NULL)) < 0)
+		{
+			if (errno != EINTR && errno != ECONNABORTED)
+				err_ret("(%s) error - accept() failed", prog_name);
+			continue;
+		}
+		if ((sfd = tcp_connect_try(argv[optind + 1], argv[optind + 2])) < 0)
+		{
+			err_msg("(%s) error - cannot connect to %s:%s", prog_name, argv[optind + 1], argv[optind + 2]);
+			close(cfd);
+			continue;
+		}
+		tcp_tune(cfd);
+
+		if ((c = calloc(1, sizeof(*c))) == NULL)
+			err_sys("(%s) error - out of memory", prog_name);
+		c->id = ++id;
+		c->cfd = cfd;
+		c->sfd = sfd;
+		c->opened = now();
+		c->threads = 4;
+		pthread_mutex_init(&c->lock, NULL);
+		for (i = 0; i < 2; i++)
+		{
+			struct direction *d = &c->dir[i];
+
+			d->upstream = i == 0;
+			d->src = i == 0 ? cfd : sfd;
+			d->dst = i == 0 ? sfd : cfd;
+			d->conn = c;
+			d->seed[0] = id;
+			d->seed[1] = i;
+			d->seed[2] = 0x330e;
+			pthread_mutex_init(&d->lock, NULL);
+			pthread_cond_init(&d->cond, NULL);
+		}
+		for (i = 0; i < 2; i++)
+		{
+			start(&attr, reader, &c->dir[i]);
+			start(&attr, writer, &c->dir[i]);
+		}
+	}
+}
@@ -0,0 +1,254 @@
+/*
+
+module: bufpool.c
+
+purpose: pool of the buffers that move file contents
+         buffers are carved from 2 MiB slabs mapped with mmap(), in power of
+         two classes from one page up to the slab, so each one is aligned to
+         its own size and comes from the kernel already zeroed (nothing is
+         cleared by hand). A released buffer goes to the free list of its
+         class and is handed out again before any new memory is mapped.
+
+         With "huge" the slabs are huge pages (MAP_HUGETLB) when some are
+         reserved, transparent huge pages (MADV_HUGEPAGE) otherwise.
+
+         The chunk moved by one read()/send() is fixed with bp_init() or
+         auto-tuned per transfer by bp_chunk() from the socket buffers and
+         the size of the file.
+
+         The pool belongs to one process (it is not shared across fork()).
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "errlib.h"
+#include "bufpool.h"
+
+#define BP_PAGE 4096
+#define BP_CLASSES 10 /* BP_PAGE << i, up to BP_SLAB */
+
+extern char *prog_name;
+
+struct bp_class
+{
+	char *free;  /* released buffers, linked through their first bytes */
+	char *carve; /* rest of the last slab of the class */
+	size_t left;
+};
+
+static pthread_mutex_t bp_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bp_class bp_cls[BP_CLASSES];
+static size_t bp_cfg_chunk = 0; /* 0 = auto */
+static int bp_huge = 0;
+
+/* Counters for bp_report(). */
+static unsigned long long bp_gets, bp_reused;
+static int bp_slabs, bp_huge_slabs;
+static size_t bp_in_use, bp_peak;
+
+static size_t bp_parse_size(const char *str, char **end)
+{
+	double v;
+
+	errno = 0;
+	v = strtod(str, end);
+	if (errno != 0 || *end == str || v < 0)
+		return 0;
+	switch (**end)
+	{
+	case 'm':
+	case 'M':
+		v *= 1024;
+		/* fall through */
+	case 'k':
+	case 'K':
+		v *= 1024;
+		(*end)++;
+		break;
+	}
+	return (size_t)v;
+}
+
+/* "chunk[:huge]" or "auto[:huge]"; chunk in bytes with optional k, m
+   suffixes, rounded up to a power of two between one page and BP_MAX_CHUNK. */
+int bp_parse(const char *str, size_t *chunk, int *huge)
+{
+	char *end;
+	size_t c;
+
+	if (strncmp(str, "auto", 4) == 0)
+	{
+		*chunk = 0;
+		end = (char *)str + 4;
+	}
+	else
+	{
+		if ((*chunk = bp_parse_size(str, &end)) == 0 || *chunk > BP_MAX_CHUNK)
+			return -1;
+		for (c = BP_PAGE; c < *chunk; c <<= 1)
+			;
+		*chunk = c;
+	}
+
+	*huge = 0;
+	if (strcmp(end, ":huge") == 0)
+		*huge = 1;
+	else if (*end != '\0')
+		return -1;
+	return 0;
+}
+
+/* Before fork(): chunk 0 = auto-tuned. */
+void bp_init(size_t chunk, int huge)
+{
+	bp_cfg_chunk = chunk;
+	bp_huge = huge;
+
+	if (chunk > 0)
+		err_msg("(%s) --- I/O buffers of %zu bytes%s", prog_name, chunk, huge ? " on huge pages" : "");
+	else
+		err_msg("(%s) --- I/O buffers auto-tuned (%d-%d KiB)%s", prog_name, BP_MIN_CHUNK >> 10, BP_MAX_CHUNK >> 10, huge ? " on huge pages" : "");
+}
+
+/* Bytes to move at a time on sockfd (-1 = unknown) for a file of size bytes
+   (0 = unknown). Auto-tuned: the larger socket buffer, at least
+   1/BP_AUTO_SPLIT of the file, between BP_MIN_CHUNK and BP_MAX_CHUNK; never
+   more than the file needs. */
+size_t bp_chunk(int sockfd, off_t size)
+{
+	size_t c = BP_AUTO_CHUNK, want;
+	int snd, rcv;
+	socklen_t len = sizeof(int);
+
+	if (bp_cfg_chunk > 0)
+		return bp_cfg_chunk;
+
+	if (sockfd >= 0 && getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &snd, &len) == 0 &&
+	    getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcv, &len) == 0)
+		c = snd > rcv ? snd : rcv;
+	if (size / BP_AUTO_SPLIT > (off_t)c)
+		c = size / BP_AUTO_SPLIT;
+
+	if (c > BP_MAX_CHUNK)
+		c = BP_MAX_CHUNK;
+	for (want = BP_MIN_CHUNK; want < c; want <<= 1)
+		;
+	while (size > 0 && want > BP_PAGE && (off_t)(want >> 1) >= size)
+		want >>= 1;
+	return want;
+}
+
+static int bp_class(size_t len)
+{
+	int i;
+
+	for (i = 0; i < BP_CLASSES && ((size_t)BP_PAGE << i) < len; i++)
+		;
+	return i;
+}
+
+/* A new slab aligned to BP_SLAB. Lock held. */
+static char *bp_slab(void)
+{
+	char *p, *aligned;
+
+	if (bp_huge && (p = mmap(NULL, BP_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) != MAP_FAILED)
+	{
+		bp_slabs++;
+		bp_huge_slabs++;
+		return p;
+	}
+
+	/* Twice the size, then the ends outside the aligned slab are unmapped. */
+	if ((p = mmap(NULL, 2 * BP_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return NULL;
+	aligned = (char *)(((uintptr_t)p + BP_SLAB - 1) & ~((uintptr_t)BP_SLAB - 1));
+	if (aligned > p)
+		munmap(p, aligned - p);
+	munmap(aligned + BP_SLAB, p + BP_SLAB - aligned);
+	if (bp_huge)
+		madvise(aligned, BP_SLAB, MADV_HUGEPAGE);
+	bp_slabs++;
+	return aligned;
+}
+
+/* A buffer of at least len bytes (at most BP_SLAB), aligned to its size.
+   Returns NULL if no memory can be mapped. */
+void *bp_get(size_t len)
+{
+	struct bp_class *c;
+	size_t size;
+	char *buf;
+	int i;
+
+	if (len == 0 || (i = bp_class(len)) >= BP_CLASSES)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	c = &bp_cls[i];
+	size = (size_t)BP_PAGE << i;
+
+	pthread_mutex_lock(&bp_lock);
+	if (c->free != NULL)
+	{
+		buf = c->free;
+		memcpy(&c->free, buf, sizeof(char *));
+		bp_reused++;
+	}
+	else
+	{
+		if (c->left == 0)
+		{
+			if ((c->carve = bp_slab()) == NULL)
+			{
+				pthread_mutex_unlock(&bp_lock);
+				return NULL;
+			}
+			c->left = BP_SLAB;
+		}
+		buf = c->carve;
+		c->carve += size;
+		c->left -= size;
+	}
+	bp_gets++;
+	if ((bp_in_use += size) > bp_peak)
+		bp_peak = bp_in_use;
+	pthread_mutex_unlock(&bp_lock);
+	return buf;
+}
+
+/* Gives back a buffer of bp_get(len). NULL is ignored. */
+void bp_put(void *buf, size_t len)
+{
+	struct bp_class *c;
+
+	if (buf == NULL)
+		return;
+	c = &bp_cls[bp_class(len)];
+
+	pthread_mutex_lock(&bp_lock);
+	memcpy(buf, &c->free, sizeof(char *));
+	c->free = buf;
+	bp_in_use -= (size_t)BP_PAGE << bp_class(len);
+	pthread_mutex_unlock(&bp_lock);
+}
+
+void bp_report(void)
+{
+	pthread_mutex_lock(&bp_lock);
+	if (bp_gets > 0)
+		printf("(%s) --- buffers: %llu gets, %llu reused, %d slabs (%d huge pages), peak %zu bytes in use\n",
+		       prog_name, bp_gets, bp_reused, bp_slabs, bp_huge_slabs, bp_peak);
+	pthread_mutex_unlock(&bp_lock);
+}
@@ -0,0 +1,34 @@
+/*
+
+module: bufpool.h
+
+purpose: definitions of the I/O buffer pool (bufpool.c)
+
+*/
+
+#ifndef _BUFPOOL_H
+
+#define _BUFPOOL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BP_SLAB (2 << 20)	   /* Memory mapped at a time, one huge page. */
+#define BP_MIN_CHUNK (64 << 10)	   /* Auto-tuned chunk limits. */
+#define BP_MAX_CHUNK BP_SLAB
+#define BP_AUTO_CHUNK (256 << 10)  /* Auto-tuned chunk when nothing is known. */
+#define BP_AUTO_SPLIT 32	   /* Auto-tuned chunk: at least 1/BP_AUTO_SPLIT of the file. */
+
+int bp_parse(const char *str, size_t *chunk, int *huge);
+
+void bp_init(size_t chunk, int huge);
+
+size_t bp_chunk(int sockfd, off_t size);
+
+void *bp_get(size_t len);
+
+void bp_put(void *buf, size_t len);
+
+void bp_report(void);
+
+#endif
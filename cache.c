@@ -0,0 +1,639 @@
+/*
+
+module: cache.c
+
+purpose: bounded in-memory cache of small files for the GET command
+         every entry holds the complete v1 response ("+OK\r\n", size, contents,
+         timestamp), so a hit costs no path lookup and goes out with a single
+         send(). The cache lives in a MAP_SHARED arena mapped before fork(), so
+         the children of the concurrent server fill and use the same entries.
+
+         Memory: the arena (the byte budget) is split into slab classes of
+         CACHE_MIN_CHUNK << i bytes, carved on demand; when a class has no free
+         chunk and the arena is exhausted, its least recently used entry is
+         evicted.
+
+         Invalidation: the directory of every cached file is watched through one
+         inotify instance, inherited by the children (so they can add watches);
+         a thread of the process that called cache_init() reads the events and
+         drops the entries of the files that changed. A per-watch counter,
+         bumped on every event, keeps a file read before a change from being
+         inserted after the event was handled. Every ancestor of a watched
+         directory is watched as well for renames and removals of directories,
+         which change what a name leads to without an event in the directory
+         of the file: they flush the whole cache. Files reached through a
+         symbolic link to a directory are not cached.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "ratelimit.h"
+#include "cache.h"
+#include "csum.h"
+#include "pathidx.h"
+
+#define CACHE_NONE ((size_t)-1)
+#define CACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define CACHE_ANCESTOR (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_MASK_ADD)
+
+extern char *prog_name;
+
+struct cache_entry
+{
+	int used;
+	int next;	     /* hash chain by name, or free list */
+	int next_wd;	     /* hash chain by (watch, basename) */
+	int prev_lru, next_lru; /* LRU of the slab class, head = most recent */
+	int cls;
+	int wd;
+	unsigned int hash, hash_wd;
+	size_t off; /* chunk: name, '\0', response */
+	size_t len; /* response bytes */
+};
+
+struct cache_class
+{
+	int lru_head, lru_tail;
+	size_t free; /* free chunks, linked through their first bytes */
+};
+
+struct cache_shared
+{
+	pthread_mutex_t lock;
+	int disabled; /* the watcher failed: entries can no longer be trusted */
+	int free_entry;
+	size_t carved; /* arena bytes already split into chunks */
+	size_t bytes;  /* bytes of the chunks in use */
+	int files;
+	unsigned long long hits, misses, evictions, invalidations;
+	struct cache_class cls[CACHE_MAX_CLASSES];
+	int bucket[CACHE_BUCKETS];
+	int bucket_wd[CACHE_BUCKETS];
+	unsigned int wdgen[CACHE_MAXWD];
+};
+
+static struct cache_shared *cache = NULL;
+static struct cache_entry *cache_entry;
+static char *cache_arena;
+static int cache_nentries, cache_nclasses;
+static size_t cache_budget, cache_threshold;
+static int cache_ifd = -1;
+
+/* Response buffer of the calling process. */
+static char *cache_buf = NULL;
+
+static unsigned int cache_hash(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static unsigned int cache_hash_wd(int wd, const char *base)
+{
+	return cache_hash(base) ^ ((unsigned int)wd * 2654435761u);
+}
+
+static const char *cache_base(const char *name)
+{
+	const char *p = strrchr(name, '/');
+
+	return p == NULL ? name : p + 1;
+}
+
+static void cache_lock(void)
+{
+	if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&cache->lock);
+}
+
+static size_t cache_parse_size(const char *str, char **end)
+{
+	double v;
+
+	errno = 0;
+	v = strtod(str, end);
+	if (errno != 0 || *end == str || v < 0)
+		return 0;
+	switch (**end)
+	{
+	case 'g':
+	case 'G':
+		v *= 1024;
+		/* fall through */
+	case 'm':
+	case 'M':
+		v *= 1024;
+		/* fall through */
+	case 'k':
+	case 'K':
+		v *= 1024;
+		(*end)++;
+		break;
+	}
+	return (size_t)v;
+}
+
+/* "budget[:threshold]", sizes in bytes with optional k, m, g suffixes. */
+int cache_parse(const char *str, size_t *budget, size_t *threshold)
+{
+	char *end;
+
+	*threshold = CACHE_THRESHOLD;
+	if ((*budget = cache_parse_size(str, &end)) == 0)
+		return -1;
+	if (*end == ':' && (*threshold = cache_parse_size(end + 1, &end)) == 0)
+		return -1;
+	if (*end != '\0' || *threshold > (1u << 30))
+		return -1;
+	return 0;
+}
+
+/* LRU and hash chains. Lock held. */
+static void cache_lru_unlink(int i)
+{
+	struct cache_entry *e = &cache_entry[i];
+	struct cache_class *c = &cache->cls[e->cls];
+
+	if (e->prev_lru >= 0)
+		cache_entry[e->prev_lru].next_lru = e->next_lru;
+	else
+		c->lru_head = e->next_lru;
+	if (e->next_lru >= 0)
+		cache_entry[e->next_lru].prev_lru = e->prev_lru;
+	else
+		c->lru_tail = e->prev_lru;
+}
+
+static void cache_lru_push(int i)
+{
+	struct cache_entry *e = &cache_entry[i];
+	struct cache_class *c = &cache->cls[e->cls];
+
+	e->prev_lru = -1;
+	e->next_lru = c->lru_head;
+	if (c->lru_head >= 0)
+		cache_entry[c->lru_head].prev_lru = i;
+	else
+		c->lru_tail = i;
+	c->lru_head = i;
+}
+
+static void cache_chain_remove(int *head, int i, int wd_chain)
+{
+	int *p = head;
+
+	while (*p >= 0 && *p != i)
+		p = wd_chain ? &cache_entry[*p].next_wd : &cache_entry[*p].next;
+	if (*p == i)
+		*p = wd_chain ? cache_entry[i].next_wd : cache_entry[i].next;
+}
+
+static int cache_find(const char *name, unsigned int h)
+{
+	int i;
+
+	for (i = cache->bucket[h % CACHE_BUCKETS]; i >= 0; i = cache_entry[i].next)
+		if (cache_entry[i].hash == h && strcmp(cache_arena + cache_entry[i].off, name) == 0)
+			return i;
+	return -1;
+}
+
+static void cache_remove(int i)
+{
+	struct cache_entry *e = &cache_entry[i];
+	struct cache_class *c = &cache->cls[e->cls];
+
+	cache_chain_remove(&cache->bucket[e->hash % CACHE_BUCKETS], i, 0);
+	cache_chain_remove(&cache->bucket_wd[e->hash_wd % CACHE_BUCKETS], i, 1);
+	cache_lru_unlink(i);
+
+	*(size_t *)(cache_arena + e->off) = c->free;
+	c->free = e->off;
+	cache->bytes -= (size_t)CACHE_MIN_CHUNK << e->cls;
+	cache->files--;
+
+	e->used = 0;
+	e->next = cache->free_entry;
+	cache->free_entry = i;
+}
+
+static size_t cache_chunk(int cls)
+{
+	struct cache_class *c = &cache->cls[cls];
+	size_t size = (size_t)CACHE_MIN_CHUNK << cls, off;
+
+	if (c->free == CACHE_NONE)
+	{
+		if (cache->carved + size <= cache_budget)
+		{
+			off = cache->carved;
+			cache->carved += size;
+			return off;
+		}
+		if (c->lru_tail < 0)
+			return CACHE_NONE;
+		cache_remove(c->lru_tail);
+		cache->evictions++;
+	}
+	off = c->free;
+	c->free = *(size_t *)(cache_arena + off);
+	return off;
+}
+
+static void cache_insert(const char *name, int wd, const char *resp, size_t len)
+{
+	size_t need = strlen(name) + 1 + len, off;
+	struct cache_entry *e;
+	int cls, i;
+
+	for (cls = 0; cls < cache_nclasses && ((size_t)CACHE_MIN_CHUNK << cls) < need; cls++)
+		;
+	if (cls == cache_nclasses || (off = cache_chunk(cls)) == CACHE_NONE)
+		return;
+	if ((i = cache->free_entry) < 0)
+	{
+		/* No entry left (only with many tiny files): give the chunk back. */
+		*(size_t *)(cache_arena + off) = cache->cls[cls].free;
+		cache->cls[cls].free = off;
+		return;
+	}
+	e = &cache_entry[i];
+	cache->free_entry = e->next;
+
+	memcpy(cache_arena + off, name, need - len);
+	memcpy(cache_arena + off + need - len, resp, len);
+	e->used = 1;
+	e->cls = cls;
+	e->wd = wd;
+	e->off = off;
+	e->len = len;
+	e->hash = cache_hash(name);
+	e->hash_wd = cache_hash_wd(wd, cache_base(name));
+	e->next = cache->bucket[e->hash % CACHE_BUCKETS];
+	cache->bucket[e->hash % CACHE_BUCKETS] = i;
+	e->next_wd = cache->bucket_wd[e->hash_wd % CACHE_BUCKETS];
+	cache->bucket_wd[e->hash_wd % CACHE_BUCKETS] = i;
+	cache_lru_push(i);
+	cache->bytes += (size_t)CACHE_MIN_CHUNK << cls;
+	cache->files++;
+}
+
+/* Drops the entries of file base in watch wd, or of the whole watch if base is NULL. Lock held. */
+static void cache_invalidate(int wd, const char *base)
+{
+	unsigned int h;
+	int i, next;
+
+	cache->wdgen[wd % CACHE_MAXWD]++;
+
+	if (base == NULL)
+	{
+		for (i = 0; i < cache_nentries; i++)
+			if (cache_entry[i].used && cache_entry[i].wd == wd)
+			{
+				cache_remove(i);
+				cache->invalidations++;
+			}
+		return;
+	}
+
+	h = cache_hash_wd(wd, base);
+	for (i = cache->bucket_wd[h % CACHE_BUCKETS]; i >= 0; i = next)
+	{
+		next = cache_entry[i].next_wd;
+		if (cache_entry[i].hash_wd == h && cache_entry[i].wd == wd &&
+			strcmp(cache_base(cache_arena + cache_entry[i].off), base) == 0)
+		{
+			cache_remove(i);
+			cache->invalidations++;
+		}
+	}
+}
+
+/* Drops every entry: nothing in the cache can be trusted. Lock held. */
+static void cache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < cache_nentries; i++)
+		if (cache_entry[i].used)
+		{
+			cache_remove(i);
+			cache->invalidations++;
+		}
+	for (i = 0; i < CACHE_MAXWD; i++)
+		cache->wdgen[i]++;
+}
+
+static void *cache_watcher(void *arg)
+{
+	char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+	int i;
+
+	(void)arg;
+	for (;;)
+	{
+		if ((n = read(cache_ifd, buf, sizeof(buf))) <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			err_ret("(%s) error - read() of the inotify events failed, cache disabled", prog_name);
+			cache_lock();
+			cache->disabled = 1;
+			for (i = 0; i < cache_nentries; i++)
+				if (cache_entry[i].used)
+					cache_remove(i);
+			pthread_mutex_unlock(&cache->lock);
+			return NULL;
+		}
+
+		cache_lock();
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event *)p;
+			/* Events lost, or a directory on the path of cached files moved:
+			   the entries below it may be under any watch. */
+			if ((ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) ||
+			    ((ev->mask & IN_ISDIR) && (ev->mask & (IN_MOVED_FROM | IN_MOVED_TO))))
+				cache_flush();
+			else if (ev->len == 0 || (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)))
+				cache_invalidate(ev->wd, NULL);
+			else
+				cache_invalidate(ev->wd, ev->name);
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+	return NULL;
+}
+
+/* Must be called before fork(): the arena and the inotify instance are inherited by the children. */
+void cache_init(size_t budget, size_t threshold)
+{
+	pthread_mutexattr_t mattr;
+	pthread_t tid;
+	size_t size;
+	char *base;
+	int i;
+
+	for (cache_nclasses = 0; cache_nclasses < CACHE_MAX_CLASSES &&
+		((size_t)CACHE_MIN_CHUNK << cache_nclasses) < threshold + CACHE_FRAMING + CACHE_MAXKEY; cache_nclasses++)
+		;
+	cache_nclasses++;
+	if (cache_nclasses > CACHE_MAX_CLASSES || ((size_t)CACHE_MIN_CHUNK << (cache_nclasses - 1)) > budget)
+		err_quit("(%s) error - cache of %zu bytes too small for files of %zu bytes", prog_name, budget, threshold);
+
+	if ((cache_ifd = inotify_init1(IN_CLOEXEC)) < 0)
+	{
+		err_ret("(%s) error - inotify_init1() failed, cache disabled", prog_name);
+		return;
+	}
+
+	cache_nentries = budget / CACHE_MIN_CHUNK;
+	size = sizeof(struct cache_shared) + cache_nentries * sizeof(struct cache_entry) + budget;
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		err_sys("(%s) error - mmap() of the file cache failed", prog_name);
+
+	cache = (struct cache_shared *)base;
+	cache_entry = (struct cache_entry *)(base + sizeof(struct cache_shared));
+	cache_arena = base + sizeof(struct cache_shared) + cache_nentries * sizeof(struct cache_entry);
+	cache_budget = budget;
+	cache_threshold = threshold;
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&cache->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	for (i = 0; i < CACHE_MAX_CLASSES; i++)
+	{
+		cache->cls[i].lru_head = cache->cls[i].lru_tail = -1;
+		cache->cls[i].free = CACHE_NONE;
+	}
+	for (i = 0; i < CACHE_BUCKETS; i++)
+		cache->bucket[i] = cache->bucket_wd[i] = -1;
+	for (i = 0; i < cache_nentries; i++)
+		cache_entry[i].next = i + 1 < cache_nentries ? i + 1 : -1;
+	cache->free_entry = 0;
+
+	if (pthread_create(&tid, NULL, cache_watcher, NULL) != 0)
+		err_quit("(%s) error - pthread_create() of the cache watcher failed", prog_name);
+	pthread_detach(tid);
+
+	err_msg("(%s) --- file cache: %zu bytes, files up to %zu bytes", prog_name, budget, threshold);
+}
+
+/* Watch on the directory of name, after the watches on its ancestors (up to
+   the working directory or "/"). Returns -1 if a component is a symbolic link. */
+static int cache_watch(const char *name)
+{
+	char dir[CACHE_MAXKEY], *p;
+	size_t len;
+	int wd;
+
+	for (len = strlen(name); len > 0 && name[len - 1] != '/'; len--)
+		;
+	while (len > 1 && name[len - 1] == '/')
+		len--;
+	if (len == 0)
+		return inotify_add_watch(cache_ifd, ".", CACHE_EVENTS);
+	memcpy(dir, name, len);
+	dir[len] = '\0';
+
+	if (dir[0] != '/' && inotify_add_watch(cache_ifd, ".", CACHE_ANCESTOR) < 0)
+		return -1;
+	for (p = dir; (p = strchr(p, '/')) != NULL; p++)
+	{
+		if (p > dir && p[-1] == '/')
+			continue;
+		*p = '\0';
+		wd = inotify_add_watch(cache_ifd, p == dir ? "/" : dir, CACHE_ANCESTOR | IN_ONLYDIR | IN_DONT_FOLLOW);
+		*p = '/';
+		if (wd < 0)
+			return -1;
+	}
+	return inotify_add_watch(cache_ifd, dir, CACHE_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+}
+
+/* Loads the response for name into cache_buf. Returns its length, 0 if the file
+   cannot be cached (the caller falls back to the normal GET path). */
+static size_t cache_load(const char *name, int *wd, unsigned int *gen)
+{
+	struct stat st;
+	uint32_t v;
+	size_t got = 0;
+	ssize_t n;
+	int fd;
+
+	/* The watch comes first: any change after this point is seen. */
+	if ((*wd = cache_watch(name)) < 0)
+		return 0;
+	cache_lock();
+	*gen = cache->wdgen[*wd % CACHE_MAXWD];
+	pthread_mutex_unlock(&cache->lock);
+
+	/* Symbolic links and hard links may change outside the watched directory. */
+	if ((fd = pi_open(name, O_RDONLY | O_NOFOLLOW)) < 0)
+		return 0;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 || (size_t)st.st_size > cache_threshold)
+	{
+		close(fd);
+		return 0;
+	}
+
+	memcpy(cache_buf, "+OK\r\n", 5);
+	v = htonl(st.st_size);
+	memcpy(cache_buf + 5, &v, 4);
+	while (got < (size_t)st.st_size && (n = read(fd, cache_buf + 9 + got, st.st_size - got)) > 0)
+		got += n;
+	close(fd);
+	if (got != (size_t)st.st_size)
+		return 0;
+	v = htonl(st.st_mtime);
+	memcpy(cache_buf + 9 + got, &v, 4);
+	return got + CACHE_FRAMING;
+}
+
+/* Loads name into cache_buf and, unless it changed meanwhile, into the
+   cache. Returns the length of the response, 0 if it cannot be cached. */
+static size_t cache_fill(const char *name, unsigned int h)
+{
+	unsigned int gen;
+	size_t len;
+	int wd;
+
+	if ((len = cache_load(name, &wd, &gen)) == 0)
+		return 0;
+	cache_lock();
+	if (!cache->disabled && cache->wdgen[wd % CACHE_MAXWD] == gen && cache_find(name, h) < 0)
+		cache_insert(name, wd, cache_buf, len);
+	pthread_mutex_unlock(&cache->lock);
+	return len;
+}
+
+/* Answers "GET name" from the cache, loading the file if it is small enough;
+   with crc set ("CGET name") the CRC32C of the contents follows the response.
+   Returns 1 if the response was sent, 0 if the caller must serve the request
+   itself, -1 if the send failed. */
+int cache_get(int connfd, const char *filename, struct rl_conn *rl, int crc)
+{
+	unsigned int h;
+	size_t len = 0;
+	int i;
+
+	if (cache == NULL || cache->disabled || strlen(filename) >= CACHE_MAXKEY)
+		return 0;
+	if (cache_buf == NULL && (cache_buf = malloc(cache_threshold + CACHE_FRAMING + 4)) == NULL)
+		return 0;
+
+	h = cache_hash(filename);
+	cache_lock();
+	if ((i = cache_find(filename, h)) >= 0)
+	{
+		/* Copied out, so the lock is not held during send(). */
+		len = cache_entry[i].len;
+		memcpy(cache_buf, cache_arena + cache_entry[i].off + strlen(filename) + 1, len);
+		cache_lru_unlink(i);
+		cache_lru_push(i);
+		cache->hits++;
+	}
+	else
+		cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	if (len == 0 && (len = cache_fill(filename, h)) == 0)
+		return 0;
+
+	if (crc)
+	{
+		/* Small file: computed on the copy just made. */
+		uint32_t v = htonl(crc32c(0, cache_buf + 9, len - CACHE_FRAMING));
+
+		memcpy(cache_buf + len, &v, 4);
+		len += 4;
+	}
+
+	rl_acquire(rl, len);
+	return sendn(connfd, cache_buf, len, MSG_NOSIGNAL) == (ssize_t)len ? 1 : -1;
+}
+
+void cache_report(void)
+{
+	unsigned long long hits, misses, evictions, invalidations;
+	size_t bytes;
+	int files;
+
+	if (cache == NULL)
+		return;
+	cache_lock();
+	hits = cache->hits;
+	misses = cache->misses;
+	evictions = cache->evictions;
+	invalidations = cache->invalidations;
+	bytes = cache->bytes;
+	files = cache->files;
+	pthread_mutex_unlock(&cache->lock);
+
+	printf("(%s) --- cache: %llu hits, %llu misses, %llu evictions, %llu invalidations, %d files (%zu/%zu bytes)\n",
+	       prog_name, hits, misses, evictions, invalidations, files, bytes, cache_budget);
+}
+
+/* Writes to fd the names of the cached files, one per "\r\n" line, least
+   recently used first (for a new server process, see handoff.c). Returns 0, -1. */
+int cache_names(int fd)
+{
+	char *list, *p;
+	size_t size = 0;
+	int c, i, rc;
+
+	if (cache == NULL)
+		return 0;
+	cache_lock();
+	for (c = 0; c < cache_nclasses; c++)
+		for (i = cache->cls[c].lru_head; i >= 0; i = cache_entry[i].next_lru)
+			size += strlen(cache_arena + cache_entry[i].off) + 2;
+	if ((list = malloc(size + 1)) == NULL)
+	{
+		pthread_mutex_unlock(&cache->lock);
+		return -1;
+	}
+	p = list;
+	for (c = 0; c < cache_nclasses; c++)
+		for (i = cache->cls[c].lru_tail; i >= 0; i = cache_entry[i].prev_lru)
+			p += sprintf(p, "%s\r\n", cache_arena + cache_entry[i].off);
+	pthread_mutex_unlock(&cache->lock);
+
+	rc = sendn(fd, list, p - list, MSG_NOSIGNAL) == p - list ? 0 : -1;
+	free(list);
+	return rc;
+}
+
+/* Loads name into the cache without a client (warm-up after a handoff). */
+void cache_warm(const char *name)
+{
+	if (cache == NULL || cache->disabled || strlen(name) >= CACHE_MAXKEY)
+		return;
+	if (cache_buf == NULL && (cache_buf = malloc(cache_threshold + CACHE_FRAMING + 4)) == NULL)
+		return;
+	cache_fill(name, cache_hash(name));
+}
@@ -0,0 +1,37 @@
+/*
+
+module: cache.h
+
+purpose: definitions of the small-file cache (cache.c)
+
+*/
+
+#ifndef _CACHE_H
+
+#define _CACHE_H
+
+#include <stddef.h>
+
+#define CACHE_MIN_CHUNK 1024	/* Smallest slab class (bytes). */
+#define CACHE_MAX_CLASSES 32	/* Slab classes, CACHE_MIN_CHUNK << i. */
+#define CACHE_THRESHOLD 65536	/* Default largest cached file (bytes). */
+#define CACHE_BUCKETS 65536	/* Hash table buckets. */
+#define CACHE_MAXWD 4096	/* Invalidation counters, indexed by watch descriptor. */
+#define CACHE_MAXKEY 1024	/* Longest filename that can be cached. */
+#define CACHE_FRAMING 13	/* "+OK\r\n" + size (4) + timestamp (4). */
+
+struct rl_conn;
+
+int cache_parse(const char *str, size_t *budget, size_t *threshold);
+
+void cache_init(size_t budget, size_t threshold);
+
+int cache_get(int connfd, const char *filename, struct rl_conn *rl, int crc);
+
+void cache_report(void);
+
+int cache_names(int fd);
+
+void cache_warm(const char *name);
+
+#endif
@@ -8,8 +8,24 @@
 
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "../errlib.h"
 #include "../sockwrap.h"
+#include "../proto2.h"
+#include "../mget.h"
+#include "../arch.h"
+#include "../bufpool.h"
+#include "../tls.h"
+#include "../fdpass.h"
+#include "../shmring.h"
+#include "../fclient.h"
+#include "../delta.h"
+#include "../put.h"
+#include "../mcast.h"
 
 #define MAXBUFL 4096		 /* Lunghezza buffer. */
 #define MSG_ERROR "-ERR\r"     /* Risposta negativa dal server. */
@@ -17,11 +33,41 @@
 #define MSG_OK "+OK\r\n"	 /* Risposta positiva dal server. */
 #define TIMEOUT 15		 /* TIMEOUT per la Select() (sec). */
 
+/* Stato di una richiesta del protocollo v2. */
+struct request2
+{
+        char *name;             /* Nome del file richiesto. */
+        FILE *fPtr;             /* File locale (NULL se non ancora aperto o annullato). */
+        uint64_t size;          /* Dimensione annunciata dal frame HEAD. */
+        uint64_t mtime;         /* Timestamp annunciato dal frame HEAD. */
+        int cancelled;          /* CANCEL inviato: il file non viene scritto. */
+};
+
 /* Prototipi di funzione. */
-void doRequest(int argc, char *argv[], int sockfd);
+void doRequest(int nfiles, char *files[], int sockfd, char *host, char *port);
+void doRequestV2(int nfiles, char *files[], int sockfd);
+void doRequestMget(int nfiles, char *files[], int sockfd);
+void doRequestTar(int npatterns, char *patterns[], int sockfd);
+void doRequestFd(int nfiles, char *files[], int sockfd);
+void doRequestRing(int nfiles, char *files[], int sockfd);
+void doRequestDelta(int nfiles, char *files[], int sockfd);
+void doRequestPut(int nfiles, char *files[], int sockfd);
+void doRequestMcast(int nfiles, char *files[], char *host, char *port);
 
 /* Variabili globali. */
 char *prog_name;
+int use_v2 = 0;                 /* Protocollo v2 multiplexato (-2). */
+int use_tar = 0;                /* Argomenti = directory o glob scaricati come archivio (-a). */
+uint64_t max_bytes = 0;         /* Annulla i file più grandi (-m, solo v2; 0 = nessun limite). */
+int use_max = 0;                /* -m presente sulla riga di comando. */
+char *tls_ca = NULL;            /* CA con cui verificare il certificato del server (-T; NULL = in chiaro). */
+int ktls = 1;                   /* Cifratura nel kernel dopo l'handshake, se disponibile (-K la disabilita). */
+char *unix_path = NULL;         /* Server sulla stessa macchina, socket AF_UNIX (-U). */
+int use_ring = 0;               /* Con -U, file ricevuti dagli anelli in memoria condivisa (-R). */
+int verify_crc = 0;             /* File richiesti con CGET e verificati con il CRC32C (-C). */
+int use_delta = 0;              /* File aggiornati ricevendo solo le differenze dalla copia locale (-D). */
+int use_put = 0;                /* Argomenti = file locali da inviare al server con PUT (-P). */
+char *mcast = NULL;             /* Gruppo multicast da cui ricevere i file, il resto con RGET (-M). */
 
 int main(int argc, char *argv[])
 {
@@ -29,180 +75,870 @@ int main(int argc, char *argv[])
         prog_name = argv[0];
 
         int sockfd;
+        int opt;
+        size_t bp_bytes;
+        int bp_huge;
+
+        /* Opzioni da riga di comando. */
+        while ((opt = getopt(argc, argv, "t:2m:ab:T:KU:RCDPM:")) != -1)
+        {
+                switch (opt)
+                {
+                case 't':
+                        /* Profilo di tuning TCP applicato alla socket prima della connect. */
+                        if (tcp_set_profile(optarg) < 0)
+                                err_quit("(%s) error - unknown tcp profile '%s' (%s)", prog_name, optarg, TCP_PROFILES);
+                        break;
+                case '2':
+                        /* Tutti i file su una connessione, con risposte interlacciate. */
+                        use_v2 = 1;
+                        break;
+                case 'a':
+                        /* Ogni argomento è una directory o un glob, ricevuto come archivio ed estratto. */
+                        use_tar = 1;
+                        break;
+                case 'm':
+                        /* I file più grandi di max_bytes vengono annullati con un CANCEL. */
+                        max_bytes = strtoull(optarg, NULL, 10);
+                        use_max = 1;
+                        break;
+                case 'b':
+                        /* Buffer dei dati ricevuti: "byte[:huge]" o "auto[:huge]". */
+                        if (bp_parse(optarg, &bp_bytes, &bp_huge) < 0)
+                                err_quit("(%s) error - invalid buffer setting '%s'", prog_name, optarg);
+                        bp_init(bp_bytes, bp_huge);
+                        break;
+                case 'T':
+                        /* TLS, verificando il server con la CA indicata. */
+                        tls_ca = optarg;
+                        break;
+                case 'K':
+                        /* TLS solo in user space, senza kTLS. */
+                        ktls = 0;
+                        break;
+                case 'U':
+                        /* Connessione AF_UNIX: i file arrivano come descrittori (FGET). */
+                        unix_path = optarg;
+                        break;
+                case 'R':
+                        /* Con -U: richieste e file passano da anelli in memoria condivisa. */
+                        use_ring = 1;
+                        break;
+                case 'C':
+                        /* Contenuto verificato con il CRC32C inviato dal server (CGET). */
+                        verify_crc = 1;
+                        break;
+                case 'D':
+                        /* Delta: il server invia solo le parti cambiate rispetto alla copia locale (DGET). */
+                        use_delta = 1;
+                        break;
+                case 'P':
+                        /* Upload: ogni argomento è un file locale, inviato al server con il suo nome. */
+                        use_put = 1;
+                        break;
+                case 'M':
+                        /* Multicast: "gruppo:porta[:interfaccia[:perdita %]]", dal server solo le parti perse. */
+                        mcast = optarg;
+                        break;
+                default:
+                        err_quit("usage: %s [-t %s] [-2 [-m max_bytes] | -a] [-b chunk[:huge]] [-T ca_file [-K]] [-C | -D | -P | -M group:port[:iface[:loss]]] (<dest_host> <dest_port> | -U socket_path [-R]) <filename1> <filename2> ...", prog_name, TCP_PROFILES);
+                }
+        }
+
+        /* Con -U non ci sono host e porta: i filename iniziano subito. */
+        int first = unix_path != NULL ? optind : optind + 2;
 
-        if (argc < 4)
-                err_quit("usage: %s <dest_host> <dest_port> <filename1> <filename2> ...", prog_name);
+        if (argc - first < 1 || (use_ring && unix_path == NULL) || (use_max && !use_v2) || (verify_crc && (use_tar || use_v2 || use_ring)) ||
+            (use_delta && (use_tar || use_v2 || use_ring || verify_crc)) ||
+            (use_put && (use_tar || use_v2 || use_ring || verify_crc || use_delta)) ||
+            (mcast != NULL && (use_tar || use_v2 || unix_path != NULL || verify_crc || use_delta || use_put || tls_ca != NULL)))
+                err_quit("usage: %s [-t %s] [-2 [-m max_bytes] | -a] [-b chunk[:huge]] [-T ca_file [-K]] [-C | -D | -P | -M group:port[:iface[:loss]]] (<dest_host> <dest_port> | -U socket_path [-R]) <filename1> <filename2> ...", prog_name, TCP_PROFILES);
+        else if (mcast != NULL)
+        {
+                /* Multicast: la connessione TCP serve solo per le parti perse, la apre mc_get(). */
+                doRequestMcast(argc - first, argv + first, argv[optind], argv[optind + 1]);
+
+                /* Programma terminato correttamente. */
+                return 0;
+        }
         else
         {
                 /* tcp_connect() crea una socket TCP e si connette al server. */
-                sockfd = tcp_connect(argv[1], argv[2]);
+                sockfd = unix_path != NULL ? unix_connect(unix_path) : tcp_connect(argv[optind], argv[optind + 1]);
 
-                /* Crea una richiesta di file sulla socket socketfd. */
-                doRequest(argc, argv, sockfd);
+                /* Handshake TLS: da qui in poi si usa il descrittore restituito. */
+                if (tls_ca != NULL)
+                {
+                        if (tls_client_init(tls_ca, ktls) < 0)
+                                err_quit("(%s) error - invalid CA file '%s'", prog_name, tls_ca);
+                        if ((sockfd = tls_start(sockfd, unix_path != NULL ? "localhost" : argv[optind])) < 0)
+                                err_quit("(%s) error - TLS handshake failed with server [%s]", prog_name, unix_path != NULL ? unix_path : argv[optind]);
+                }
+
+                /* Crea una richiesta di file sulla socket socketfd (argv[] a partire dal primo filename). */
+                if (use_tar)
+                        doRequestTar(argc - first, argv + first, sockfd);
+                else if (use_v2)
+                        doRequestV2(argc - first, argv + first, sockfd);
+                else if (use_put)
+                        doRequestPut(argc - first, argv + first, sockfd);
+                else if (use_delta)
+                        doRequestDelta(argc - first, argv + first, sockfd);
+                else if (use_ring)
+                        doRequestRing(argc - first, argv + first, sockfd);
+                else if (unix_path != NULL && !verify_crc)
+                        /* Stessa macchina: nessun byte dei file passa dalla socket. */
+                        doRequestFd(argc - first, argv + first, sockfd);
+                else if (argc - first >= MGET_MIN_FILES && !verify_crc)
+                        /* Con molti file usiamo un solo comando MGET. */
+                        doRequestMget(argc - first, argv + first, sockfd);
+                else
+                        /* GET (CGET con -C) in pipeline tramite la libreria client (fclient.c). */
+                        doRequest(argc - first, argv + first, sockfd, unix_path != NULL ? unix_path : argv[optind], unix_path != NULL ? NULL : argv[optind + 1]);
 
                 /* Chiude correttamente la socket. */
                 Close(sockfd);
 
+                /* Attendiamo che il relay TLS (se presente) chiuda la connessione. */
+                tls_end();
+
                 /* Programma terminato correttamente. */
                 return 0;
         }
 }
 
-void doRequest(int argc, char *argv[], int sockfd)
+/* Nome locale del file: se viene richiesto un path prendiamo quello che segue l'ultimo "/". */
+static char *localName(char *name)
+{
+        char *temp = strrchr(name, '/');
+
+        return temp != NULL ? temp + 1 : name;
+}
+
+/* Buffer per i dati dei file ricevuti, preso dal pool alla prima richiesta. */
+static char *dataBuffer(int sockfd, size_t *len)
 {
-        char buffer[MAXBUFL]; /* Buffer usato lato client. */
-        int i;                /* Contatore per il loop. */
+        static char *buf = NULL;
+        static size_t buflen = 0;
 
-        /* Settaggio del timer. */
-	fd_set read_set;
-	struct timeval tval;
-	tval.tv_sec = TIMEOUT;	  	 /* Numero di secondi. */
-	tval.tv_usec = 0;		 /* Numero di microsecondi. */
-	FD_ZERO(&read_set);
-	FD_SET(sockfd, &read_set);
+        if (buf == NULL && (buf = bp_get(buflen = bp_chunk(sockfd, 0))) == NULL)
+                err_sys("(%s) error - no memory for a buffer of %zu bytes", prog_name, buflen);
+        *len = buflen;
+        return buf;
+}
+
+/* Destinazione di un file richiesto con la libreria: aperta al primo byte ricevuto. */
+struct getFile
+{
+        char *name;
+        FILE *fPtr;
+};
 
-	for (i = 3; i < argc; i++)
+static int onData(struct fc_req *r, const char *data, size_t len)
+{
+        struct getFile *g = r->arg;
+
+        if (g->fPtr == NULL)
+                g->fPtr = Fopen(localName(g->name), "w");
+        if (fwrite(data, 1, len, g->fPtr) != len)
+                return -1;
+
+        /* Teniamo traccia della percentuale di dati scaricati. */
+        printf("\rDownloading: %lu%%     ", (unsigned long)(r->received * 100 / r->size));
+        return 0;
+}
+
+static void onDone(struct fc_req *r)
+{
+        struct getFile *g = r->arg;
+
+        if (r->status == FC_OK && g->fPtr == NULL)
+                g->fPtr = Fopen(localName(g->name), "w"); /* file vuoto */
+        if (g->fPtr != NULL)
+                Fclose(g->fPtr);
+        g->fPtr = NULL;
+
+        if (r->status == FC_OK)
+        {
+                printf("\nReceived file %s\nReceived file size %u\nReceived file timestamp %u\n", localName(g->name), r->size, r->timestamp);
+                if (r->verify)
+                        printf("Received file CRC32C %08x (verified)\n", r->crc);
+        }
+        else if (r->status == FC_ERR)
+                err_msg("(%s) error - server side, '%s' not available", prog_name, g->name);
+        else
         {
-                /* Calcola e salva la lunghezza del filename */
-                size_t length = strlen(argv[i]);
+                err_msg("(%s) error - '%s': %s", prog_name, g->name, fc_strstatus(r->status));
 
-                /* Cancelliamo tutti i byte del buffer. */
-                memset(buffer, 0, MAXBUFL);
+                /* Non lasciamo su disco un file corrotto. */
+                if (r->status == FC_ECSUM && unlink(localName(g->name)) != 0)
+                        err_ret("(%s) error - unlink() of '%s' failed", prog_name, localName(g->name));
+        }
+}
 
-                /* Creiamo il comando per richiedere il file seguendo il protocollo. */
-                strcpy(buffer, MSG_GET);
-                strncat(buffer, argv[i], length);
-                strncat(buffer, "\r\n", 2);
+/* Con TLS la connessione non si può riaprire (un solo relay per processo). */
+static int noReconnect(const char *host, const char *port)
+{
+        (void)port;
+        err_msg("(%s) error - connection with server [%s] lost", prog_name, host);
+        return -1;
+}
 
-                /* Inviamo il comando. */
-                Writen(sockfd, buffer, strlen(buffer));
+void doRequest(int nfiles, char *files[], int sockfd, char *host, char *port)
+{
+        struct fc_pool *pool;
+        struct fc_req *req;
+        struct getFile *g;
+        int i;
+
+        /* Una sola connessione, quella già aperta, con tutte le GET in pipeline. */
+        pool = fc_pool_new(1, tls_enabled() ? noReconnect : NULL);
+        req = calloc(nfiles, sizeof(*req));
+        g = calloc(nfiles, sizeof(*g));
+        if (pool == NULL || req == NULL || g == NULL)
+                err_sys("(%s) error - out of memory", prog_name);
+        if (fc_pool_adopt(pool, host, port, sockfd) < 0)
+                err_sys("(%s) error - fc_pool_adopt() failed", prog_name);
+
+        for (i = 0; i < nfiles; i++)
+        {
+                g[i].name = files[i];
+                fc_req_init(&req[i], files[i]);
+                req[i].on_data = onData;
+                req[i].on_done = onDone;
+                req[i].arg = &g[i];
+                req[i].verify = verify_crc;
+                fc_submit(pool, host, port, &req[i]);
+        }
+        fc_run(pool);
+
+        fc_pool_free(pool);
+        free(req);
+        free(g);
+}
+
+/* Invia il GET v2 della richiesta i (id = i + 1). */
+static void sendGetV2(int sockfd, char *files[], int i)
+{
+        if (v2_send(sockfd, V2_GET, 0, i + 1, files[i], strlen(files[i])) < 0)
+                err_sys("(%s) error - sending v2 GET for '%s' failed", prog_name, files[i]);
+}
+
+void doRequestV2(int nfiles, char *files[], int sockfd)
+{
+        char buffer[MAXBUFL];           /* Buffer usato lato client. */
+        size_t chunk;
+        char *data = dataBuffer(sockfd, &chunk); /* Payload dei frame DATA. */
+        struct request2 *req;           /* Una entry per file, indice = id - 1. */
+        struct v2_header h;
+        struct request2 *r;
+        int sent = 0, completed = 0;    /* GET inviati e richieste concluse. */
+        int n;
+
+        fd_set read_set;
+        struct timeval tval;
+
+        if ((req = calloc(nfiles, sizeof(struct request2))) == NULL)
+                err_sys("(%s) error - calloc() failed", prog_name);
+
+        /* Passiamo al protocollo v2 e inviamo subito tutti i GET, fino al massimo
+           di richieste contemporanee accettate dal server. */
+        Writen(sockfd, V2_MAGIC "\r\n", 6);
+        for (; sent < nfiles && sent < V2_MAX_INFLIGHT; sent++)
+        {
+                req[sent].name = files[sent];
+                sendGetV2(sockfd, files, sent);
+        }
 
-                if (Select(FD_SETSIZE, &read_set, NULL, NULL, &tval) > 0)
+        while (completed < nfiles)
+        {
+                FD_ZERO(&read_set);
+                FD_SET(sockfd, &read_set);
+                tval.tv_sec = TIMEOUT;
+                tval.tv_usec = 0;
+
+                if (Select(FD_SETSIZE, &read_set, NULL, NULL, &tval) == 0)
                 {
-                        /* Riceviamo la risposta dal server. */
-                        Recv(sockfd, buffer, 5, 0);
+                        printf("(%s) - timeout waiting for data from server\n", prog_name);
+                        break;
+                }
 
-                        /* strncmp() ritorna 0 se la risposta è positiva. */
-                        if (strncmp(buffer, MSG_OK, 5) == 0)
-                        {
-                    				u_int32_t file_bytes;
+                if ((n = v2_recv_header(sockfd, &h)) <= 0)
+                {
+                        err_msg("(%s) error - connection closed by server, closing..", prog_name);
+                        break;
+                }
+                if (h.id < 1 || h.id > (uint32_t)sent)
+                {
+                        err_msg("(%s) error - invalid response, closing..", prog_name);
+                        break;
+                }
+                r = &req[h.id - 1];
 
-                    				/* Tutti i descrittori che non sono pronti al ritorno della select()
-                    				   avranno bit del descriptor set puliti.
-                    				   Riportiamo per sicurezza i bit che ci interessano a 1. */
-                    				if (Select(FD_SETSIZE, &read_set, NULL, NULL, &tval) > 0)
-                      			{
-                                /* Riceviamo il numero di byte del file richiesto tramite la socket. */
-                                Recv(sockfd, &file_bytes, 4, 0);
-                                file_bytes = ntohl(file_bytes);
-                    				}
+                if (h.type == V2_HEAD && h.length == 16)
+                {
+                        uint64_t v[2];
 
-                    				/* select() ritorna 0 (timeout). */
-                    				else
-                    				{
-                    				        printf("(%s) - timeout waiting for data from server\n", prog_name);
+                        Readn(sockfd, v, 16);
+                        r->size = be64toh(v[0]);
+                        r->mtime = be64toh(v[1]);
 
-                    				        return;
-                    				}
+                        if (max_bytes > 0 && r->size > max_bytes)
+                        {
+                                /* File troppo grande: annulliamo la richiesta, i DATA già in viaggio vengono scartati. */
+                                printf("(%s) --- file %s is %llu bytes, cancelling\n", prog_name, r->name, (unsigned long long)r->size);
+                                r->cancelled = 1;
+                                if (v2_send(sockfd, V2_CANCEL, 0, h.id, NULL, 0) < 0)
+                                        err_sys("(%s) error - sending v2 CANCEL failed", prog_name);
+                        }
+                        else
+                                r->fPtr = Fopen(localName(r->name), "w");
+                }
+                else if (h.type == V2_DATA)
+                {
+                        /* Copiamo il payload nel file, a blocchi del buffer dei dati. */
+                        while (h.length > 0)
+                        {
+                                size_t len = h.length < chunk ? h.length : chunk;
 
-                                FILE *fPtr;
-                                int n;                                 /* Numero di byte ricevuti. */
-                                u_int32_t remaining_data = file_bytes; /* Dati da leggere, inizialmente uguali al numero di byte del file. */
+                                if (Readn(sockfd, data, len) != (ssize_t)len)
+                                        err_quit("(%s) error - server side, closing..", prog_name);
+                                if (r->fPtr != NULL)
+                                        fwrite(data, sizeof(char), len, r->fPtr);
+                                h.length -= len;
+                        }
+                }
+                else if (h.type == V2_END && h.length == 0)
+                {
+                        if (r->fPtr != NULL)
+                                Fclose(r->fPtr);
+                        r->fPtr = NULL;
 
-                                char *temp = argv[i];
+                        /* Un END senza V2_F_CANCELLED può incrociare il nostro CANCEL: il file resta comunque annullato. */
+                        if ((h.flags & V2_F_CANCELLED) || r->cancelled)
+                                printf("(%s) --- request for %s cancelled\n", prog_name, r->name);
+                        else
+                                printf("Received file %s\nReceived file size %llu\nReceived file timestamp %llu\n", localName(r->name),
+                                       (unsigned long long)r->size, (unsigned long long)r->mtime);
+                        completed++;
+                }
+                else if (h.type == V2_ERR && h.length < MAXBUFL)
+                {
+                        Readn(sockfd, buffer, h.length);
+                        buffer[h.length] = '\0';
+                        if (r->fPtr != NULL)
+                                Fclose(r->fPtr);
+                        r->fPtr = NULL;
+
+                        /* Nel protocollo v2 l'errore riguarda solo la richiesta, la connessione resta aperta. */
+                        err_msg("(%s) error - server side for %s: %s", prog_name, r->name, buffer);
+                        completed++;
+                }
+                else
+                {
+                        err_msg("(%s) error - invalid response, closing..", prog_name);
+                        break;
+                }
 
-                                /* Se viene richiesto il file in un path cerchiamo se nel nome del file
-				   c'è "/", se c'è andiamo a cercare l'ultima occorrenza di "/" e poi
-				   prendiamo il nome del file. */
+                /* Una richiesta conclusa libera il posto per il GET successivo. */
+                if ((h.type == V2_END || h.type == V2_ERR) && sent < nfiles)
+                {
+                        req[sent].name = files[sent];
+                        sendGetV2(sockfd, files, sent);
+                        sent++;
+                }
+        }
 
-                                if (strstr(argv[i], "/") != NULL)
+        for (n = 0; n < sent; n++)
+                if (req[n].fPtr != NULL)
+                        Fclose(req[n].fPtr);
+        free(req);
 
-                                        temp = (strrchr(argv[i], '/')) + 1;
+        return; /* Torniamo alla funzione chiamante. */
+}
 
-                                fPtr = Fopen(temp, "w");
+/* Attende dati dal server per al massimo TIMEOUT secondi; ritorna 0 in caso di timeout. */
+static int waitServer(int sockfd)
+{
+        fd_set read_set;
+        struct timeval tval;
 
+        FD_ZERO(&read_set);
+        FD_SET(sockfd, &read_set);
+        tval.tv_sec = TIMEOUT;
+        tval.tv_usec = 0;
 
-                        				int var=0;
-                                                        while (remaining_data>0)
-                                                        {
-                        					/*Se non è stato inviato nessun dato nel precedente ciclo di while, c'è un problema lato server. */
-                        					if(var==remaining_data){
-                        						err_msg("\n(%s) error - server side, closing..", prog_name);
-                                                                	return;
-                        					}
+        if (Select(FD_SETSIZE, &read_set, NULL, NULL, &tval) > 0)
+                return 1;
 
-                        					var= remaining_data;
-                        					if(remaining_data<sizeof(buffer)){
-                        						n=Recv(sockfd,buffer,remaining_data,0);
-                        						fwrite(buffer, sizeof(char), n, fPtr);
-                        						remaining_data=0;
+        printf("(%s) - timeout waiting for data from server\n", prog_name);
+        return 0;
+}
 
-                        					}
-                        					else{
-                        						n=Recv(sockfd, buffer, sizeof(buffer), 0);
-                        			                        fwrite(buffer, sizeof(char), n, fPtr);
-                        						remaining_data -= n;
-                        					}
+void doRequestMget(int nfiles, char *files[], int sockfd)
+{
+        char buffer[MAXBUFL];           /* Buffer usato lato client. */
+        unsigned char rec[MGET_RECLEN]; /* Stato, dimensione e timestamp di un file. */
+        size_t used, length, chunk;
+        char *data = dataBuffer(sockfd, &chunk); /* Contenuto dei file. */
+        uint64_t file_bytes, timest, remaining_data;
+        char status;
+        FILE *fPtr;
+        int i;
+
+        /* Comando "MGET n\r\n" seguito dai nomi dei file, inviati a blocchi di MAXBUFL. */
+        used = snprintf(buffer, sizeof(buffer), "%s %d\r\n", MSG_MGET, nfiles);
+        for (i = 0; i < nfiles; i++)
+        {
+                length = strlen(files[i]);
+                if (used + length + 2 > sizeof(buffer))
+                {
+                        Writen(sockfd, buffer, used);
+                        used = 0;
+                }
+                if (length + 2 > sizeof(buffer))
+                        err_quit("(%s) error - filename too long: %s", prog_name, files[i]);
+                memcpy(buffer + used, files[i], length);
+                memcpy(buffer + used + length, "\r\n", 2);
+                used += length + 2;
+        }
+        Writen(sockfd, buffer, used);
 
+        if (!waitServer(sockfd))
+                return;
+        if (Readn(sockfd, buffer, 5) != 5 || strncmp(buffer, MSG_OK, 5) != 0)
+        {
+                err_msg("(%s) error - server side, closing..", prog_name);
+                return;
+        }
 
+        for (i = 0; i < nfiles; i++)
+        {
+                if (!waitServer(sockfd))
+                        return;
+                if (Readn(sockfd, rec, MGET_RECLEN) != MGET_RECLEN)
+                {
+                        err_msg("(%s) error - server side, closing..", prog_name);
+                        return;
+                }
+                mget_unpack(rec, &status, &file_bytes, &timest);
 
-                                                                /* Teniamo traccia della percentuale di dati sccaricati. */
-                                                                printf("\rDownloading: %lu%%     ", (unsigned long)(file_bytes - remaining_data) * 100 / file_bytes);
+                /* Un file non disponibile non interrompe il batch. */
+                if (status != '+')
+                {
+                        err_msg("(%s) error - server side for %s: file not available", prog_name, files[i]);
+                        continue;
+                }
 
+                fPtr = Fopen(localName(files[i]), "w");
+                for (remaining_data = file_bytes; remaining_data > 0; remaining_data -= length)
+                {
+                        length = remaining_data < chunk ? remaining_data : chunk;
+                        if (!waitServer(sockfd))
+                        {
+                                Fclose(fPtr);
+                                return;
+                        }
+                        if (Readn(sockfd, data, length) != (ssize_t)length)
+                        {
+                                err_msg("\n(%s) error - server side, closing..", prog_name);
+                                Fclose(fPtr);
+                                return;
+                        }
+                        fwrite(data, sizeof(char), length, fPtr);
+                }
+                Fclose(fPtr);
 
-                                                        }
-                        				Fclose(fPtr);
+                printf("Received file %s\nReceived file size %llu\nReceived file timestamp %llu\n", localName(files[i]),
+                       (unsigned long long)file_bytes, (unsigned long long)timest);
+        }
 
+        return; /* Torniamo alla funzione chiamante. */
+}
 
-                        				char timestamp[10]="";
-                        				u_int32_t timest;
+/* Un nome ricevuto nell'archivio è accettato solo se relativo e senza componenti "..". */
+static int safeName(const char *name)
+{
+        const char *p;
 
-                        				/* Riceviamo tramite sockfd la data dell'ultima modifica (timestamp). */
-                        				if (Select(FD_SETSIZE, &read_set, NULL, NULL, &tval) > 0)
-                                        		{
+        if (name[0] == '/' || name[0] == '\0')
+                return 0;
+        for (p = name; p != NULL; p = strchr(p, '/'))
+        {
+                if (*p == '/')
+                        p++;
+                if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0'))
+                        return 0;
+        }
+        return 1;
+}
 
-                        				        Recv(sockfd, &timestamp, 4, 0);
-                        				}
-                        				else
-                        				{
-                        				        printf("(%s) - timeout waiting for data from server\n", prog_name);
+/* Crea tutte le directory del path (come "mkdir -p"); se file è 1 l'ultimo componente è un file. */
+static void makeDirs(const char *name, int file)
+{
+        char path[ARCH_MAXPATH];
+        char *p;
 
-                        				        return;
-                        				}
+        snprintf(path, sizeof(path), "%s", name);
+        for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/'))
+        {
+                *p = '\0';
+                if (mkdir(path, 0755) != 0 && errno != EEXIST)
+                        err_sys("(%s) error - mkdir() of '%s' failed", prog_name, path);
+                *p = '/';
+        }
+        if (!file && mkdir(path, 0755) != 0 && errno != EEXIST)
+                err_sys("(%s) error - mkdir() of '%s' failed", prog_name, path);
+}
 
-                        		                timest = ntohl(*(uint32_t *)timestamp);
+/* Copia size byte dalla socket nel file fPtr (NULL = scarta), più il padding del blocco tar. */
+static int copyEntry(int sockfd, FILE *fPtr, uint64_t size)
+{
+        size_t chunk;
+        char *buffer = dataBuffer(sockfd, &chunk);
+        uint64_t remaining_data = size + (ARCH_BLOCK - size % ARCH_BLOCK) % ARCH_BLOCK;
+        size_t length;
 
-	                        printf("\nReceived file %s\nReceived file size %u\nReceived file timestamp %u\n", temp, file_bytes, timest);
+        while (remaining_data > 0)
+        {
+                length = remaining_data < chunk ? remaining_data : chunk;
+                if (!waitServer(sockfd) || Readn(sockfd, buffer, length) != (ssize_t)length)
+                        return -1;
+                if (fPtr != NULL && size > 0)
+                        fwrite(buffer, sizeof(char), length < size ? length : size, fPtr);
+                size -= length < size ? length : size;
+                remaining_data -= length;
+        }
+        return 0;
+}
 
+void doRequestTar(int npatterns, char *patterns[], int sockfd)
+{
+        unsigned char block[ARCH_BLOCK];
+        char longname[ARCH_MAXPATH];
+        struct arch_entry e;
+        struct timespec times[2];
+        FILE *fPtr;
+        long files;
+        int i, n, zeros, havelong;
+
+        for (i = 0; i < npatterns; i++)
+        {
+                /* Comando "TAR pattern\r\n". */
+                snprintf(longname, sizeof(longname), "%s%s\r\n", MSG_TAR, patterns[i]);
+                Writen(sockfd, longname, strlen(longname));
+
+                if (!waitServer(sockfd))
+                        return;
+                if (Readn(sockfd, block, 5) != 5 || strncmp((char *)block, MSG_OK, 5) != 0)
+                {
+                        err_msg("(%s) error - server side, closing..", prog_name);
+                        return;
+                }
+
+                /* Estraiamo le entry man mano che arrivano, fino ai due blocchi a zero finali. */
+                files = 0;
+                zeros = 0;
+                havelong = 0;
+                while (zeros < 2)
+                {
+                        if (!waitServer(sockfd) || Readn(sockfd, block, ARCH_BLOCK) != ARCH_BLOCK)
+                                return;
+                        if ((n = arch_parse(block, &e)) == 0)
+                        {
+                                zeros++;
+                                continue;
+                        }
+                        if (n < 0)
+                        {
+                                err_msg("(%s) error - invalid archive header, closing..", prog_name);
+                                return;
                         }
+                        zeros = 0;
 
-                        /* strncmp() è uguale a 0 se riceviamo una risposta negativa dal server. */
-                        else if (strncmp(buffer, MSG_ERROR, 5) == 0)
+                        if (e.type == 'L')
                         {
-                                Recv(sockfd, buffer, 1, 0);
-                                if (strncmp(buffer, "\n", 1) == 0)
+                                /* Nome lungo (GNU) dell'entry successiva. */
+                                n = (ARCH_BLOCK - e.size % ARCH_BLOCK) % ARCH_BLOCK; /* padding */
+                                if (e.size >= sizeof(longname) || Readn(sockfd, longname, e.size) != (ssize_t)e.size ||
+                                    Readn(sockfd, block, n) != n)
                                 {
-                                	err_msg("(%s) error - server side, closing..", prog_name);
+                                        err_msg("(%s) error - invalid archive header, closing..", prog_name);
                                         return;
                                 }
+                                longname[e.size] = '\0';
+                                havelong = 1;
+                                continue;
                         }
+                        if (havelong)
+                                snprintf(e.name, sizeof(e.name), "%s", longname);
+                        havelong = 0;
 
-                        /* Se si riceve altro. */
-                        else
+                        if (!safeName(e.name))
                         {
-                                err_msg("(%s) error - invalid response, closing..", prog_name);
+                                err_msg("(%s) error - unsafe name '%s' in archive, skipped", prog_name, e.name);
+                                if (copyEntry(sockfd, NULL, e.type == '0' ? e.size : 0) < 0)
+                                        return;
+                                continue;
+                        }
 
-                                return;
+                        if (e.type == '5')
+                                makeDirs(e.name, 0);
+                        else if (e.type == '0')
+                        {
+                                makeDirs(e.name, 1);
+                                fPtr = Fopen(e.name, "w");
+                                if (copyEntry(sockfd, fPtr, e.size) < 0)
+                                {
+                                        Fclose(fPtr);
+                                        err_msg("\n(%s) error - server side, closing..", prog_name);
+                                        return;
+                                }
+                                fflush(fPtr);
+
+                                /* Manteniamo il timestamp dell'ultima modifica del server. */
+                                times[0].tv_sec = times[1].tv_sec = e.mtime;
+                                times[0].tv_nsec = times[1].tv_nsec = 0;
+                                futimens(fileno(fPtr), times);
+                                Fclose(fPtr);
+
+                                printf("Received file %s\nReceived file size %llu\nReceived file timestamp %llu\n", e.name,
+                                       (unsigned long long)e.size, (unsigned long long)e.mtime);
+                                files++;
                         }
+                        else if (copyEntry(sockfd, NULL, e.size) < 0) /* altri tipi: ignorati */
+                                return;
                 }
-                /* select() ritorna 0 (timeout). */
-                else
+
+                printf("(%s) --- extracted %ld files of '%s'\n", prog_name, files, patterns[i]);
+        }
+
+        return; /* Torniamo alla funzione chiamante. */
+}
+
+void doRequestFd(int nfiles, char *files[], int sockfd)
+{
+        char buffer[MAXBUFL];
+        struct stat st;
+        int i, fd;
+        ssize_t n;
+
+        for (i = 0; i < nfiles; i++)
+        {
+                /* "FGET filename\r\n" */
+                if (strlen(files[i]) > MAXBUFL - 8)
+                        err_quit("(%s) error - file name too long: '%s'", prog_name, files[i]);
+                snprintf(buffer, MAXBUFL, "%s %s\r\n", MSG_FGET, files[i]);
+                Writen(sockfd, buffer, strlen(buffer));
+
+                if (!waitServer(sockfd))
+                        return;
+
+                /* Il descrittore viaggia insieme ai byte di "+OK\r\n". */
+                if ((n = Read_fd(sockfd, buffer, 5, &fd)) <= 0)
+                        err_quit("(%s) error - connection closed by server", prog_name);
+                if (n < 5 && Readn(sockfd, buffer + n, 5 - n) != 5 - n)
+                        err_quit("(%s) error - connection closed by server", prog_name);
+
+                if (strncmp(buffer, MSG_OK, 5) != 0 || fd < 0)
                 {
-                        printf("(%s) - timeout waiting for data from server\n", prog_name);
+                        if (fd >= 0)
+                                close(fd);
+                        err_msg("(%s) error - server side, closing..", prog_name);
+                        return;
+                }
+
+                if (fstat(fd, &st) != 0)
+                        err_sys("(%s) error - fstat() of the received descriptor failed", prog_name);
 
+                FILE *fPtr = Fopen(localName(files[i]), "w");
+
+                /* Copia dal file del server mappato in memoria: nessun passaggio dalla socket. */
+                if (st.st_size > 0)
+                {
+                        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                        if (data == MAP_FAILED)
+                                err_sys("(%s) error - mmap() of '%s' failed", prog_name, files[i]);
+                        madvise(data, st.st_size, MADV_SEQUENTIAL);
+                        if (fwrite(data, 1, st.st_size, fPtr) != (size_t)st.st_size)
+                                err_sys("(%s) error - writing '%s' failed", prog_name, localName(files[i]));
+                        munmap(data, st.st_size);
+                }
+                Fclose(fPtr);
+                close(fd);
+
+                printf("Received file %s\nReceived file size %llu\nReceived file timestamp %llu\n", localName(files[i]),
+                       (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+        }
+}
+
+void doRequestRing(int nfiles, char *files[], int sockfd)
+{
+        char buffer[MAXBUFL], *p;
+        struct shm_chan c;
+        uint32_t size, timestamp, left;
+        size_t len;
+        ssize_t n;
+        int i, fd;
+
+        /* Negoziazione: il server risponde "+OK\r\n" con il memfd degli anelli. */
+        Writen(sockfd, MSG_RING "\r\n", 6);
+        if (!waitServer(sockfd))
+                return;
+        if ((n = Read_fd(sockfd, buffer, 5, &fd)) <= 0)
+                err_quit("(%s) error - connection closed by server", prog_name);
+        if (n < 5 && Readn(sockfd, buffer + n, 5 - n) != 5 - n)
+                err_quit("(%s) error - connection closed by server", prog_name);
+        if (strncmp(buffer, MSG_OK, 5) != 0 || fd < 0)
+        {
+                if (fd >= 0)
+                        close(fd);
+                err_msg("(%s) error - server side, closing..", prog_name);
+                return;
+        }
+        if (shm_attach(&c, sockfd, fd) < 0)
+                err_quit("(%s) error - invalid rings from server", prog_name);
+        close(fd);
+
+        for (i = 0; i < nfiles; i++)
+        {
+                /* "GET filename\r\n", come sulla socket. */
+                if (strlen(files[i]) > MAXBUFL - 8)
+                        err_quit("(%s) error - file name too long: '%s'", prog_name, files[i]);
+                snprintf(buffer, MAXBUFL, "GET %s\r\n", files[i]);
+                if (shm_write(&c, buffer, strlen(buffer)) < 0)
+                        err_quit("(%s) error - connection closed by server", prog_name);
+
+                /* "+OK\r\n" oppure "-ERR\r\n". */
+                if (shm_read(&c, buffer, 5) != 5)
+                        err_quit("(%s) error - connection closed by server", prog_name);
+                if (strncmp(buffer, MSG_OK, 5) != 0)
+                {
+                        err_msg("(%s) error - server side, closing..", prog_name);
+                        break;
+                }
+                if (shm_read(&c, &size, 4) != 4)
+                        err_quit("(%s) error - connection closed by server", prog_name);
+                size = ntohl(size);
+
+                FILE *fPtr = Fopen(localName(files[i]), "w");
+
+                /* Scriviamo il file direttamente dall'anello, senza copie intermedie. */
+                for (left = size; left > 0; left -= len)
+                {
+                        if ((len = shm_peek(&c, &p)) == 0)
+                                err_quit("(%s) error - connection closed by server", prog_name);
+                        if (len > left)
+                                len = left;
+                        if (fwrite(p, 1, len, fPtr) != len)
+                                err_sys("(%s) error - writing '%s' failed", prog_name, localName(files[i]));
+                        shm_consume(&c, len);
+                }
+                Fclose(fPtr);
+
+                if (shm_read(&c, &timestamp, 4) != 4)
+                        err_quit("(%s) error - connection closed by server", prog_name);
+
+                printf("Received file %s\nReceived file size %u\nReceived file timestamp %u\n", localName(files[i]), size, ntohl(timestamp));
+        }
+
+        shm_close(&c);
+}
+
+void doRequestDelta(int nfiles, char *files[], int sockfd)
+{
+        struct delta_stats ds;
+        int i, rc;
+
+        for (i = 0; i < nfiles; i++)
+        {
+                /* Firma della copia locale (se esiste), poi il file ricostruito dai suoi blocchi e dai dati ricevuti. */
+                rc = delta_get(sockfd, files[i], localName(files[i]), 1, &ds);
+
+                /* Il CRC32C del file ricostruito non corrisponde: lo richiediamo intero. */
+                if (rc == DELTA_ECSUM)
+                {
+                        err_msg("(%s) error - '%s': rebuilt file does not match, fetching it whole", prog_name, files[i]);
+                        rc = delta_get(sockfd, files[i], localName(files[i]), 0, &ds);
+                }
+
+                if (rc == DELTA_EREFUSED)
+                {
+                        err_msg("(%s) error - server side, '%s' not available", prog_name, files[i]);
                         return;
                 }
+                else if (rc == DELTA_ELOCAL)
+                        err_sys("(%s) error - writing '%s' failed", prog_name, localName(files[i]));
+                else if (rc == DELTA_ECSUM)
+                {
+                        /* Anche il file intero non corrisponde al CRC32C del server: la copia locale resta com'era. */
+                        err_msg("(%s) error - '%s': CRC32C mismatch, local copy left unchanged", prog_name, files[i]);
+                        continue;
+                }
+                else if (rc != DELTA_OK)
+                        err_quit("(%s) error - connection closed by server", prog_name);
+
+                printf("Received file %s\nReceived file size %u\nReceived file timestamp %u\n", localName(files[i]), ds.size, ds.timestamp);
+                printf("Delta: %llu bytes received, %llu bytes reused from the local copy\n", (unsigned long long)ds.literal, (unsigned long long)ds.copied);
         }
+}
 
-        return; /* Torniamo alla funzione chiamante. */
+void doRequestPut(int nfiles, char *files[], int sockfd)
+{
+        int i, rc;
+
+        for (i = 0; i < nfiles; i++)
+        {
+                /* Il server risponde "+OK\r\n" solo quando il file è su disco con il suo nome. */
+                if ((rc = put_send(sockfd, files[i], localName(files[i]))) > 0)
+                {
+                        err_msg("(%s) error - server side, '%s' refused, closing..", prog_name, localName(files[i]));
+                        return;
+                }
+                else if (rc < 0)
+                        err_sys("(%s) error - uploading '%s' failed", prog_name, files[i]);
+
+                printf("Sent file %s\n", localName(files[i]));
+        }
+}
+
+void doRequestMcast(int nfiles, char *files[], char *host, char *port)
+{
+        struct mc_file *f;
+        int i, failed = 0;
+
+        if ((f = calloc(nfiles, sizeof(*f))) == NULL)
+                err_sys("(%s) error - no memory for %d files", prog_name, nfiles);
+        for (i = 0; i < nfiles; i++)
+        {
+                f[i].name = files[i];
+                f[i].local = localName(files[i]);
+        }
+
+        /* Tutti i file insieme dal gruppo, poi con RGET quello che la FEC non ha ricostruito. */
+        if (mc_get(mcast, host, port, f, nfiles) < 0)
+                err_sys("(%s) error - cannot join multicast group %s", prog_name, mcast);
+
+        for (i = 0; i < nfiles; i++)
+        {
+                if (f[i].status == MC_EREFUSED)
+                        err_msg("(%s) error - server side, '%s' not available", prog_name, files[i]);
+                else if (f[i].status == MC_ELOCAL)
+                        err_ret("(%s) error - writing '%s' failed", prog_name, f[i].local);
+                else if (f[i].status != MC_OK)
+                        err_msg("(%s) error - '%s': connection with server [%s] failed", prog_name, files[i], host);
+                else
+                {
+                        printf("Received file %s\nReceived file size %u\nReceived file timestamp %u\n", f[i].local, f[i].size, f[i].timestamp);
+                        printf("Multicast: %llu bytes received, %llu rebuilt with FEC, %llu fetched with RGET\n", (unsigned long long)f[i].received,
+                               (unsigned long long)f[i].rebuilt, (unsigned long long)f[i].repaired);
+                        continue;
+                }
+                failed++;
+        }
+        free(f);
+
+        if (failed > 0)
+                err_quit("(%s) error - %d of %d files not received", prog_name, failed, nfiles);
 }
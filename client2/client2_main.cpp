@@ -0,0 +1,196 @@
+/*
+ * Client TCP in C++20 (sockco.hpp) che richiede con GET i file passati sulla
+ * riga di comando, distribuiti su una o più connessioni (-c).
+ * Su ogni connessione una coroutine invia tutti i GET in pipeline e un'altra
+ * riceve le risposte nello stesso ordine; tutte girano in un solo thread.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include "../sockco.hpp"
+
+extern "C"
+{
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../bufpool.h"
+}
+
+#define MAXBUFL 4096		 /* Lunghezza buffer. */
+#define MSG_GET "GET "		 /* Messaggio di richiesta dal client. */
+#define MSG_OK "+OK\r\n"	 /* Risposta positiva dal server. */
+#define TIMEOUT 15		 /* TIMEOUT di ogni attesa sulla socket (sec). */
+
+/* Prototipi di funzione. */
+sockco::task<> manageConnection(char *host, char *port, char *files[], int nfiles, int k);
+sockco::task<> sendRequests(int sockfd, char *files[], int nfiles, int k);
+
+/* Variabili globali. */
+char *prog_name;
+int nconns = 1;                 /* Connessioni aperte verso il server (-c). */
+int received = 0;               /* File ricevuti correttamente. */
+
+int main(int argc, char *argv[])
+{
+        /* Per la libreria errlib. */
+        prog_name = argv[0];
+
+        int opt;
+
+        /* Opzioni da riga di comando. */
+        while ((opt = getopt(argc, argv, "t:c:")) != -1)
+        {
+                switch (opt)
+                {
+                case 't':
+                        /* Profilo di tuning TCP applicato alla socket prima della connect. */
+                        if (tcp_set_profile(optarg) < 0)
+                                err_quit("(%s) error - unknown tcp profile '%s' (%s)", prog_name, optarg, TCP_PROFILES);
+                        break;
+                case 'c':
+                        /* File distribuiti a turno su questo numero di connessioni. */
+                        if ((nconns = atoi(optarg)) < 1)
+                                err_quit("(%s) error - invalid number of connections '%s'", prog_name, optarg);
+                        break;
+                default:
+                        err_quit("usage: %s [-t %s] [-c connections] <dest_host> <dest_port> <filename1> <filename2> ...", prog_name, TCP_PROFILES);
+                }
+        }
+
+        int first = optind + 2;
+
+        if (argc - first < 1)
+                err_quit("usage: %s [-t %s] [-c connections] <dest_host> <dest_port> <filename1> <filename2> ...", prog_name, TCP_PROFILES);
+
+        /* Un nome troppo lungo non entrerebbe nel comando GET. */
+        for (int i = first; i < argc; i++)
+                if (strlen(argv[i]) + 7 > MAXBUFL)
+                        err_quit("(%s) error - file name too long '%s'", prog_name, argv[i]);
+
+        /* L'executor va creato prima delle socket: la chiusura di una socket sveglia chi la attende. */
+        sockco::executor ex;
+
+        for (int k = 0; k < nconns && k < argc - first; k++)
+                sockco::spawn(manageConnection(argv[optind], argv[optind + 1], argv + first, argc - first, k));
+
+        if (ex.run() < 0)
+                err_sys("(%s) error - epoll_wait() failed", prog_name);
+
+        /* Programma terminato correttamente solo se sono arrivati tutti i file. */
+        return received == argc - first ? 0 : 1;
+}
+
+/* Nome locale del file: se viene richiesto un path prendiamo quello che segue l'ultimo "/". */
+static char *localName(char *name)
+{
+        char *temp = strrchr(name, '/');
+
+        return temp != NULL ? temp + 1 : name;
+}
+
+/* Invia in pipeline i GET dei file della connessione k (uno ogni nconns a partire da k). */
+sockco::task<> sendRequests(int sockfd, char *files[], int nfiles, int k)
+{
+        char buffer[MAXBUFL];
+
+        for (int i = k; i < nfiles; i += nconns)
+        {
+                ssize_t len = snprintf(buffer, sizeof(buffer), "%s%s\r\n", MSG_GET, files[i]);
+
+                /* EBADF: la connessione è stata chiusa da chi riceve (es. dopo un -ERR). */
+                if (co_await sockco::sendn(sockfd, buffer, len, 0, TIMEOUT * 1000) != len)
+                {
+                        if (errno != EBADF)
+                                err_ret("(%s) error - sendn() failed", prog_name);
+                        co_return;
+                }
+        }
+}
+
+/* Connessione k: i GET partono da sendRequests(), qui riceviamo le risposte in ordine. */
+sockco::task<> manageConnection(char *host, char *port, char *files[], int nfiles, int k)
+{
+        /* Connect bloccante (tcp_connect_try(), RFC 8305): avviene una volta per connessione. */
+        sockco::socket conn = sockco::socket::connect(host, port);
+
+        if (!conn)
+        {
+                err_ret("(%s) error - cannot connect to server [%s:%s]", prog_name, host, port);
+                co_return;
+        }
+
+        sockco::spawn(sendRequests(conn.get(), files, nfiles, k));
+
+        /* Buffer per i dati dei file ricevuti, dal pool come in client1. */
+        size_t buflen = bp_chunk(conn.get(), 0);
+        char *data = (char *)bp_get(buflen);
+
+        if (data == NULL)
+                err_sys("(%s) error - no memory for a buffer of %zu bytes", prog_name, buflen);
+
+        sockco::reader in(conn.get(), TIMEOUT * 1000);
+
+        for (int i = k; i < nfiles; i += nconns)
+        {
+                char buffer[5];
+                u_int32_t size, timestamp;
+
+                if (co_await in.readn(buffer, 5) != 5)
+                {
+                        err_ret("(%s) error - connection lost while waiting for '%s'", prog_name, files[i]);
+                        break;
+                }
+
+                /* -ERR: il server chiude la connessione, i file successivi non arriveranno. */
+                if (strncmp(buffer, MSG_OK, 5) != 0)
+                {
+                        err_msg("(%s) error - server side, '%s' not available", prog_name, files[i]);
+                        break;
+                }
+
+                if (co_await in.readn(&size, 4) != 4)
+                {
+                        err_ret("(%s) error - connection lost while receiving '%s'", prog_name, files[i]);
+                        break;
+                }
+                size = ntohl(size);
+
+                sockco::unique_fd file(open(localName(files[i]), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+
+                if (!file)
+                {
+                        err_ret("(%s) error - cannot create '%s'", prog_name, localName(files[i]));
+                        break;
+                }
+
+                u_int32_t remaining_data = size;
+                ssize_t n;
+
+                while (remaining_data > 0)
+                {
+                        if ((n = co_await in.read(data, remaining_data < buflen ? remaining_data : buflen)) <= 0)
+                                break;
+                        if (writen(file.get(), data, n) != n)
+                                err_sys("(%s) error - write() of '%s' failed", prog_name, localName(files[i]));
+                        remaining_data -= n;
+                }
+
+                if (remaining_data > 0 || co_await in.readn(&timestamp, 4) != 4)
+                {
+                        err_ret("(%s) error - '%s' truncated (%u of %u bytes)", prog_name, files[i], size - remaining_data, size);
+                        break;
+                }
+
+                printf("Received file %s\nReceived file size %u\nReceived file timestamp %u\n", localName(files[i]), size, ntohl(timestamp));
+                received++;
+        }
+
+        bp_put(data, buflen);
+
+        /* Chiude la socket (e sveglia sendRequests() se sta ancora inviando). */
+        if (conn.reset() != 0)
+                err_ret("(%s) error - close() failed", prog_name);
+}
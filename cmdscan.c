@@ -0,0 +1,254 @@
+/*
+
+module: cmdscan.c
+
+purpose: batch parser of pipelined commands
+         a burst of short GETs is split into lines in one pass over the
+         buffer: 32 (AVX2) or 16 (SSE2) bytes are compared with '\n' at a
+         time and the resulting bit mask of line ends is walked with ctz,
+         so there is neither a loop per byte nor a call per line. Without
+         x86 vectors the same is done 8 bytes at a time in a 64-bit word
+         (SWAR). Each line becomes a descriptor (verb, name span) pointing
+         into the buffer.
+
+         cs_next() gives the server one GET or CGET at a time out of a burst
+         taken with two system calls: a peek finds where the run of complete
+         GET/CGET lines queued in the socket ends and a recv() takes exactly
+         those bytes. Any other command stays in the socket for the usual
+         path, so binary payloads (PUT, v2 frames) are never consumed here.
+
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "cmdscan.h"
+
+typedef size_t cs_eol_fn(const char *buf, size_t len, uint32_t *eol, size_t max);
+
+/* Line ends of the bytes from i on, one memchr() per line. */
+static size_t cs_eol_memchr_from(const char *buf, size_t len, size_t i, uint32_t *eol, size_t n, size_t max)
+{
+	const char *p;
+
+	while (n < max && i < len && (p = memchr(buf + i, '\n', len - i)) != NULL)
+	{
+		eol[n++] = p - buf;
+		i = p - buf + 1;
+	}
+	return n;
+}
+
+static size_t cs_eol_memchr(const char *buf, size_t len, uint32_t *eol, size_t max)
+{
+	return cs_eol_memchr_from(buf, len, 0, eol, 0, max);
+}
+
+/* 8 bytes at a time: after the XOR with '\n' the line ends are the zero bytes
+   of the word, and ~(((x & 0x7f..) + 0x7f..) | x | 0x7f..) has exactly their
+   high bits set. */
+static size_t cs_eol_swar(const char *buf, size_t len, uint32_t *eol, size_t max)
+{
+	const uint64_t low = 0x7f7f7f7f7f7f7f7fULL, nl = 0x0a0a0a0a0a0a0a0aULL;
+	uint64_t x, z;
+	size_t i, n = 0;
+
+	for (i = 0; i + 8 <= len && n < max; i += 8)
+	{
+		memcpy(&x, buf + i, 8);
+		x = le64toh(x) ^ nl;
+		for (z = ~(((x & low) + low) | x | low); z != 0 && n < max; z &= z - 1)
+			eol[n++] = i + (__builtin_ctzll(z) >> 3);
+	}
+	if (n == max)
+		return n;
+	return cs_eol_memchr_from(buf, len, i, eol, n, max);
+}
+
+#ifdef __x86_64__
+
+static size_t cs_eol_sse2(const char *buf, size_t len, uint32_t *eol, size_t max)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	unsigned int m;
+	size_t i, n = 0;
+
+	for (i = 0; i + 16 <= len && n < max; i += 16)
+		for (m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), nl)); m != 0 && n < max; m &= m - 1)
+			eol[n++] = i + __builtin_ctz(m);
+	if (n == max)
+		return n;
+	return cs_eol_memchr_from(buf, len, i, eol, n, max);
+}
+
+__attribute__((target("avx2"))) static size_t cs_eol_avx2(const char *buf, size_t len, uint32_t *eol, size_t max)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	unsigned int m;
+	size_t i, n = 0;
+
+	for (i = 0; i + 32 <= len && n < max; i += 32)
+		for (m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), nl)); m != 0 && n < max; m &= m - 1)
+			eol[n++] = i + __builtin_ctz(m);
+	if (n == max)
+		return n;
+	return cs_eol_memchr_from(buf, len, i, eol, n, max);
+}
+
+#endif
+
+static const struct
+{
+	const char *name;
+	cs_eol_fn *fn;
+} cs_impls[] = {
+#ifdef __x86_64__
+	{"avx2", cs_eol_avx2},
+	{"sse2", cs_eol_sse2},
+#endif
+	{"swar", cs_eol_swar},
+	{"memchr", cs_eol_memchr},
+};
+
+static int cs_cur = -1;
+
+static int cs_supported(const char *name)
+{
+#ifdef __x86_64__
+	if (strcmp(name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+/* Forces an implementation (for bench/cmd_bench): 0, or -1 if unknown or not
+   supported by this CPU. */
+int cs_set_impl(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(cs_impls) / sizeof(cs_impls[0]); i++)
+		if (strcmp(cs_impls[i].name, name) == 0 && cs_supported(name))
+		{
+			cs_cur = i;
+			return 0;
+		}
+	return -1;
+}
+
+/* The first implementation supported by the CPU, in order of preference. */
+const char *cs_impl(void)
+{
+	size_t i;
+
+	for (i = 0; cs_cur < 0; i++)
+		if (cs_supported(cs_impls[i].name))
+			cs_cur = i;
+	return cs_impls[cs_cur].name;
+}
+
+/* Splits the complete lines of buf (at most max, and CS_BATCH) into commands.
+   *used (if not NULL) is set to the bytes they take; an incomplete last line
+   is left out. The buffer is not modified. */
+size_t cs_scan(char *buf, size_t len, struct cs_cmd *cmd, size_t max, size_t *used)
+{
+	uint32_t eol[CS_BATCH];
+	size_t i, n, start = 0, end;
+
+	cs_impl();
+	if (max > CS_BATCH)
+		max = CS_BATCH;
+	n = cs_impls[cs_cur].fn(buf, len, eol, max);
+
+	for (i = 0; i < n; i++)
+	{
+		char *line = buf + start;
+
+		/* Contents without the CR LF. */
+		end = eol[i] > start && buf[eol[i] - 1] == '\r' ? eol[i] - 1 : eol[i];
+
+		if (end - start >= 4 && memcmp(line, "GET ", 4) == 0)
+		{
+			cmd[i].verb = CS_GET;
+			cmd[i].name = line + 4;
+		}
+		else if (end - start >= 5 && memcmp(line, "CGET ", 5) == 0)
+		{
+			cmd[i].verb = CS_CGET;
+			cmd[i].name = line + 5;
+		}
+		else
+		{
+			cmd[i].verb = CS_OTHER;
+			cmd[i].name = line;
+		}
+		cmd[i].line = line;
+		cmd[i].namelen = buf + end - cmd[i].name;
+		cmd[i].len = eol[i] + 1 - start;
+		start = eol[i] + 1;
+	}
+
+	if (used != NULL)
+		*used = start;
+	return n;
+}
+
+/* Burst of the connection of this process: the GETs and CGETs already taken
+   from the socket, with their names terminated in place. */
+static char cs_buf[CS_PEEK];
+static struct cs_cmd cs_cmds[CS_BATCH];
+static size_t cs_n = 0, cs_i = 0;
+
+/* A new connection. */
+void cs_reset(void)
+{
+	cs_n = cs_i = 0;
+}
+
+/* The next GET or CGET the client has pipelined, without waiting: from the
+   burst already taken, else from a new one. NULL if the socket has no
+   complete GET/CGET line in front (nothing queued, or another command). */
+struct cs_cmd *cs_next(int connfd)
+{
+	size_t i, n, bytes;
+	ssize_t r;
+
+	if (cs_i < cs_n)
+		return &cs_cmds[cs_i++];
+	cs_n = cs_i = 0;
+
+	if ((r = recv(connfd, cs_buf, sizeof(cs_buf), MSG_PEEK | MSG_DONTWAIT)) <= 0)
+		return NULL;
+
+	/* Only the run of GET/CGET lines at the front is taken (a line too long for
+	   the server's buffer is left to its own truncating path). */
+	n = cs_scan(cs_buf, r, cs_cmds, CS_BATCH, NULL);
+	for (i = 0, bytes = 0; i < n && cs_cmds[i].verb != CS_OTHER && cs_cmds[i].len < CS_MAXLINE; i++)
+		bytes += cs_cmds[i].len;
+	if (i == 0)
+		return NULL;
+
+	/* The same bytes just peeked, already queued: the descriptors stay valid. */
+	do
+		r = recv(connfd, cs_buf, bytes, MSG_WAITALL);
+	while (r < 0 && errno == EINTR);
+	if (r != (ssize_t)bytes)
+		return NULL;
+
+	cs_n = i;
+	for (i = 0; i < cs_n; i++)
+		cs_cmds[i].name[cs_cmds[i].namelen] = '\0';
+	return &cs_cmds[cs_i++];
+}
+
+/* Commands of the burst taken from the socket and not yet returned by cs_next(). */
+size_t cs_queued(struct cs_cmd **cmd)
+{
+	*cmd = cs_cmds + cs_i;
+	return cs_n - cs_i;
+}
@@ -0,0 +1,49 @@
+/*
+
+module: cmdscan.h
+
+purpose: definitions of the batch command parser (cmdscan.c)
+
+*/
+
+#ifndef _CMDSCAN_H
+
+#define _CMDSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CS_BATCH 256	   /* Commands parsed (and taken from the socket) at a time. */
+#define CS_PEEK 65536	   /* Bytes of pipelined commands examined at a time. */
+#define CS_MAXLINE 4096	   /* Longest line taken by cs_next() (the servers' MAXBUFL). */
+#define CS_IMPLS "avx2|sse2|swar|memchr"
+
+/* Verb of a command line. */
+#define CS_OTHER 0
+#define CS_GET 1  /* "GET name" */
+#define CS_CGET 2 /* "CGET name" */
+
+/* A complete command line of a buffer: nothing is copied, the spans point
+   into the buffer. */
+struct cs_cmd
+{
+	char *line;	  /* first byte of the line (the verb) */
+	char *name;	  /* GET, CGET: the file name; otherwise the whole line */
+	uint32_t namelen; /* without the CR LF */
+	uint32_t len;	  /* of the whole line, LF included */
+	int verb;
+};
+
+size_t cs_scan(char *buf, size_t len, struct cs_cmd *cmd, size_t max, size_t *used);
+
+int cs_set_impl(const char *name);
+
+const char *cs_impl(void);
+
+void cs_reset(void);
+
+struct cs_cmd *cs_next(int connfd);
+
+size_t cs_queued(struct cs_cmd **cmd);
+
+#endif
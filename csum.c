@@ -0,0 +1,340 @@
+/*
+
+module: csum.c
+
+purpose: CRC32C (Castagnoli) of the responses to CGET and cache of digests
+         with SSE4.2 the crc32 instruction runs on three interleaved streams,
+         so its 3 cycle latency is hidden, and the three CRCs are joined by
+         tables that shift a CRC over a fixed run of zeros (method of
+         M. Adler). Without SSE4.2 a slicing-by-8 table version is used. The
+         implementation is chosen at run time.
+
+         The servers compute the CRC on the bytes they already read to send
+         them. The digest of a file sent this way is kept in a table shared by
+         all the processes, keyed by device, inode, size, mtime and ctime, so a
+         later CGET of the same version can go out with sendfile() without the
+         server touching the contents. Entries are written under a sequence
+         counter (odd while being written), so readers never lock.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "ratelimit.h"
+#include "csum.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u /* reflected */
+#define CRC32C_LONG 8192	/* Stream length of the interleaved loops. */
+#define CRC32C_SHORT 256
+#define CSUM_CHUNK (256 << 10)	/* sendfile() between two rate limiter calls. */
+
+extern char *prog_name;
+
+struct csum_entry
+{
+	uint32_t seq; /* odd while the entry is written */
+	uint32_t crc;
+	struct csum_key key;
+};
+
+static struct csum_entry *csum_table = NULL;
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long[4][256], crc32c_short[4][256];
+static uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+/* GF(2) matrix (32 columns) times vector. */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec)
+	{
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+/* Tables that apply to a CRC the effect of len zero bytes. */
+static void crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+	uint32_t even[32], odd[32], *op, row = 1;
+	int n;
+
+	/* Operator for one zero bit, then squared up to one zero byte and beyond. */
+	odd[0] = CRC32C_POLY;
+	for (n = 1; n < 32; n++)
+	{
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_square(even, odd); /* 2 bits */
+	gf2_square(odd, even); /* 4 bits */
+	op = odd;
+	while (len)
+	{
+		gf2_square(even, odd);
+		op = even;
+		if ((len >>= 1) == 0)
+			break;
+		gf2_square(odd, even);
+		op = odd;
+		len >>= 1;
+	}
+
+	for (n = 0; n < 256; n++)
+	{
+		zeros[0][n] = gf2_times(op, n);
+		zeros[1][n] = gf2_times(op, n << 8);
+		zeros[2][n] = gf2_times(op, n << 16);
+		zeros[3][n] = gf2_times(op, (uint32_t)n << 24);
+	}
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/* Slicing-by-8, little endian. */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t w;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0)
+	{
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8)
+	{
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = crc32c_table[7][w & 0xff] ^ crc32c_table[6][(w >> 8) & 0xff] ^
+		      crc32c_table[5][(w >> 16) & 0xff] ^ crc32c_table[4][(w >> 24) & 0xff] ^
+		      crc32c_table[3][(w >> 32) & 0xff] ^ crc32c_table[2][(w >> 40) & 0xff] ^
+		      crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c0 = crc, c1, c2, w0, w1, w2;
+	const unsigned char *end;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0)
+	{
+		c0 = _mm_crc32_u8(c0, *p++);
+		len--;
+	}
+
+	/* Three streams of CRC32C_LONG bytes, then of CRC32C_SHORT. */
+	while (len >= 3 * CRC32C_LONG)
+	{
+		c1 = c2 = 0;
+		for (end = p + CRC32C_LONG; p < end; p += 8)
+		{
+			memcpy(&w0, p, 8);
+			memcpy(&w1, p + CRC32C_LONG, 8);
+			memcpy(&w2, p + 2 * CRC32C_LONG, 8);
+			c0 = _mm_crc32_u64(c0, w0);
+			c1 = _mm_crc32_u64(c1, w1);
+			c2 = _mm_crc32_u64(c2, w2);
+		}
+		c0 = crc32c_shift(crc32c_long, c0) ^ c1;
+		c0 = crc32c_shift(crc32c_long, c0) ^ c2;
+		p += 2 * CRC32C_LONG;
+		len -= 3 * CRC32C_LONG;
+	}
+	while (len >= 3 * CRC32C_SHORT)
+	{
+		c1 = c2 = 0;
+		for (end = p + CRC32C_SHORT; p < end; p += 8)
+		{
+			memcpy(&w0, p, 8);
+			memcpy(&w1, p + CRC32C_SHORT, 8);
+			memcpy(&w2, p + 2 * CRC32C_SHORT, 8);
+			c0 = _mm_crc32_u64(c0, w0);
+			c1 = _mm_crc32_u64(c1, w1);
+			c2 = _mm_crc32_u64(c2, w2);
+		}
+		c0 = crc32c_shift(crc32c_short, c0) ^ c1;
+		c0 = crc32c_shift(crc32c_short, c0) ^ c2;
+		p += 2 * CRC32C_SHORT;
+		len -= 3 * CRC32C_SHORT;
+	}
+
+	while (len >= 8)
+	{
+		memcpy(&w0, p, 8);
+		c0 = _mm_crc32_u64(c0, w0);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		c0 = _mm_crc32_u8(c0, *p++);
+	return c0;
+}
+#endif
+
+static void crc32c_setup(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for (n = 0; n < 256; n++)
+	{
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[0][n] = c;
+	}
+	for (n = 0; n < 256; n++)
+		for (k = 1; k < 8; k++)
+			crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+
+	crc32c_fn = crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		crc32c_zeros(crc32c_long, CRC32C_LONG);
+		crc32c_zeros(crc32c_short, CRC32C_SHORT);
+		crc32c_fn = crc32c_hw;
+	}
+#endif
+}
+
+/* CRC32C of buf, continuing crc (0 for the first block). */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_setup);
+	return ~crc32c_fn(~crc, buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+	pthread_once(&crc32c_once, crc32c_setup);
+	return crc32c_fn == crc32c_sw ? "slicing-by-8" : "sse4.2";
+}
+
+/* Must be called before fork(). */
+void csum_init(void)
+{
+	csum_table = mmap(NULL, CSUM_ENTRIES * sizeof(struct csum_entry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (csum_table == MAP_FAILED)
+		err_sys("(%s) error - mmap() of the digest cache failed", prog_name);
+	err_msg("(%s) --- CRC32C: %s, %d digests cached", prog_name, crc32c_impl(), CSUM_ENTRIES);
+}
+
+static int csum_key(int fd, struct csum_key *k)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+	memset(k, 0, sizeof(*k));
+	k->dev = st.st_dev;
+	k->ino = st.st_ino;
+	k->size = st.st_size;
+	k->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	k->ctime_ns = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+	return 0;
+}
+
+static struct csum_entry *csum_slot(const struct csum_key *k)
+{
+	uint64_t h = (k->dev * 0x9e3779b97f4a7c15ull) ^ (k->ino * 0xc2b2ae3d27d4eb4full);
+
+	return &csum_table[(h ^ (h >> 29)) % CSUM_ENTRIES];
+}
+
+/* Identity of the open file fd into k. Returns 1 and the digest if this version
+   of the file, of the given size, is in the cache; 0 otherwise. */
+int csum_lookup(int fd, off_t size, struct csum_key *k, uint32_t *crc)
+{
+	struct csum_entry *e, copy;
+	uint32_t seq;
+
+	if (csum_key(fd, k) < 0)
+	{
+		memset(k, 0, sizeof(*k));
+		return 0;
+	}
+	if (csum_table == NULL || k->size != (uint64_t)size)
+		return 0;
+
+	e = csum_slot(k);
+	if ((seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)) & 1)
+		return 0;
+	memcpy(&copy, e, sizeof(copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq || seq == 0 || memcmp(&copy.key, k, sizeof(*k)) != 0)
+		return 0;
+	*crc = copy.crc;
+	return 1;
+}
+
+/* Stores the digest of the version k of fd, unless the file changed since k was taken. */
+void csum_store(int fd, const struct csum_key *k, uint32_t crc)
+{
+	struct csum_entry *e;
+	struct csum_key now;
+	uint32_t seq;
+
+	if (csum_table == NULL || csum_key(fd, &now) < 0 || memcmp(&now, k, sizeof(now)) != 0)
+		return;
+
+	e = csum_slot(k);
+	seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return; /* another process is writing it */
+	e->key = *k;
+	e->crc = crc;
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Sends size bytes of fd with sendfile(), paced by the rate limiter. Returns 0, -1 on failure. */
+int csum_sendfile(int connfd, int fd, off_t size, struct rl_conn *rl)
+{
+	off_t off = 0;
+	size_t len;
+
+	while (off < size)
+	{
+		len = size - off < CSUM_CHUNK ? size - off : CSUM_CHUNK;
+		rl_acquire(rl, len);
+		if (sendfilen(connfd, fd, off, len) != (ssize_t)len)
+			return -1;
+		off += len;
+	}
+	return 0;
+}
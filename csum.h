@@ -0,0 +1,48 @@
+/*
+
+module: csum.h
+
+purpose: definitions of the CRC32C checksum and of the digest cache (csum.c)
+
+         request:  "CGET filename\r\n"
+         response: as for GET, followed by the CRC32C of the contents
+
+             +OK\r\n | B1..B4 (size) | contents | T1..T4 (timestamp) | C1..C4 (CRC32C)
+
+         C1..C4 is unsigned 32 bit in network byte order.
+
+*/
+
+#ifndef _CSUM_H
+
+#define _CSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define MSG_CGET "CGET"
+#define CSUM_ENTRIES 4096 /* Digests kept by the servers (shared by all the processes). */
+
+/* Identity of a version of a file: a write or a metadata change updates ctime. */
+struct csum_key
+{
+	uint64_t dev, ino, size;
+	int64_t mtime_ns, ctime_ns;
+};
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+const char *crc32c_impl(void);
+
+void csum_init(void);
+
+int csum_lookup(int fd, off_t size, struct csum_key *k, uint32_t *crc);
+
+void csum_store(int fd, const struct csum_key *k, uint32_t crc);
+
+struct rl_conn;
+
+int csum_sendfile(int connfd, int fd, off_t size, struct rl_conn *rl);
+
+#endif
@@ -0,0 +1,773 @@
+/*
+
+module: delta.c
+
+purpose: DGET delta command, both sides
+         the client sends the signature of its copy of a file, one rolling
+         checksum (as in rsync) and one CRC32C per whole block; the server
+         looks for those blocks at every byte offset of the current file and
+         answers with copy instructions for the blocks found and literal data
+         for the rest, which the client applies to rebuild the file.
+
+         Both sides split the file into slices handled by up to DELTA_THREADS
+         threads: the client computes the signature of its blocks, the server
+         rolls the checksum over its slice. The sums of a whole block, needed
+         for every signature record and after every match, use AVX2 when
+         available; the CRC32C comes from csum.c. While the server threads
+         scan, one more thread computes the CRC32C of the whole file (unless
+         its digest is cached) for the final check: on a mismatch the client
+         keeps its copy and can ask for the whole file.
+
+         The server reads the file with pread() into a window per thread
+         rather than mapping it, so a file truncated during the request ends
+         the DGET with an error instead of a SIGBUS.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "ratelimit.h"
+#include "csum.h"
+#include "pathidx.h"
+#include "delta.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define DELTA_BUFL 65536 /* Client receive buffer of the literal data. */
+#define DELTA_WINDOW (1 << 20) /* Server: bytes of the file read at once by each thread. */
+#define DELTA_NONE UINT32_MAX
+
+extern char *prog_name;
+
+/* Block found by the server: offset in the current file, block of the client copy. */
+struct delta_match
+{
+	uint64_t off;
+	uint32_t block;
+};
+
+/* Signature records of the client, hashed on the rolling checksum. */
+struct delta_index
+{
+	const struct delta_sig *sig;
+	uint32_t n, bs;
+	uint32_t *slot; /* block + 1, 0 = empty */
+	int bits;
+};
+
+/* A slice of work for one thread. */
+struct delta_job
+{
+	const unsigned char *map;
+	uint64_t size;
+	uint32_t bs;
+	uint64_t start, end;
+
+	/* client: signature of the blocks [start, end) */
+	struct delta_sig *sig;
+
+	/* server: matches starting in [start, end), from the window [woff, woff + wlen) of fd */
+	const struct delta_index *idx;
+	struct delta_match *m;
+	size_t nm, cap;
+	int fd;
+	unsigned char *win;
+	uint64_t woff;
+	size_t wlen;
+	int failed;
+};
+
+/* Server: CRC32C of the whole file, computed while the slices are scanned. */
+struct delta_crc
+{
+	int fd;
+	uint64_t size;
+	uint32_t crc;
+	int failed;
+};
+
+static pthread_once_t delta_once = PTHREAD_ONCE_INIT;
+static void (*delta_sums_fn)(const unsigned char *p, size_t len, uint32_t *a, uint32_t *b);
+
+/* a = sum of the bytes, b = sum of (len - i) * p[i], both mod 2^32. */
+static void delta_sums_sw(const unsigned char *p, size_t len, uint32_t *a, uint32_t *b)
+{
+	uint32_t s1 = 0, s2 = 0;
+
+	while (len-- > 0)
+	{
+		s1 += *p++;
+		s2 += s1;
+	}
+	*a = s1;
+	*b = s2;
+}
+
+#if defined(__x86_64__)
+/* 32 bytes per step: b grows by 32 times the sum so far plus the bytes
+   weighted 32..1 (maddubs), a by their sum (sad). */
+__attribute__((target("avx2"))) static void delta_sums_avx2(const unsigned char *p, size_t len, uint32_t *a, uint32_t *b)
+{
+	const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+						 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+	const __m256i ones = _mm256_set1_epi16(1), zero = _mm256_setzero_si256();
+	__m256i va = zero, vprev = zero, vw = zero, x;
+	uint64_t l[4];
+	uint32_t w[8], s1, s2;
+	int k;
+
+	for (; len >= 32; len -= 32, p += 32)
+	{
+		x = _mm256_loadu_si256((const __m256i *)p);
+		vprev = _mm256_add_epi64(vprev, va);
+		va = _mm256_add_epi64(va, _mm256_sad_epu8(x, zero));
+		vw = _mm256_add_epi32(vw, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+	}
+
+	_mm256_storeu_si256((__m256i *)l, va);
+	s1 = l[0] + l[1] + l[2] + l[3];
+	_mm256_storeu_si256((__m256i *)l, vprev);
+	s2 = 32 * (uint32_t)(l[0] + l[1] + l[2] + l[3]);
+	_mm256_storeu_si256((__m256i *)w, vw);
+	for (k = 0; k < 8; k++)
+		s2 += w[k];
+
+	while (len-- > 0)
+	{
+		s1 += *p++;
+		s2 += s1;
+	}
+	*a = s1;
+	*b = s2;
+}
+#endif
+
+static void delta_setup(void)
+{
+	delta_sums_fn = delta_sums_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		delta_sums_fn = delta_sums_avx2;
+#endif
+}
+
+static uint32_t delta_pack(uint32_t a, uint32_t b)
+{
+	return (a & 0xffff) | (b << 16);
+}
+
+/* Rolling checksum of a block. */
+uint32_t delta_weak(const unsigned char *p, size_t len)
+{
+	uint32_t a, b;
+
+	pthread_once(&delta_once, delta_setup);
+	delta_sums_fn(p, len, &a, &b);
+	return delta_pack(a, b);
+}
+
+/* About sqrt(size), rounded to a power of two, so the signature and the
+   literal data around a change both stay small. */
+uint32_t delta_block_size(off_t size)
+{
+	uint32_t bs = DELTA_MIN_BLOCK;
+
+	while (bs < DELTA_MAX_BLOCK && ((uint64_t)bs * bs < (uint64_t)size || (uint64_t)size / bs > DELTA_MAX_BLOCKS))
+		bs <<= 1;
+	return bs;
+}
+
+/* Splits [0, units) into slices of at least min_units, one per thread, and
+   runs fn on them; a slice is [start, end) in units of scale, the last one
+   ends at total. jobs must have room for DELTA_THREADS entries. */
+static void delta_parallel(void *(*fn)(void *), struct delta_job *jobs, uint64_t units, uint64_t min_units, uint64_t scale, uint64_t total)
+{
+	pthread_t tid[DELTA_THREADS];
+	int n, i, started[DELTA_THREADS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	n = units / min_units;
+	if (n > DELTA_THREADS)
+		n = DELTA_THREADS;
+	if (n > cpus)
+		n = cpus;
+	if (n < 1)
+		n = 1;
+
+	for (i = 0; i < n; i++)
+	{
+		jobs[i] = jobs[0];
+		jobs[i].start = units * i / n * scale;
+		jobs[i].end = i == n - 1 ? total : units * (i + 1) / n * scale;
+	}
+	/* Slice 0 in the calling thread; a slice whose thread cannot start too. */
+	for (i = 1; i < n; i++)
+		started[i] = pthread_create(&tid[i], NULL, fn, &jobs[i]) == 0;
+	fn(&jobs[0]);
+	for (i = 1; i < n; i++)
+	{
+		if (started[i])
+			pthread_join(tid[i], NULL);
+		else
+			fn(&jobs[i]);
+	}
+}
+
+/* Client: signature of the blocks of a slice. */
+static void *delta_sign(void *arg)
+{
+	struct delta_job *j = arg;
+	const unsigned char *p;
+	uint32_t a, b;
+	uint64_t k;
+
+	for (k = j->start; k < j->end; k++)
+	{
+		p = j->map + k * j->bs;
+		delta_sums_fn(p, j->bs, &a, &b);
+		j->sig[k].weak = htonl(delta_pack(a, b));
+		j->sig[k].strong = htonl(crc32c(0, p, j->bs));
+	}
+	return NULL;
+}
+
+static int delta_index_build(struct delta_index *idx, const struct delta_sig *sig, uint32_t n, uint32_t bs)
+{
+	uint32_t k, h;
+
+	idx->sig = sig;
+	idx->n = n;
+	idx->bs = bs;
+	for (idx->bits = 4; (1u << idx->bits) < 2 * n; idx->bits++)
+		;
+	if ((idx->slot = calloc(1u << idx->bits, sizeof(uint32_t))) == NULL)
+		return -1;
+	for (k = 0; k < n; k++)
+	{
+		for (h = (sig[k].weak * 2654435761u) >> (32 - idx->bits); idx->slot[h] != 0; h = (h + 1) & ((1u << idx->bits) - 1))
+			;
+		idx->slot[h] = k + 1;
+	}
+	return 0;
+}
+
+/* Block of the client with the data at p, or DELTA_NONE. The block after
+   the last match (hint) is tried first, so unchanged runs stay in order. */
+static uint32_t delta_find(const struct delta_index *idx, const unsigned char *p, uint32_t weak, uint32_t hint)
+{
+	uint32_t h, k, strong = 0;
+	int have = 0;
+
+	if (hint < idx->n && idx->sig[hint].weak == weak)
+	{
+		strong = crc32c(0, p, idx->bs);
+		have = 1;
+		if (idx->sig[hint].strong == strong)
+			return hint;
+	}
+	for (h = (weak * 2654435761u) >> (32 - idx->bits); (k = idx->slot[h]) != 0; h = (h + 1) & ((1u << idx->bits) - 1))
+	{
+		if (idx->sig[k - 1].weak != weak)
+			continue;
+		if (!have)
+		{
+			strong = crc32c(0, p, idx->bs);
+			have = 1;
+		}
+		if (idx->sig[k - 1].strong == strong)
+			return k - 1;
+	}
+	return DELTA_NONE;
+}
+
+/* Server: bytes [pos, pos + need) of the file in the window of the slice,
+   read again from pos when they run past its end (pos only grows). Returns
+   a pointer to pos, NULL if the file is shorter than at the start. */
+static const unsigned char *delta_window(struct delta_job *j, uint64_t pos, size_t need)
+{
+	uint64_t limit = j->end + j->bs < j->size ? j->end + j->bs : j->size;
+	size_t keep = 0, len;
+	ssize_t r;
+
+	if (pos + need <= j->woff + j->wlen)
+		return j->win + (pos - j->woff);
+	if (pos < j->woff + j->wlen)
+	{
+		keep = j->woff + j->wlen - pos;
+		memmove(j->win, j->win + (pos - j->woff), keep);
+	}
+	j->woff = pos;
+	j->wlen = keep;
+	while (j->wlen < DELTA_WINDOW && j->woff + j->wlen < limit)
+	{
+		len = DELTA_WINDOW - j->wlen;
+		if (len > limit - j->woff - j->wlen)
+			len = limit - j->woff - j->wlen;
+		if ((r = pread(j->fd, j->win + j->wlen, len, j->woff + j->wlen)) < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		j->wlen += r;
+	}
+	return pos + need <= j->woff + j->wlen ? j->win : NULL;
+}
+
+/* Server: blocks of the client at every offset of the slice. After a match
+   the search restarts one block later, otherwise the checksum rolls by one byte. */
+static void *delta_scan(void *arg)
+{
+	struct delta_job *j = arg;
+	const unsigned char *p;
+	uint64_t pos = j->start;
+	uint32_t bs = j->bs, a = 0, b = 0, k, hint = DELTA_NONE;
+	int valid = 0;
+	struct delta_match *m;
+
+	if ((j->win = malloc(DELTA_WINDOW)) == NULL)
+	{
+		j->failed = 1;
+		return NULL;
+	}
+	j->woff = pos;
+	j->wlen = 0;
+
+	while (pos < j->end && pos + bs <= j->size)
+	{
+		/* One byte past the block, for the roll. */
+		if ((p = delta_window(j, pos, pos + bs < j->size ? bs + 1 : bs)) == NULL)
+		{
+			j->failed = 1;
+			break;
+		}
+		if (!valid)
+		{
+			delta_sums_fn(p, bs, &a, &b);
+			valid = 1;
+		}
+		if ((k = delta_find(j->idx, p, delta_pack(a, b), hint)) != DELTA_NONE)
+		{
+			if (j->nm == j->cap)
+			{
+				j->cap = j->cap ? 2 * j->cap : 1024;
+				if ((m = realloc(j->m, j->cap * sizeof(*m))) == NULL)
+				{
+					j->failed = 1;
+					break;
+				}
+				j->m = m;
+			}
+			j->m[j->nm].off = pos;
+			j->m[j->nm++].block = k;
+			hint = k + 1;
+			pos += bs;
+			valid = 0;
+			continue;
+		}
+		if (pos + bs >= j->size)
+			break;
+		a += p[bs] - p[0];
+		b += a - bs * p[0];
+		pos++;
+	}
+	free(j->win);
+	j->win = NULL;
+	return NULL;
+}
+
+static void *delta_crc_file(void *arg)
+{
+	struct delta_crc *c = arg;
+	unsigned char *buf = malloc(DELTA_WINDOW);
+	uint64_t off = 0;
+	ssize_t r;
+
+	c->crc = 0;
+	while (buf != NULL && off < c->size)
+	{
+		if ((r = pread(c->fd, buf, c->size - off < DELTA_WINDOW ? c->size - off : DELTA_WINDOW, off)) < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		c->crc = crc32c(c->crc, buf, r);
+		off += r;
+	}
+	c->failed = off != c->size;
+	free(buf);
+	return NULL;
+}
+
+/* Buffered instructions, sent with MSG_MORE until the last one. */
+struct delta_out
+{
+	int connfd;
+	struct rl_conn *rl;
+	size_t len;
+	unsigned char buf[4096];
+};
+
+static int delta_flush(struct delta_out *o, int more)
+{
+	if (o->len == 0)
+		return 0;
+	rl_acquire(o->rl, o->len);
+	if (sendn(o->connfd, o->buf, o->len, MSG_NOSIGNAL | (more ? MSG_MORE : 0)) != (ssize_t)o->len)
+		return -1;
+	o->len = 0;
+	return 0;
+}
+
+static int delta_put(struct delta_out *o, char op, uint32_t v1, uint32_t v2, int nv)
+{
+	if (o->len + 9 > sizeof(o->buf) && delta_flush(o, 1) < 0)
+		return -1;
+	o->buf[o->len++] = op;
+	v1 = htonl(v1);
+	v2 = htonl(v2);
+	if (nv > 0)
+		memcpy(o->buf + o->len, &v1, 4);
+	if (nv > 1)
+		memcpy(o->buf + o->len + 4, &v2, 4);
+	o->len += 4 * nv;
+	return 0;
+}
+
+/* Literal data: straight from the file with sendfile(). */
+static int delta_literal(struct delta_out *o, int fd, uint64_t off, uint64_t len)
+{
+	size_t n;
+
+	if (len == 0)
+		return 0;
+	if (delta_put(o, 'L', len, 0, 1) < 0 || delta_flush(o, 1) < 0)
+		return -1;
+	for (; len > 0; off += n, len -= n)
+	{
+		n = len < DELTA_CHUNK ? len : DELTA_CHUNK;
+		rl_acquire(o->rl, n);
+		if (sendfilen(o->connfd, fd, off, n) != (ssize_t)n)
+			return -1;
+	}
+	return 0;
+}
+
+/* Reads the signature, then sends the instructions. Returns 0, -1 if the
+   connection must be closed ("-ERR" already sent if the request was refused). */
+int delta_serve(int connfd, struct rl_conn *rl, const char *filename, const char *peer)
+{
+	struct delta_job jobs[DELTA_THREADS];
+	struct delta_index idx;
+	struct delta_out o;
+	struct delta_sig *sig = NULL;
+	struct delta_crc dc;
+	struct csum_key ck;
+	struct stat st;
+	pthread_t crc_tid;
+	uint32_t hdr[2], bs, n, k, crc = 0, run_block = 0, run_len = 0, v[2];
+	uint64_t pos = 0, literal = 0, copied = 0;
+	int fd = -1, nj = 0, i, crc_cached, crc_thread = 0, rc = -1;
+	size_t m;
+
+	memset(&idx, 0, sizeof(idx));
+	if (filename == NULL || readn(connfd, hdr, 8) != 8)
+	{
+		err_msg("(%s) error - illegal DGET command from client [%s]", prog_name, peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+	bs = ntohl(hdr[0]);
+	n = ntohl(hdr[1]);
+	if (bs < DELTA_MIN_BLOCK || bs > DELTA_MAX_BLOCK || n > DELTA_MAX_BLOCKS ||
+	    (sig = malloc((n > 0 ? n : 1) * sizeof(*sig))) == NULL || readn(connfd, sig, n * sizeof(*sig)) != (ssize_t)(n * sizeof(*sig)))
+	{
+		err_msg("(%s) error - invalid DGET signature from client [%s]", prog_name, peer);
+		free(sig);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+	for (k = 0; k < n; k++)
+	{
+		sig[k].weak = ntohl(sig[k].weak);
+		sig[k].strong = ntohl(sig[k].strong);
+	}
+
+	printf("(%s) --- client [%s] asked for the delta of file '%s' (%u blocks of %u bytes)\n", prog_name, peer, filename, n, bs);
+
+	if ((fd = pi_open(filename, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX ||
+	    delta_index_build(&idx, sig, n, bs) < 0)
+	{
+		err_msg("(%s) error - '%s' is not a readable file for client [%s]: %s", prog_name, filename, peer,
+			fd < 0 ? strerror(errno) : "not a regular file");
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		goto out;
+	}
+
+	o.connfd = connfd;
+	o.rl = rl;
+	o.len = 0;
+	memcpy(o.buf, "+OK\r\n", 5);
+	v[0] = htonl(st.st_size);
+	memcpy(o.buf + 5, v, 4);
+	o.len = 9;
+	if (delta_flush(&o, 1) < 0)
+		goto fail;
+
+	/* Matches; meanwhile, in one more thread, the digest of the whole file unless it is cached. */
+	crc_cached = csum_lookup(fd, st.st_size, &ck, &crc);
+	memset(jobs, 0, sizeof(jobs));
+	if (!crc_cached)
+	{
+		dc.fd = fd;
+		dc.size = st.st_size;
+		crc_thread = pthread_create(&crc_tid, NULL, delta_crc_file, &dc) == 0;
+	}
+	if (n > 0 && st.st_size >= bs)
+	{
+		pthread_once(&delta_once, delta_setup);
+		if (st.st_size > DELTA_SLICE)
+			posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+		jobs[0].size = st.st_size;
+		jobs[0].bs = bs;
+		jobs[0].idx = &idx;
+		jobs[0].fd = fd;
+
+		/* Slices of whole blocks: an unchanged file matches at the same offsets in every slice. */
+		delta_parallel(delta_scan, jobs, st.st_size / bs, DELTA_SLICE / bs, bs, st.st_size);
+		nj = DELTA_THREADS;
+	}
+	if (!crc_cached)
+	{
+		if (crc_thread)
+			pthread_join(crc_tid, NULL);
+		else
+			delta_crc_file(&dc);
+		if (dc.failed)
+			goto changed;
+		crc = dc.crc;
+	}
+
+	for (i = 0; i < nj; i++)
+		if (jobs[i].failed)
+			goto changed;
+
+	/* Slices in order; a match overlapping the previous one (across slices) is dropped. */
+	for (i = 0; i < nj; i++)
+	{
+		for (m = 0; m < jobs[i].nm; m++)
+		{
+			struct delta_match *x = &jobs[i].m[m];
+
+			if (x->off < pos)
+				continue;
+			if (run_len > 0 && (x->off > pos || x->block != run_block + run_len))
+			{
+				if (delta_put(&o, 'C', run_block, run_len, 2) < 0)
+					goto fail;
+				copied += (uint64_t)run_len * bs;
+				run_len = 0;
+			}
+			if (delta_literal(&o, fd, pos, x->off - pos) < 0)
+				goto fail;
+			literal += x->off - pos;
+			if (run_len++ == 0)
+				run_block = x->block;
+			pos = x->off + bs;
+		}
+	}
+	if (run_len > 0)
+	{
+		if (delta_put(&o, 'C', run_block, run_len, 2) < 0)
+			goto fail;
+		copied += (uint64_t)run_len * bs;
+	}
+	if (delta_literal(&o, fd, pos, st.st_size - pos) < 0)
+		goto fail;
+	literal += st.st_size - pos;
+
+	/* End, timestamp and CRC32C of the whole file. */
+	if (delta_put(&o, 'E', 0, 0, 0) < 0)
+		goto fail;
+	v[0] = htonl(st.st_mtime);
+	v[1] = htonl(crc);
+	memcpy(o.buf + o.len, v, 8);
+	o.len += 8;
+	if (delta_flush(&o, 0) < 0)
+		goto fail;
+
+	if (!crc_cached)
+		csum_store(fd, &ck, crc);
+	printf("(%s) --- sent delta of file '%s' to client [%s]: %llu literal bytes, %llu bytes reused\n", prog_name, filename, peer,
+	       (unsigned long long)literal, (unsigned long long)copied);
+	rc = 0;
+	goto out;
+
+changed:
+	err_msg("(%s) error - computing the delta of '%s' failed for client [%s] (file truncated or out of memory)", prog_name, filename, peer);
+	goto out;
+fail:
+	err_ret("(%s) error - sending the delta of '%s' failed with client [%s]", prog_name, filename, peer);
+out:
+	for (i = 0; i < nj; i++)
+		free(jobs[i].m);
+	free(idx.slot);
+	free(sig);
+	if (fd >= 0)
+		close(fd);
+	return rc;
+}
+
+/* Client: asks for name with the signature of local (if use_basis and it
+   exists) and rebuilds local through a temporary file. */
+int delta_get(int sockfd, const char *name, const char *local, int use_basis, struct delta_stats *ds)
+{
+	struct delta_job jobs[DELTA_THREADS];
+	struct delta_sig *sig = NULL;
+	struct stat st;
+	char tmp[PATH_MAX], line[4096 + 8], *buf = NULL;
+	unsigned char *map = NULL, op;
+	uint32_t bs = DELTA_MIN_BLOCK, n = 0, v[2], crc = 0, len, chunk;
+	uint64_t done = 0;
+	int old = -1, out = -1, created = 0, rc = DELTA_EIO;
+	size_t l;
+
+	memset(ds, 0, sizeof(*ds));
+	if ((l = snprintf(line, sizeof(line), "%s %s\r\n", MSG_DGET, name)) >= sizeof(line) ||
+	    snprintf(tmp, sizeof(tmp), "%s.dget", local) >= (int)sizeof(tmp) || (buf = malloc(DELTA_BUFL)) == NULL)
+	{
+		free(buf);
+		return DELTA_ELOCAL;
+	}
+
+	/* Signature of the local copy, if any. */
+	if (use_basis && (old = open(local, O_RDONLY | O_CLOEXEC)) >= 0 && fstat(old, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size >= DELTA_MIN_BLOCK && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, old, 0)) != MAP_FAILED)
+	{
+		bs = delta_block_size(st.st_size);
+		if ((n = st.st_size / bs) > DELTA_MAX_BLOCKS)
+			n = DELTA_MAX_BLOCKS;
+		if ((sig = malloc(n * sizeof(*sig))) == NULL)
+		{
+			rc = DELTA_ELOCAL;
+			goto out;
+		}
+		pthread_once(&delta_once, delta_setup);
+		memset(jobs, 0, sizeof(jobs));
+		jobs[0].map = map;
+		jobs[0].bs = bs;
+		jobs[0].sig = sig;
+		delta_parallel(delta_sign, jobs, n, DELTA_SLICE / bs, 1, n);
+	}
+	else if (map == MAP_FAILED)
+		map = NULL;
+
+	v[0] = htonl(bs);
+	v[1] = htonl(n);
+	if (writen(sockfd, line, l) != (ssize_t)l || writen(sockfd, v, 8) != 8 ||
+	    (n > 0 && writen(sockfd, sig, n * sizeof(*sig)) != (ssize_t)(n * sizeof(*sig))))
+		goto out;
+
+	/* "+OK\r\n" and the size, or "-ERR\r\n". */
+	if (readn(sockfd, buf, 5) != 5)
+		goto out;
+	if (memcmp(buf, "+OK\r\n", 5) != 0)
+	{
+		rc = memcmp(buf, "-ERR\r", 5) == 0 ? DELTA_EREFUSED : DELTA_EIO;
+		goto out;
+	}
+	if (readn(sockfd, v, 4) != 4)
+		goto out;
+	ds->size = ntohl(v[0]);
+
+	if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+	{
+		rc = DELTA_ELOCAL;
+		goto out;
+	}
+	created = 1;
+
+	for (;;)
+	{
+		if (readn(sockfd, &op, 1) != 1)
+			goto out;
+		if (op == 'E')
+			break;
+		if (op == 'L')
+		{
+			if (readn(sockfd, v, 4) != 4 || (len = ntohl(v[0])) > ds->size - done)
+				goto out;
+			for (; len > 0; len -= chunk)
+			{
+				chunk = len < DELTA_BUFL ? len : DELTA_BUFL;
+				if (readn(sockfd, buf, chunk) != chunk)
+					goto out;
+				crc = crc32c(crc, buf, chunk);
+				if (writen(out, buf, chunk) != chunk)
+				{
+					rc = DELTA_ELOCAL;
+					goto out;
+				}
+				done += chunk;
+				ds->literal += chunk;
+			}
+		}
+		else if (op == 'C')
+		{
+			/* Blocks of the local copy, from the mapping. */
+			if (readn(sockfd, v, 8) != 8)
+				goto out;
+			v[0] = ntohl(v[0]);
+			v[1] = ntohl(v[1]);
+			if ((uint64_t)v[0] + v[1] > n || (uint64_t)v[1] * bs > ds->size - done)
+				goto out;
+			crc = crc32c(crc, map + (uint64_t)v[0] * bs, (uint64_t)v[1] * bs);
+			if (writen(out, map + (uint64_t)v[0] * bs, (uint64_t)v[1] * bs) != (ssize_t)((uint64_t)v[1] * bs))
+			{
+				rc = DELTA_ELOCAL;
+				goto out;
+			}
+			done += (uint64_t)v[1] * bs;
+			ds->copied += (uint64_t)v[1] * bs;
+		}
+		else
+			goto out;
+	}
+
+	if (readn(sockfd, v, 8) != 8)
+		goto out;
+	ds->timestamp = ntohl(v[0]);
+	ds->crc = ntohl(v[1]);
+
+	if (done != ds->size || crc != ds->crc)
+		rc = DELTA_ECSUM;
+	else
+	{
+		rc = close(out) == 0 && rename(tmp, local) == 0 ? DELTA_OK : DELTA_ELOCAL;
+		out = -1;
+	}
+
+out:
+	if (out >= 0)
+		close(out);
+	if (rc != DELTA_OK && created)
+		unlink(tmp);
+	if (map != NULL)
+		munmap(map, st.st_size);
+	if (old >= 0)
+		close(old);
+	free(sig);
+	free(buf);
+	return rc;
+}
@@ -0,0 +1,71 @@
+/*
+
+module: delta.h
+
+purpose: definitions of the DGET delta command (delta.c)
+
+         request:  "DGET filename\r\n" | S1..S4 (block size) | N1..N4 (blocks)
+                   followed by the signature of the client copy, one record
+                   per whole block
+
+             W1..W4 (rolling checksum) | H1..H4 (CRC32C of the block)
+
+         response: "+OK\r\n" | B1..B4 (size of the file) | instructions |
+                   T1..T4 (timestamp) | C1..C4 (CRC32C of the whole file)
+
+             'L' | L1..L4 | L bytes     literal data
+             'C' | I1..I4 | K1..K4      K blocks of the client copy from block I
+             'E'                        end of the instructions
+
+         "-ERR\r\n" if the file is not a readable regular file or the
+         signature is invalid (then the connection is closed, as for GET).
+         Integers are unsigned 32 bit in network byte order. With N = 0 the
+         whole file comes as literal data.
+
+*/
+
+#ifndef _DELTA_H
+
+#define _DELTA_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MSG_DGET "DGET"
+#define DELTA_MIN_BLOCK 2048	    /* Block size limits (the client picks ~sqrt(size)). */
+#define DELTA_MAX_BLOCK (64 << 10)
+#define DELTA_MAX_BLOCKS (1 << 21)  /* Blocks in a signature. */
+#define DELTA_THREADS 8		    /* Threads computing signatures and matches. */
+#define DELTA_SLICE (8 << 20)	    /* Least bytes of file per thread. */
+#define DELTA_CHUNK (1 << 20)	    /* Literal bytes per sendfile()/read (rate limiter granularity). */
+
+/* Outcome of delta_get(). */
+#define DELTA_OK 0
+#define DELTA_EREFUSED -1 /* -ERR from the server, the connection is closed */
+#define DELTA_EIO -2	  /* connection lost or invalid response */
+#define DELTA_ECSUM -3	  /* rebuilt file does not match: the local copy is left as it was */
+#define DELTA_ELOCAL -4	  /* local file error */
+
+/* One block of the client copy. */
+struct delta_sig
+{
+	uint32_t weak, strong;
+};
+
+struct delta_stats
+{
+	uint32_t size, timestamp, crc;
+	uint64_t literal, copied; /* bytes received and bytes taken from the local copy */
+};
+
+struct rl_conn;
+
+uint32_t delta_weak(const unsigned char *p, size_t len);
+
+uint32_t delta_block_size(off_t size);
+
+int delta_serve(int connfd, struct rl_conn *rl, const char *filename, const char *peer);
+
+int delta_get(int sockfd, const char *name, const char *local, int use_basis, struct delta_stats *st);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+
+module: diskio.c
+
+purpose: disk reads decoupled from the network path
+         a read is first tried with preadv2(RWF_NOWAIT), which succeeds only if
+         the data is in the page cache; on a miss it is queued to a small pool
+         of threads of the calling process, and the completion is signalled on
+         an eventfd that the network side sleeps on.
+
+         Backpressure: the number of reads handed to the pools of all processes
+         is bounded by a process-shared semaphore created before fork(); when
+         the disk is saturated dio_submit() blocks instead of queueing more
+         work, so no thread or buffer piles up. Each process counts the slots
+         it holds in a shared table, and the parent gives back those of a
+         child that died with reads in flight (dio_reap()).
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "errlib.h"
+#include "bufpool.h"
+#include "diskio.h"
+
+extern char *prog_name;
+
+/* Shared by all the processes. */
+struct dio_shared
+{
+	sem_t slots;
+	struct
+	{
+		pid_t pid; /* 0 = free entry */
+		int held;  /* slots taken and not yet given back */
+	} proc[DIO_PROCS];
+};
+
+static struct dio_shared *dio = NULL;
+static int dio_threads;
+
+/* Pool of the calling process, started on its first submit. */
+static pid_t dio_pid = 0;
+static int *dio_held = NULL; /* NULL if the table was full */
+static int dio_efd = -1;
+static pthread_mutex_t dio_lock;
+static pthread_cond_t dio_cond;
+static struct dio_req *dio_head, *dio_tail;
+
+/* Reads r->len bytes, fewer only at end of file (errno 0) or when the
+   rest is not cached (errno EAGAIN, with RWF_NOWAIT). */
+static ssize_t dio_pread(struct dio_req *r, int flags)
+{
+	struct iovec iov;
+	size_t got = 0;
+	ssize_t n;
+
+	errno = 0;
+	while (got < r->len)
+	{
+		iov.iov_base = r->buf + got;
+		iov.iov_len = r->len - got;
+		if ((n = preadv2(r->fd, &iov, 1, r->off + got, flags)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return got > 0 && errno == EAGAIN ? (ssize_t)got : -1;
+		}
+		if (n == 0)
+			break;
+		got += n;
+	}
+	return got;
+}
+
+static void *dio_worker(void *arg)
+{
+	struct dio_req *r;
+	ssize_t res;
+	uint64_t one = 1;
+
+	(void)arg;
+	for (;;)
+	{
+		pthread_mutex_lock(&dio_lock);
+		while (dio_head == NULL)
+			pthread_cond_wait(&dio_cond, &dio_lock);
+		r = dio_head;
+		if ((dio_head = r->next) == NULL)
+			dio_tail = NULL;
+		pthread_mutex_unlock(&dio_lock);
+
+		res = dio_pread(r, 0);
+
+		pthread_mutex_lock(&dio_lock);
+		r->res = res;
+		r->done = 1;
+		pthread_mutex_unlock(&dio_lock);
+		if (dio_held != NULL)
+			__atomic_sub_fetch(dio_held, 1, __ATOMIC_RELEASE);
+		sem_post(&dio->slots);
+		if (write(dio_efd, &one, sizeof(one)) != sizeof(one))
+			err_ret("(%s) error - write() of the disk I/O eventfd failed", prog_name);
+	}
+	return NULL;
+}
+
+static void dio_start(void)
+{
+	pthread_t tid;
+	int i;
+
+	if ((dio_efd = eventfd(0, EFD_CLOEXEC)) < 0)
+		err_sys("(%s) error - eventfd() failed", prog_name);
+	pthread_mutex_init(&dio_lock, NULL);
+	pthread_cond_init(&dio_cond, NULL);
+	dio_head = dio_tail = NULL;
+
+	dio_held = NULL;
+	for (i = 0; i < DIO_PROCS; i++)
+	{
+		pid_t free_pid = 0;
+
+		if (__atomic_compare_exchange_n(&dio->proc[i].pid, &free_pid, getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			dio_held = &dio->proc[i].held;
+			break;
+		}
+	}
+
+	for (i = 0; i < dio_threads; i++)
+	{
+		if (pthread_create(&tid, NULL, dio_worker, NULL) != 0)
+			err_sys("(%s) error - pthread_create() of the disk I/O pool failed", prog_name);
+		pthread_detach(tid);
+	}
+	dio_pid = getpid();
+}
+
+/* Must be called before fork(): depth (the disk reads in flight in all the
+   processes) is shared, the threads are started by each process when needed. */
+void dio_init(int threads, int depth)
+{
+	dio = mmap(NULL, sizeof(struct dio_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (dio == MAP_FAILED)
+		err_sys("(%s) error - mmap() of the disk I/O semaphore failed", prog_name);
+	if (sem_init(&dio->slots, 1, depth) != 0)
+		err_sys("(%s) error - sem_init() failed", prog_name);
+	dio_threads = threads;
+
+	err_msg("(%s) --- disk I/O pool: %d threads per process, %d reads in flight", prog_name, threads, depth);
+}
+
+int dio_enabled(void)
+{
+	return dio != NULL;
+}
+
+/* Called by the parent from the SIGCHLD handler: gives back the disk slots of
+   a child that exited with reads in flight (e.g. err_sys() during a transfer). */
+void dio_reap(pid_t pid)
+{
+	int i, n;
+
+	if (dio == NULL)
+		return;
+
+	for (i = 0; i < DIO_PROCS; i++)
+		if (__atomic_load_n(&dio->proc[i].pid, __ATOMIC_RELAXED) == pid)
+		{
+			for (n = __atomic_exchange_n(&dio->proc[i].held, 0, __ATOMIC_ACQ_REL); n > 0; n--)
+				sem_post(&dio->slots);
+			__atomic_store_n(&dio->proc[i].pid, 0, __ATOMIC_RELEASE);
+		}
+}
+
+/* Starts reading r->len bytes at r->off of r->fd into r->buf. Data already in
+   the page cache is read at once; otherwise the read goes to the pool, waiting
+   for a free disk slot. */
+void dio_submit(struct dio_req *r)
+{
+	r->done = 0;
+	r->queued = 0;
+	r->head = 0;
+	if ((r->res = dio_pread(r, RWF_NOWAIT)) == (ssize_t)r->len || (r->res >= 0 && errno == 0))
+	{
+		r->done = 1; /* whole, or up to the end of the file */
+		return;
+	}
+	if (r->res > 0)
+	{
+		/* Partly cached: only the rest goes to the disk. */
+		r->head = r->res;
+		r->buf += r->head;
+		r->off += r->head;
+		r->len -= r->head;
+	}
+	else if (errno != EAGAIN && errno != EOPNOTSUPP)
+	{
+		r->done = 1;
+		return;
+	}
+
+	if (dio_pid != getpid())
+		dio_start();
+	while (sem_wait(&dio->slots) != 0 && errno == EINTR)
+		;
+	if (dio_held != NULL)
+		__atomic_add_fetch(dio_held, 1, __ATOMIC_ACQUIRE);
+
+	r->queued = 1;
+	r->next = NULL;
+	pthread_mutex_lock(&dio_lock);
+	if (dio_tail != NULL)
+		dio_tail->next = r;
+	else
+		dio_head = r;
+	dio_tail = r;
+	pthread_cond_signal(&dio_cond);
+	pthread_mutex_unlock(&dio_lock);
+}
+
+/* Waits for the completion of r, sleeping on the eventfd. */
+void dio_wait(struct dio_req *r)
+{
+	uint64_t n;
+	int done;
+
+	if (!r->queued)
+		return;
+	for (;;)
+	{
+		pthread_mutex_lock(&dio_lock);
+		done = r->done;
+		pthread_mutex_unlock(&dio_lock);
+		if (done)
+			break;
+		if (read(dio_efd, &n, sizeof(n)) < 0 && errno != EINTR)
+			err_sys("(%s) error - read() of the disk I/O eventfd failed", prog_name);
+	}
+	r->queued = 0;
+
+	/* Put back the part read by dio_submit(). */
+	r->buf -= r->head;
+	r->off -= r->head;
+	r->len += r->head;
+	if (r->res >= 0)
+		r->res += r->head;
+	else if (r->head > 0)
+		r->res = r->head;
+	r->head = 0;
+}
+
+/* Next chunk of the stream: up to DIO_CHUNK bytes after the last one requested. */
+static void dio_stream_next(struct dio_stream *s, struct dio_req *r)
+{
+	r->off = s->next_off;
+	r->len = s->size - s->next_off < DIO_CHUNK ? s->size - s->next_off : DIO_CHUNK;
+	s->next_off += r->len;
+	if (r->len == 0)
+	{
+		r->res = 0;
+		r->done = 1;
+		r->queued = 0;
+	}
+	else
+		dio_submit(r);
+}
+
+int dio_stream_open(struct dio_stream *s, int fd, off_t size)
+{
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	s->size = size;
+	for (i = 0; i < DIO_STREAM_BUFS; i++)
+		if ((s->req[i].buf = bp_get(DIO_CHUNK)) == NULL)
+		{
+			while (--i >= 0)
+				bp_put(s->req[i].buf, DIO_CHUNK);
+			return -1;
+		}
+	for (i = 0; i < DIO_STREAM_BUFS; i++)
+	{
+		s->req[i].fd = fd;
+		dio_stream_next(s, &s->req[i]);
+	}
+	return 0;
+}
+
+/* Like fread(): up to n bytes, 0 at end of file or on error. */
+ssize_t dio_stream_read(struct dio_stream *s, void *buf, size_t n)
+{
+	struct dio_req *r = &s->req[s->cur];
+
+	dio_wait(r);
+	if (s->eof || r->res <= 0)
+		return 0;
+	if (n > r->res - s->pos)
+		n = r->res - s->pos;
+	memcpy(buf, r->buf + s->pos, n);
+	s->pos += n;
+
+	if (s->pos == (size_t)r->res)
+	{
+		/* Chunk consumed: it goes back to the disk for the chunk after the last one in flight. */
+		if (r->res == (ssize_t)r->len)
+			dio_stream_next(s, r);
+		else
+			s->eof = 1; /* the file shrank: no data after the gap */
+		s->cur = (s->cur + 1) % DIO_STREAM_BUFS;
+		s->pos = 0;
+	}
+	return n;
+}
+
+void dio_stream_close(struct dio_stream *s)
+{
+	int i;
+
+	for (i = 0; i < DIO_STREAM_BUFS; i++)
+	{
+		dio_wait(&s->req[i]);
+		bp_put(s->req[i].buf, DIO_CHUNK);
+	}
+}
@@ -0,0 +1,59 @@
+/*
+
+module: diskio.h
+
+purpose: definitions of functions in diskio.c
+
+*/
+
+#ifndef _DISKIO_H
+
+#define _DISKIO_H
+
+#include <sys/types.h>
+
+#define DIO_CHUNK (256 << 10)	/* Bytes per disk read. */
+#define DIO_STREAM_BUFS 2	/* Chunks read ahead of the one being sent. */
+#define DIO_DEPTH 16		/* Default disk reads in flight (all processes). */
+#define DIO_PROCS 1024		/* Processes whose disk slots are accounted (see dio_reap()). */
+
+struct dio_req
+{
+	struct dio_req *next;
+	int fd;
+	off_t off;
+	size_t len;
+	char *buf;
+	ssize_t res; /* bytes read, -1 on error */
+	int done;
+	int queued;  /* handed to the pool */
+	size_t head; /* bytes already read by dio_submit() when queued */
+};
+
+/* Sequential reader of a file, DIO_STREAM_BUFS chunks ahead. */
+struct dio_stream
+{
+	off_t next_off, size;
+	struct dio_req req[DIO_STREAM_BUFS];
+	int cur;    /* chunk being consumed */
+	size_t pos; /* bytes of req[cur] already consumed */
+	int eof;    /* a short read ended the stream */
+};
+
+void dio_init(int threads, int depth);
+
+int dio_enabled(void);
+
+void dio_reap(pid_t pid);
+
+void dio_submit(struct dio_req *r);
+
+void dio_wait(struct dio_req *r);
+
+int dio_stream_open(struct dio_stream *s, int fd, off_t size);
+
+ssize_t dio_stream_read(struct dio_stream *s, void *buf, size_t n);
+
+void dio_stream_close(struct dio_stream *s);
+
+#endif
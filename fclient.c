@@ -0,0 +1,553 @@
+/*
+
+module: fclient.c
+
+purpose: client library for the GET protocol
+         connections are kept in a pool keyed by host:port and reused while
+         the server keeps them open; requests are pipelined on them (up to
+         FC_MAX_INFLIGHT each, up to max_conns connections per server) and
+         completed in order by a parser fed with whatever recv() returns, so
+         bodies are streamed to the caller's buffer, descriptor or callback
+         without being held in memory.
+
+         The server closes the connection after "-ERR": the requests still in
+         flight on it are submitted again on a new connection. The same is done
+         once for a connection lost before any byte of the response (e.g. a
+         kept-alive connection closed by the server timeout).
+
+         Single threaded: nothing happens between calls, I/O is driven by
+         fc_wait() and fc_run().
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "csum.h"
+#include "bufpool.h"
+#include "fclient.h"
+
+/* Parser states. */
+#define FC_S_STATUS 0 /* "+OK\r\n" or "-ERR\r" */
+#define FC_S_ERRNL 1  /* "\n" of "-ERR\r\n" */
+#define FC_S_SIZE 2
+#define FC_S_BODY 3
+#define FC_S_TS 4
+#define FC_S_CRC 5 /* trailer of CGET */
+
+#define FC_MAX_POLL 256 /* Connections polled in one round (the others wait for the next). */
+
+extern char *prog_name;
+
+struct fc_conn
+{
+	char host[FC_HOSTLEN], port[32]; /* port "" = AF_UNIX */
+	int fd;
+	struct fc_req *head, *tail; /* the first inflight are sent */
+	struct fc_req *unsent;
+	int inflight, queued;
+	int state, dead;
+	char hdr[5];
+	size_t hlen, hneed;
+	uint32_t left;
+	struct fc_conn *next;
+};
+
+struct fc_pool
+{
+	struct fc_conn *conns;
+	int max_conns;
+	fc_connect_fn *connect;
+	char *buf; /* receive buffer, from the buffer pool */
+	size_t buflen;
+};
+
+static void fc_place(struct fc_pool *pool, const char *host, const char *port, struct fc_req *r);
+
+static int fc_connect(const char *host, const char *port)
+{
+	struct sockaddr_un sun;
+	int sockfd;
+
+	if (port != NULL)
+		return tcp_connect_try(host, port); /* cached resolution, happy eyeballs */
+
+	if (strlen(host) >= sizeof(sun.sun_path) || (sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, host);
+	if (connect(sockfd, (SA *)&sun, SUN_LEN(&sun)) != 0)
+	{
+		err_ret("(%s) error - connect() to '%s' failed", prog_name, host);
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+struct fc_pool *fc_pool_new(int max_conns, fc_connect_fn *connect)
+{
+	struct fc_pool *pool;
+
+	if ((pool = calloc(1, sizeof(*pool))) == NULL)
+		return NULL;
+	pool->buflen = bp_chunk(-1, 0);
+	if ((pool->buf = bp_get(pool->buflen)) == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+	pool->max_conns = max_conns > 0 ? max_conns : 1;
+	pool->connect = connect != NULL ? connect : fc_connect;
+	return pool;
+}
+
+static struct fc_conn *fc_conn_new(struct fc_pool *pool, const char *host, const char *port, int fd)
+{
+	struct fc_conn *c;
+
+	if (strlen(host) >= FC_HOSTLEN || (port != NULL && strlen(port) >= sizeof(c->port)) ||
+		(c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+	strcpy(c->host, host);
+	strcpy(c->port, port != NULL ? port : "");
+	c->fd = fd;
+	c->hneed = 5;
+	c->next = pool->conns;
+	pool->conns = c;
+	return c;
+}
+
+/* A connected descriptor (e.g. after a TLS handshake) is added to the pool as
+   a connection to host:port. The pool works on a copy: fd stays to the caller. */
+int fc_pool_adopt(struct fc_pool *pool, const char *host, const char *port, int fd)
+{
+	int copy;
+
+	if ((copy = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+		return -1;
+	if (fc_conn_new(pool, host, port, copy) == NULL)
+	{
+		close(copy);
+		return -1;
+	}
+	return 0;
+}
+
+void fc_req_init(struct fc_req *r, const char *name)
+{
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->fd = -1;
+}
+
+const char *fc_strstatus(int status)
+{
+	switch (status)
+	{
+	case FC_PENDING:
+		return "pending";
+	case FC_OK:
+		return "ok";
+	case FC_ERR:
+		return "refused by the server";
+	case FC_EIO:
+		return "connection failed";
+	case FC_ESINK:
+		return "destination error";
+	case FC_ECSUM:
+		return "checksum mismatch";
+	}
+	return "unknown";
+}
+
+static void fc_done(struct fc_req *r, int status)
+{
+	r->status = status;
+	if (r->on_done != NULL)
+		r->on_done(r);
+}
+
+static int fc_same(struct fc_conn *c, const char *host, const char *port)
+{
+	return strcmp(c->host, host) == 0 && strcmp(c->port, port != NULL ? port : "") == 0;
+}
+
+/* A kept-alive connection with nothing in flight: still open on the server side? */
+static int fc_alive(struct fc_conn *c)
+{
+	char b;
+	ssize_t n = recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void fc_conn_free(struct fc_pool *pool, struct fc_conn *c)
+{
+	struct fc_conn **pp;
+
+	for (pp = &pool->conns; *pp != c; pp = &(*pp)->next)
+		;
+	*pp = c->next;
+	close(c->fd);
+	free(c);
+}
+
+/* Sends the queued GETs (CGETs), up to FC_MAX_INFLIGHT in flight. */
+static void fc_flush(struct fc_pool *pool, struct fc_conn *c)
+{
+	char line[4096 + 8];
+	size_t len;
+
+	(void)pool;
+	while (c->unsent != NULL && c->inflight < FC_MAX_INFLIGHT && !c->dead)
+	{
+		len = snprintf(line, sizeof(line), "%s %s\r\n", c->unsent->verify ? MSG_CGET : "GET", c->unsent->name);
+		if (len >= sizeof(line) || sendn(c->fd, line, len, MSG_NOSIGNAL) != (ssize_t)len)
+		{
+			c->dead = 1;
+			break;
+		}
+		c->unsent = c->unsent->next;
+		c->inflight++;
+	}
+}
+
+/* Closes c and moves its requests elsewhere. A request is failed instead if
+   part of its response already went to the caller, or if retry is set and it
+   was already sent again once. */
+static void fc_conn_drop(struct fc_pool *pool, struct fc_conn *c, int retry)
+{
+	struct fc_req *r, *next;
+	char host[FC_HOSTLEN], port[32];
+	int noport = c->port[0] == '\0', sent = c->inflight;
+
+	strcpy(host, c->host);
+	strcpy(port, c->port);
+	r = c->head;
+	fc_conn_free(pool, c);
+
+	for (; r != NULL; r = next, sent--)
+	{
+		next = r->next;
+		if (r->received > 0 || (sent > 0 && retry && r->retried))
+			fc_done(r, FC_EIO);
+		else
+		{
+			/* Only the GETs already sent count as a retry. */
+			r->retried |= sent > 0 && retry;
+			fc_place(pool, host, noport ? NULL : port, r);
+		}
+	}
+}
+
+/* Request at the head of c completed. */
+static void fc_complete(struct fc_conn *c, int status)
+{
+	struct fc_req *r = c->head;
+
+	if ((c->head = r->next) == NULL)
+		c->tail = NULL;
+	c->inflight--;
+	c->queued--;
+	c->state = FC_S_STATUS;
+	c->hlen = 0;
+	c->hneed = 5;
+	fc_done(r, status);
+}
+
+static void fc_sink(struct fc_req *r, const char *p, size_t n)
+{
+	r->received += n;
+	if (r->verify)
+		r->crc = crc32c(r->crc, p, n);
+	if (r->sink_err)
+		return; /* the rest of the body is discarded */
+	if (r->on_data != NULL)
+		r->sink_err = r->on_data(r, p, n) < 0;
+	else if (r->fd >= 0)
+		r->sink_err = writen(r->fd, p, n) != (ssize_t)n;
+	else if (r->buf != NULL)
+	{
+		if (r->received > r->buflen)
+			r->sink_err = 1;
+		else
+			memcpy(r->buf + r->received - n, p, n);
+	}
+}
+
+/* A header field is complete. */
+static void fc_header(struct fc_conn *c)
+{
+	struct fc_req *r = c->head;
+	uint32_t v;
+
+	switch (c->state)
+	{
+	case FC_S_STATUS:
+		if (memcmp(c->hdr, "+OK\r\n", 5) == 0)
+		{
+			c->state = FC_S_SIZE;
+			c->hneed = 4;
+		}
+		else if (memcmp(c->hdr, "-ERR\r", 5) == 0)
+		{
+			c->state = FC_S_ERRNL;
+			c->hneed = 1;
+		}
+		else
+		{
+			err_msg("(%s) error - invalid response from %s %s", prog_name, c->host, c->port);
+			c->dead = 1;
+		}
+		break;
+	case FC_S_ERRNL:
+		/* The server closes the connection after an error. */
+		fc_complete(c, FC_ERR);
+		c->dead = 1;
+		return;
+	case FC_S_SIZE:
+		memcpy(&v, c->hdr, 4);
+		r->size = c->left = ntohl(v);
+		c->state = c->left > 0 ? FC_S_BODY : FC_S_TS;
+		c->hneed = 4;
+		break;
+	case FC_S_TS:
+		memcpy(&v, c->hdr, 4);
+		r->timestamp = ntohl(v);
+		if (r->verify)
+		{
+			c->state = FC_S_CRC;
+			break;
+		}
+		fc_complete(c, r->sink_err ? FC_ESINK : FC_OK);
+		return;
+	case FC_S_CRC:
+		memcpy(&v, c->hdr, 4);
+		fc_complete(c, ntohl(v) != r->crc ? FC_ECSUM : r->sink_err ? FC_ESINK : FC_OK);
+		return;
+	}
+	c->hlen = 0;
+}
+
+static void fc_feed(struct fc_conn *c, const char *p, size_t n)
+{
+	size_t len;
+
+	while (n > 0 && !c->dead)
+	{
+		if (c->head == NULL || c->inflight == 0)
+		{
+			err_msg("(%s) error - unexpected data from %s %s", prog_name, c->host, c->port);
+			c->dead = 1;
+			break;
+		}
+		if (c->state == FC_S_BODY)
+		{
+			len = n < c->left ? n : c->left;
+			fc_sink(c->head, p, len);
+			if ((c->left -= len) == 0)
+			{
+				c->state = FC_S_TS;
+				c->hlen = 0;
+				c->hneed = 4;
+			}
+		}
+		else
+		{
+			len = c->hneed - c->hlen < n ? c->hneed - c->hlen : n;
+			memcpy(c->hdr + c->hlen, p, len);
+			if ((c->hlen += len) == c->hneed)
+				fc_header(c);
+		}
+		p += len;
+		n -= len;
+	}
+}
+
+/* Puts r on a connection to host:port with room, opening one if needed. */
+static void fc_place(struct fc_pool *pool, const char *host, const char *port, struct fc_req *r)
+{
+	struct fc_conn *c, *best = NULL;
+	int n = 0, fd;
+
+	for (c = pool->conns; c != NULL; c = c->next)
+	{
+		if (!fc_same(c, host, port) || c->dead)
+			continue;
+		if (c->queued == 0 && !fc_alive(c))
+		{
+			c->dead = 1; /* freed by the next fc_step() */
+			continue;
+		}
+		n++;
+		if (best == NULL || c->queued < best->queued)
+			best = c;
+	}
+	if (best == NULL || (best->queued > 0 && n < pool->max_conns))
+	{
+		if ((fd = pool->connect(host, port)) >= 0)
+		{
+			if ((c = fc_conn_new(pool, host, port, fd)) != NULL)
+				best = c;
+			else
+				close(fd);
+		}
+	}
+	if (best == NULL)
+	{
+		fc_done(r, FC_EIO);
+		return;
+	}
+
+	r->status = FC_PENDING;
+	r->received = 0;
+	r->crc = 0;
+	r->sink_err = 0;
+	r->next = NULL;
+	if (best->tail != NULL)
+		best->tail->next = r;
+	else
+		best->head = r;
+	best->tail = r;
+	if (best->unsent == NULL)
+		best->unsent = r;
+	best->queued++;
+}
+
+/* Queues a GET of r->name to host:port. Returns 0, -1 if no connection could
+   be opened (r is then already completed with FC_EIO). */
+int fc_submit(struct fc_pool *pool, const char *host, const char *port, struct fc_req *r)
+{
+	struct fc_conn *c;
+
+	r->retried = 0;
+	fc_place(pool, host, port, r);
+	if (r->status != FC_PENDING)
+		return -1;
+	/* Sent at once if there is room. */
+	for (c = pool->conns; c != NULL; c = c->next)
+		if (c->tail == r)
+			fc_flush(pool, c);
+	return 0;
+}
+
+/* One round of I/O on all the connections. Returns the requests still queued. */
+static int fc_step(struct fc_pool *pool)
+{
+	struct pollfd pfd[FC_MAX_POLL];
+	struct fc_conn *conn[FC_MAX_POLL], *c, *next;
+	int n = 0, queued = 0, i, r;
+	ssize_t len;
+
+	for (c = pool->conns; c != NULL; c = next)
+	{
+		next = c->next;
+		fc_flush(pool, c);
+		if (c->dead)
+			fc_conn_drop(pool, c, 1);
+	}
+	for (c = pool->conns; c != NULL; c = c->next)
+	{
+		queued += c->queued;
+		if (c->inflight > 0 && n < FC_MAX_POLL)
+		{
+			pfd[n].fd = c->fd;
+			pfd[n].events = POLLIN;
+			conn[n++] = c;
+		}
+	}
+	if (n == 0)
+		return queued;
+
+	if ((r = poll(pfd, n, FC_TIMEOUT * 1000)) < 0)
+	{
+		if (errno != EINTR)
+			err_sys("(%s) error - poll() failed", prog_name);
+		return queued;
+	}
+	if (r == 0)
+	{
+		/* Timeout: the requests in flight fail, no retry. */
+		for (i = 0; i < n; i++)
+		{
+			printf("(%s) - timeout waiting for data from server %s %s\n", prog_name, conn[i]->host, conn[i]->port);
+			for (struct fc_req *q = conn[i]->head; q != NULL; q = q->next)
+				q->retried = 1;
+			fc_conn_drop(pool, conn[i], 1);
+		}
+		return 1;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (pfd[i].revents == 0)
+			continue;
+		c = conn[i];
+		if ((len = recv(c->fd, pool->buf, pool->buflen, 0)) > 0)
+			fc_feed(c, pool->buf, len);
+		else if (len < 0 && errno == EINTR)
+			continue;
+		else
+		{
+			/* Closed by the server: retried once if nothing of the response arrived. */
+			fc_conn_drop(pool, c, 1);
+			continue;
+		}
+		if (c->dead)
+			fc_conn_drop(pool, c, c->state != FC_S_STATUS || c->hlen > 0);
+	}
+	return 1;
+}
+
+/* Drives the I/O until r is completed. Returns its status. */
+int fc_wait(struct fc_pool *pool, struct fc_req *r)
+{
+	while (r->status == FC_PENDING && fc_step(pool) > 0)
+		;
+	return r->status;
+}
+
+/* Drives the I/O until every request is completed (results through on_done()). */
+void fc_run(struct fc_pool *pool)
+{
+	while (fc_step(pool) > 0)
+		;
+}
+
+/* Synchronous GET. */
+int fc_get(struct fc_pool *pool, const char *host, const char *port, struct fc_req *r)
+{
+	if (fc_submit(pool, host, port, r) < 0)
+		return r->status;
+	return fc_wait(pool, r);
+}
+
+/* Closes every connection; requests not completed yet fail with FC_EIO. */
+void fc_pool_free(struct fc_pool *pool)
+{
+	struct fc_req *r, *next;
+
+	while (pool->conns != NULL)
+	{
+		r = pool->conns->head;
+		fc_conn_free(pool, pool->conns);
+		for (; r != NULL; r = next)
+		{
+			next = r->next;
+			fc_done(r, FC_EIO);
+		}
+	}
+	bp_put(pool->buf, pool->buflen);
+	free(pool);
+}
@@ -0,0 +1,95 @@
+/*
+
+module: fclient.h
+
+purpose: definitions of the client library (fclient.c)
+
+         Usage:
+
+             struct fc_pool *pool = fc_pool_new(2, NULL);
+             struct fc_req r;
+
+             fc_req_init(&r, "dir/file");
+             r.fd = fd;              (or r.buf/r.buflen, or r.on_data)
+             r.on_done = done;       (optional, called on completion)
+             r.verify = 1;           (optional, CGET: contents checked with CRC32C)
+             fc_submit(pool, host, port, &r);
+             ...                     (more requests, pipelined)
+             fc_wait(pool, &r);      (or fc_run(pool) for all of them)
+             fc_pool_free(pool);
+
+         A request must stay valid until it is completed. The callbacks may
+         submit new requests, not wait for them. With port == NULL, host is an
+         AF_UNIX path.
+
+*/
+
+#ifndef _FCLIENT_H
+
+#define _FCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FC_TIMEOUT 15	    /* Seconds without data from a connection with requests in flight. */
+#define FC_MAX_INFLIGHT 32  /* Pipelined GETs per connection. */
+#define FC_HOSTLEN 256
+
+/* Status of a request. */
+#define FC_PENDING 0
+#define FC_OK 1
+#define FC_ERR 2   /* -ERR from the server */
+#define FC_EIO 3   /* connection failed, lost or timed out */
+#define FC_ESINK 4 /* the destination refused the data (buffer too small, write error, callback < 0) */
+#define FC_ECSUM 5 /* the contents do not match the CRC32C sent by the server */
+
+struct fc_req;
+
+typedef int fc_data_fn(struct fc_req *r, const char *data, size_t len);
+typedef void fc_done_fn(struct fc_req *r);
+typedef int fc_connect_fn(const char *host, const char *port);
+
+struct fc_req
+{
+	/* Set by the caller. The body goes to on_data if set, else to fd if >= 0,
+	   else to buf (buflen bytes at most); with none of them it is discarded. */
+	const char *name;
+	fc_data_fn *on_data;
+	int fd;
+	char *buf;
+	size_t buflen;
+	fc_done_fn *on_done;
+	void *arg;
+	int verify;
+
+	/* Set by the library. */
+	int status;
+	uint32_t size, timestamp, crc;
+	uint64_t received;
+
+	/* Internal. */
+	struct fc_req *next;
+	int sink_err, retried;
+};
+
+struct fc_pool;
+
+struct fc_pool *fc_pool_new(int max_conns, fc_connect_fn *connect);
+
+int fc_pool_adopt(struct fc_pool *pool, const char *host, const char *port, int fd);
+
+void fc_pool_free(struct fc_pool *pool);
+
+void fc_req_init(struct fc_req *r, const char *name);
+
+int fc_submit(struct fc_pool *pool, const char *host, const char *port, struct fc_req *r);
+
+int fc_wait(struct fc_pool *pool, struct fc_req *r);
+
+void fc_run(struct fc_pool *pool);
+
+int fc_get(struct fc_pool *pool, const char *host, const char *port, struct fc_req *r);
+
+const char *fc_strstatus(int status);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+
+module: fdpass.c
+
+purpose: FGET command, server side
+         the file is opened read-only and the descriptor is passed to the
+         client over the AF_UNIX socket: no byte of the contents goes through
+         the socket.
+
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "pathidx.h"
+#include "fdpass.h"
+
+extern char *prog_name;
+
+/* Returns 0 if the connection can go on with the next command, -1 if it must be closed. */
+int fdpass_serve(int connfd, const char *filename, const char *peer)
+{
+	struct stat st;
+	int fd;
+
+	if (filename == NULL)
+	{
+		err_msg("(%s) error - illegal FGET command from client [%s]", prog_name, peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	printf("(%s) --- client [%s] asked to pass file '%s'\n", prog_name, peer, filename);
+
+	if ((fd = pi_open(filename, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		err_msg("(%s) error - '%s' is not a readable file for client [%s]: %s", prog_name, filename, peer,
+			fd < 0 ? strerror(errno) : "not a regular file");
+		if (fd >= 0)
+			close(fd);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	if (write_fd(connfd, "+OK\r\n", 5, fd) != 5)
+	{
+		err_ret("(%s) error - passing '%s' failed with client [%s]", prog_name, filename, peer);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	printf("(%s) --- passed file '%s' (%lld bytes) to client [%s]\n", prog_name, filename, (long long)st.st_size, peer);
+	return 0;
+}
@@ -0,0 +1,24 @@
+/*
+
+module: fdpass.h
+
+purpose: definitions of the FGET command (fdpass.c), AF_UNIX connections only
+
+         request:  "FGET filename\r\n"
+         response: "+OK\r\n" carrying, as SCM_RIGHTS ancillary data, a
+                   read-only descriptor of the file: the client reads or
+                   mmap()s it directly and takes size and timestamp from
+                   fstat(); "-ERR\r\n" if the file is not a readable regular
+                   file (then the connection is closed, as for GET)
+
+*/
+
+#ifndef _FDPASS_H
+
+#define _FDPASS_H
+
+#define MSG_FGET "FGET"
+
+int fdpass_serve(int connfd, const char *filename, const char *peer);
+
+#endif
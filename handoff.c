@@ -0,0 +1,198 @@
+/*
+
+module: handoff.c
+
+purpose: restart without closing the listening socket
+         with -H path the server listens on an AF_UNIX control socket. A new
+         server process started with the same path connects to it and gets
+         the listening socket of the running one over SCM_RIGHTS, together
+         with the names in its small-file cache, which it loads before
+         accepting. The connections waiting in the accept queue stay there
+         and are accepted by the new process; the old one stops accepting,
+         lets its children finish their transfers and exits. If the new
+         process fails before it is ready, the old one keeps serving.
+         An old process busy with a client (server1 is iterative) answers
+         only after that connection: the new one waits as long as the old
+         one is alive, since its pending connection is reset if it exits.
+
+         Socket activation: a listening socket passed as descriptor 3 with
+         LISTEN_PID/LISTEN_FDS (the systemd protocol) is used instead of
+         creating one.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "cache.h"
+#include "handoff.h"
+
+extern char *prog_name;
+
+/* Listening socket from socket activation, -1 if none. */
+int ho_activated(void)
+{
+	const char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS");
+	int on = 0, n;
+	socklen_t len = sizeof(on);
+
+	if (pid == NULL || fds == NULL || atol(pid) != (long)getpid() || (n = atoi(fds)) < 1)
+		return -1;
+
+	/* Not inherited by anything the server starts. */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	if (getsockopt(HO_LISTEN_FDS_START, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) != 0 || !on)
+		err_quit("(%s) error - descriptor %d from socket activation is not a listening socket", prog_name, HO_LISTEN_FDS_START);
+	fcntl(HO_LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+	if (n > 1)
+		err_msg("(%s) --- %d sockets from socket activation, only the first one is used", prog_name, n);
+	err_msg("(%s) --- listening socket from socket activation", prog_name);
+	return HO_LISTEN_FDS_START;
+}
+
+/* Process at the other end of the control connection, -1 if it runs as another user. */
+static pid_t ho_peer(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || (cred.uid != geteuid() && cred.uid != 0))
+		return -1;
+	return cred.pid;
+}
+
+/* New process: the listening socket of the server on the control socket
+   path, after loading its cached files. Returns -1 if no server answers. */
+int ho_takeover(const char *path)
+{
+	struct sockaddr_un sun;
+	struct timeval tv = {HO_TIMEOUT, 0};
+	struct pollfd pfd;
+	char line[4096];
+	int sockfd, listenfd = -1, files = 0, rc;
+	ssize_t n;
+	pid_t pid;
+
+	if (strlen(path) >= sizeof(sun.sun_path) || (sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (connect(sockfd, (SA *)&sun, SUN_LEN(&sun)) != 0)
+	{
+		close(sockfd);
+		return -1; /* no server running: first start */
+	}
+	if ((pid = ho_peer(sockfd)) < 0)
+		goto fail;
+
+	/* The old process accepts between two clients: no time limit while it is alive. */
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	while ((rc = poll(&pfd, 1, HO_TIMEOUT * 1000)) == 0 || (rc < 0 && errno == EINTR))
+		if (rc == 0)
+			err_msg("(%s) --- process %d is busy, still waiting for the listening socket", prog_name, (int)pid);
+	if (rc < 0)
+		goto fail;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (read_fd(sockfd, line, 5, &listenfd) != 5 || listenfd < 0 || memcmp(line, "+OK\r\n", 5) != 0)
+		goto fail;
+
+	/* The cache of the old process, filled again before the first client. */
+	while ((n = readline_unbuffered(sockfd, line, sizeof(line))) > 0 && strcmp(line, "\r\n") != 0)
+	{
+		cache_warm(strtok(line, "\r\n"));
+		files++;
+	}
+	if (n <= 0 || sendn(sockfd, "+OK\r\n", 5, MSG_NOSIGNAL) != 5)
+		goto fail;
+	close(sockfd);
+	unlink(path); /* the old process is leaving: its control socket is replaced by ours */
+
+	err_msg("(%s) --- took over the listening socket of process %d (%d cached files)", prog_name, (int)pid, files);
+	return listenfd;
+
+fail:
+	err_msg("(%s) error - handoff from the server on '%s' failed", prog_name, path);
+	if (listenfd >= 0)
+		close(listenfd);
+	close(sockfd);
+	return -1;
+}
+
+/* Control socket for the next process; a stale one at path is replaced
+   (after a takeover, ho_takeover() has already removed the old one). */
+int ho_control(const char *path)
+{
+	int ctlfd = unix_listen(path, NULL);
+
+	fcntl(ctlfd, F_SETFD, FD_CLOEXEC);
+	chmod(path, 0600);
+	err_msg("(%s) --- handoff control socket on '%s'", prog_name, path);
+	return ctlfd;
+}
+
+/* Waits for a client on listenfd or a new process on ctlfd (-1 = no handoff).
+   Returns 1 if a new process is asking for the socket, 0 to accept a client. */
+int ho_pending(int listenfd, int ctlfd)
+{
+	struct pollfd pfd[2];
+
+	if (ctlfd < 0)
+		return 0;
+	pfd[0].fd = listenfd;
+	pfd[1].fd = ctlfd;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (poll(pfd, 2, -1) < 0)
+		if (errno != EINTR)
+			return 0;
+	return (pfd[1].revents & POLLIN) != 0;
+}
+
+/* Old process: passes listenfd to the process connecting on ctlfd. Returns 0
+   once it is accepting (the caller stops), -1 if it failed (the caller goes on). */
+int ho_handover(int ctlfd, int listenfd)
+{
+	struct timeval tv = {HO_TIMEOUT, 0};
+	char ack[5];
+	pid_t pid;
+	int fd;
+
+	if ((fd = accept4(ctlfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if ((pid = ho_peer(fd)) < 0)
+	{
+		err_msg("(%s) error - handoff refused to a process of another user", prog_name);
+		close(fd);
+		return -1;
+	}
+	if (write_fd(fd, "+OK\r\n", 5, listenfd) != 5 || cache_names(fd) < 0 || sendn(fd, "\r\n", 2, MSG_NOSIGNAL) != 2 ||
+	    readn(fd, ack, 5) != 5 || memcmp(ack, "+OK\r\n", 5) != 0)
+	{
+		err_msg("(%s) error - handoff to process %d failed, still accepting", prog_name, (int)pid);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	err_msg("(%s) --- listening socket handed over to process %d", prog_name, (int)pid);
+	return 0;
+}
@@ -0,0 +1,34 @@
+/*
+
+module: handoff.h
+
+purpose: definitions of the listening socket handoff (handoff.c)
+
+         control socket (AF_UNIX, path given with -H), new -> old process:
+
+             old:  "+OK\r\n" carrying the listening socket as SCM_RIGHTS,
+                   then the names in the small-file cache, one per line,
+                   least recently used first, and an empty line
+             new:  "+OK\r\n" once it is ready to accept: the old process
+                   stops accepting and exits after its transfers
+
+*/
+
+#ifndef _HANDOFF_H
+
+#define _HANDOFF_H
+
+#define HO_TIMEOUT 10		/* Seconds for each step of the handoff. */
+#define HO_LISTEN_FDS_START 3	/* First descriptor passed by socket activation. */
+
+int ho_activated(void);
+
+int ho_takeover(const char *path);
+
+int ho_control(const char *path);
+
+int ho_pending(int listenfd, int ctlfd);
+
+int ho_handover(int ctlfd, int listenfd);
+
+#endif
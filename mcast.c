@@ -0,0 +1,1096 @@
+/*
+
+module: mcast.c
+
+purpose: multicast distribution of files with forward error correction
+         the server (mc_start(), a process of its own) announces each file
+         on an IPv4 multicast group and sends it once as numbered datagrams,
+         paced to a fixed rate; after every block of MC_BLOCK data packets
+         come MC_REPAIR Reed-Solomon repair packets (Cauchy matrix over
+         GF(256)), so any MC_BLOCK of the packets of a block rebuild it.
+         MC_WINDOW blocks are sent interleaved, packet index by packet index,
+         so a burst of losses (a full socket buffer) is spread over many
+         blocks. Repairs are sums of data packets multiplied by constants:
+         with AVX2 32 bytes at a time, through two 16-entry tables (low and
+         high nibble) looked up with vpshufb, otherwise one 256-entry table
+         per constant.
+
+         A receiver (mc_get()) joins the group, writes the data packets of
+         the files it wants straight into their mapping, decodes a block as
+         soon as it has enough packets and, at the end, fetches only the
+         ranges that could not be rebuilt with RGET on one TCP connection,
+         MC_PIPELINE requests at a time. The file is checked against the
+         announced CRC32C before taking its name; if it does not match, or a
+         range comes back with another length or is refused (it changed on
+         the server), it is fetched whole.
+
+         The sender reads each window with pread() rather than mapping the
+         file, so a file truncated during the multicast ends its transfer
+         with an error instead of a SIGBUS.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "ratelimit.h"
+#include "csum.h"
+#include "pathidx.h"
+#include "mcast.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define MC_HDR 12		/* "MC", type, index, session, block. */
+#define MC_MAXPAYLOAD 8192	/* Largest packet accepted from an announcement (jumbo frames). */
+#define MC_BATCH 64		/* Datagrams per recvmmsg(). */
+#define MC_BUFSIZE (8 << 20)	/* Socket buffers of sender and receivers. */
+#define MC_WAIT 15000		/* Receivers wait this long for an announcement (ms). */
+#define MC_WINBYTES ((size_t)MC_WINDOW * MC_BLOCK * MC_PAYLOAD) /* File bytes of a window, read before it is sent. */
+#define MC_ECHANGED 1		/* Internal: a range of another length, the file changed on the server. */
+
+extern char *prog_name;
+
+/* GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1. */
+static uint8_t gf_exp[512], gf_log[256];
+static uint8_t mc_cauchy[MC_REPAIR][MC_BLOCK]; /* 1 / (x_j + y_i), x_j = MC_BLOCK + j, y_i = i */
+
+static pthread_once_t mc_once = PTHREAD_ONCE_INIT;
+static void (*mc_madd_fn)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+static const char *mc_impl_name;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	return a == 0 || b == 0 ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+/* dst += c * src, one table of the 256 products. */
+static void mc_madd_sw(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	uint8_t t[256];
+	size_t i;
+
+	if (c == 0)
+		return;
+	for (i = 0; i < 256; i++)
+		t[i] = gf_mul(c, i);
+	for (i = 0; i < len; i++)
+		dst[i] ^= t[src[i]];
+}
+
+#if defined(__x86_64__)
+/* c * x = c * (x & 15) + c * (x & 240): two 16-entry tables, 32 lookups per vpshufb. */
+__attribute__((target("avx2"))) static void mc_madd_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	uint8_t lo[16], hi[16];
+	__m256i tlo, thi, mask = _mm256_set1_epi8(0x0f), x, p;
+	size_t i;
+
+	if (c == 0)
+		return;
+	for (i = 0; i < 16; i++)
+	{
+		lo[i] = gf_mul(c, i);
+		hi[i] = gf_mul(c, i << 4);
+	}
+	tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+	thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+
+	for (i = 0; i + 32 <= len; i += 32)
+	{
+		x = _mm256_loadu_si256((const __m256i *)(src + i));
+		p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(x, mask)),
+				     _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask)));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), p));
+	}
+	for (; i < len; i++)
+		dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+#endif
+
+static void mc_setup(void)
+{
+	int i, j, x = 1;
+
+	for (i = 0; i < 255; i++)
+	{
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		if ((x <<= 1) & 0x100)
+			x ^= 0x11d;
+	}
+	for (j = 0; j < MC_REPAIR; j++)
+		for (i = 0; i < MC_BLOCK; i++)
+			mc_cauchy[j][i] = gf_inv((MC_BLOCK + j) ^ i);
+
+	mc_madd_fn = mc_madd_sw;
+	mc_impl_name = "table";
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+	{
+		mc_madd_fn = mc_madd_avx2;
+		mc_impl_name = "avx2";
+	}
+#endif
+}
+
+/* Implementation of the GF(256) arithmetic, for the logs. */
+const char *mc_impl(void)
+{
+	pthread_once(&mc_once, mc_setup);
+	return mc_impl_name;
+}
+
+static double mc_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void mc_sleep(double sec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = sec;
+	ts.tv_nsec = (sec - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+/* "group:port[:iface[:opt]]": multicast group, port, address of the interface
+   (empty or missing = chosen by the kernel); *opt is what follows, or NULL.
+   0, or -1 if invalid. */
+int mc_parse(const char *str, struct sockaddr_in *group, struct in_addr *iface, const char **opt)
+{
+	char addr[INET_ADDRSTRLEN], ifa[INET_ADDRSTRLEN], *end;
+	const char *port, *c;
+	size_t n;
+	long p;
+
+	if ((port = strchr(str, ':')) == NULL || (size_t)(port - str) >= sizeof(addr))
+		return -1;
+	memcpy(addr, str, port - str);
+	addr[port - str] = '\0';
+	p = strtol(++port, &end, 10);
+	if (end == port || (*end != '\0' && *end != ':') || p < 1 || p > 65535)
+		return -1;
+
+	ifa[0] = '\0';
+	*opt = NULL;
+	if (*end == ':')
+	{
+		c = end + 1;
+		if ((end = strchr(c, ':')) != NULL)
+			*opt = end + 1;
+		if ((n = end != NULL ? (size_t)(end - c) : strlen(c)) >= sizeof(ifa))
+			return -1;
+		memcpy(ifa, c, n);
+		ifa[n] = '\0';
+	}
+
+	memset(group, 0, sizeof(*group));
+	group->sin_family = AF_INET;
+	group->sin_port = htons(p);
+	if (inet_pton(AF_INET, addr, &group->sin_addr) != 1 || !IN_MULTICAST(ntohl(group->sin_addr.s_addr)))
+		return -1;
+	iface->s_addr = htonl(INADDR_ANY);
+	if (ifa[0] != '\0' && inet_pton(AF_INET, ifa, iface) != 1)
+		return -1;
+	return 0;
+}
+
+static void mc_header(uint8_t *h, char type, int index, uint32_t session, uint32_t block)
+{
+	h[0] = 'M';
+	h[1] = 'C';
+	h[2] = type;
+	h[3] = index;
+	session = htonl(session);
+	block = htonl(block);
+	memcpy(h + 4, &session, 4);
+	memcpy(h + 8, &block, 4);
+}
+
+/* Sender pacing: next is when the following datagram may leave. */
+struct mc_pace
+{
+	double rate, next;
+};
+
+static void mc_pace(struct mc_pace *p, size_t bytes)
+{
+	double now = mc_now();
+
+	/* No credit for idle time beyond 10 ms. */
+	if (p->next < now - 0.01)
+		p->next = now - 0.01;
+	p->next += bytes / p->rate;
+	if (p->next > now + 0.001)
+		mc_sleep(p->next - now);
+}
+
+/* All the datagrams, retrying while the interface queue is full. */
+static int mc_sendmmsg(int s, struct mmsghdr *m, int n)
+{
+	int r;
+
+	while (n > 0)
+	{
+		if ((r = sendmmsg(s, m, n, 0)) < 0)
+		{
+			if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR)
+				return -1;
+			mc_sleep(0.001);
+			continue;
+		}
+		m += r;
+		n -= r;
+	}
+	return 0;
+}
+
+/* Reads len bytes at off; -1 if the file is shorter (truncated since the fstat()). */
+static int mc_pread(int fd, uint8_t *buf, size_t len, uint64_t off)
+{
+	ssize_t r;
+
+	while (len > 0)
+	{
+		if ((r = pread(fd, buf, len, off)) < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		len -= r;
+		off += r;
+	}
+	return 0;
+}
+
+/* Announces and sends one file. 0, or -1 if it cannot be read or sent. */
+static int mc_send_file(int s, const struct sockaddr_in *group, const char *filename, struct mc_pace *pace, int lead)
+{
+	struct mmsghdr msg[MC_WINDOW];
+	struct iovec iov[MC_WINDOW][2];
+	uint8_t hdr[MC_WINDOW][MC_HDR], ann[MC_HDR + 16 + PATH_MAX], *rep = NULL, *win = NULL;
+	struct csum_key ck;
+	struct stat st;
+	uint32_t session, npk, nblocks, b0, b, v[3], ndata = 0, nrep = 0;
+	size_t annlen, wlen, namelen = strlen(filename);
+	uint64_t base;
+	int fd, i, j, idx, nb, n, kb, rc = -1;
+	double t0;
+
+	if (namelen > PATH_MAX || (fd = pi_open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+		err_ret("(%s) error - cannot open '%s' for multicast", prog_name, filename);
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX || (win = malloc(MC_WINBYTES)) == NULL ||
+	    (rep = malloc(MC_WINDOW * MC_REPAIR * MC_PAYLOAD)) == NULL)
+	{
+		err_msg("(%s) error - '%s' is not a readable file for multicast", prog_name, filename);
+		goto out;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	/* Digest for the receivers' check, as for CGET. */
+	if (!csum_lookup(fd, st.st_size, &ck, &v[2]))
+	{
+		for (v[2] = 0, base = 0; base < (uint64_t)st.st_size; base += wlen)
+		{
+			wlen = st.st_size - base < MC_WINBYTES ? st.st_size - base : MC_WINBYTES;
+			if (mc_pread(fd, win, wlen, base) < 0)
+			{
+				err_msg("(%s) error - '%s' was truncated while read for multicast", prog_name, filename);
+				goto out;
+			}
+			v[2] = crc32c(v[2], win, wlen);
+		}
+		csum_store(fd, &ck, v[2]);
+	}
+
+	session = (uint32_t)getpid() << 16 ^ (uint32_t)(mc_now() * 1e6);
+	npk = (st.st_size + MC_PAYLOAD - 1) / MC_PAYLOAD;
+	nblocks = (npk + MC_BLOCK - 1) / MC_BLOCK;
+
+	mc_header(ann, 'A', 0, session, 0);
+	v[0] = htonl(st.st_size);
+	v[1] = htonl(st.st_mtime);
+	v[2] = htonl(v[2]);
+	memcpy(ann + MC_HDR, v, 12);
+	ann[MC_HDR + 12] = MC_BLOCK;
+	ann[MC_HDR + 13] = MC_REPAIR;
+	ann[MC_HDR + 14] = MC_PAYLOAD >> 8;
+	ann[MC_HDR + 15] = MC_PAYLOAD & 0xff;
+	memcpy(ann + MC_HDR + 16, filename, namelen);
+	annlen = MC_HDR + 16 + namelen;
+
+	printf("(%s) --- multicast of file '%s': %u bytes, %u blocks\n", prog_name, filename, (uint32_t)st.st_size, nblocks);
+
+	/* Receivers that are starting have time to join the group. */
+	for (i = 0; i < lead; i += 100)
+	{
+		sendto(s, ann, annlen, 0, (const struct sockaddr *)group, sizeof(*group));
+		mc_sleep(0.1);
+	}
+
+	t0 = mc_now();
+	memset(msg, 0, sizeof(msg));
+	for (b0 = 0; b0 < nblocks; b0 += MC_WINDOW)
+	{
+		nb = nblocks - b0 < MC_WINDOW ? nblocks - b0 : MC_WINDOW;
+
+		/* The data of the window, from base. */
+		base = (uint64_t)b0 * MC_BLOCK * MC_PAYLOAD;
+		wlen = st.st_size - base < MC_WINBYTES ? st.st_size - base : MC_WINBYTES;
+		if (mc_pread(fd, win, wlen, base) < 0)
+		{
+			err_msg("(%s) error - '%s' was truncated during the multicast", prog_name, filename);
+			goto end;
+		}
+
+		/* Repair packets of the window: a short last packet counts as padded with zeros. */
+		memset(rep, 0, (size_t)nb * MC_REPAIR * MC_PAYLOAD);
+		for (b = 0; b < (uint32_t)nb; b++)
+			for (i = 0; i < MC_BLOCK && (b0 + b) * MC_BLOCK + i < npk; i++)
+			{
+				uint64_t off = ((uint64_t)(b0 + b) * MC_BLOCK + i) * MC_PAYLOAD;
+				size_t len = st.st_size - off < MC_PAYLOAD ? st.st_size - off : MC_PAYLOAD;
+
+				for (j = 0; j < MC_REPAIR; j++)
+					mc_madd_fn(rep + (b * MC_REPAIR + j) * MC_PAYLOAD, win + (off - base), mc_cauchy[j][i], len);
+			}
+
+		/* Late receivers learn the file from here on. */
+		mc_pace(pace, annlen);
+		sendto(s, ann, annlen, 0, (const struct sockaddr *)group, sizeof(*group));
+
+		/* Index by index over the blocks of the window. */
+		for (idx = 0; idx < MC_BLOCK + MC_REPAIR; idx++)
+		{
+			size_t bytes = 0;
+
+			for (b = 0, n = 0; b < (uint32_t)nb; b++)
+			{
+				kb = npk - (b0 + b) * MC_BLOCK < MC_BLOCK ? npk - (b0 + b) * MC_BLOCK : MC_BLOCK;
+				if (idx >= kb && idx < MC_BLOCK)
+					continue;
+
+				mc_header(hdr[n], 'D', idx, session, b0 + b);
+				iov[n][0].iov_base = hdr[n];
+				iov[n][0].iov_len = MC_HDR;
+				if (idx < MC_BLOCK)
+				{
+					uint64_t off = ((uint64_t)(b0 + b) * MC_BLOCK + idx) * MC_PAYLOAD;
+
+					iov[n][1].iov_base = win + (off - base);
+					iov[n][1].iov_len = st.st_size - off < MC_PAYLOAD ? st.st_size - off : MC_PAYLOAD;
+					ndata++;
+				}
+				else
+				{
+					iov[n][1].iov_base = rep + (b * MC_REPAIR + idx - MC_BLOCK) * MC_PAYLOAD;
+					iov[n][1].iov_len = MC_PAYLOAD;
+					nrep++;
+				}
+				msg[n].msg_hdr.msg_name = (void *)group;
+				msg[n].msg_hdr.msg_namelen = sizeof(*group);
+				msg[n].msg_hdr.msg_iov = iov[n];
+				msg[n].msg_hdr.msg_iovlen = 2;
+				bytes += MC_HDR + iov[n][1].iov_len;
+				n++;
+			}
+			if (n == 0)
+				continue;
+			mc_pace(pace, bytes);
+			if (mc_sendmmsg(s, msg, n) < 0)
+			{
+				err_ret("(%s) error - sendmmsg() failed for '%s'", prog_name, filename);
+				goto out;
+			}
+		}
+	}
+
+	printf("(%s) --- multicast of file '%s' done: %u data and %u repair packets in %.2f s\n", prog_name, filename, ndata, nrep, mc_now() - t0);
+	rc = 0;
+
+	/* End, a few times, with the announcement for whoever missed it (receivers
+	   also stop after MC_IDLE without datagrams). After a truncation too: the
+	   receivers fetch what they lack and find the file changed. */
+end:
+	ann[2] = 'E';
+	for (i = 0; i < 3; i++)
+	{
+		sendto(s, ann, annlen, 0, (const struct sockaddr *)group, sizeof(*group));
+		mc_sleep(0.02);
+	}
+
+out:
+	free(rep);
+	free(win);
+	close(fd);
+	return rc;
+}
+
+/* Server: a process that sends the files on the group of spec
+   ("group:port[:iface[:rate[:burst]]]", already checked) and exits; it does
+   not keep the listening socket. */
+void mc_start(const char *spec, char *files[], int nfiles, int listenfd)
+{
+	struct sockaddr_in group;
+	struct in_addr iface;
+	struct mc_pace pace;
+	const char *opt;
+	double burst;
+	int s, i, bufsize = MC_BUFSIZE;
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+	{
+		err_ret("(%s) error - fork() of the multicast sender failed", prog_name);
+		return;
+	}
+	if (pid > 0)
+		return;
+	close(listenfd);
+
+	if (mc_parse(spec, &group, &iface, &opt) < 0)
+		exit(1);
+	pace.next = 0;
+	if (opt == NULL || rl_parse(opt, &pace.rate, &burst) < 0 || pace.rate <= 0)
+		pace.rate = MC_RATE;
+
+	s = Socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(s, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+	if (iface.s_addr != htonl(INADDR_ANY) && setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) != 0)
+		err_sys("(%s) error - cannot send multicast from %s", prog_name, inet_ntoa(iface));
+
+	printf("(%s) --- multicast sender on %s:%d, %.0f bytes/s, %d+%d packets per block (GF(256): %s)\n", prog_name, inet_ntoa(group.sin_addr),
+	       ntohs(group.sin_port), pace.rate, MC_BLOCK, MC_REPAIR, mc_impl());
+
+	for (i = 0; i < nfiles; i++)
+		mc_send_file(s, &group, files[i], &pace, i == 0 ? MC_LEAD : 0);
+
+	close(s);
+	exit(0);
+}
+
+/* RGET: args is what follows the command ("offset length filename\r\n").
+   Returns 0, -1 if the connection must be closed ("-ERR" already sent if the
+   request was refused). */
+int mc_range_serve(int connfd, struct rl_conn *rl, char *args, const char *peer)
+{
+	unsigned long long off, len;
+	struct stat st;
+	char *filename = NULL, head[9];
+	uint32_t v;
+	size_t n;
+	int fd = -1, pos = 0;
+
+	if (args == NULL || sscanf(args, " %llu %llu %n", &off, &len, &pos) < 2 || pos == 0 || (filename = strtok(args + pos, "\r\n")) == NULL)
+	{
+		err_msg("(%s) error - illegal RGET command from client [%s]", prog_name, peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	if ((fd = pi_open(filename, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX ||
+	    off > (unsigned long long)st.st_size)
+	{
+		err_msg("(%s) error - '%s' has no range %llu+%llu for client [%s]", prog_name, filename, off, len, peer);
+		if (fd >= 0)
+			close(fd);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+	if (len > st.st_size - off)
+		len = st.st_size - off;
+
+	memcpy(head, "+OK\r\n", 5);
+	v = htonl(len);
+	memcpy(head + 5, &v, 4);
+	if (sendn(connfd, head, 9, MSG_NOSIGNAL | MSG_MORE) != 9)
+		goto fail;
+	for (; len > 0; off += n, len -= n)
+	{
+		n = len < MC_CHUNK ? len : MC_CHUNK;
+		rl_acquire(rl, n);
+		if (sendfilen(connfd, fd, off, n) != (ssize_t)n)
+			goto fail;
+	}
+	v = htonl(st.st_mtime);
+	if (sendn(connfd, &v, 4, MSG_NOSIGNAL) != 4)
+		goto fail;
+
+	printf("(%s) --- sent range of file '%s' to client [%s]\n", prog_name, filename, peer);
+	close(fd);
+	return 0;
+
+fail:
+	err_ret("(%s) error - sending a range of '%s' failed with client [%s]", prog_name, filename, peer);
+	close(fd);
+	return -1;
+}
+
+/* Receiver state of a wanted file. */
+struct mc_rx
+{
+	struct mc_file *f;
+	int started, ended;
+	uint32_t session, size, mtime, crc, psize, npk, nblocks;
+	int k, r;
+	double last;	    /* last datagram of the session */
+	int fd;		    /* temporary file, "<local>.mcast" */
+	char tmp[PATH_MAX];
+	uint8_t *map;	    /* npk * psize bytes: the last packet padded with zeros */
+	uint8_t *have;	    /* per packet */
+	uint8_t *ndata;	    /* data packets per block */
+	uint8_t *repmask;   /* repair packets kept per block */
+	uint8_t **rep;	    /* r * psize bytes per block, only while it can still be decoded */
+};
+
+static uint32_t mc_kb(const struct mc_rx *x, uint32_t b)
+{
+	return x->npk - b * x->k < (uint32_t)x->k ? x->npk - b * x->k : (uint32_t)x->k;
+}
+
+static size_t mc_plen(const struct mc_rx *x, uint32_t p)
+{
+	return x->size - (uint64_t)p * x->psize < x->psize ? x->size - (uint64_t)p * x->psize : x->psize;
+}
+
+static void mc_rx_free(struct mc_rx *x)
+{
+	uint32_t b;
+
+	if (x->rep != NULL)
+		for (b = 0; b < x->nblocks; b++)
+			free(x->rep[b]);
+	free(x->rep);
+	free(x->repmask);
+	free(x->ndata);
+	free(x->have);
+	if (x->map != NULL)
+		munmap(x->map, (size_t)x->npk * x->psize);
+	x->rep = NULL;
+	x->repmask = x->ndata = x->have = x->map = NULL;
+}
+
+/* Announcement of a wanted file: temporary file and tables. */
+static int mc_rx_start(struct mc_rx *x, uint32_t session, const uint8_t *p)
+{
+	uint32_t v[3];
+	size_t maplen;
+
+	memcpy(v, p, 12);
+	x->size = ntohl(v[0]);
+	x->mtime = ntohl(v[1]);
+	x->crc = ntohl(v[2]);
+	x->k = p[12];
+	x->r = p[13];
+	x->psize = p[14] << 8 | p[15];
+	if (x->k < 1 || x->k > MC_BLOCK || x->r > MC_REPAIR || x->psize < 1 || x->psize > MC_MAXPAYLOAD)
+		return -1;
+	x->npk = ((uint64_t)x->size + x->psize - 1) / x->psize;
+	x->nblocks = (x->npk + x->k - 1) / x->k;
+	maplen = (size_t)x->npk * x->psize;
+
+	if (ftruncate(x->fd, maplen) != 0 ||
+	    (maplen > 0 && (x->map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, x->fd, 0)) == MAP_FAILED) ||
+	    (x->have = calloc(x->npk + 1, 1)) == NULL || (x->ndata = calloc(x->nblocks + 1, 1)) == NULL ||
+	    (x->repmask = calloc(x->nblocks + 1, 1)) == NULL || (x->rep = calloc(x->nblocks + 1, sizeof(*x->rep))) == NULL)
+	{
+		if (x->map == MAP_FAILED)
+			x->map = NULL;
+		x->f->status = MC_ELOCAL;
+		return -1;
+	}
+	x->session = session;
+	x->started = 1;
+	return 0;
+}
+
+/* Missing data packets of block b from its repair packets: the repairs minus
+   the known data leave m equations in the m missing packets, solved with the
+   inverse of the m x m Cauchy submatrix (always invertible). */
+static void mc_decode(struct mc_rx *x, uint32_t b)
+{
+	uint8_t a[MC_REPAIR][2 * MC_REPAIR], *s[MC_REPAIR], t;
+	uint32_t kb = mc_kb(x, b), first = b * x->k, i;
+	int miss[MC_REPAIR], rows[MC_REPAIR], m = 0, nr = 0, j, u, c;
+
+	for (i = 0; i < kb; i++)
+		if (!x->have[first + i])
+			miss[m++] = i;
+	for (j = 0; j < x->r && nr < m; j++)
+		if (x->repmask[b] & 1 << j)
+			rows[nr++] = j;
+
+	for (u = 0; u < m; u++)
+	{
+		s[u] = x->rep[b] + (size_t)rows[u] * x->psize;
+		for (i = 0; i < kb; i++)
+			if (x->have[first + i])
+				mc_madd_fn(s[u], x->map + (uint64_t)(first + i) * x->psize, mc_cauchy[rows[u]][i], mc_plen(x, first + i));
+
+		/* [A | I] */
+		for (c = 0; c < m; c++)
+		{
+			a[u][c] = mc_cauchy[rows[u]][miss[c]];
+			a[u][m + c] = u == c;
+		}
+	}
+
+	/* Gauss-Jordan: [I | A^-1]. */
+	for (c = 0; c < m; c++)
+	{
+		for (u = c; a[u][c] == 0; u++)
+			;
+		for (j = 0; j < 2 * m; j++)
+		{
+			t = a[u][j];
+			a[u][j] = a[c][j];
+			a[c][j] = t;
+		}
+		t = gf_inv(a[c][c]);
+		for (j = 0; j < 2 * m; j++)
+			a[c][j] = gf_mul(a[c][j], t);
+		for (u = 0; u < m; u++)
+			if (u != c && (t = a[u][c]) != 0)
+				for (j = 0; j < 2 * m; j++)
+					a[u][j] ^= gf_mul(t, a[c][j]);
+	}
+
+	for (c = 0; c < m; c++)
+	{
+		uint8_t *dst = x->map + (uint64_t)(first + miss[c]) * x->psize;
+
+		memset(dst, 0, x->psize);
+		for (u = 0; u < m; u++)
+			mc_madd_fn(dst, s[u], a[c][m + u], x->psize);
+		x->have[first + miss[c]] = 1;
+		x->f->rebuilt += mc_plen(x, first + miss[c]);
+	}
+	x->ndata[b] = kb;
+}
+
+/* A datagram of a started session. */
+static void mc_rx_packet(struct mc_rx *x, int index, uint32_t b, const uint8_t *p, size_t len)
+{
+	uint32_t kb, pk;
+	int nrep;
+
+	if (b >= x->nblocks)
+		return;
+	kb = mc_kb(x, b);
+	if ((uint32_t)index < kb)
+	{
+		pk = b * x->k + index;
+		if (x->have[pk] || len != mc_plen(x, pk))
+			return;
+		memcpy(x->map + (uint64_t)pk * x->psize, p, len);
+		x->have[pk] = 1;
+		x->ndata[b]++;
+		x->f->received += len;
+	}
+	else if (index >= x->k && index < x->k + x->r && x->ndata[b] < kb && len == x->psize)
+	{
+		if (x->rep[b] == NULL && (x->rep[b] = malloc((size_t)x->r * x->psize)) == NULL)
+			return;
+		memcpy(x->rep[b] + (size_t)(index - x->k) * x->psize, p, len);
+		x->repmask[b] |= 1 << (index - x->k);
+	}
+	else
+		return;
+
+	/* Enough packets: the block is rebuilt now and its repairs freed. */
+	nrep = __builtin_popcount(x->repmask[b]);
+	if (x->ndata[b] < kb && x->ndata[b] + (uint32_t)nrep >= kb)
+		mc_decode(x, b);
+	if (x->ndata[b] == kb && x->rep[b] != NULL)
+	{
+		free(x->rep[b]);
+		x->rep[b] = NULL;
+	}
+}
+
+/* Reply to an RGET: into map (exactly want bytes, MC_ECHANGED for another
+   length, the rest of the reply left unread) or, without a map, to out. */
+static int mc_rget_reply(int sockfd, uint8_t *map, uint32_t want, int out, uint32_t *got, uint32_t *ts)
+{
+	char buf[65536];
+	uint32_t v, n, done;
+
+	if (readn(sockfd, buf, 5) != 5)
+		return MC_EIO;
+	if (memcmp(buf, "+OK\r\n", 5) != 0)
+		return memcmp(buf, "-ERR\r", 5) == 0 ? MC_EREFUSED : MC_EIO;
+	if (readn(sockfd, &v, 4) != 4)
+		return MC_EIO;
+	*got = ntohl(v);
+	if (map != NULL && *got != want)
+		return MC_ECHANGED;
+
+	if (map != NULL)
+	{
+		if (readn(sockfd, map, *got) != *got)
+			return MC_EIO;
+	}
+	else
+		for (done = 0; done < *got; done += n)
+		{
+			n = *got - done < sizeof(buf) ? *got - done : sizeof(buf);
+			if (readn(sockfd, buf, n) != n)
+				return MC_EIO;
+			if (writen(out, buf, n) != n)
+				return MC_ELOCAL;
+		}
+
+	if (readn(sockfd, &v, 4) != 4)
+		return MC_EIO;
+	*ts = ntohl(v);
+	return MC_OK;
+}
+
+/* The missing packets of x with RGET, runs of consecutive packets as one
+   range, at most MC_PIPELINE requests ahead of the replies. */
+static int mc_repair(struct mc_rx *x, int sockfd)
+{
+	char line[PATH_MAX + 64];
+	uint32_t *start = NULL, *count = NULL, nr = 0, p, sent, done, got, ts;
+	uint64_t off, len;
+	int rc = MC_OK, l;
+
+	if ((start = malloc((x->npk / 2 + 1) * sizeof(*start))) == NULL || (count = malloc((x->npk / 2 + 1) * sizeof(*count))) == NULL)
+	{
+		free(start);
+		return MC_ELOCAL;
+	}
+	for (p = 0; p < x->npk; p++)
+		if (!x->have[p])
+		{
+			if (nr > 0 && start[nr - 1] + count[nr - 1] == p)
+				count[nr - 1]++;
+			else
+			{
+				start[nr] = p;
+				count[nr++] = 1;
+			}
+		}
+
+	for (sent = done = 0; done < nr && rc == MC_OK;)
+	{
+		for (; sent < nr && sent - done < MC_PIPELINE; sent++)
+		{
+			off = (uint64_t)start[sent] * x->psize;
+			len = (uint64_t)count[sent] * x->psize < x->size - off ? (uint64_t)count[sent] * x->psize : x->size - off;
+			if ((l = snprintf(line, sizeof(line), "%s %llu %llu %s\r\n", MSG_RGET, (unsigned long long)off, (unsigned long long)len, x->f->name)) >= (int)sizeof(line) ||
+			    writen(sockfd, line, l) != l)
+			{
+				rc = l >= (int)sizeof(line) ? MC_ELOCAL : MC_EIO;
+				break;
+			}
+		}
+		if (rc != MC_OK)
+			break;
+
+		off = (uint64_t)start[done] * x->psize;
+		len = (uint64_t)count[done] * x->psize < x->size - off ? (uint64_t)count[done] * x->psize : x->size - off;
+		if ((rc = mc_rget_reply(sockfd, x->map + off, len, -1, &got, &ts)) == MC_OK)
+		{
+			for (p = 0; p < count[done]; p++)
+				x->have[start[done] + p] = 1;
+			x->f->repaired += got;
+		}
+		done++;
+	}
+
+	free(start);
+	free(count);
+	return rc;
+}
+
+/* The whole file over TCP, in place of the temporary contents. */
+static int mc_fetch_whole(struct mc_rx *x, int sockfd)
+{
+	char line[PATH_MAX + 64];
+	uint32_t got, ts;
+	int rc, l;
+
+	if (x->map != NULL)
+		munmap(x->map, (size_t)x->npk * x->psize);
+	x->map = NULL;
+	if (ftruncate(x->fd, 0) != 0 || lseek(x->fd, 0, SEEK_SET) != 0)
+		return MC_ELOCAL;
+
+	if ((l = snprintf(line, sizeof(line), "%s 0 %u %s\r\n", MSG_RGET, UINT32_MAX, x->f->name)) >= (int)sizeof(line))
+		return MC_ELOCAL;
+	if (writen(sockfd, line, l) != l)
+		return MC_EIO;
+	if ((rc = mc_rget_reply(sockfd, NULL, 0, x->fd, &got, &ts)) != MC_OK)
+		return rc;
+
+	x->size = got;
+	x->mtime = ts;
+	x->f->repaired += got;
+	return MC_OK;
+}
+
+/* TCP connection to the server, opened at the first range needed. */
+static int mc_conn(int *sockfd, const char *host, const char *port)
+{
+	if (*sockfd < 0)
+		*sockfd = tcp_connect_try(host, port);
+	return *sockfd;
+}
+
+/* Gaps, check and name of a file at the end of its transfer. */
+static void mc_finish(struct mc_rx *x, int *sockfd, const char *host, const char *port)
+{
+	struct mc_file *f = x->f;
+	struct timespec times[2];
+	uint32_t p;
+	int whole = !x->started, rc = MC_OK;
+
+	if (f->status != MC_OK)
+		return;
+
+	for (p = 0; p < x->npk && !whole; p++)
+		if (!x->have[p])
+			break;
+	if (whole || p < x->npk)
+	{
+		if (mc_conn(sockfd, host, port) < 0)
+			rc = MC_EIO;
+		else if (!whole)
+			rc = mc_repair(x, *sockfd);
+	}
+
+	/* A range of another length, or refused: the file changed on the server
+	   since the announcement. Replies still in flight are dropped with the
+	   connection, and the file is fetched whole on a new one. */
+	if (!whole && (rc == MC_ECHANGED || rc == MC_EREFUSED))
+	{
+		err_msg("(%s) error - '%s' changed on the server, fetching it whole", prog_name, f->name);
+		close(*sockfd);
+		*sockfd = -1;
+		whole = 1;
+		rc = mc_conn(sockfd, host, port) < 0 ? MC_EIO : MC_OK;
+	}
+
+	/* Never announced, or changed on the server since the announcement: whole. */
+	if (rc == MC_OK && !whole && x->size > 0 && crc32c(0, x->map, x->size) != x->crc)
+	{
+		err_msg("(%s) error - '%s': rebuilt file does not match, fetching it whole", prog_name, f->name);
+		whole = 1;
+		rc = mc_conn(sockfd, host, port) < 0 ? MC_EIO : MC_OK;
+	}
+	if (rc == MC_OK && whole)
+		rc = mc_fetch_whole(x, *sockfd);
+
+	if (rc == MC_OK)
+	{
+		if (x->map != NULL)
+			munmap(x->map, (size_t)x->npk * x->psize);
+		x->map = NULL;
+		times[0].tv_sec = times[1].tv_sec = x->mtime;
+		times[0].tv_nsec = times[1].tv_nsec = 0;
+		if (ftruncate(x->fd, x->size) != 0 || futimens(x->fd, times) != 0 || rename(x->tmp, f->local) != 0)
+			rc = MC_ELOCAL;
+	}
+
+	/* -ERR closes the connection on the server side. */
+	if (rc != MC_OK && *sockfd >= 0)
+	{
+		close(*sockfd);
+		*sockfd = -1;
+	}
+	f->status = rc;
+	f->size = x->size;
+	f->timestamp = x->mtime;
+}
+
+/* Receiver: joins the group of spec ("group:port[:iface[:loss]]", loss = %
+   of datagrams dropped on purpose, for tests) and rebuilds the files, fetching
+   what is missing from host:port. Each file gets its status; -1 if the group
+   cannot be joined. */
+int mc_get(const char *spec, const char *host, const char *port, struct mc_file *f, int nfiles)
+{
+	struct sockaddr_in group;
+	struct ip_mreq mreq;
+	struct mmsghdr msg[MC_BATCH];
+	struct iovec iov[MC_BATCH];
+	struct mc_rx *rx;
+	struct pollfd pfd;
+	const char *opt;
+	uint8_t *buf;
+	uint32_t session, block;
+	unsigned int seed = getpid() ^ time(NULL);
+	double loss = 0, t0, now;
+	int s, i, j, n, on = 1, bufsize = MC_BUFSIZE, pending, sockfd = -1;
+
+	if (mc_parse(spec, &group, &mreq.imr_interface, &opt) < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (opt != NULL)
+		loss = atof(opt) / 100;
+	mreq.imr_multiaddr = group.sin_addr;
+	pthread_once(&mc_once, mc_setup);
+
+	if ((rx = calloc(nfiles, sizeof(*rx))) == NULL || (buf = malloc(MC_BATCH * (MC_HDR + MC_MAXPAYLOAD))) == NULL)
+	{
+		free(rx);
+		return -1;
+	}
+
+	/* Several receivers on the same host share the port. */
+	s = Socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize)) != 0)
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	Bind(s, (struct sockaddr *)&group, sizeof(group));
+	if (setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+	{
+		close(s);
+		free(rx);
+		free(buf);
+		return -1;
+	}
+
+	for (i = 0; i < nfiles; i++)
+	{
+		rx[i].f = &f[i];
+		rx[i].fd = -1;
+		f[i].status = MC_OK;
+		f[i].size = f[i].timestamp = 0;
+		f[i].received = f[i].rebuilt = f[i].repaired = 0;
+		if (snprintf(rx[i].tmp, sizeof(rx[i].tmp), "%s.mcast", f[i].local) >= (int)sizeof(rx[i].tmp) ||
+		    (rx[i].fd = open(rx[i].tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+		{
+			f[i].status = MC_ELOCAL;
+			rx[i].ended = 1;
+		}
+	}
+
+	for (i = 0; i < MC_BATCH; i++)
+	{
+		iov[i].iov_base = buf + (size_t)i * (MC_HDR + MC_MAXPAYLOAD);
+		iov[i].iov_len = MC_HDR + MC_MAXPAYLOAD;
+		memset(&msg[i], 0, sizeof(msg[i]));
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	t0 = mc_now();
+	for (;;)
+	{
+		/* Done: every file ended, went quiet, or was never announced. */
+		now = mc_now();
+		for (i = 0, pending = 0; i < nfiles; i++)
+		{
+			if (!rx[i].ended && rx[i].started && now - rx[i].last > MC_IDLE / 1000.0)
+				rx[i].ended = 1;
+			if (!rx[i].ended && !rx[i].started && now - t0 > MC_WAIT / 1000.0)
+				rx[i].ended = 1;
+			pending += !rx[i].ended;
+		}
+		if (pending == 0)
+			break;
+
+		if (poll(&pfd, 1, 100) <= 0 || (n = recvmmsg(s, msg, MC_BATCH, MSG_DONTWAIT, NULL)) <= 0)
+			continue;
+		now = mc_now();
+
+		for (j = 0; j < n; j++)
+		{
+			uint8_t *h = iov[j].iov_base;
+			size_t len = msg[j].msg_len;
+
+			if (len < MC_HDR || h[0] != 'M' || h[1] != 'C' || (loss > 0 && rand_r(&seed) < loss * RAND_MAX))
+				continue;
+			memcpy(&session, h + 4, 4);
+			memcpy(&block, h + 8, 4);
+			session = ntohl(session);
+			block = ntohl(block);
+
+			for (i = 0; i < nfiles; i++)
+				if (rx[i].started && rx[i].session == session)
+					break;
+
+			if (i == nfiles && (h[2] == 'A' || h[2] == 'E') && len > MC_HDR + 16)
+			{
+				/* Announcement of a file we want and have not seen yet (at the end
+				   too: then all of it comes with RGET). */
+				for (i = 0; i < nfiles; i++)
+					if (!rx[i].started && !rx[i].ended && strlen(f[i].name) == len - MC_HDR - 16 &&
+					    memcmp(f[i].name, h + MC_HDR + 16, len - MC_HDR - 16) == 0)
+						break;
+				if (i < nfiles && mc_rx_start(&rx[i], session, h + MC_HDR) < 0)
+				{
+					if (f[i].status == MC_OK)
+						f[i].status = MC_EIO;
+					rx[i].ended = 1;
+					continue;
+				}
+			}
+			if (i == nfiles || rx[i].ended)
+				continue;
+
+			rx[i].last = now;
+			if (h[2] == 'D')
+				mc_rx_packet(&rx[i], h[3], block, h + MC_HDR, len - MC_HDR);
+			else if (h[2] == 'E')
+				rx[i].ended = 1;
+		}
+	}
+	close(s);
+	free(buf);
+
+	/* Whatever FEC could not rebuild, over TCP. */
+	for (i = 0; i < nfiles; i++)
+	{
+		if (rx[i].fd >= 0)
+			mc_finish(&rx[i], &sockfd, host, port);
+		mc_rx_free(&rx[i]);
+		if (rx[i].fd >= 0)
+		{
+			close(rx[i].fd);
+			if (f[i].status != MC_OK)
+				unlink(rx[i].tmp);
+		}
+	}
+	if (sockfd >= 0)
+		close(sockfd);
+	free(rx);
+	return 0;
+}
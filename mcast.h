@@ -0,0 +1,78 @@
+/*
+
+module: mcast.h
+
+purpose: definitions of the multicast distribution and of the RGET range
+         command (mcast.c)
+
+         datagram: "MC" | type | index | S1..S4 (session) | N1..N4 (block) | payload
+
+             'A'  announce, every window:
+                  Z1..Z4 (size) | T1..T4 (timestamp) | C1..C4 (CRC32C) |
+                  K (data packets per block) | R (repair packets per block) |
+                  P1..P2 (payload bytes per packet) | filename
+             'D'  packet index of block N: data (index < K, the last packet
+                  of the file is padded with zeros) or Reed-Solomon repair
+                  (index K + j, j < R) over GF(256) of the data of the block
+             'E'  end of the transfer, with the payload of 'A'
+
+         A block is decoded from any K of its K + R packets. What cannot be
+         rebuilt comes from the TCP port of the server:
+
+         request:  "RGET offset length filename\r\n"
+         response: "+OK\r\n" | B1..B4 (bytes sent) | contents | T1..T4 (timestamp)
+
+         with offset and length in decimal; the range is cut at the end of
+         the file and "-ERR\r\n" (then the connection is closed) answers a
+         file that cannot be read or an offset past its end. Integers are
+         unsigned 32 bit in network byte order. Multicast is IPv4 only.
+
+*/
+
+#ifndef _MCAST_H
+
+#define _MCAST_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define MSG_RGET "RGET"
+#define MC_PAYLOAD 1200	    /* Bytes of a file per datagram (fits the usual MTUs, tunnels included). */
+#define MC_BLOCK 32	    /* Data packets per block. */
+#define MC_REPAIR 4	    /* Repair packets per block: up to 4 losses out of 36 are recovered. */
+#define MC_WINDOW 16	    /* Blocks sent interleaved: a burst of 64 losses costs each block 4. */
+#define MC_RATE 10e6	    /* Default sending rate (bytes/s). */
+#define MC_LEAD 1000	    /* Announcements before the first file (ms), while receivers join. */
+#define MC_IDLE 2000	    /* A transfer without datagrams for this long is over (ms). */
+#define MC_PIPELINE 32	    /* RGET requests in flight. */
+#define MC_CHUNK (1 << 20)  /* Bytes per sendfile() of RGET (rate limiter granularity). */
+
+/* Outcome of a file in mc_get(). */
+#define MC_OK 0
+#define MC_EREFUSED -1 /* -ERR from the server for a missing range */
+#define MC_EIO -2      /* server unreachable, connection lost or invalid response */
+#define MC_ECSUM -3    /* the file does not match the announced CRC32C, even fetched whole */
+#define MC_ELOCAL -4   /* local file error */
+
+/* A file wanted by a receiver. */
+struct mc_file
+{
+	const char *name, *local;
+	int status;
+	uint32_t size, timestamp;
+	uint64_t received, rebuilt, repaired; /* bytes from the data packets, from FEC, from RGET */
+};
+
+struct rl_conn;
+
+int mc_parse(const char *str, struct sockaddr_in *group, struct in_addr *iface, const char **opt);
+
+void mc_start(const char *spec, char *files[], int nfiles, int listenfd);
+
+int mc_range_serve(int connfd, struct rl_conn *rl, char *args, const char *peer);
+
+int mc_get(const char *spec, const char *host, const char *port, struct mc_file *f, int nfiles);
+
+const char *mc_impl(void);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+
+module: mget.c
+
+purpose: MGET batch command, server side
+         the names of the batch are read in large blocks, then a few threads
+         open, stat and prefetch (POSIX_FADV_WILLNEED) the files up to
+         MGET_WINDOW entries ahead of the one being sent, so the disk works on
+         the next files while the current one goes out on the socket.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "ratelimit.h"
+#include "bufpool.h"
+#include "pathidx.h"
+#include "mget.h"
+
+#define MGET_TIMEOUT 15 /* Timeout while reading the names of the batch (sec). */
+
+extern char *prog_name;
+
+struct mget_entry
+{
+	char *name;
+	int fd; /* -1 = not available */
+	struct stat st;
+	int ready; /* opened (or failed) by a worker */
+};
+
+struct mget_batch
+{
+	struct mget_entry *e;
+	int n;
+	int next;  /* next entry to open */
+	int sent;  /* entries already sent: the window starts here */
+	int abort; /* the connection failed, the workers must stop */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+void mget_pack(unsigned char *rec, char status, uint64_t size, uint64_t mtime)
+{
+	size = htobe64(size);
+	mtime = htobe64(mtime);
+	rec[0] = status;
+	memcpy(rec + 1, &size, 8);
+	memcpy(rec + 9, &mtime, 8);
+}
+
+void mget_unpack(const unsigned char *rec, char *status, uint64_t *size, uint64_t *mtime)
+{
+	*status = rec[0];
+	memcpy(size, rec + 1, 8);
+	memcpy(mtime, rec + 9, 8);
+	*size = be64toh(*size);
+	*mtime = be64toh(*mtime);
+}
+
+/* Reads n names, one per CRLF-terminated line. Data is peeked and only the
+   bytes up to the last name are consumed, so a command pipelined after the
+   batch is left in the socket for manageRequest(). */
+static int mget_names(int connfd, struct mget_entry *e, int n)
+{
+	char buf[MGET_BUFL];
+	size_t have = 0, end, used, start, len;
+	ssize_t r;
+	char *nl;
+	int got = 0;
+	fd_set rset;
+	struct timeval tval;
+
+	while (got < n)
+	{
+		FD_ZERO(&rset);
+		FD_SET(connfd, &rset);
+		tval.tv_sec = MGET_TIMEOUT;
+		tval.tv_usec = 0;
+		if (Select(connfd + 1, &rset, NULL, NULL, &tval) == 0)
+			return -1;
+
+		if ((r = recv(connfd, buf + have, sizeof(buf) - have, MSG_PEEK)) <= 0)
+			return -1;
+		end = have + r;
+
+		used = 0;
+		while (got < n && (nl = memchr(buf + used, '\n', end - used)) != NULL)
+		{
+			start = used;
+			len = nl - (buf + start);
+			if (len > 0 && buf[start + len - 1] == '\r')
+				len--;
+			if (len == 0)
+				return -1;
+			if ((e[got].name = strndup(buf + start, len)) == NULL)
+				return -1;
+			got++;
+			used = nl - buf + 1;
+		}
+
+		/* Consume what belongs to the batch: everything, unless the last name was found. */
+		if (got == n)
+			end = used;
+		if (readn(connfd, buf + have, end - have) != (ssize_t)(end - have))
+			return -1;
+
+		/* Keep the partial line for the next round. */
+		have = end - used;
+		memmove(buf, buf + used, have);
+		if (have == sizeof(buf))
+			return -1; /* line too long */
+	}
+	return 0;
+}
+
+static void *mget_worker(void *arg)
+{
+	struct mget_batch *b = arg;
+	struct mget_entry *e;
+	int i;
+
+	pthread_mutex_lock(&b->lock);
+	for (;;)
+	{
+		while (!b->abort && b->next < b->n && b->next >= b->sent + MGET_WINDOW)
+			pthread_cond_wait(&b->cond, &b->lock);
+		if (b->abort || b->next >= b->n)
+			break;
+		i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+
+		e = &b->e[i];
+		if ((e->fd = pi_open(e->name, O_RDONLY)) >= 0)
+		{
+			if (fstat(e->fd, &e->st) != 0 || !S_ISREG(e->st.st_mode))
+			{
+				close(e->fd);
+				e->fd = -1;
+			}
+			else
+				posix_fadvise(e->fd, 0, MGET_PREFETCH, POSIX_FADV_WILLNEED);
+		}
+
+		pthread_mutex_lock(&b->lock);
+		e->ready = 1;
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+/* Sends the record of entry e. Returns the bytes of contents sent, -1 on error. */
+static long long mget_send(int connfd, struct mget_entry *e, struct rl_conn *rl, char *buffer, size_t chunk)
+{
+	unsigned char rec[MGET_RECLEN];
+	uint64_t remaining;
+	ssize_t n;
+
+	if (e->fd < 0)
+	{
+		mget_pack(rec, '-', 0, 0);
+		return sendn(connfd, rec, MGET_RECLEN, MSG_NOSIGNAL) == MGET_RECLEN ? 0 : -1;
+	}
+
+	remaining = e->st.st_size;
+	mget_pack(rec, '+', remaining, e->st.st_mtime);
+	if (sendn(connfd, rec, MGET_RECLEN, MSG_NOSIGNAL | MSG_MORE) != MGET_RECLEN)
+		return -1;
+
+	while (remaining > 0)
+	{
+		/* A file truncated meanwhile breaks the framing: the connection is closed. */
+		if ((n = read(e->fd, buffer, remaining < chunk ? remaining : chunk)) <= 0)
+			return -1;
+		rl_acquire(rl, n);
+		if (sendn(connfd, buffer, n, MSG_NOSIGNAL) != n)
+			return -1;
+		remaining -= n;
+	}
+	return e->st.st_size;
+}
+
+/* Serves "MGET n\r\n" + names; "MGET" has already been read. Returns 0 if the
+   connection can go on with the next command, -1 if it must be closed. */
+int mget_serve(int connfd, struct rl_conn *rl, const char *peer)
+{
+	struct mget_batch b;
+	pthread_t tid[MGET_THREADS];
+	char line[32], *end, *buffer;
+	long long sent, total = 0;
+	size_t chunk = bp_chunk(connfd, 0);
+	int i, n, nthreads, ok = 0, rc = -1;
+
+	/* " n\r\n" */
+	if (readline_unbuffered(connfd, line, sizeof(line)) <= 0 || line[0] != ' ' ||
+		(n = strtol(line + 1, &end, 10)) <= 0 || n > MGET_MAX || strcmp(end, "\r\n") != 0)
+	{
+		err_msg("(%s) error - illegal MGET command from client [%s]", prog_name, peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	if ((b.e = calloc(n, sizeof(struct mget_entry))) == NULL || (buffer = bp_get(chunk)) == NULL)
+	{
+		err_ret("(%s) error - no memory for a MGET of %d files from client [%s]", prog_name, n, peer);
+		free(b.e);
+		return -1;
+	}
+	b.n = n;
+
+	if (mget_names(connfd, b.e, n) < 0)
+	{
+		err_msg("(%s) error - invalid MGET file list from client [%s]", prog_name, peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		goto out;
+	}
+
+	printf("(%s) --- client [%s] asked to send %d files with MGET\n", prog_name, peer, n);
+
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.cond, NULL);
+	nthreads = n < MGET_THREADS ? n : MGET_THREADS;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&tid[i], NULL, mget_worker, &b) != 0)
+			break;
+	nthreads = i;
+	if (nthreads == 0)
+	{
+		err_msg("(%s) error - pthread_create() failed for client [%s]", prog_name, peer);
+		goto destroy;
+	}
+
+	if (sendn(connfd, "+OK\r\n", 5, MSG_NOSIGNAL | MSG_MORE) != 5)
+		goto join;
+
+	for (i = 0; i < n; i++)
+	{
+		pthread_mutex_lock(&b.lock);
+		while (!b.e[i].ready)
+			pthread_cond_wait(&b.cond, &b.lock);
+		pthread_mutex_unlock(&b.lock);
+
+		sent = mget_send(connfd, &b.e[i], rl, buffer, chunk);
+		if (b.e[i].fd >= 0)
+		{
+			close(b.e[i].fd);
+			b.e[i].fd = -1;
+			ok++;
+		}
+
+		pthread_mutex_lock(&b.lock);
+		b.sent = i + 1;
+		pthread_cond_broadcast(&b.cond);
+		pthread_mutex_unlock(&b.lock);
+
+		if (sent < 0)
+		{
+			err_ret("(%s) error - sending '%s' of the MGET batch failed with client [%s]", prog_name, b.e[i].name, peer);
+			goto join;
+		}
+		total += sent;
+	}
+
+	printf("(%s) --- sent %d/%d files (%lld bytes) of the MGET batch to client [%s]\n", prog_name, ok, n, total, peer);
+	rc = 0;
+
+join:
+	pthread_mutex_lock(&b.lock);
+	b.abort = 1;
+	pthread_cond_broadcast(&b.cond);
+	pthread_mutex_unlock(&b.lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+
+destroy:
+	pthread_mutex_destroy(&b.lock);
+	pthread_cond_destroy(&b.cond);
+
+out:
+	for (i = 0; i < n; i++)
+	{
+		if (b.e[i].ready && b.e[i].fd >= 0)
+			close(b.e[i].fd);
+		free(b.e[i].name);
+	}
+	free(b.e);
+	bp_put(buffer, chunk);
+	return rc;
+}
@@ -0,0 +1,40 @@
+/*
+
+module: mget.h
+
+purpose: definitions of the MGET batch command (mget.c)
+
+         request:  "MGET n\r\n" followed by n lines "filename\r\n"
+         response: "+OK\r\n" followed, in request order, by one record per file
+
+             S (1) | B1..B8 (size) | T1..T8 (timestamp) | contents
+
+         S = '+' file sent, '-' file not available (size 0, no contents).
+         Integers are unsigned 64 bit in network byte order.
+
+*/
+
+#ifndef _MGET_H
+
+#define _MGET_H
+
+#include <stdint.h>
+
+#define MSG_MGET "MGET"
+#define MGET_MAX 100000		/* Files in a single MGET. */
+#define MGET_RECLEN 17		/* Status + size + timestamp. */
+#define MGET_THREADS 8		/* Threads opening and prefetching the batch. */
+#define MGET_WINDOW 128		/* Files opened ahead of the one being sent. */
+#define MGET_PREFETCH (8 << 20) /* Bytes of each file handed to POSIX_FADV_WILLNEED. */
+#define MGET_BUFL 65536		/* Reads of the file list. */
+#define MGET_MIN_FILES 4	/* client1 switches to MGET from this many files. */
+
+struct rl_conn;
+
+void mget_pack(unsigned char *rec, char status, uint64_t size, uint64_t mtime);
+
+void mget_unpack(const unsigned char *rec, char *status, uint64_t *size, uint64_t *mtime);
+
+int mget_serve(int connfd, struct rl_conn *rl, const char *peer);
+
+#endif
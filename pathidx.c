@@ -0,0 +1,370 @@
+/*
+
+module: pathidx.c
+
+purpose: served root
+         with a root directory every name sent by a client is resolved
+         below it: the root and the directories used by the process are
+         kept open (O_PATH descriptors in a small hash table), and a name is
+         opened relative to the descriptor of its directory with openat2()
+         and RESOLVE_BENEATH, so neither "..", an absolute path nor a
+         symbolic link can lead outside the tree, and only the last
+         component is looked up. Without openat2() (kernel < 5.6) the name
+         is walked one component at a time with O_NOFOLLOW, refusing ".."
+         and symbolic links.
+
+         An index shared by all the processes maps each name looked up to
+         its state (inode, or missing) together with the identity and the
+         ctime of its directory; creating, removing or renaming an entry
+         changes that ctime, so a missing name is refused while the directory
+         does not change. A cached directory descriptor is checked against
+         its ancestors (one fstat() per component, see pi_dir()), so the
+         index is never consulted for a directory that a rename or removal
+         of an ancestor has taken off the name.
+
+         The directory descriptors belong to the process and are shared by
+         its threads (the MGET workers): a mutex covers them from the
+         lookup of the directory to the open of the name.
+
+         Without a root, pi_open() is open().
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "errlib.h"
+#include "pathidx.h"
+
+extern char *prog_name;
+
+struct pi_entry
+{
+	uint32_t seq; /* odd while the entry is written */
+	uint32_t missing;
+	uint64_t hash; /* of the whole name */
+	uint64_t dir_dev, dir_ino;
+	int64_t dir_ctime_ns;
+	uint64_t ino;
+};
+
+struct pi_shared
+{
+	unsigned long long lookups, refused, escapes, dir_opens;
+	struct pi_entry entry[PI_ENTRIES];
+};
+
+/* Open directory of the calling process. */
+struct pi_dir
+{
+	char *name; /* NULL = free slot */
+	int fd;
+	uint64_t dev, ino;
+	int64_t ctime_ns;
+	uint64_t up_dev, up_ino; /* parent when the descriptor was opened */
+	int64_t up_ctime_ns;
+};
+
+static struct pi_shared *pi = NULL;
+static struct pi_dir pi_dirs[PI_DIRS];
+static pthread_mutex_t pi_dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pi_root = -1;
+static int pi_has_openat2 = 1;
+
+static uint64_t pi_hash(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ull; /* FNV-1a */
+
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*s++) * 0x100000001b3ull;
+	return h;
+}
+
+/* Name walked below dirfd one component at a time: no "..", no symbolic links. */
+static int pi_walk(int dirfd, const char *path, int flags)
+{
+	char comp[NAME_MAX + 1];
+	const char *p = path, *end;
+	int fd = -1, cur = dirfd, next;
+
+	for (;;)
+	{
+		while (*p == '/')
+			p++;
+		end = p + strcspn(p, "/");
+		if (end - p > NAME_MAX)
+		{
+			errno = ENAMETOOLONG;
+			break;
+		}
+		memcpy(comp, p, end - p);
+		comp[end - p] = '\0';
+		if (strcmp(comp, "..") == 0)
+		{
+			errno = EXDEV;
+			break;
+		}
+		while (*end == '/')
+			end++;
+		if (*end == '\0')
+		{
+			fd = openat(cur, comp[0] != '\0' ? comp : ".", flags | O_NOFOLLOW | O_CLOEXEC);
+			break;
+		}
+		if ((next = openat(cur, comp, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+			break;
+		if (cur != dirfd)
+			close(cur);
+		cur = next;
+		p = end;
+	}
+	if (cur != dirfd)
+		close(cur);
+	return fd;
+}
+
+static int pi_openat(int dirfd, const char *path, int flags)
+{
+	struct open_how how;
+	int fd;
+
+	if (pi_has_openat2)
+	{
+		memset(&how, 0, sizeof(how));
+		how.flags = flags | O_CLOEXEC;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		if ((fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how))) >= 0 || errno != ENOSYS)
+			return fd;
+		pi_has_openat2 = 0;
+	}
+	return pi_walk(dirfd, path, flags);
+}
+
+/* Must be called before fork(). Names are resolved below root from now on. */
+void pi_init(const char *root)
+{
+	if ((pi_root = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+		err_sys("(%s) error - cannot open the served root '%s'", prog_name, root);
+
+	/* Code that still goes by name (e.g. the inotify watches of the cache) sees the same tree. */
+	if (fchdir(pi_root) != 0)
+		err_sys("(%s) error - cannot change directory to '%s'", prog_name, root);
+
+	pi = mmap(NULL, sizeof(struct pi_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pi == MAP_FAILED)
+		err_sys("(%s) error - mmap() of the name index failed", prog_name);
+
+	err_msg("(%s) --- serving the tree below '%s' (%d names indexed)", prog_name, root, PI_ENTRIES);
+}
+
+int pi_enabled(void)
+{
+	return pi_root >= 0;
+}
+
+static int64_t pi_ctime(const struct stat *st)
+{
+	return (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+/* Descriptor of directory name (len bytes, 0 = the root) with its current
+   identity and ctime in st. Returns NULL if it cannot be opened.
+
+   A cached descriptor is reused only while its parent, validated the same
+   way up to the root, still has the identity and ctime it had when the
+   descriptor was opened: renaming, removing or replacing any ancestor
+   changes the ctime of the directory above it, and the chain below is
+   opened again one component at a time. */
+static struct pi_dir *pi_dir(const char *name, size_t len, struct stat *st)
+{
+	static struct pi_dir root;
+	struct pi_dir *d, *up;
+	struct stat upst;
+	const char *base;
+	char path[PATH_MAX];
+	uint64_t up_dev, up_ino;
+	int64_t up_ctime_ns;
+	int fd;
+
+	if (len == 0)
+	{
+		d = &root;
+		d->fd = pi_root;
+		if (fstat(d->fd, st) != 0)
+			return NULL;
+		goto done;
+	}
+
+	for (base = name + len; base > name && base[-1] != '/'; base--)
+		;
+	if ((up = pi_dir(name, base > name ? (size_t)(base - name - 1) : 0, &upst)) == NULL)
+		return NULL;
+	up_dev = up->dev;
+	up_ino = up->ino;
+	up_ctime_ns = up->ctime_ns;
+
+	d = &pi_dirs[pi_hash(name, len) % PI_DIRS];
+	if (d->name != NULL && strlen(d->name) == len && memcmp(d->name, name, len) == 0 && d->up_dev == up_dev &&
+	    d->up_ino == up_ino && d->up_ctime_ns == up_ctime_ns && fstat(d->fd, st) == 0)
+		goto done;
+
+	/* Opened below the parent before the slot (possibly the parent's own) is reused. */
+	if (len >= sizeof(path))
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	memcpy(path, name, len);
+	path[len] = '\0';
+	base = path + (base - name);
+	if ((fd = pi_openat(up->fd, base[0] != '\0' ? base : ".", O_PATH | O_DIRECTORY)) < 0 && errno == EXDEV && pi_has_openat2)
+		fd = pi_openat(pi_root, path, O_PATH | O_DIRECTORY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, st) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	if (d->name != NULL)
+	{
+		close(d->fd);
+		free(d->name);
+	}
+	if ((d->name = strdup(path)) == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+	d->fd = fd;
+	d->up_dev = up_dev;
+	d->up_ino = up_ino;
+	d->up_ctime_ns = up_ctime_ns;
+	__atomic_fetch_add(&pi->dir_opens, 1, __ATOMIC_RELAXED);
+
+done:
+	d->dev = st->st_dev;
+	d->ino = st->st_ino;
+	d->ctime_ns = pi_ctime(st);
+	return d;
+}
+
+/* Index entry for hash in directory d, if it is still valid. */
+static int pi_lookup(uint64_t hash, const struct pi_dir *d, struct pi_entry *out)
+{
+	struct pi_entry *e = &pi->entry[hash % PI_ENTRIES];
+	uint32_t seq;
+
+	if ((seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)) & 1)
+		return 0;
+	memcpy(out, e, sizeof(*out));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq && seq != 0 && out->hash == hash &&
+	       out->dir_dev == d->dev && out->dir_ino == d->ino && out->dir_ctime_ns == d->ctime_ns;
+}
+
+static void pi_store(uint64_t hash, const struct pi_dir *d, int missing, uint64_t ino)
+{
+	struct pi_entry *e = &pi->entry[hash % PI_ENTRIES];
+	uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+
+	if ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return; /* another process is writing it */
+	e->hash = hash;
+	e->missing = missing;
+	e->dir_dev = d->dev;
+	e->dir_ino = d->ino;
+	e->dir_ctime_ns = d->ctime_ns;
+	e->ino = ino;
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Opens a name sent by a client: below the served root if there is one.
+   Returns the descriptor, -1 with errno (EACCES if the name leads outside
+   the tree). */
+int pi_open(const char *name, int flags)
+{
+	struct pi_entry e;
+	struct pi_dir *d;
+	struct stat st;
+	const char *slash, *base;
+	uint64_t hash;
+	size_t len;
+	int fd;
+
+	if (pi_root < 0)
+		return open(name, flags);
+
+	__atomic_fetch_add(&pi->lookups, 1, __ATOMIC_RELAXED);
+	len = strlen(name);
+	hash = pi_hash(name, len);
+	slash = strrchr(name, '/');
+	base = slash != NULL ? slash + 1 : name;
+
+	/* d and its descriptor stay valid until the name is opened. */
+	pthread_mutex_lock(&pi_dirs_lock);
+	if (name[0] == '/' || (d = pi_dir(name, slash != NULL ? (size_t)(slash - name) : 0, &st)) == NULL)
+	{
+		fd = -1;
+		if (name[0] == '/')
+			errno = EXDEV;
+		goto out;
+	}
+
+	/* Missing the last time and the directory has not changed since. */
+	if (pi_lookup(hash, d, &e) && e.missing)
+	{
+		pthread_mutex_unlock(&pi_dirs_lock);
+		__atomic_fetch_add(&pi->refused, 1, __ATOMIC_RELAXED);
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* A symbolic link may leave its directory and still stay in the tree:
+	   only then the whole name is resolved again from the root. */
+	if ((fd = pi_openat(d->fd, base[0] != '\0' ? base : ".", flags)) < 0 && errno == EXDEV && pi_has_openat2)
+		fd = pi_openat(pi_root, name, flags);
+	if (fd >= 0 && fstat(fd, &st) == 0)
+		pi_store(hash, d, 0, st.st_ino);
+	else if (fd < 0 && errno == ENOENT)
+		pi_store(hash, d, 1, 0);
+
+out:
+	pthread_mutex_unlock(&pi_dirs_lock);
+	if (fd < 0 && errno == EXDEV)
+	{
+		__atomic_fetch_add(&pi->escapes, 1, __ATOMIC_RELAXED);
+		err_msg("(%s) error - '%s' leads outside the served root", prog_name, name);
+		errno = EACCES;
+	}
+	return fd;
+}
+
+void pi_report(void)
+{
+	int i, ndirs = 0;
+
+	if (pi == NULL)
+		return;
+	pthread_mutex_lock(&pi_dirs_lock);
+	for (i = 0; i < PI_DIRS; i++)
+		if (pi_dirs[i].name != NULL)
+			ndirs++;
+	pthread_mutex_unlock(&pi_dirs_lock);
+	printf("(%s) --- served root: %llu lookups, %llu refused by the index, %llu outside the root, %llu directories opened, %d open here\n",
+	       prog_name, __atomic_load_n(&pi->lookups, __ATOMIC_RELAXED), __atomic_load_n(&pi->refused, __ATOMIC_RELAXED),
+	       __atomic_load_n(&pi->escapes, __ATOMIC_RELAXED), __atomic_load_n(&pi->dir_opens, __ATOMIC_RELAXED), ndirs);
+}
@@ -0,0 +1,24 @@
+/*
+
+module: pathidx.h
+
+purpose: definitions of the served root (pathidx.c)
+
+*/
+
+#ifndef _PATHIDX_H
+
+#define _PATHIDX_H
+
+#define PI_DIRS 256	    /* Directory descriptors kept open by each process. */
+#define PI_ENTRIES 65536    /* Names in the index (shared by all the processes). */
+
+void pi_init(const char *root);
+
+int pi_enabled(void);
+
+int pi_open(const char *name, int flags);
+
+void pi_report(void);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+
+module: prefetch.c
+
+purpose: page cache hints for the GET command
+         the file being sent is marked POSIX_FADV_SEQUENTIAL; the GETs the
+         client has already pipelined behind it are peeked from the socket
+         (nothing is consumed) and their first PF_AHEAD bytes are handed to
+         POSIX_FADV_WILLNEED, so the disk reads them while the current body
+         streams. A large file that is not requested again in the pipeline is
+         dropped with POSIX_FADV_DONTNEED once sent, so one-shot transfers do
+         not flush the page cache.
+
+         A name is advised once per connection: the list is emptied when a
+         connection starts, and a file dropped from the page cache leaves it,
+         so a later request for it is advised again.
+
+*/
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "cmdscan.h"
+#include "pathidx.h"
+#include "prefetch.h"
+
+/* Files advised most recently on this connection, so a long pipeline is not advised twice. */
+static unsigned int pf_done[PF_MAX_FILES];
+static int pf_ndone = 0;
+
+static unsigned int pf_hash(const char *s, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/* Calls fn on the name of every complete GET the client has pipelined (first
+   those the server has already taken from the socket, then those still
+   queued in it), stopping at the first other command. Returns 1 if fn
+   stopped the scan, 0 otherwise. */
+static int pf_queued(int connfd, int (*fn)(const char *name, void *arg), void *arg)
+{
+	static char buf[PF_PEEK];
+	struct cs_cmd *taken, cmd[PF_MAX_FILES];
+	size_t i, n, count = 0;
+	ssize_t r;
+
+	for (n = cs_queued(&taken), i = 0; i < n && count < PF_MAX_FILES; i++, count++)
+		if (taken[i].verb != CS_GET)
+			return 0;
+		else if (fn(taken[i].name, arg))
+			return 1;
+
+	if (count == PF_MAX_FILES || (r = recv(connfd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT)) <= 0)
+		return 0;
+
+	/* Lines split in one pass; the names are terminated in our copy. */
+	for (n = cs_scan(buf, r, cmd, PF_MAX_FILES - count, NULL), i = 0; i < n && cmd[i].verb == CS_GET; i++)
+	{
+		cmd[i].name[cmd[i].namelen] = '\0';
+		if (fn(cmd[i].name, arg))
+			return 1;
+	}
+	return 0;
+}
+
+/* Called when a connection starts. */
+void pf_reset(void)
+{
+	pf_ndone = 0;
+}
+
+static int pf_willneed(const char *name, void *arg)
+{
+	unsigned int h = pf_hash(name, strlen(name));
+	int i, fd;
+
+	(void)arg;
+	for (i = 0; i < pf_ndone && i < PF_MAX_FILES; i++)
+		if (pf_done[i] == h)
+			return 0;
+	pf_done[pf_ndone++ % PF_MAX_FILES] = h;
+
+	/* The hint belongs to the page cache: the descriptor can be closed at once. */
+	if ((fd = pi_open(name, O_RDONLY | O_NONBLOCK)) >= 0)
+	{
+		posix_fadvise(fd, 0, PF_AHEAD, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+	return 0;
+}
+
+static int pf_match(const char *name, void *arg)
+{
+	return strcmp(name, (const char *)arg) == 0;
+}
+
+/* Called when the file fd is about to be sent on connfd. */
+void pf_begin(int connfd, int fd)
+{
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	pf_queued(connfd, pf_willneed, NULL);
+}
+
+/* Called once the file fd (size bytes) has been sent. */
+void pf_end(int connfd, int fd, off_t size, const char *filename)
+{
+	unsigned int h;
+	int i;
+
+	if (size < PF_DONTNEED_MIN)
+		return;
+	/* Requested again in the pipeline: keep it. */
+	if (pf_queued(connfd, pf_match, (void *)filename))
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	/* Out of the page cache: the next request for it is advised again. */
+	h = pf_hash(filename, strlen(filename));
+	for (i = 0; i < pf_ndone && i < PF_MAX_FILES; i++)
+		if (pf_done[i] == h)
+			pf_done[i] = 0;
+}
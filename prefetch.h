@@ -0,0 +1,26 @@
+/*
+
+module: prefetch.h
+
+purpose: definitions of functions in prefetch.c
+
+*/
+
+#ifndef _PREFETCH_H
+
+#define _PREFETCH_H
+
+#include <sys/types.h>
+
+#define PF_PEEK 65536		   /* Bytes of pipelined requests examined. */
+#define PF_MAX_FILES 16		   /* Upcoming files prefetched at most. */
+#define PF_AHEAD (4 << 20)	   /* Bytes of each upcoming file handed to POSIX_FADV_WILLNEED. */
+#define PF_DONTNEED_MIN (32 << 20) /* Files at least this large are dropped from the page cache once sent. */
+
+void pf_reset(void);
+
+void pf_begin(int connfd, int fd);
+
+void pf_end(int connfd, int fd, off_t size, const char *filename);
+
+#endif
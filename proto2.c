@@ -0,0 +1,288 @@
+/*
+
+module: proto2.c
+
+purpose: multiplexed protocol v2, server side
+         every GET frame opens a stream; the chunks of all the open streams are
+         sent round-robin on the same connection, so a huge file does not block
+         the ones requested after it. A CANCEL frame closes a stream early.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "ratelimit.h"
+#include "pathidx.h"
+#include "proto2.h"
+
+#define V2_TIMEOUT 15 /* Idle connection timeout (sec). */
+
+extern char *prog_name;
+
+struct v2_stream
+{
+	uint32_t id;
+	int fd; /* -1 = free slot */
+	uint64_t remaining;
+};
+
+void v2_pack(unsigned char *buf, uint8_t type, uint8_t flags, uint32_t id, uint64_t length)
+{
+	uint32_t nid = htonl(id);
+	uint64_t nlen = htobe64(length);
+
+	buf[0] = type;
+	buf[1] = flags;
+	buf[2] = buf[3] = 0;
+	memcpy(buf + 4, &nid, 4);
+	memcpy(buf + 8, &nlen, 8);
+}
+
+void v2_unpack(const unsigned char *buf, struct v2_header *h)
+{
+	uint32_t nid;
+	uint64_t nlen;
+
+	h->type = buf[0];
+	h->flags = buf[1];
+	memcpy(&nid, buf + 4, 4);
+	memcpy(&nlen, buf + 8, 8);
+	h->id = ntohl(nid);
+	h->length = be64toh(nlen);
+}
+
+/* Sends header and payload; returns 0 on success, -1 on error. */
+int v2_send(int fd, uint8_t type, uint8_t flags, uint32_t id, const void *payload, uint64_t length)
+{
+	unsigned char hdr[V2_HDRLEN];
+
+	v2_pack(hdr, type, flags, id, length);
+	if (sendn(fd, hdr, V2_HDRLEN, MSG_NOSIGNAL | (length ? MSG_MORE : 0)) != V2_HDRLEN)
+		return -1;
+	if (length && sendn(fd, payload, length, MSG_NOSIGNAL) != (ssize_t)length)
+		return -1;
+	return 0;
+}
+
+/* Returns 1 if a header was read, 0 on EOF, -1 on error or truncated header. */
+int v2_recv_header(int fd, struct v2_header *h)
+{
+	unsigned char hdr[V2_HDRLEN];
+	ssize_t n;
+
+	if ((n = readn(fd, hdr, V2_HDRLEN)) == 0)
+		return 0;
+	if (n != V2_HDRLEN)
+		return -1;
+	v2_unpack(hdr, h);
+	return 1;
+}
+
+static struct v2_stream *v2_find(struct v2_stream *s, uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < V2_MAX_INFLIGHT; i++)
+		if (s[i].fd >= 0 && s[i].id == id)
+			return &s[i];
+	return NULL;
+}
+
+static int v2_error(int connfd, uint32_t id, const char *msg)
+{
+	return v2_send(connfd, V2_ERR, 0, id, msg, strlen(msg));
+}
+
+/* Handles one client frame. Returns 0 to go on, -1 to close the connection. */
+static int v2_command(int connfd, struct v2_stream *s, int *nactive, const struct v2_header *h, const char *peer)
+{
+	char name[V2_MAXNAME + 1];
+	unsigned char meta[16];
+	struct v2_stream *st;
+	struct stat stat_buf;
+	uint64_t v;
+	int i, fd;
+
+	switch (h->type)
+	{
+	case V2_GET:
+		if (h->length == 0 || h->length > V2_MAXNAME)
+		{
+			err_msg("(%s) error - invalid v2 GET length %llu from client [%s]", prog_name, (unsigned long long)h->length, peer);
+			return -1;
+		}
+		if (readn(connfd, name, h->length) != (ssize_t)h->length)
+			return -1;
+		name[h->length] = '\0';
+
+		printf("(%s) --- client [%s] asked to send file '%s' (v2 id %u)\n", prog_name, peer, name, h->id);
+		errno = 0;
+
+		if (v2_find(s, h->id) != NULL)
+			return v2_error(connfd, h->id, "duplicate request id");
+		for (i = 0; i < V2_MAX_INFLIGHT && s[i].fd >= 0; i++)
+			;
+		if (i == V2_MAX_INFLIGHT)
+			return v2_error(connfd, h->id, "too many requests in flight");
+
+		if ((fd = pi_open(name, O_RDONLY)) < 0 || fstat(fd, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode))
+		{
+			int err = (fd >= 0 && errno == 0) ? EINVAL : errno;
+
+			err_msg("(%s) error - cannot open '%s' for client [%s]: %s", prog_name, name, peer, strerror(err));
+			if (fd >= 0)
+				close(fd);
+			return v2_error(connfd, h->id, strerror(err));
+		}
+
+		v = htobe64(stat_buf.st_size);
+		memcpy(meta, &v, 8);
+		v = htobe64(stat_buf.st_mtime);
+		memcpy(meta + 8, &v, 8);
+		if (v2_send(connfd, V2_HEAD, 0, h->id, meta, sizeof(meta)) < 0)
+		{
+			close(fd);
+			return -1;
+		}
+
+		s[i].id = h->id;
+		s[i].fd = fd;
+		s[i].remaining = stat_buf.st_size;
+		(*nactive)++;
+		return 0;
+
+	case V2_CANCEL:
+		if (h->length != 0)
+			return -1;
+		/* A CANCEL for a request already completed is not an error: the END crossed it. */
+		if ((st = v2_find(s, h->id)) != NULL)
+		{
+			printf("(%s) --- client [%s] cancelled request %u\n", prog_name, peer, h->id);
+			close(st->fd);
+			st->fd = -1;
+			(*nactive)--;
+			return v2_send(connfd, V2_END, V2_F_CANCELLED, h->id, NULL, 0);
+		}
+		return 0;
+
+	default:
+		err_msg("(%s) error - illegal v2 frame type 0x%02x from client [%s]", prog_name, h->type, peer);
+		v2_error(connfd, 0, "illegal frame");
+		return -1;
+	}
+}
+
+/* Sends the next chunk of stream st. Returns 0 on success, -1 if the connection failed. */
+static int v2_chunk(int connfd, struct v2_stream *st, int *nactive, struct rl_conn *rl, char *buffer, const char *peer)
+{
+	ssize_t n;
+	size_t len = st->remaining < V2_CHUNK ? st->remaining : V2_CHUNK;
+
+	if (len > 0)
+	{
+		if ((n = read(st->fd, buffer, len)) <= 0)
+		{
+			/* File truncated while being sent: the request fails, the connection survives. */
+			err_msg("(%s) error - read() failed for v2 request %u of client [%s]", prog_name, st->id, peer);
+			close(st->fd);
+			st->fd = -1;
+			(*nactive)--;
+			return v2_error(connfd, st->id, "read error");
+		}
+		rl_acquire(rl, n);
+		if (v2_send(connfd, V2_DATA, 0, st->id, buffer, n) < 0)
+			return -1;
+		st->remaining -= n;
+	}
+
+	if (st->remaining == 0)
+	{
+		close(st->fd);
+		st->fd = -1;
+		(*nactive)--;
+		printf("(%s) --- sent v2 request %u to client [%s]\n", prog_name, st->id, peer);
+		return v2_send(connfd, V2_END, 0, st->id, NULL, 0);
+	}
+	return 0;
+}
+
+/* Serves a connection that sent V2_MAGIC, until the client closes it (after all
+   the streams are complete), an error occurs or the idle timeout expires. */
+void v2_serve(int connfd, struct rl_conn *rl, const char *peer)
+{
+	struct v2_stream s[V2_MAX_INFLIGHT];
+	struct v2_header h;
+	char buffer[V2_CHUNK];
+	fd_set rset, wset;
+	struct timeval tval;
+	int i, n, nactive = 0, eof = 0, next = 0;
+
+	for (i = 0; i < V2_MAX_INFLIGHT; i++)
+		s[i].fd = -1;
+
+	printf("(%s) --- client [%s] switched to protocol v2\n", prog_name, peer);
+
+	while (!eof || nactive > 0)
+	{
+		FD_ZERO(&rset);
+		FD_ZERO(&wset);
+		if (!eof)
+			FD_SET(connfd, &rset);
+		if (nactive > 0)
+			FD_SET(connfd, &wset);
+		tval.tv_sec = V2_TIMEOUT;
+		tval.tv_usec = 0;
+
+		if ((n = select(connfd + 1, &rset, &wset, NULL, &tval)) == 0)
+		{
+			printf("(%s) Timeout waiting for data from client [%s]: connection with client will be closed\n", prog_name, peer);
+			break;
+		}
+		else if (n < 0)
+		{
+			if (INTERRUPTED_BY_SIGNAL)
+				continue;
+			err_ret("(%s) error - select() failed with client [%s]", prog_name, peer);
+			break;
+		}
+
+		/* New frames first, so that a CANCEL takes effect before the next chunk. */
+		if (FD_ISSET(connfd, &rset))
+		{
+			if ((n = v2_recv_header(connfd, &h)) == 0)
+				eof = 1; /* the client has finished sending requests */
+			else if (n < 0 || v2_command(connfd, s, &nactive, &h, peer) < 0)
+				break;
+		}
+
+		/* One chunk of the next stream, round-robin. */
+		if (FD_ISSET(connfd, &wset) && nactive > 0)
+		{
+			for (i = 0; i < V2_MAX_INFLIGHT && s[(next + i) % V2_MAX_INFLIGHT].fd < 0; i++)
+				;
+			next = (next + i) % V2_MAX_INFLIGHT;
+			if (v2_chunk(connfd, &s[next], &nactive, rl, buffer, peer) < 0)
+			{
+				err_ret("(%s) error - sendn() failed with client [%s]", prog_name, peer);
+				break;
+			}
+			next = (next + 1) % V2_MAX_INFLIGHT;
+		}
+	}
+
+	for (i = 0; i < V2_MAX_INFLIGHT; i++)
+		if (s[i].fd >= 0)
+			close(s[i].fd);
+
+	if (eof && nactive == 0)
+		printf("(%s) --- connection closed by party [%s]\n", prog_name, peer);
+}
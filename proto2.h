@@ -0,0 +1,62 @@
+/*
+
+module: proto2.h
+
+purpose: definitions of the multiplexed protocol v2 (proto2.c)
+
+         The client switches a connection to v2 by sending "GET2\r\n" instead of
+         "GET name\r\n"; from then on both sides exchange frames made of a
+         16-byte header, in network byte order:
+
+             type (1) | flags (1) | reserved (2) | request id (4) | length (8)
+
+         followed by "length" bytes of payload.
+
+*/
+
+#ifndef _PROTO2_H
+
+#define _PROTO2_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define V2_MAGIC "GET2"		/* Replaces "GET " in the first command. */
+#define V2_HDRLEN 16
+#define V2_CHUNK 16384		/* DATA payload: files are interleaved at this granularity. */
+#define V2_MAXNAME 4096		/* Longest filename accepted in a GET frame. */
+#define V2_MAX_INFLIGHT 64	/* Concurrent requests per connection. */
+
+/* client -> server */
+#define V2_GET 0x01		/* payload: filename */
+#define V2_CANCEL 0x02		/* no payload */
+
+/* server -> client */
+#define V2_HEAD 0x81		/* payload: size (8) + mtime (8) */
+#define V2_DATA 0x82		/* payload: file contents */
+#define V2_END 0x83		/* no payload, last frame of a request */
+#define V2_ERR 0x84		/* payload: error text, last frame of a request */
+
+#define V2_F_CANCELLED 0x01	/* flag of the END frame that acknowledges a CANCEL */
+
+struct v2_header
+{
+	uint8_t type;
+	uint8_t flags;
+	uint32_t id;
+	uint64_t length;
+};
+
+struct rl_conn;
+
+void v2_pack(unsigned char *buf, uint8_t type, uint8_t flags, uint32_t id, uint64_t length);
+
+void v2_unpack(const unsigned char *buf, struct v2_header *h);
+
+int v2_send(int fd, uint8_t type, uint8_t flags, uint32_t id, const void *payload, uint64_t length);
+
+int v2_recv_header(int fd, struct v2_header *h);
+
+void v2_serve(int connfd, struct rl_conn *rl, const char *peer);
+
+#endif
@@ -0,0 +1,400 @@
+/*
+
+module: put.c
+
+purpose: PUT upload command, both sides
+         the server receives the file into a temporary file of the upload
+         directory, allocated up front with fallocate(); the contents go
+         socket -> pipe -> file with splice(), without passing through user
+         space (read()/write() where the socket cannot splice). The file gets
+         the timestamp of the client, is made durable and then renamed over
+         the final name, so a reader sees either the old file or the whole
+         new one.
+
+         Durability is a group commit shared by all the processes: an upload
+         that needs it takes a ticket, and one process at a time runs
+         syncfs() for every ticket taken before it started, so concurrent
+         uploads share the flushes instead of running one fsync() each. The
+         process flushing holds an flock() on its own open of the upload
+         directory, which the kernel drops if it dies, so the others can
+         take over without trusting a pid.
+
+         The size declared by the client is checked against the per-upload
+         limit and the free space of the file system before it is reserved.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "ratelimit.h"
+#include "put.h"
+
+#define PUT_BUFL 65536 /* read()/write() fallback. */
+
+extern char *prog_name;
+
+struct put_sync
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t seq;  /* last ticket taken */
+	uint64_t done; /* every ticket up to this one is durable */
+};
+
+static struct put_sync *put_sync = NULL;
+static int put_dirfd = -1;
+static uint64_t put_max = PUT_MAX;
+
+/* Open of the upload directory of the calling process, flock()ed while it runs syncfs(). */
+static int put_lockfd = -1;
+static pid_t put_lockpid = 0;
+
+static void put_lock(void)
+{
+	if (pthread_mutex_lock(&put_sync->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&put_sync->lock);
+}
+
+/* "directory[:max_byte]", max_byte with optional k, m, g suffixes (at most 4g - 1,
+   the largest size of the protocol). Returns 0, -1. */
+int put_parse(const char *str, char *dir, size_t dirlen, uint64_t *max)
+{
+	const char *colon = strrchr(str, ':');
+	char *end;
+	double v = 0;
+	size_t len = strlen(str);
+
+	*max = PUT_MAX;
+	if (colon != NULL)
+	{
+		errno = 0;
+		v = strtod(colon + 1, &end);
+		if (errno == 0 && end != colon + 1 && v >= 1)
+		{
+			switch (*end)
+			{
+			case 'g':
+			case 'G':
+				v *= 1024;
+				/* fall through */
+			case 'm':
+			case 'M':
+				v *= 1024;
+				/* fall through */
+			case 'k':
+			case 'K':
+				v *= 1024;
+				end++;
+				break;
+			}
+			if (*end == '\0')
+			{
+				if (v > UINT32_MAX)
+					return -1;
+				*max = (uint64_t)v;
+				len = colon - str;
+			}
+		}
+	}
+	if (len == 0 || len >= dirlen)
+		return -1;
+	memcpy(dir, str, len);
+	dir[len] = '\0';
+	return 0;
+}
+
+/* Must be called before fork(). Enables PUT into dir, files up to max bytes. */
+void put_init(const char *dir, uint64_t max)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	struct stat st;
+
+	if ((put_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fstat(put_dirfd, &st) != 0)
+		err_sys("(%s) error - cannot open the upload directory '%s'", prog_name, dir);
+	put_max = max;
+
+	put_sync = mmap(NULL, sizeof(struct put_sync), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (put_sync == MAP_FAILED)
+		err_sys("(%s) error - mmap() of the upload state failed", prog_name);
+	memset(put_sync, 0, sizeof(struct put_sync));
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&put_sync->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&put_sync->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	err_msg("(%s) --- uploads (PUT) enabled into '%s', files up to %llu bytes", prog_name, dir, (unsigned long long)max);
+}
+
+/* Group commit: returns once everything written to the file system of fd
+   before the call is durable. Returns 0, -1 if syncfs() failed. */
+static int put_commit(int fd)
+{
+	struct timespec ts;
+	uint64_t ticket, target;
+	int rc = 0;
+
+	/* An open of our own: an inherited one would share the lock with the parent. */
+	if (put_lockpid != getpid())
+	{
+		put_lockfd = openat(put_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		put_lockpid = getpid();
+	}
+	if (put_lockfd < 0)
+		return syncfs(fd);
+
+	put_lock();
+	ticket = ++put_sync->seq;
+	while (put_sync->done < ticket)
+	{
+		/* Nobody flushing (or the process that was died, releasing the lock): our turn, for all the tickets so far. */
+		if (flock(put_lockfd, LOCK_EX | LOCK_NB) == 0)
+		{
+			target = put_sync->seq;
+			pthread_mutex_unlock(&put_sync->lock);
+
+			rc = syncfs(fd);
+
+			put_lock();
+			if (rc == 0 && put_sync->done < target)
+				put_sync->done = target;
+			flock(put_lockfd, LOCK_UN);
+			pthread_cond_broadcast(&put_sync->cond);
+			if (rc != 0)
+				break;
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += PUT_SYNC_WAIT_MSEC * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		if (pthread_cond_timedwait(&put_sync->cond, &put_sync->lock, &ts) == EOWNERDEAD)
+			pthread_mutex_consistent(&put_sync->lock);
+	}
+	pthread_mutex_unlock(&put_sync->lock);
+	return rc;
+}
+
+/* size bytes from the socket to the file: splice() through a pipe, or
+   read()/write() if the socket does not support it. Returns 0, -1. */
+static int put_receive(int connfd, int fd, uint32_t size, struct rl_conn *rl)
+{
+	char *buf;
+	loff_t off = 0;
+	ssize_t n, m;
+	size_t len;
+	int p[2];
+
+	if (pipe2(p, O_CLOEXEC) < 0)
+		return -1;
+	fcntl(p[1], F_SETPIPE_SZ, PUT_PIPE);
+
+	while (off < size)
+	{
+		len = size - off < PUT_CHUNK ? size - off : PUT_CHUNK;
+		if ((n = splice(connfd, NULL, p[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EINVAL && off == 0)
+			break; /* no splice() from this socket */
+		if (n <= 0)
+			goto fail;
+		rl_acquire(rl, n);
+		while (n > 0)
+		{
+			if ((m = splice(p[0], NULL, fd, &off, n, SPLICE_F_MOVE)) < 0 && errno == EINTR)
+				continue;
+			if (m <= 0)
+				goto fail;
+			n -= m;
+		}
+	}
+	close(p[0]);
+	close(p[1]);
+	if (off == size)
+		return 0;
+
+	if ((buf = malloc(PUT_BUFL)) == NULL)
+		return -1;
+	for (; off < size; off += n)
+	{
+		len = size - off < PUT_BUFL ? size - off : PUT_BUFL;
+		if ((n = readn(connfd, buf, len)) != (ssize_t)len || writen(fd, buf, len) != (ssize_t)len)
+		{
+			free(buf);
+			return -1;
+		}
+		rl_acquire(rl, len);
+	}
+	free(buf);
+	return 0;
+
+fail:
+	close(p[0]);
+	close(p[1]);
+	return -1;
+}
+
+/* Receives one file. Returns 0, -1 if the connection must be closed
+   ("-ERR" already sent). */
+int put_serve(int connfd, struct rl_conn *rl, const char *filename, const char *peer)
+{
+	struct timeval tv = {PUT_TIMEOUT, 0}, none = {0, 0};
+	struct timespec times[2];
+	struct statvfs vfs;
+	char tmp[4096];
+	uint32_t v;
+	int fd = -1, err;
+
+	if (put_dirfd < 0 || filename == NULL || filename[0] == '\0' || filename[0] == '.' || strchr(filename, '/') != NULL ||
+	    snprintf(tmp, sizeof(tmp), ".%s.put%d", filename, (int)getpid()) >= (int)sizeof(tmp))
+	{
+		err_msg("(%s) error - %s PUT command from client [%s]", prog_name, put_dirfd < 0 ? "disabled" : "illegal", peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	/* A client that stops sending does not keep the process forever. */
+	setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (readn(connfd, &v, 4) != 4)
+	{
+		err_ret("(%s) error - reading the size of '%s' failed with client [%s]", prog_name, filename, peer);
+		goto fail;
+	}
+	v = ntohl(v);
+
+	printf("(%s) --- client [%s] uploads file '%s' (%u bytes)\n", prog_name, peer, filename, v);
+
+	/* The size comes from the client: nothing is reserved beyond the limit or the free space. */
+	if (v > put_max || (fstatvfs(put_dirfd, &vfs) == 0 && v > (uint64_t)vfs.f_bavail * vfs.f_frsize))
+	{
+		err_msg("(%s) error - '%s' from client [%s] refused: %u bytes, %s", prog_name, filename, peer, v,
+			v > put_max ? "over the upload limit" : "more than the free space");
+		goto fail;
+	}
+
+	/* Temporary file next to the final one (a leftover of a dead process is replaced). */
+	unlinkat(put_dirfd, tmp, 0);
+	if ((fd = openat(put_dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0)
+	{
+		err_ret("(%s) error - cannot create '%s' for client [%s]", prog_name, tmp, peer);
+		goto fail;
+	}
+	/* Space reserved before receiving: a full disk fails now, and the file is contiguous. */
+	if (v > 0 && fallocate(fd, 0, 0, v) != 0 && errno != EOPNOTSUPP)
+	{
+		err_ret("(%s) error - fallocate() of %u bytes for '%s' failed with client [%s]", prog_name, v, filename, peer);
+		goto fail;
+	}
+
+	if (put_receive(connfd, fd, v, rl) < 0 || readn(connfd, &v, 4) != 4)
+	{
+		err_ret("(%s) error - receiving '%s' failed with client [%s]", prog_name, filename, peer);
+		goto fail;
+	}
+
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_sec = ntohl(v);
+	times[1].tv_nsec = 0;
+	futimens(fd, times);
+
+	/* Contents durable, then the name: the directory entry goes to disk with the second commit. */
+	if (put_commit(fd) != 0 || renameat(put_dirfd, tmp, put_dirfd, filename) != 0)
+	{
+		err_ret("(%s) error - storing '%s' failed with client [%s]", prog_name, filename, peer);
+		goto fail;
+	}
+	err = put_commit(fd);
+	close(fd);
+	fd = -1;
+	setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+	if (err != 0)
+	{
+		err_ret("(%s) error - syncfs() after renaming '%s' failed with client [%s]", prog_name, filename, peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return -1;
+	}
+
+	if (sendn(connfd, "+OK\r\n", 5, MSG_NOSIGNAL) != 5)
+	{
+		err_ret("(%s) error - sendn() failed with client [%s]", prog_name, peer);
+		return -1;
+	}
+	printf("(%s) --- received file '%s' from client [%s]\n", prog_name, filename, peer);
+	return 0;
+
+fail:
+	if (fd >= 0)
+	{
+		close(fd);
+		unlinkat(put_dirfd, tmp, 0);
+	}
+	sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+	return -1;
+}
+
+/* Client: uploads the file at path as name. Returns 0, 1 if the server
+   refused it ("-ERR", the connection is closed), -1 on a local or
+   connection error. */
+int put_send(int sockfd, const char *path, const char *name)
+{
+	char line[4096 + 8];
+	struct stat st;
+	uint32_t v;
+	size_t len;
+	int fd;
+
+	if ((len = snprintf(line, sizeof(line), "%s%s\r\n", MSG_PUT, name)) >= sizeof(line) ||
+	    (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX)
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Header, contents with sendfile(), timestamp. */
+	memcpy(line + len, &(uint32_t){htonl(st.st_size)}, 4);
+	if (sendn(sockfd, line, len + 4, MSG_NOSIGNAL | MSG_MORE) != (ssize_t)len + 4 ||
+	    sendfilen(sockfd, fd, 0, st.st_size) != st.st_size)
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	v = htonl(st.st_mtime);
+	if (sendn(sockfd, &v, 4, MSG_NOSIGNAL) != 4 || readn(sockfd, line, 5) != 5)
+		return -1;
+	if (memcmp(line, "+OK\r\n", 5) == 0)
+		return 0;
+	return memcmp(line, "-ERR\r", 5) == 0 ? 1 : -1;
+}
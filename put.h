@@ -0,0 +1,44 @@
+/*
+
+module: put.h
+
+purpose: definitions of the PUT upload command (put.c)
+
+         request:  "PUT filename\r\n" | B1..B4 (size) | contents | T1..T4 (timestamp)
+         response: "+OK\r\n" once the file is on disk under its name;
+                   "-ERR\r\n" if uploads are disabled, the name is not a
+                   plain file name, the size is over the limit of the server
+                   or the free space, or the file cannot be written (then
+                   the connection is closed, as for GET)
+
+         Same framing as the response to GET. filename is a name inside the
+         upload directory of the server (no '/'); a file with the same name
+         is replaced atomically.
+
+*/
+
+#ifndef _PUT_H
+
+#define _PUT_H
+
+#define MSG_PUT "PUT "
+#define PUT_CHUNK (1 << 20)	  /* Bytes moved by one splice() (rate limiter granularity). */
+#define PUT_PIPE (1 << 20)	  /* Size of the pipe between socket and file. */
+#define PUT_TIMEOUT 15		  /* Seconds without data before an upload is dropped. */
+#define PUT_SYNC_WAIT_MSEC 100	  /* Wait for the process running the shared syncfs() between two checks. */
+#define PUT_MAX (1u << 30)	  /* Default largest upload (bytes). */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct rl_conn;
+
+int put_parse(const char *str, char *dir, size_t dirlen, uint64_t *max);
+
+void put_init(const char *dir, uint64_t max);
+
+int put_serve(int connfd, struct rl_conn *rl, const char *filename, const char *peer);
+
+int put_send(int sockfd, const char *path, const char *name);
+
+#endif
@@ -0,0 +1,296 @@
+/*
+
+module: ratelimit.c
+
+purpose: token bucket bandwidth limiter for the servers
+         buckets per connection, per client address and global; the per-address
+         and global buckets live in a MAP_SHARED mapping created before fork(),
+         so they are enforced across the children of the concurrent server
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "errlib.h"
+#include "ratelimit.h"
+
+extern char *prog_name;
+
+struct rl_addr
+{
+	unsigned char key[17]; /* key[0] = 0 means free slot */
+	struct rl_bucket bucket;
+};
+
+struct rl_shared
+{
+	pthread_mutex_t lock;
+	struct rl_bucket global;
+	struct rl_addr addr[RL_ADDR_SLOTS];
+};
+
+static struct rl_config rl_cfg;
+static struct rl_shared *rl_shm = NULL;
+
+static double rl_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void rl_bucket_init(struct rl_bucket *b, double rate, double burst, double now)
+{
+	b->rate = rate;
+	b->burst = burst;
+	b->tokens = burst;
+	b->last = now;
+}
+
+/* Refills b at the given rate (which may differ from b->rate, see fair share),
+   takes nbytes and returns the seconds the caller must wait to pay the debt. */
+static double rl_bucket_take(struct rl_bucket *b, double rate, size_t nbytes, double now)
+{
+	if (rate <= 0)
+		return 0;
+
+	b->tokens += (now - b->last) * rate;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+	b->last = now;
+
+	b->tokens -= nbytes;
+	return b->tokens < 0 ? -b->tokens / rate : 0;
+}
+
+/* Parses "rate[:burst]" in bytes/sec, with optional k/m/g suffixes (powers of 1024). */
+int rl_parse(const char *str, double *rate, double *burst)
+{
+	double v[2] = {0, 0};
+	char *end;
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		errno = 0;
+		v[i] = strtod(str, &end);
+		if (errno != 0 || end == str || v[i] < 0)
+			return -1;
+		switch (*end)
+		{
+		case 'g':
+		case 'G':
+			v[i] *= 1024;
+			/* fall through */
+		case 'm':
+		case 'M':
+			v[i] *= 1024;
+			/* fall through */
+		case 'k':
+		case 'K':
+			v[i] *= 1024;
+			end++;
+			break;
+		}
+		if (*end == '\0')
+			break;
+		if (*end != ':' || i == 1)
+			return -1;
+		str = end + 1;
+	}
+
+	*rate = v[0];
+	*burst = v[1] > 0 ? v[1] : (v[0] / 10 > RL_MIN_BURST ? v[0] / 10 : RL_MIN_BURST);
+	return 0;
+}
+
+/* Must be called before fork(): the shared table is inherited by the children. */
+void rl_init(const struct rl_config *cfg)
+{
+	pthread_mutexattr_t attr;
+
+	rl_cfg = *cfg;
+	if (!rl_enabled())
+		return;
+
+	/* Without an explicit per-address limit the fair share uses the global burst. */
+	if (rl_cfg.addr_rate <= 0)
+		rl_cfg.addr_burst = rl_cfg.global_burst;
+
+	rl_shm = mmap(NULL, sizeof(struct rl_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (rl_shm == MAP_FAILED)
+		err_sys("(%s) error - mmap() of the rate limiter table failed", prog_name);
+	memset(rl_shm, 0, sizeof(struct rl_shared));
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&rl_shm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	rl_bucket_init(&rl_shm->global, cfg->global_rate, cfg->global_burst, rl_now());
+
+	err_msg("(%s) --- rate limit: connection %.0f B/s (burst %.0f), address %.0f B/s (burst %.0f), global %.0f B/s (burst %.0f)",
+			prog_name, cfg->conn_rate, cfg->conn_burst, cfg->addr_rate, cfg->addr_burst, cfg->global_rate, cfg->global_burst);
+}
+
+int rl_enabled(void)
+{
+	return rl_cfg.conn_rate > 0 || rl_cfg.addr_rate > 0 || rl_cfg.global_rate > 0;
+}
+
+static unsigned int rl_hash(const unsigned char *key)
+{
+	unsigned int h = 2166136261u; /* FNV-1a */
+	int i;
+
+	for (i = 0; i < 17; i++)
+		h = (h ^ key[i]) * 16777619u;
+	return h;
+}
+
+/* Finds (or takes over the least recently used) slot for key. Lock held. */
+static int rl_addr_slot(const unsigned char *key, double now)
+{
+	unsigned int h = rl_hash(key);
+	int i, slot, lru = -1;
+
+	for (i = 0; i < RL_ADDR_SLOTS; i++)
+	{
+		slot = (h + i) % RL_ADDR_SLOTS;
+		if (memcmp(rl_shm->addr[slot].key, key, 17) == 0)
+			return slot;
+		if (rl_shm->addr[slot].key[0] == 0)
+		{
+			lru = slot;
+			break;
+		}
+		if (lru < 0 || rl_shm->addr[slot].bucket.last < rl_shm->addr[lru].bucket.last)
+			lru = slot;
+	}
+
+	memcpy(rl_shm->addr[lru].key, key, 17);
+	rl_bucket_init(&rl_shm->addr[lru].bucket, rl_cfg.addr_rate, rl_cfg.addr_burst, now);
+	return lru;
+}
+
+/* Only TCP paces: setsockopt(SO_MAX_PACING_RATE) also succeeds on AF_UNIX
+   sockets (FGET, the TLS relay socketpair), which then send at full speed. */
+static int rl_kernel_paces(int sockfd)
+{
+	int domain, type;
+	socklen_t len = sizeof(domain);
+
+	if (getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &len) != 0 || (domain != AF_INET && domain != AF_INET6))
+		return 0;
+	len = sizeof(type);
+	return getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+}
+
+/* Sets up the limiter for a new connection. The per-connection rate is handed
+   to the kernel with SO_MAX_PACING_RATE (TCP internal pacing or the fq qdisc)
+   when the socket is TCP; the token bucket is the fallback. */
+void rl_conn_init(struct rl_conn *c, int sockfd, const struct sockaddr *sa, socklen_t salen)
+{
+	double now = rl_now();
+
+	memset(c, 0, sizeof(*c));
+	c->slot = -1;
+	if (!rl_enabled())
+		return;
+
+	rl_bucket_init(&c->bucket, rl_cfg.conn_rate, rl_cfg.conn_burst, now);
+
+#ifdef SO_MAX_PACING_RATE
+	if (rl_cfg.conn_rate > 0 && rl_kernel_paces(sockfd))
+	{
+		unsigned int pacing = rl_cfg.conn_rate > 4294967295.0 ? 4294967295u : (unsigned int)rl_cfg.conn_rate;
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing, sizeof(pacing)) == 0)
+			c->paced = 1;
+		else
+			err_ret("(%s) warning - SO_MAX_PACING_RATE not available, pacing in userspace", prog_name);
+	}
+#endif
+
+	if (rl_cfg.addr_rate > 0 || rl_cfg.global_rate > 0)
+	{
+		c->key[0] = sa->sa_family;
+		if (sa->sa_family == AF_INET && salen >= sizeof(struct sockaddr_in))
+			memcpy(c->key + 1, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+		else if (sa->sa_family == AF_INET6 && salen >= sizeof(struct sockaddr_in6))
+			memcpy(c->key + 1, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+
+		pthread_mutex_lock(&rl_shm->lock);
+		c->slot = rl_addr_slot(c->key, now);
+		pthread_mutex_unlock(&rl_shm->lock);
+	}
+}
+
+/* Takes nbytes from every bucket of the connection and returns the delay in
+   microseconds before they may be sent (0 = send now). Does not block: an
+   event-driven engine re-arms the connection after the delay instead of sleeping. */
+long rl_reserve(struct rl_conn *c, size_t nbytes)
+{
+	double now, wait = 0, w, rate;
+	int i, active = 0;
+
+	if (!rl_enabled())
+		return 0;
+
+	now = rl_now();
+	if (!c->paced)
+		wait = rl_bucket_take(&c->bucket, rl_cfg.conn_rate, nbytes, now);
+
+	if (c->slot >= 0)
+	{
+		pthread_mutex_lock(&rl_shm->lock);
+
+		/* The slot may have been recycled by another client meanwhile. */
+		if (memcmp(rl_shm->addr[c->slot].key, c->key, 17) != 0)
+			c->slot = rl_addr_slot(c->key, now);
+
+		/* Fair share: with a global cap every active address gets at most
+		   global_rate / active_addresses, so one client cannot starve the others. */
+		rate = rl_cfg.addr_rate;
+		if (rl_cfg.global_rate > 0)
+		{
+			for (i = 0; i < RL_ADDR_SLOTS; i++)
+				if (rl_shm->addr[i].key[0] != 0 && now - rl_shm->addr[i].bucket.last < RL_ACTIVE_SEC)
+					active++;
+			if (now - rl_shm->addr[c->slot].bucket.last >= RL_ACTIVE_SEC)
+				active++; /* count ourselves */
+			if (rate <= 0 || rl_cfg.global_rate / active < rate)
+				rate = rl_cfg.global_rate / active;
+		}
+
+		if ((w = rl_bucket_take(&rl_shm->addr[c->slot].bucket, rate, nbytes, now)) > wait)
+			wait = w;
+		if ((w = rl_bucket_take(&rl_shm->global, rl_cfg.global_rate, nbytes, now)) > wait)
+			wait = w;
+
+		pthread_mutex_unlock(&rl_shm->lock);
+	}
+
+	return (long)(wait * 1e6);
+}
+
+/* Blocking version of rl_reserve(), for the select()/sendn() loops of the servers. */
+void rl_acquire(struct rl_conn *c, size_t nbytes)
+{
+	long usec = rl_reserve(c, nbytes);
+	struct timespec ts;
+
+	if (usec <= 0)
+		return;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
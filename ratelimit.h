@@ -0,0 +1,59 @@
+/*
+
+module: ratelimit.h
+
+purpose: definitions of functions in ratelimit.c
+
+*/
+
+#ifndef _RATELIMIT_H
+
+#define _RATELIMIT_H
+
+#include <sys/socket.h>
+#include <pthread.h>
+
+#define RL_ADDR_SLOTS 256    /* Per-address buckets kept in the shared table. */
+#define RL_ACTIVE_SEC 1.0    /* An address is "active" if it sent in the last second. */
+#define RL_MIN_BURST 65536.0 /* Default burst: 100 ms of traffic, at least 64 KiB. */
+
+/* Token bucket (bytes). tokens may go negative: the sender then owes
+   -tokens/rate seconds, so chunks larger than the burst are still accepted. */
+struct rl_bucket
+{
+	double rate;  /* bytes/sec, 0 = unlimited */
+	double burst; /* bytes */
+	double tokens;
+	double last; /* CLOCK_MONOTONIC seconds of the last refill */
+};
+
+/* Limiter configuration, filled from the command line. */
+struct rl_config
+{
+	double conn_rate, conn_burst;	  /* per connection */
+	double addr_rate, addr_burst;	  /* per client address */
+	double global_rate, global_burst; /* whole server */
+};
+
+/* Per-connection state, lives in manageRequest(). */
+struct rl_conn
+{
+	struct rl_bucket bucket; /* used only if SO_MAX_PACING_RATE is not available */
+	int paced;		 /* 1 = per-connection rate offloaded to the kernel */
+	int slot;		 /* index in the shared per-address table, -1 = none */
+	unsigned char key[17];	 /* family + address bytes */
+};
+
+int rl_parse(const char *str, double *rate, double *burst);
+
+void rl_init(const struct rl_config *cfg);
+
+int rl_enabled(void);
+
+void rl_conn_init(struct rl_conn *c, int sockfd, const struct sockaddr *sa, socklen_t salen);
+
+long rl_reserve(struct rl_conn *c, size_t nbytes);
+
+void rl_acquire(struct rl_conn *c, size_t nbytes);
+
+#endif
@@ -7,10 +7,30 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
 #include "../errlib.h"
 #include "../sockwrap.h"
+#include "../ratelimit.h"
+#include "../proto2.h"
+#include "../mget.h"
+#include "../arch.h"
+#include "../cache.h"
+#include "../bufpool.h"
+#include "../prefetch.h"
+#include "../diskio.h"
+#include "../tls.h"
+#include "../fdpass.h"
+#include "../handoff.h"
+#include "../pathidx.h"
+#include "../trace.h"
+#include "../cmdscan.h"
+#include "../shmring.h"
+#include "../csum.h"
+#include "../delta.h"
+#include "../put.h"
+#include "../mcast.h"
 
 #define MAXBUFL 4096		 /* Lunghezza buffer. */
 #define MSG_ERROR "-ERR\r\n"     /* Risposta negativa dal server. */
@@ -20,6 +40,7 @@
 
 /* Prototipi di funzione. */
 void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen);
+int closeConnection(int connfd);
 
 /* Variabili globali. */
 char *prog_name;
@@ -31,12 +52,152 @@ int main(int argc, char *argv[])
 
 	int listenfd;
 
-	if (argc < 2)
-		err_quit("usage: %s <port>", prog_name);
+	int opt;
+	struct rl_config rlcfg; /* Limiti di banda (token bucket). */
+	size_t cache_bytes = 0, cache_max = 0; /* Cache dei file piccoli (0 = disabilitata). */
+	int dio_threads = 0, dio_depth = DIO_DEPTH; /* Pool di I/O su disco (0 = disabilitato). */
+	char *bp_opt = NULL;	  /* Blocco di I/O dei file ("auto" se NULL) e huge page. */
+	char *tls_certkey = NULL; /* Certificato e chiave TLS (NULL = in chiaro). */
+	int ktls = 1;		  /* Cifratura nel kernel dopo l'handshake, se disponibile. */
+	char *unix_path = NULL;	  /* Socket AF_UNIX al posto della porta TCP. */
+	char *upload_dir = NULL;  /* Directory dei file ricevuti con PUT (NULL = PUT disabilitato). */
+	char *handoff_path = NULL; /* Socket di controllo per il riavvio senza interruzioni (-H). */
+	char *root_dir = NULL;	   /* Radice servita: i nomi dei client non ne escono (-R). */
+	char *trace_path = NULL;   /* Traccia delle richieste per bench/trace_replay (-w). */
+
+	memset(&rlcfg, 0, sizeof(rlcfg));
+
+	/* Opzioni da riga di comando. */
+	while ((opt = getopt(argc, argv, "t:r:a:g:c:d:b:T:KU:u:H:R:w:")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			/* Profilo di tuning TCP (buffer, NODELAY, NOTSENT_LOWAT, congestion control, keepalive). */
+			if (tcp_set_profile(optarg) < 0)
+				err_quit("(%s) error - unknown tcp profile '%s' (%s)", prog_name, optarg, TCP_PROFILES);
+			break;
+		case 'r':
+			/* Banda massima per connessione, "rate[:burst]" in byte/s (suffissi k, m, g). */
+			if (rl_parse(optarg, &rlcfg.conn_rate, &rlcfg.conn_burst) < 0)
+				err_quit("(%s) error - invalid rate '%s'", prog_name, optarg);
+			break;
+		case 'a':
+			/* Banda massima per indirizzo del client. */
+			if (rl_parse(optarg, &rlcfg.addr_rate, &rlcfg.addr_burst) < 0)
+				err_quit("(%s) error - invalid rate '%s'", prog_name, optarg);
+			break;
+		case 'g':
+			/* Banda massima complessiva del server, divisa equamente tra i client attivi. */
+			if (rl_parse(optarg, &rlcfg.global_rate, &rlcfg.global_burst) < 0)
+				err_quit("(%s) error - invalid rate '%s'", prog_name, optarg);
+			break;
+		case 'c':
+			/* Cache in memoria dei file piccoli: "byte[:dimensione massima di un file]". */
+			if (cache_parse(optarg, &cache_bytes, &cache_max) < 0)
+				err_quit("(%s) error - invalid cache setting '%s'", prog_name, optarg);
+			break;
+		case 'd':
+			/* Letture dal disco in un pool di thread: "thread[:letture in corso]". */
+			if (sscanf(optarg, "%d:%d", &dio_threads, &dio_depth) < 1 || dio_threads < 1 || dio_depth < 1)
+				err_quit("(%s) error - invalid disk I/O setting '%s'", prog_name, optarg);
+			break;
+		case 'b':
+			/* Buffer del pool: "byte[:huge]" o "auto[:huge]". */
+			bp_opt = optarg;
+			break;
+		case 'T':
+			/* TLS: "certificato.pem:chiave.pem". */
+			tls_certkey = optarg;
+			break;
+		case 'K':
+			/* TLS solo in user space, senza kTLS. */
+			ktls = 0;
+			break;
+		case 'U':
+			/* Client sulla stessa macchina: socket AF_UNIX (abilita anche FGET e RING). */
+			unix_path = optarg;
+			break;
+		case 'u':
+			/* Upload: i file ricevuti con PUT vanno in questa directory ("directory[:max_byte]"). */
+			upload_dir = optarg;
+			break;
+		case 'H':
+			/* Riavvio: la socket in ascolto passa dal processo in esecuzione a quello nuovo. */
+			handoff_path = optarg;
+			break;
+		case 'R':
+			/* Radice servita: i nomi chiesti dai client sono risolti solo sotto questa directory. */
+			root_dir = optarg;
+			break;
+		case 'w':
+			/* Cattura: ogni richiesta servita viene registrata in questo file. */
+			trace_path = optarg;
+			break;
+		default:
+			err_quit("usage: %s [-t %s] [-r conn_rate[:burst]] [-a addr_rate[:burst]] [-g global_rate[:burst]] [-c cache_bytes[:max_file]] [-d threads[:depth]] [-b chunk[:huge]] [-T cert:key [-K]] [-u upload_dir[:max_bytes]] [-H control_path] [-R root_dir] [-w trace_file] (<port> | -U socket_path)", prog_name, TCP_PROFILES);
+		}
+	}
+
+	if (unix_path == NULL && argc - optind < 1)
+		err_quit("usage: %s [-t %s] [-r conn_rate[:burst]] [-a addr_rate[:burst]] [-g global_rate[:burst]] [-c cache_bytes[:max_file]] [-d threads[:depth]] [-b chunk[:huge]] [-T cert:key [-K]] [-u upload_dir[:max_bytes]] [-H control_path] [-R root_dir] [-w trace_file] (<port> | -U socket_path)", prog_name, TCP_PROFILES);
 	else
 	{
-		/* La listen crea la socket TCP, fa la bind sulla porta e permette connessioni da accettare. */
-		listenfd = tcp_listen(NULL, argv[1], NULL);
+		/* Radice servita: da qui in poi anche i percorsi relativi delle altre opzioni partono da lì. */
+		if (root_dir != NULL)
+			pi_init(root_dir);
+
+		/* Traccia delle richieste, scritta da tutti i figli. */
+		if (trace_path != NULL)
+			tr_init(trace_path);
+
+		/* Tabella dei token bucket condivisa, creata prima di qualunque fork(). */
+		rl_init(&rlcfg);
+
+		/* Cache dei file piccoli, anch'essa condivisa tra i figli. */
+		if (cache_bytes > 0)
+			cache_init(cache_bytes, cache_max);
+
+		/* Limite delle letture dal disco in corso, condiviso tra i figli. */
+		if (dio_threads > 0)
+			dio_init(dio_threads, dio_depth);
+
+		/* Blocco di lettura/invio dei file, fisso o adattato a ogni trasferimento. */
+		if (bp_opt != NULL)
+		{
+			size_t bp_bytes;
+			int bp_huge;
+
+			if (bp_parse(bp_opt, &bp_bytes, &bp_huge) < 0)
+				err_quit("(%s) error - invalid buffer setting '%s'", prog_name, bp_opt);
+			bp_init(bp_bytes, bp_huge);
+		}
+
+		/* Upload abilitati (commit su disco raggruppati). */
+		if (upload_dir != NULL)
+		{
+			char put_dir[4096];
+			uint64_t put_max;
+
+			if (put_parse(upload_dir, put_dir, sizeof(put_dir), &put_max) < 0)
+				err_quit("(%s) error - invalid upload setting '%s'", prog_name, upload_dir);
+			put_init(put_dir, put_max);
+		}
+
+		/* Digest CRC32C dei file inviati con CGET. */
+		csum_init();
+
+		if (tls_certkey != NULL && tls_server_init(tls_certkey, ktls) < 0)
+			err_quit("(%s) error - invalid TLS certificate/key '%s'", prog_name, tls_certkey);
+
+		/* La socket in ascolto arriva da systemd (socket activation) o dal server già in
+		   esecuzione sulla socket di controllo (-H); se no la listen crea la socket TCP
+		   (AF_UNIX con -U), fa la bind sulla porta e permette connessioni da accettare. */
+		if ((listenfd = ho_activated()) < 0 && (handoff_path == NULL || (listenfd = ho_takeover(handoff_path)) < 0))
+			listenfd = unix_path != NULL ? unix_listen(unix_path, NULL) : tcp_listen(NULL, argv[optind], NULL);
+
+		/* Socket di controllo da cui il prossimo processo prenderà la socket in ascolto. */
+		int ctlfd = handoff_path != NULL ? ho_control(handoff_path) : -1;
 
 		int connfd; /* Socket connessa. */
 
@@ -47,15 +208,54 @@ int main(int argc, char *argv[])
 		{
 			socklen_t clilen = sizeof(cliaddr); /* Lunghezza Client. */
 
+			/* Un nuovo processo del server chiede la socket in ascolto: se la riceve smettiamo di accettare. */
+			if (ho_pending(listenfd, ctlfd))
+			{
+				if (ho_handover(ctlfd, listenfd) == 0)
+					break;
+				continue;
+			}
+
 			connfd = Accept(listenfd, (struct sockaddr *)&cliaddr, &clilen);
 
 			printf("(%s) --- accepted connection from client [%s]\n", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
+			/* Applichiamo (e registriamo) il profilo TCP anche alla socket connessa. */
+			if (cliaddr.ss_family != AF_UNIX)
+				tcp_tune(connfd);
+
+			/* Handshake TLS: la connessione prosegue sul descrittore restituito
+			   (la socket stessa con kTLS, altrimenti il relay in user space). */
+			if (tls_enabled())
+			{
+				int tlsfd = tls_start(connfd, NULL);
+
+				if (tlsfd < 0)
+				{
+					err_msg("(%s) error - TLS handshake failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+					if (close(connfd) != 0)
+						err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+					continue;
+				}
+				connfd = tlsfd;
+			}
+
 			/* Processa la richiesta */
+			tr_begin();
 			manageRequest(connfd, cliaddr, clilen);
+			cache_report();
+			bp_report();
+			pi_report();
 			if (close(connfd) != 0)
 				err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+
+			/* Attendiamo che il relay TLS (se presente) invii tutto e chiuda la connessione. */
+			tls_end();
 		}
+
+		/* Socket passata al nuovo processo (server iterativo: nessun trasferimento in corso). */
+		close(listenfd);
+		close(ctlfd);
 	}
 	/* Programma terminato correttamente. */
 	return 0;
@@ -74,17 +274,41 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 
 	int nByteRead; /* Numero di byte ricevuti dalla connfd. */
 
+	/* Token bucket della connessione (e del suo indirizzo). */
+	struct rl_conn rl;
+	rl_conn_init(&rl, connfd, (struct sockaddr *)&cliaddr, clilen);
+
+	/* Nessun comando di una connessione precedente nella raffica, né file già consigliati. */
+	cs_reset();
+	pf_reset();
+
+	/* Buffer dei dati dei file, preso dal pool al primo GET e riusato. */
+	char *data = NULL;
+	size_t data_len = 0, chunk;
+
 	for (;;)
 	{
 		char buffer[MAXBUFL]; /* Buffer utilizzato lato server. */
 
-		/* Cancelliamo tutti i byte del buffer. */
-		memset(buffer, 0, MAXBUFL);
+		/* Cancelliamo i byte del comando (recv() può restituirne meno di 4). */
+		memset(buffer, 0, 4);
+
+		/* Risposta precedente conclusa: la registriamo nella traccia (-w); i GET
+		   già presi dalla socket con la raffica contano come richieste in coda. */
+		struct cs_cmd *cmd;
+		tr_wait(connfd, cs_queued(&cmd) > 0);
+
+		/* GET e CGET in pipeline arrivano a raffiche, analizzate in una passata
+		   (cmdscan.c): il prossimo, se c'è, è già pronto senza select() né recv(). */
+		cmd = cs_next(connfd);
 
-		if (select(FD_SETSIZE, &read_set, NULL, NULL, &tval) > 0)
+		if (cmd != NULL || select(FD_SETSIZE, &read_set, NULL, NULL, &tval) > 0)
 		{
+			if (cmd != NULL)
+				memcpy(buffer, cmd->line, 4);
+
 			/* Riceviamo dal socket connesso. */
-			if ((nByteRead = recv(connfd, buffer, 4, 0)) == 0)
+			if ((nByteRead = cmd != NULL ? 4 : recv(connfd, buffer, 4, 0)) == 0)
 			{
 			printf("(%s) --- connection closed by party [%s]\n", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 				break;
@@ -96,10 +320,13 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 			}
 			else
 			{
+				tr_command(connfd, buffer);
+
 				/* strncmp() è uguale a 0 se riceviamo un messaggio di richiesta dal client. */
-				if (strncmp(buffer, MSG_GET, 4) == 0)
+				if (strncmp(buffer, MSG_GET, 4) == 0 || strncmp(buffer, MSG_CGET, 4) == 0)
 				{
-					memset(buffer, 0, MAXBUFL);
+					/* CGET: la risposta termina con il CRC32C del contenuto. */
+					int want_crc = buffer[0] == 'C';
 
 					/* Tutti i descrittori che non sono pronti al ritorno della select()
 					   avranno bit del descriptor set puliti.
@@ -107,10 +334,11 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 
 					FD_SET(connfd, &read_set);
 
-					if (select(FD_SETSIZE, &read_set, NULL, NULL, &tval) > 0)
+					if (cmd != NULL || select(FD_SETSIZE, &read_set, NULL, NULL, &tval) > 0)
 					{
-						/* Leggiamo il nome del file più \r\n, \0 è aggiunto dalla funzione. */
-						nByteRead = readline_unbuffered(connfd, buffer, MAXBUFL);
+						/* Leggiamo il nome del file più \r\n, \0 è aggiunto dalla funzione
+						   (dalla raffica il nome è già separato e terminato). */
+						nByteRead = cmd != NULL ? (int)cmd->len : readline_unbuffered(connfd, buffer, MAXBUFL);
 
 						if (nByteRead == 0)
 						{
@@ -124,30 +352,53 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 						}
 						else
 						{
-							/* Prendiamo solo il nome del file, senza altri caratteri. */
-							char *token = strtok(buffer, "\r");
+							/* Prendiamo solo il nome del file, senza altri caratteri (dopo CGET resta lo spazio). */
+							char *token = cmd != NULL ? cmd->name : strtok(want_crc && buffer[0] == ' ' ? buffer + 1 : buffer, "\r");
 
 							printf("(%s) --- received string '%s' from client [%s]\n", prog_name, token, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
 							char filename[MAXBUFL];
 
 							strcpy(filename, token);
+							tr_name(filename);
+
+							/* File piccolo: risposta completa dalla cache, senza stat() né open(). */
+							int cached = cache_get(connfd, filename, &rl, want_crc);
+
+							if (cached > 0)
+							{
+								printf("(%s) --- sent file '%s' to client [%s] (cache)\n", prog_name, filename, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+								continue;
+							}
+							else if (cached < 0)
+							{
+								err_ret("(%s) error - sendn() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+
+								if ((closeConnection(connfd)) == 0)
+									break;
+								else
+								{
+									err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+									break;
+								}
+							}
+
+							/* Apriamo il file: con -R solo sotto la radice servita. */
+							int fd = pi_open(filename, O_RDONLY | O_CLOEXEC);
 
-							/* Controlliamo se il file è accessibile. */
-							if ((access(filename, F_OK)) != -1)
+							if (fd >= 0)
 							{
 								/* File esiste. */
 
 								printf("(%s) --- client [%s] asked to send file '%s'\n", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen), filename);
 
-								memset(buffer, 0, MAXBUFL);
-								strncpy(buffer, MSG_OK, 5);
-
-								if ((sendn(connfd, buffer, 5, MSG_NOSIGNAL)) != 5)
+								if ((sendn(connfd, MSG_OK, 5, MSG_NOSIGNAL)) != 5)
 								{
 									err_ret("(%s) error - sendn() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-									if ((close(connfd)) == 0)
+									close(fd);
+
+									if ((closeConnection(connfd)) == 0)
 										break;
 									else
 									{
@@ -159,11 +410,13 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 								struct stat stat_buf;
 
 								/* Otteniamo informazioni dal file (byte, timestamp). */
-								if ((stat(filename, &stat_buf)) != 0)
+								if ((fstat(fd, &stat_buf)) != 0)
 								{
-									err_ret("(%s) error - stat() of the file '%s' failed with client [%s]", prog_name, filename, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+									err_ret("(%s) error - fstat() of the file '%s' failed with client [%s]", prog_name, filename, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+
+									close(fd);
 
-									if ((close(connfd)) == 0)
+									if ((closeConnection(connfd)) == 0)
 										break;
 									else
 									{
@@ -180,7 +433,9 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 								{
 									err_ret("(%s) error - sendn() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-									if ((close(connfd)) == 0)
+									close(fd);
+
+									if ((closeConnection(connfd)) == 0)
 										break;
 									else
 									{
@@ -189,16 +444,41 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 									}
 								}
 
+								/* Blocco adatto al file e alla socket; il buffer del pool cresce solo se serve. */
+								chunk = bp_chunk(connfd, stat_buf.st_size);
+								if (chunk > data_len)
+								{
+									bp_put(data, data_len);
+									data_len = 0;
+									if ((data = bp_get(chunk)) == NULL)
+									{
+										err_ret("(%s) error - no memory for a buffer of %zu bytes for client [%s]", prog_name, chunk, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+
+										close(fd);
+
+										if ((closeConnection(connfd)) == 0)
+											break;
+										else
+										{
+											err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+											break;
+										}
+									}
+									data_len = chunk;
+								}
+
 								int n = 0;				    	/* Numero di byte. */
 								int i;						/* Numero di byte letti. */
 								u_int32_t remaining_data = ntohl(file_dim); 	/* Dati rimasti da inviare. */
 
 								FILE *fPtr;
-								if ((fPtr = fopen(filename, "r")) == NULL)
+								if ((fPtr = fdopen(fd, "r")) == NULL)
 								{
-									err_msg("(%s) error - fopen of '%s' failed with client [%s]: %s", prog_name, filename, sock_ntop((struct sockaddr *)&cliaddr, clilen), strerror(errno));
+									err_msg("(%s) error - fdopen of '%s' failed with client [%s]: %s", prog_name, filename, sock_ntop((struct sockaddr *)&cliaddr, clilen), strerror(errno));
+
+									close(fd);
 
-									if ((close(connfd)) == 0)
+									if ((closeConnection(connfd)) == 0)
 										break;
 									else
 									{
@@ -207,33 +487,74 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 									}
 								}
 
-								/* Leggiamo dal file puntato da fPtr MAXBUF elementi di dati, ognuno di un byte
-								   e li salviamo nel buffer. */
-								i = fread(buffer, sizeof(char), MAXBUFL, fPtr);
+								/* Lettura sequenziale del file corrente e prefetch dei file dei GET già in coda. */
+								pf_begin(connfd, fileno(fPtr));
+
+								/* CGET di una versione del file di cui conosciamo già il CRC32C, o GET su una
+								   connessione kTLS (la cifratura è nel kernel): il contenuto parte con sendfile(),
+								   senza passare dal buffer. Se l'invio fallisce remaining_data resta > 0 e la
+								   connessione viene chiusa più sotto. */
+								struct csum_key ck;
+								u_int32_t crc = 0;
+								int crc_cached = want_crc && csum_lookup(fileno(fPtr), stat_buf.st_size, &ck, &crc);
+								int use_sendfile = crc_cached || (!want_crc && tls_kernel());
+
+								if (use_sendfile)
+								{
+									if (csum_sendfile(connfd, fileno(fPtr), stat_buf.st_size, &rl) == 0)
+									{
+										remaining_data = 0;
+									}
+								}
+
+								/* Con il pool di I/O su disco (-d) i blocchi successivi vengono letti
+								   in anticipo dai thread del pool mentre questo viene inviato. */
+								struct dio_stream ds;
+								int use_dio = !use_sendfile && dio_enabled() && dio_stream_open(&ds, fileno(fPtr), stat_buf.st_size) == 0;
 
-								while ((n = sendn(connfd, buffer, i, MSG_NOSIGNAL)) > 0)
+								/* Leggiamo dal file puntato da fPtr un blocco di chunk byte e lo salviamo
+								   nel buffer (nulla se il file è già stato inviato). */
+								i = use_sendfile ? 0 : use_dio ? (size_t)dio_stream_read(&ds, data, chunk) : fread(data, sizeof(char), chunk, fPtr);
+
+								/* Attendiamo i token necessari per il blocco da inviare. */
+								rl_acquire(&rl, i);
+
+								while (remaining_data > 0 && (n = sendn(connfd, data, i, MSG_NOSIGNAL)) > 0)
 								{
-									memset(buffer, 0, MAXBUFL);
+									if (want_crc)
+										crc = crc32c(crc, data, n);
 
-									i = fread(buffer, sizeof(char), MAXBUFL, fPtr);
+									i = use_dio ? (size_t)dio_stream_read(&ds, data, chunk) : fread(data, sizeof(char), chunk, fPtr);
 
 									/* Teniamo conto dei dati rimasti. */
 									remaining_data -= n;
 
-									/* Se il file è stato inviato correttamente. */
+									/* File inviato: si chiude più sotto. */
 									if (remaining_data <= 0)
-									{
-										printf("(%s) --- sent file '%s' to client [%s]\n", prog_name, filename, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+										break;
 
-										if ((fclose(fPtr)) == 0)
-											break;
-										else
-										{
-											err_ret("(%s) error - fclose() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
-											break;
-										}
-									}
+									rl_acquire(&rl, i);
 								}
+								/* Attendiamo le letture ancora in corso nel pool prima di chiudere il file. */
+								if (use_dio)
+									dio_stream_close(&ds);
+
+								/* Se il file è stato inviato correttamente (anche un file vuoto, per cui il ciclo non parte). */
+								if (remaining_data <= 0)
+								{
+									printf("(%s) --- sent file '%s' to client [%s]%s\n", prog_name, filename, sock_ntop((struct sockaddr *)&cliaddr, clilen), use_sendfile ? " (sendfile)" : "");
+
+									/* Digest di questa versione del file per le prossime CGET. */
+									if (want_crc && !crc_cached)
+										csum_store(fileno(fPtr), &ck, crc);
+
+									/* File grande richiesto una sola volta: fuori dalla page cache. */
+									pf_end(connfd, fileno(fPtr), stat_buf.st_size, filename);
+
+									if ((fclose(fPtr)) != 0)
+										err_ret("(%s) error - fclose() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+								}
+
 								/* Se il file non è stato inviato correttamente chiudiamo la connessione per evitare loop infiniti. */
 								if (remaining_data > 0)
 								{
@@ -241,7 +562,7 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 
 									if ((fclose(fPtr)) == 0)
 									{
-										if ((close(connfd)) == 0)
+										if ((closeConnection(connfd)) == 0)
 											break;
 										else
 										{
@@ -253,7 +574,7 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 									{
 										err_ret("(%s) error - fclose() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-										if ((close(connfd)) == 0)
+										if ((closeConnection(connfd)) == 0)
 											break;
 										else
 										{
@@ -270,7 +591,7 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 								{
 									err_ret("(%s) error - sendn() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-									if ((close(connfd)) == 0)
+									if ((closeConnection(connfd)) == 0)
 										break;
 									else
 									{
@@ -278,17 +599,36 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 										break;
 									}
 								}
+
+								/* Coda di CGET: CRC32C del contenuto inviato. */
+								if (want_crc)
+								{
+									u_int32_t crc_net = htonl(crc);
+
+									if ((sendn(connfd, &crc_net, 4, MSG_NOSIGNAL)) != 4)
+									{
+										err_ret("(%s) error - sendn() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+
+										if ((closeConnection(connfd)) == 0)
+											break;
+										else
+										{
+											err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+											break;
+										}
+									}
+								}
 							}
 							else
 							{
 								/* File non esistente. */
 
-								err_msg("(%s) error - access() failed with client [%s]: %s", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen), strerror(errno));
+								err_msg("(%s) error - cannot open '%s' for client [%s]: %s", prog_name, filename, sock_ntop((struct sockaddr *)&cliaddr, clilen), strerror(errno));
 
 								if ((sendn(connfd, MSG_ERROR, sizeof(char) * 6, MSG_NOSIGNAL)) != 6)
 									err_ret("(%s) error - sendn() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-								if ((close(connfd)) == 0)
+								if ((closeConnection(connfd)) == 0)
 									break;
 								else
 								{
@@ -302,7 +642,7 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 					{
 						printf("(%s) Timeout waiting for data from client [%s]: connection with client will be closed\n", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-						if ((close(connfd)) == 0)
+						if ((closeConnection(connfd)) == 0)
 							break;
 						else
 						{
@@ -314,7 +654,7 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 					{
 						err_ret("(%s) error - select() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-						if ((close(connfd)) == 0)
+						if ((closeConnection(connfd)) == 0)
 							break;
 						else
 						{
@@ -324,6 +664,115 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 					}
 				}
 
+				/* Protocollo v2 multiplexato: "GET2\r\n" al posto del primo "GET ". */
+				else if (strncmp(buffer, V2_MAGIC, 4) == 0 && readn(connfd, buffer + 4, 2) == 2 && strncmp(buffer + 4, "\r\n", 2) == 0)
+				{
+					v2_serve(connfd, &rl, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+					break;
+				}
+
+				/* Comando MGET: molti file con una sola richiesta, la connessione resta aperta. */
+				else if (strncmp(buffer, MSG_MGET, 4) == 0)
+				{
+					if (mget_serve(connfd, &rl, sock_ntop((struct sockaddr *)&cliaddr, clilen)) < 0)
+					{
+						if ((closeConnection(connfd)) == 0)
+							break;
+						else
+						{
+							err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+							break;
+						}
+					}
+				}
+
+				/* Comando TAR: directory o glob inviati come un unico archivio. */
+				else if (strncmp(buffer, MSG_TAR, 4) == 0)
+				{
+					if (readline_unbuffered(connfd, buffer, MAXBUFL) <= 0 ||
+						arch_serve(connfd, &rl, strtok(buffer, "\r\n"), sock_ntop((struct sockaddr *)&cliaddr, clilen)) < 0)
+					{
+						if ((closeConnection(connfd)) == 0)
+							break;
+						else
+						{
+							err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+							break;
+						}
+					}
+				}
+
+				/* Comando FGET (solo socket AF_UNIX): al client arriva il descrittore del file aperto. */
+				else if (strncmp(buffer, MSG_FGET, 4) == 0 && cliaddr.ss_family == AF_UNIX)
+				{
+					if (readline_unbuffered(connfd, buffer, MAXBUFL) <= 0 ||
+						fdpass_serve(connfd, buffer[0] == ' ' ? strtok(buffer + 1, "\r\n") : NULL, sock_ntop((struct sockaddr *)&cliaddr, clilen)) < 0)
+					{
+						if ((closeConnection(connfd)) == 0)
+							break;
+						else
+						{
+							err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+							break;
+						}
+					}
+				}
+
+				/* Comando PUT: file ricevuto dal client nella directory di upload (-u). */
+				else if (strncmp(buffer, MSG_PUT, 4) == 0)
+				{
+					if (readline_unbuffered(connfd, buffer, MAXBUFL) <= 0 ||
+						put_serve(connfd, &rl, strtok(buffer, "\r\n"), sock_ntop((struct sockaddr *)&cliaddr, clilen)) < 0)
+					{
+						if ((closeConnection(connfd)) == 0)
+							break;
+						else
+						{
+							err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+							break;
+						}
+					}
+				}
+
+				/* Comando DGET: il client invia la firma della sua copia del file e riceve solo le differenze. */
+				else if (strncmp(buffer, MSG_DGET, 4) == 0)
+				{
+					if (readline_unbuffered(connfd, buffer, MAXBUFL) <= 0 ||
+						delta_serve(connfd, &rl, buffer[0] == ' ' ? strtok(buffer + 1, "\r\n") : NULL, sock_ntop((struct sockaddr *)&cliaddr, clilen)) < 0)
+					{
+						if ((closeConnection(connfd)) == 0)
+							break;
+						else
+						{
+							err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+							break;
+						}
+					}
+				}
+
+				/* Comando RGET: un intervallo di byte di un file (le parti perse dai client multicast). */
+				else if (strncmp(buffer, MSG_RGET, 4) == 0)
+				{
+					if (readline_unbuffered(connfd, buffer, MAXBUFL) <= 0 ||
+						mc_range_serve(connfd, &rl, buffer, sock_ntop((struct sockaddr *)&cliaddr, clilen)) < 0)
+					{
+						if ((closeConnection(connfd)) == 0)
+							break;
+						else
+						{
+							err_ret("(%s) error - close() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+							break;
+						}
+					}
+				}
+
+				/* Anelli in memoria condivisa (solo socket AF_UNIX): "RING\r\n", poi le GET passano dagli anelli. */
+				else if (strncmp(buffer, MSG_RING, 4) == 0 && cliaddr.ss_family == AF_UNIX && readn(connfd, buffer + 4, 2) == 2 && strncmp(buffer + 4, "\r\n", 2) == 0)
+				{
+					shm_serve(connfd, &rl, sock_ntop((struct sockaddr *)&cliaddr, clilen));
+					break;
+				}
+
 				/* Se non è un messaggio di GET. */
 				else
 				{
@@ -332,7 +781,7 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 					if ((sendn(connfd, MSG_ERROR, sizeof(char) * 6, MSG_NOSIGNAL)) != 6)
 						err_ret("(%s) error - sendn() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-					if ((close(connfd)) == 0)
+					if ((closeConnection(connfd)) == 0)
 						break;
 					else
 					{
@@ -348,7 +797,7 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 		{
 			printf("(%s) Timeout waiting for data from client [%s]: connection with client will be closed\n", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-			if ((close(connfd)) == 0)
+			if ((closeConnection(connfd)) == 0)
 				break;
 			else
 			{
@@ -361,7 +810,7 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 		{
 			err_ret("(%s) error - select() failed with client [%s]", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen));
 
-			if ((close(connfd)) == 0)
+			if ((closeConnection(connfd)) == 0)
 				break;
 			else
 			{
@@ -370,5 +819,15 @@ void manageRequest(int connfd, struct sockaddr_storage cliaddr, socklen_t clilen
 			}
 		}
 	}
+	bp_put(data, data_len); /* Il buffer torna al pool per la prossima connessione. */
+
 	return; /* Torniamo alla funzione chiamante. */
 }
+
+/* Chiude la connessione con il client. Il record della traccia (-w) viene
+   chiuso prima, finché la socket permette ancora di leggere i byte inviati. */
+int closeConnection(int connfd)
+{
+	tr_end(connfd);
+	return close(connfd);
+}
@@ -0,0 +1,264 @@
+/*
+ * Server TCP concorrente su un solo thread, in C++20 (sockco.hpp).
+ * Ogni connessione è una coroutine che serve i comandi GET con codice
+ * sequenziale, come manageRequest() di server1; un executor epoll la riprende
+ * quando la socket è pronta, senza un processo o un thread per connessione.
+ * I GET in pipeline vengono serviti in ordine, analizzati a raffiche direttamente
+ * nel buffer di ricezione (cmdscan.c).
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../sockco.hpp"
+
+extern "C"
+{
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../pathidx.h"
+#include "../cmdscan.h"
+}
+
+#define MAXPEER 128		 /* Lunghezza dell'indirizzo del client. */
+#define BATCH 64		 /* Comandi analizzati per passata. */
+#define MSG_ERROR "-ERR\r\n"     /* Risposta negativa dal server. */
+#define MSG_GET "GET "		 /* Messaggio di richiesta dal client. */
+#define MSG_OK "+OK\r\n"	 /* Risposta positiva dal server. */
+#define TIMEOUT 15		 /* TIMEOUT di ogni attesa sulla socket (sec). */
+#define ACCEPT_RETRY 100	 /* Pausa dopo un errore di accept(), es. EMFILE (ms). */
+
+/* Prototipi di funzione. */
+sockco::task<> manageRequest(sockco::socket conn, struct sockaddr_storage cliaddr, socklen_t clilen);
+sockco::task<> acceptLoop(const sockco::socket &listener);
+sockco::task<int> sendFile(const sockco::socket &conn, const char *filename, const char *peer);
+
+/* Variabili globali. */
+char *prog_name;
+static int nconn = 0; /* Connessioni in corso. */
+
+int main(int argc, char *argv[])
+{
+	/* Per la libreria errlib. */
+	prog_name = argv[0];
+
+	int opt;
+	char *root_dir = NULL; /* Radice servita: i nomi dei client non ne escono (-R). */
+
+	/* Opzioni da riga di comando. */
+	while ((opt = getopt(argc, argv, "t:R:")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			/* Profilo di tuning TCP (buffer, NODELAY, NOTSENT_LOWAT, congestion control, keepalive). */
+			if (tcp_set_profile(optarg) < 0)
+				err_quit("(%s) error - unknown tcp profile '%s' (%s)", prog_name, optarg, TCP_PROFILES);
+			break;
+		case 'R':
+			/* Radice servita: i nomi chiesti dai client sono risolti solo sotto questa directory. */
+			root_dir = optarg;
+			break;
+		default:
+			err_quit("usage: %s [-t %s] [-R root_dir] <port>", prog_name, TCP_PROFILES);
+		}
+	}
+
+	if (argc - optind < 1)
+		err_quit("usage: %s [-t %s] [-R root_dir] <port>", prog_name, TCP_PROFILES);
+
+	if (root_dir != NULL)
+		pi_init(root_dir);
+
+	/* sendfile() su una connessione chiusa dal client genererebbe SIGPIPE. */
+	Signal(SIGPIPE, SIG_IGN);
+
+	/* L'executor va creato prima delle socket: la chiusura di una socket sveglia chi la attende. */
+	sockco::executor ex;
+	sockco::socket listener = sockco::socket::listen(argv[optind]);
+
+	sockco::spawn(acceptLoop(listener));
+
+	if (ex.run() < 0)
+		err_sys("(%s) error - epoll_wait() failed", prog_name);
+
+	/* Programma terminato correttamente. */
+	return 0;
+}
+
+/* Accetta le connessioni e avvia una coroutine per ciascuna. */
+sockco::task<> acceptLoop(const sockco::socket &listener)
+{
+	for (;;)
+	{
+		struct sockaddr_storage cliaddr; /* Indirizzo Client. */
+		socklen_t clilen = sizeof(cliaddr);
+
+		sockco::socket conn = co_await listener.accept((struct sockaddr *)&cliaddr, &clilen);
+
+		if (!conn)
+		{
+			/* Es. troppi descrittori aperti: riproviamo quando qualche connessione si è chiusa. */
+			err_ret("(%s) error - accept() failed", prog_name);
+			co_await sockco::sleep_for{ACCEPT_RETRY};
+			continue;
+		}
+
+		printf("(%s) --- accepted connection from client [%s] (%d open)\n", prog_name, sock_ntop((struct sockaddr *)&cliaddr, clilen), ++nconn);
+
+		/* Applichiamo (e registriamo) il profilo TCP anche alla socket connessa. */
+		tcp_tune(conn.get());
+
+		/* La coroutine gira fino alla prima attesa, poi torniamo ad accettare. */
+		sockco::spawn(manageRequest(std::move(conn), cliaddr, clilen));
+	}
+}
+
+/* Invia il file chiesto da un GET: 0 per proseguire, 1 se è stato risposto -ERR,
+   -1 se la connessione va chiusa subito. */
+sockco::task<int> sendFile(const sockco::socket &conn, const char *filename, const char *peer)
+{
+	printf("(%s) --- received string '%s' from client [%s]\n", prog_name, filename, peer);
+
+	/* Apriamo il file: con -R solo sotto la radice servita. */
+	sockco::unique_fd file(pi_open(filename, O_RDONLY | O_CLOEXEC));
+	struct stat stat_buf;
+	int found = file && fstat(file.get(), &stat_buf) == 0;
+
+	/* Solo file regolari: una directory si apre, ma sendfile() fallirebbe. */
+	if (found && !S_ISREG(stat_buf.st_mode))
+	{
+		found = 0;
+		errno = S_ISDIR(stat_buf.st_mode) ? EISDIR : EINVAL;
+	}
+
+	if (!found)
+	{
+		err_ret("(%s) error - cannot open '%s' for client [%s]", prog_name, filename, peer);
+
+		if (co_await conn.sendn(MSG_ERROR, 6) != 6)
+		{
+			err_ret("(%s) error - sendn() failed with client [%s]", prog_name, peer);
+			co_return -1;
+		}
+		co_return 1;
+	}
+
+	printf("(%s) --- client [%s] asked to send file '%s'\n", prog_name, peer, filename);
+
+	/* "+OK\r\n" e numero di byte; MSG_MORE li unisce al primo segmento del contenuto. */
+	char head[9];
+	u_int32_t file_dim = htonl(stat_buf.st_size);
+	u_int32_t timestamp = htonl(stat_buf.st_mtime);
+
+	memcpy(head, MSG_OK, 5);
+	memcpy(head + 5, &file_dim, 4);
+
+	if (co_await conn.sendn(head, 9, MSG_MORE, TIMEOUT * 1000) != 9)
+	{
+		err_ret("(%s) error - sendn() failed with client [%s]", prog_name, peer);
+		co_return -1;
+	}
+
+	/* Il contenuto passa dalla page cache alla socket senza copie (sendfile()). */
+	if (co_await conn.sendfilen(file.get(), 0, ntohl(file_dim), TIMEOUT * 1000) != (ssize_t)ntohl(file_dim))
+	{
+		err_ret("(%s) error - sendfile() of '%s' failed with client [%s]", prog_name, filename, peer);
+		co_return -1;
+	}
+
+	/* Timestamp dell'ultima modifica. */
+	if (co_await conn.sendn(&timestamp, 4, 0, TIMEOUT * 1000) != 4)
+	{
+		err_ret("(%s) error - sendn() failed with client [%s]", prog_name, peer);
+		co_return -1;
+	}
+
+	printf("(%s) --- sent file '%s' to client [%s]\n", prog_name, filename, peer);
+	co_return 0;
+}
+
+sockco::task<> manageRequest(sockco::socket conn, struct sockaddr_storage cliaddr, socklen_t clilen)
+{
+	/* sock_ntop() usa un buffer statico, condiviso da tutte le coroutine. */
+	char peer[MAXPEER];
+	snprintf(peer, sizeof(peer), "%s", sock_ntop((struct sockaddr *)&cliaddr, clilen));
+
+	/* Comandi letti a blocchi; ogni attesa scade dopo TIMEOUT secondi. */
+	sockco::reader in(conn.get(), TIMEOUT * 1000);
+
+	struct cs_cmd cmd[BATCH]; /* Comandi di una raffica, con i nomi dentro il buffer di in. */
+	int result = 0;		  /* 1: risposto -ERR, la connessione va chiusa in modo ordinato. */
+
+	while (result == 0)
+	{
+		/* Tutte le righe complete ricevute, separate in una passata (cmdscan.c). */
+		size_t used, ncmd = cs_scan(in.data(), in.buffered(), cmd, BATCH, &used);
+
+		if (ncmd == 0)
+		{
+			ssize_t nByteRead = co_await in.more();
+
+			if (nByteRead == 0)
+			{
+				printf("(%s) --- connection closed by party [%s]\n", prog_name, peer);
+				break;
+			}
+			else if (nByteRead < 0 && errno != EMSGSIZE)
+			{
+				err_ret("(%s) error - recv() failed with client [%s]", prog_name, peer);
+				break;
+			}
+			else if (nByteRead > 0)
+				continue;
+
+			/* Riga più lunga del buffer: non può essere un comando valido. */
+			cmd[0].verb = CS_OTHER;
+			ncmd = 1;
+			used = in.buffered();
+		}
+
+		for (size_t i = 0; i < ncmd && result == 0; i++)
+		{
+			if (cmd[i].verb != CS_GET)
+			{
+				err_msg("(%s) error - invalid command from client [%s]", prog_name, peer);
+
+				if (co_await conn.sendn(MSG_ERROR, 6) != 6)
+				{
+					err_ret("(%s) error - sendn() failed with client [%s]", prog_name, peer);
+					result = -1;
+				}
+				else
+					result = 1;
+				break;
+			}
+
+			/* Il nome resta nel buffer: lo terminiamo al posto del CR LF. */
+			cmd[i].name[cmd[i].namelen] = '\0';
+			result = co_await sendFile(conn, cmd[i].name, peer);
+		}
+		in.consume(used);
+	}
+
+	/* I GET in pipeline dopo quello rifiutato sono ancora da leggere: chiudendo subito
+	   partirebbe un RST e il client perderebbe le risposte non ancora ricevute.
+	   Inviamo il FIN e scartiamo i comandi finché il client non chiude. */
+	if (result == 1 && shutdown(conn.get(), SHUT_WR) == 0)
+	{
+		in.consume(in.buffered());
+		while (co_await in.more() > 0)
+			in.consume(in.buffered());
+	}
+
+	if (conn.reset() != 0)
+		err_ret("(%s) error - close() failed with client [%s]", prog_name, peer);
+
+	/* Frame delle coroutine: dopo le prime connessioni nessuna nuova allocazione. */
+	sockco::frame_pool::stats fs = sockco::frame_pool::report();
+
+	printf("(%s) --- closed connection with client [%s] (%d open; frames: %zu requests, %zu in use, peak %zu, %zu slabs)\n", prog_name, peer, --nconn,
+	       fs.requests, fs.in_use, fs.peak, fs.slabs);
+}
@@ -0,0 +1,443 @@
+/*
+
+module: shmring.c
+
+purpose: shared-memory ring transport for clients on the same host
+         the server creates a memfd with two single-producer single-consumer
+         byte rings and passes it to the client over the AF_UNIX connection.
+         Head and tail are free-running 32 bit counters; a side that finds the
+         ring empty (or full) polls it SHM_SPIN times, then sleeps on the
+         counter with a shared futex, and the other side wakes it only if its
+         "waiting" flag is set, so a busy stream makes no system call at all.
+
+         File bodies are read with pread() straight into the free space of
+         the response ring: one copy, from the page cache to the ring.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "errlib.h"
+#include "sockwrap.h"
+#include "ratelimit.h"
+#include "pathidx.h"
+#include "shmring.h"
+
+#define SHM_MAGIC 0x52494e47u /* "RING" */
+#define SHM_LINE 64	      /* Cache line. */
+
+extern char *prog_name;
+
+struct shm_ring
+{
+	uint32_t head __attribute__((aligned(SHM_LINE))); /* bytes written by the producer */
+	uint32_t head_wait;				   /* the consumer sleeps on head */
+	uint32_t tail __attribute__((aligned(SHM_LINE))); /* bytes read by the consumer */
+	uint32_t tail_wait;				   /* the producer sleeps on tail */
+	uint32_t closed __attribute__((aligned(SHM_LINE)));
+	char data[] __attribute__((aligned(SHM_LINE)));
+};
+
+/* At the start of the memfd. */
+struct shm_hdr
+{
+	uint32_t magic;
+	uint32_t req_size, resp_size;
+	uint32_t req_off, resp_off;
+};
+
+static void shm_futex_wait(uint32_t *addr, uint32_t val)
+{
+	struct timespec ts;
+
+	ts.tv_sec = SHM_WAIT_MSEC / 1000;
+	ts.tv_nsec = (SHM_WAIT_MSEC % 1000) * 1000000L;
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void shm_futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* CPU hint inside a spin loop. */
+static inline void shm_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield" ::: "memory");
+#else
+	__asm__ volatile("" ::: "memory");
+#endif
+}
+
+/* The peer closed the control socket (or died). */
+static int shm_hangup(struct shm_chan *c)
+{
+	struct pollfd p;
+
+	p.fd = c->ctl;
+	p.events = POLLRDHUP;
+	return poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+/* Waits until *counter differs from val. Returns 0, -1 if the channel was closed. */
+static int shm_wait(struct shm_chan *c, struct shm_ring *r, uint32_t *counter, uint32_t *waitflag, uint32_t val)
+{
+	int i;
+
+	for (i = 0; i < c->spin; i++)
+	{
+		if (__atomic_load_n(counter, __ATOMIC_ACQUIRE) != val)
+			return 0;
+		shm_relax();
+	}
+	for (;;)
+	{
+		if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+			return -1;
+		__atomic_store_n(waitflag, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) != val)
+			break;
+		shm_futex_wait(counter, val);
+		if (__atomic_load_n(counter, __ATOMIC_ACQUIRE) != val)
+			break;
+		if (shm_hangup(c))
+		{
+			__atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+			return -1;
+		}
+	}
+	__atomic_store_n(waitflag, 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Called after *counter has been published. The fence keeps that store
+   from being reordered after the load of *waitflag (x86 does it with a
+   plain release store): paired with the seq_cst store-then-load of
+   shm_wait(), either the waiter sees the new counter or we see its flag. */
+static void shm_signal(uint32_t *counter, uint32_t *waitflag)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waitflag, __ATOMIC_SEQ_CST))
+		shm_futex_wake(counter);
+}
+
+static size_t shm_round(size_t n)
+{
+	size_t p = 1;
+
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+static void shm_map(struct shm_chan *c, int server)
+{
+	struct shm_hdr *h = c->base;
+	struct shm_ring *req = (struct shm_ring *)((char *)c->base + h->req_off);
+	struct shm_ring *resp = (struct shm_ring *)((char *)c->base + h->resp_off);
+
+	c->tx = server ? resp : req;
+	c->rx = server ? req : resp;
+	c->tx_size = server ? h->resp_size : h->req_size;
+	c->rx_size = server ? h->req_size : h->resp_size;
+
+	/* Spinning on a single CPU only delays the peer it is waiting for. */
+	c->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+}
+
+/* Server side: creates the memfd and maps it. Returns the memfd, to be passed
+   to the client and then closed; -1 on failure. */
+int shm_create(struct shm_chan *c, int ctl, size_t req_size, size_t resp_size)
+{
+	struct shm_hdr *h;
+	size_t req_off, resp_off;
+	int fd;
+
+	req_size = shm_round(req_size);
+	resp_size = shm_round(resp_size);
+	req_off = SHM_LINE * 2;
+	resp_off = req_off + sizeof(struct shm_ring) + req_size;
+	c->len = resp_off + sizeof(struct shm_ring) + resp_size;
+	c->ctl = ctl;
+
+	if ((fd = memfd_create("shmring", MFD_CLOEXEC)) < 0)
+		return -1;
+	if (ftruncate(fd, c->len) != 0 ||
+		(c->base = mmap(NULL, c->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+
+	h = c->base;
+	h->req_size = req_size;
+	h->resp_size = resp_size;
+	h->req_off = req_off;
+	h->resp_off = resp_off;
+	__atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	shm_map(c, 1);
+	return fd;
+}
+
+/* Client side: maps the memfd received from the server. */
+int shm_attach(struct shm_chan *c, int ctl, int memfd)
+{
+	struct shm_hdr *h;
+	struct stat st;
+
+	if (fstat(memfd, &st) != 0 || (size_t)st.st_size < sizeof(struct shm_hdr))
+		return -1;
+	c->len = st.st_size;
+	c->ctl = ctl;
+	if ((c->base = mmap(NULL, c->len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED)
+		return -1;
+
+	h = c->base;
+	if (h->magic != SHM_MAGIC || h->req_size == 0 || (h->req_size & (h->req_size - 1)) ||
+		h->resp_size == 0 || (h->resp_size & (h->resp_size - 1)) ||
+		h->req_off + sizeof(struct shm_ring) + (size_t)h->req_size > h->resp_off ||
+		h->resp_off + sizeof(struct shm_ring) + (size_t)h->resp_size > c->len)
+	{
+		munmap(c->base, c->len);
+		return -1;
+	}
+	shm_map(c, 0);
+	return 0;
+}
+
+void shm_close(struct shm_chan *c)
+{
+	__atomic_store_n(&c->tx->closed, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&c->rx->closed, 1, __ATOMIC_RELEASE);
+	shm_futex_wake(&c->tx->tail);
+	shm_futex_wake(&c->rx->head);
+	munmap(c->base, c->len);
+}
+
+/* Producer: contiguous free space at the head (waits for at least one byte). Returns 0 if closed. */
+size_t shm_reserve(struct shm_chan *c, char **p)
+{
+	struct shm_ring *r = c->tx;
+	uint32_t head = r->head, tail, pos, size = c->tx_size;
+
+	while (head - (tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) >= size)
+		if (shm_wait(c, r, &r->tail, &r->tail_wait, tail) < 0)
+			return 0;
+	if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+		return 0;
+	pos = head & (size - 1);
+	*p = r->data + pos;
+	return size - (head - tail) < size - pos ? size - (head - tail) : size - pos;
+}
+
+void shm_commit(struct shm_chan *c, size_t n)
+{
+	struct shm_ring *r = c->tx;
+
+	__atomic_store_n(&r->head, r->head + (uint32_t)n, __ATOMIC_RELEASE);
+	shm_signal(&r->head, &r->head_wait);
+}
+
+/* Consumer: contiguous data at the tail (waits for at least one byte). Returns 0 if closed and empty. */
+size_t shm_peek(struct shm_chan *c, char **p)
+{
+	struct shm_ring *r = c->rx;
+	uint32_t tail = r->tail, head, pos, avail, size = c->rx_size;
+
+	while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail)
+		if (shm_wait(c, r, &r->head, &r->head_wait, head) < 0)
+			return 0;
+	avail = head - tail;
+	if (avail > size)
+		return 0; /* corrupted by the peer */
+	pos = tail & (size - 1);
+	*p = r->data + pos;
+	return avail < size - pos ? avail : size - pos;
+}
+
+void shm_consume(struct shm_chan *c, size_t n)
+{
+	struct shm_ring *r = c->rx;
+
+	__atomic_store_n(&r->tail, r->tail + (uint32_t)n, __ATOMIC_RELEASE);
+	shm_signal(&r->tail, &r->tail_wait);
+}
+
+/* Writes all n bytes. Returns 0, -1 if the channel was closed. */
+int shm_write(struct shm_chan *c, const void *buf, size_t n)
+{
+	const char *src = buf;
+	size_t len;
+	char *p;
+
+	while (n > 0)
+	{
+		if ((len = shm_reserve(c, &p)) == 0)
+			return -1;
+		if (len > n)
+			len = n;
+		memcpy(p, src, len);
+		shm_commit(c, len);
+		src += len;
+		n -= len;
+	}
+	return 0;
+}
+
+/* Reads n bytes, fewer only if the channel was closed (like readn()). */
+ssize_t shm_read(struct shm_chan *c, void *buf, size_t n)
+{
+	char *dst = buf, *p;
+	size_t got = 0, len;
+
+	while (got < n)
+	{
+		if ((len = shm_peek(c, &p)) == 0)
+			break;
+		if (len > n - got)
+			len = n - got;
+		memcpy(dst + got, p, len);
+		shm_consume(c, len);
+		got += len;
+	}
+	return got;
+}
+
+/* Reads a line up to '\n' included and terminates it. Returns its length, 0 if closed, -1 if too long. */
+ssize_t shm_readline(struct shm_chan *c, char *buf, size_t maxlen)
+{
+	size_t n = 0, len, i;
+	char *p;
+
+	while (n < maxlen - 1)
+	{
+		if ((len = shm_peek(c, &p)) == 0)
+			return 0;
+		for (i = 0; i < len && n < maxlen - 1; i++)
+			if ((buf[n++] = p[i]) == '\n')
+			{
+				shm_consume(c, i + 1);
+				buf[n] = '\0';
+				return n;
+			}
+		shm_consume(c, i);
+	}
+	return -1;
+}
+
+/* Response to "GET name\r\n" through the ring, same framing as over the socket. */
+static int shm_get(struct shm_chan *c, struct rl_conn *rl, const char *name, const char *peer)
+{
+	struct stat st;
+	char hdr[9], *p;
+	uint32_t v;
+	off_t off = 0;
+	size_t len;
+	ssize_t n;
+	int fd;
+
+	if ((fd = pi_open(name, O_RDONLY)) < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		err_msg("(%s) error - '%s' not available for client [%s] (ring)", prog_name, name, peer);
+		if (fd >= 0)
+			close(fd);
+		shm_write(c, "-ERR\r\n", 6);
+		return -1;
+	}
+
+	memcpy(hdr, "+OK\r\n", 5);
+	v = htonl(st.st_size);
+	memcpy(hdr + 5, &v, 4);
+	if (shm_write(c, hdr, 9) < 0)
+		goto fail;
+
+	while (off < st.st_size)
+	{
+		if ((len = shm_reserve(c, &p)) == 0)
+			goto fail;
+		if ((off_t)len > st.st_size - off)
+			len = st.st_size - off;
+		/* A file truncated meanwhile breaks the framing: the channel is closed. */
+		if ((n = pread(fd, p, len, off)) <= 0)
+			goto fail;
+		rl_acquire(rl, n);
+		shm_commit(c, n);
+		off += n;
+	}
+	close(fd);
+
+	v = htonl(st.st_mtime);
+	if (shm_write(c, &v, 4) < 0)
+		return -1;
+	printf("(%s) --- sent file '%s' to client [%s] (ring)\n", prog_name, name, peer);
+	return 0;
+
+fail:
+	err_msg("(%s) error - sending '%s' through the ring failed with client [%s]", prog_name, name, peer);
+	close(fd);
+	return -1;
+}
+
+/* Serves a connection after "RING\r\n": negotiates the rings, then answers GETs until the client goes away. */
+void shm_serve(int connfd, struct rl_conn *rl, const char *peer)
+{
+	struct shm_chan c;
+	char line[4096], *name;
+	int memfd;
+	ssize_t n;
+
+	if ((memfd = shm_create(&c, connfd, SHM_REQ_SIZE, SHM_RESP_SIZE)) < 0)
+	{
+		err_ret("(%s) error - creating the rings failed for client [%s]", prog_name, peer);
+		sendn(connfd, "-ERR\r\n", 6, MSG_NOSIGNAL);
+		return;
+	}
+	if (write_fd(connfd, "+OK\r\n", 5, memfd) != 5)
+	{
+		err_ret("(%s) error - passing the rings failed with client [%s]", prog_name, peer);
+		close(memfd);
+		shm_close(&c);
+		return;
+	}
+	close(memfd);
+	printf("(%s) --- shared-memory rings with client [%s]\n", prog_name, peer);
+
+	while ((n = shm_readline(&c, line, sizeof(line))) > 0)
+	{
+		if (strncmp(line, "GET ", 4) != 0 || n < 6 || line[n - 2] != '\r')
+		{
+			err_msg("(%s) error - illegal command from client [%s] (ring)", prog_name, peer);
+			shm_write(&c, "-ERR\r\n", 6);
+			break;
+		}
+		line[n - 2] = '\0';
+		name = line + 4;
+		if (shm_get(&c, rl, name, peer) < 0)
+			break;
+	}
+	if (n < 0)
+		err_msg("(%s) error - request line too long from client [%s] (ring)", prog_name, peer);
+
+	/* The client reads what is left in the ring before it sees the close. */
+	shm_close(&c);
+	printf("(%s) --- rings closed with client [%s]\n", prog_name, peer);
+}
@@ -0,0 +1,68 @@
+/*
+
+module: shmring.h
+
+purpose: definitions of the shared-memory ring transport (shmring.c), AF_UNIX
+         connections only
+
+         request:  "RING\r\n"
+         response: "+OK\r\n" carrying, as SCM_RIGHTS ancillary data, a memfd
+                   with two byte rings: client -> server and server -> client.
+                   From then on the connection is only used to notice that the
+                   peer went away; the GET commands and their responses, with
+                   the usual framing, flow through the rings.
+
+*/
+
+#ifndef _SHMRING_H
+
+#define _SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MSG_RING "RING"
+#define SHM_REQ_SIZE (64 << 10)	 /* Client -> server ring (bytes, power of two). */
+#define SHM_RESP_SIZE (4 << 20)	 /* Server -> client ring (bytes, power of two). */
+#define SHM_SPIN 2000		 /* Polls of the ring before sleeping on the futex (SMP only). */
+#define SHM_WAIT_MSEC 100	 /* Futex sleep between two checks of the peer. */
+
+struct shm_ring;
+
+/* One end of the ring pair. */
+struct shm_chan
+{
+	void *base;
+	size_t len;
+	struct shm_ring *tx, *rx;
+	uint32_t tx_size, rx_size; /* private copies: the peer can write the shared ones */
+	int ctl;  /* control socket: a hangup closes the channel */
+	int spin; /* polls before sleeping, 0 on a single CPU */
+};
+
+int shm_create(struct shm_chan *c, int ctl, size_t req_size, size_t resp_size);
+
+int shm_attach(struct shm_chan *c, int ctl, int memfd);
+
+void shm_close(struct shm_chan *c);
+
+size_t shm_reserve(struct shm_chan *c, char **p);
+
+void shm_commit(struct shm_chan *c, size_t n);
+
+size_t shm_peek(struct shm_chan *c, char **p);
+
+void shm_consume(struct shm_chan *c, size_t n);
+
+int shm_write(struct shm_chan *c, const void *buf, size_t n);
+
+ssize_t shm_read(struct shm_chan *c, void *buf, size_t n);
+
+ssize_t shm_readline(struct shm_chan *c, char *buf, size_t maxlen);
+
+struct rl_conn;
+
+void shm_serve(int connfd, struct rl_conn *rl, const char *peer);
+
+#endif
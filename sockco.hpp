@@ -0,0 +1,942 @@
+/*
+
+module: sockco.hpp
+
+purpose: C++20 coroutines over sockwrap (header only)
+         a connection is served by straight-line code that co_awaits its
+         socket operations; a single-threaded epoll executor resumes each
+         coroutine when its descriptor is ready, so many connections share
+         one thread without a process or thread each.
+
+         Usage:
+
+             sockco::task<> serve(sockco::socket conn)
+             {
+                 char buf[64];
+                 ssize_t n = co_await conn.recv(buf, sizeof(buf), 15000);
+                 ...
+                 co_await conn.sendn(buf, n);
+             }
+
+             sockco::executor ex;
+             sockco::socket l = sockco::socket::listen("1500");
+             ...                 (co_await l.accept(), then sockco::spawn(serve(...)))
+             ex.run();
+
+         Operations return like their sockwrap counterparts: a count, or -1
+         with errno (ETIMEDOUT when the timeout in ms expires; -1 = none).
+         Descriptors are non-blocking and registered once, edge-triggered:
+         an operation always tries the system call first and waits only on
+         EAGAIN. A descriptor has at most one coroutine waiting to read and
+         one waiting to write. Closing it through unique_fd wakes them with
+         EBADF.
+
+         Coroutine frames come from a per-thread pool of size classes carved
+         from slabs that are never returned: once it is warm, a connection
+         costs no malloc().
+
+*/
+
+#ifndef _SOCKCO_HPP
+
+#define _SOCKCO_HPP
+
+#include <coroutine>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+extern "C"
+{
+#include "errlib.h"
+#include "sockwrap.h"
+}
+
+extern char *prog_name;
+
+#define CO_FRAME_ALIGN 64		/* Frame sizes are rounded up to a multiple of this. */
+#define CO_FRAME_MAX 16384		/* Larger frames come from operator new. */
+#define CO_FRAME_SLAB (256 * 1024)	/* Memory mapped at a time for one size class. */
+#define CO_EVENTS 256			/* epoll events handled per wakeup. */
+#define CO_TIMERS 1024			/* Timers reserved up front. */
+#define CO_READBUF 4096			/* Buffer of a reader. */
+
+#define CO_READ 0
+#define CO_WRITE 1
+
+namespace sockco
+{
+
+class frame_pool
+{
+public:
+	struct stats
+	{
+		std::size_t requests, in_use, peak, slabs;
+	};
+
+	static void *get(std::size_t n)
+	{
+		frame_pool &p = local();
+		std::size_t c = (n + CO_FRAME_ALIGN - 1) / CO_FRAME_ALIGN;
+
+		if (n > CO_FRAME_MAX)
+			return ::operator new(n);
+		if (p.free_[c] == nullptr)
+			p.refill(c);
+
+		block *b = p.free_[c];
+		p.free_[c] = b->next;
+		p.st_.requests++;
+		if (++p.st_.in_use > p.st_.peak)
+			p.st_.peak = p.st_.in_use;
+		return b;
+	}
+
+	static void put(void *ptr, std::size_t n)
+	{
+		frame_pool &p = local();
+		std::size_t c = (n + CO_FRAME_ALIGN - 1) / CO_FRAME_ALIGN;
+
+		if (n > CO_FRAME_MAX)
+		{
+			::operator delete(ptr);
+			return;
+		}
+
+		block *b = static_cast<block *>(ptr);
+		b->next = p.free_[c];
+		p.free_[c] = b;
+		p.st_.in_use--;
+	}
+
+	static stats report()
+	{
+		return local().st_;
+	}
+
+private:
+	struct block
+	{
+		block *next;
+	};
+
+	block *free_[CO_FRAME_MAX / CO_FRAME_ALIGN + 1] = {};
+	stats st_ = {};
+
+	static frame_pool &local()
+	{
+		static thread_local frame_pool p;
+		return p;
+	}
+
+	void refill(std::size_t c)
+	{
+		std::size_t size = c * CO_FRAME_ALIGN;
+		char *slab = static_cast<char *>(mmap(nullptr, CO_FRAME_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+		if (slab == MAP_FAILED)
+			throw std::bad_alloc();
+		st_.slabs++;
+		for (std::size_t off = CO_FRAME_SLAB - CO_FRAME_SLAB % size; off >= size; off -= size)
+		{
+			block *b = reinterpret_cast<block *>(slab + off - size);
+			b->next = free_[c];
+			free_[c] = b;
+		}
+	}
+};
+
+template <typename T = void>
+class task;
+
+namespace detail
+{
+
+struct promise_base
+{
+	std::coroutine_handle<> cont; /* awaiting coroutine, resumed when this one returns */
+
+	static void *operator new(std::size_t n)
+	{
+		return frame_pool::get(n);
+	}
+
+	static void operator delete(void *ptr, std::size_t n)
+	{
+		frame_pool::put(ptr, n);
+	}
+
+	std::suspend_always initial_suspend() noexcept
+	{
+		return {};
+	}
+
+	struct final_awaiter
+	{
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			return h.promise().cont;
+		}
+
+		void await_resume() noexcept
+		{
+		}
+	};
+
+	final_awaiter final_suspend() noexcept
+	{
+		return {};
+	}
+
+	void unhandled_exception() noexcept
+	{
+		std::terminate();
+	}
+};
+
+template <typename T>
+struct promise : promise_base
+{
+	T value{};
+
+	task<T> get_return_object() noexcept;
+
+	void return_value(T v) noexcept
+	{
+		value = std::move(v);
+	}
+
+	T result()
+	{
+		return std::move(value);
+	}
+};
+
+template <>
+struct promise<void> : promise_base
+{
+	task<void> get_return_object() noexcept;
+
+	void return_void() noexcept
+	{
+	}
+
+	void result()
+	{
+	}
+};
+
+/* Coroutine started by spawn(): nobody awaits it, it frees itself. */
+struct detached
+{
+	struct promise_type
+	{
+		static void *operator new(std::size_t n)
+		{
+			return frame_pool::get(n);
+		}
+
+		static void operator delete(void *ptr, std::size_t n)
+		{
+			frame_pool::put(ptr, n);
+		}
+
+		detached get_return_object() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void() noexcept
+		{
+		}
+
+		void unhandled_exception() noexcept
+		{
+			std::terminate();
+		}
+	};
+};
+
+} // namespace detail
+
+/* Lazy coroutine: it starts when awaited and resumes the awaiting one when it returns. */
+template <typename T>
+class [[nodiscard]] task
+{
+public:
+	using promise_type = detail::promise<T>;
+
+	explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h)
+	{
+	}
+
+	task(task &&t) noexcept : h_(std::exchange(t.h_, {}))
+	{
+	}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	~task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+	{
+		h_.promise().cont = c;
+		return h_;
+	}
+
+	T await_resume()
+	{
+		return h_.promise().result();
+	}
+
+private:
+	std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail
+{
+
+template <typename T>
+inline task<T> promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+	return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/* Runs t until its first wait, then from the executor; t is freed when it returns. */
+inline detail::detached spawn(task<void> t)
+{
+	co_await t;
+}
+
+class executor
+{
+public:
+	executor()
+	{
+		if ((ep_ = epoll_create1(EPOLL_CLOEXEC)) < 0)
+			err_sys("(%s) error - epoll_create1() failed", prog_name);
+		timers_.reserve(CO_TIMERS);
+		current_ = this;
+	}
+
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	~executor()
+	{
+		close(ep_);
+		current_ = nullptr;
+	}
+
+	static executor *current() noexcept
+	{
+		return current_;
+	}
+
+	/* Until stop(), or until no coroutine waits for anything. -1 if epoll fails. */
+	int run()
+	{
+		struct epoll_event ev[CO_EVENTS];
+		int n, timeout;
+
+		while (!stopped_ && (waiting_ > 0 || live_timers()))
+		{
+			timeout = -1;
+			if (!timers_.empty())
+			{
+				std::uint64_t now = now_ms();
+				timeout = timers_.front().when > now ? (int)(timers_.front().when - now) : 0;
+			}
+
+			if ((n = epoll_wait(ep_, ev, CO_EVENTS, timeout)) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+
+			/* A coroutine resumed here may close and reuse a later descriptor of the
+			   batch: its waiter then wakes for nothing and waits again. */
+			for (int i = 0; i < n; i++)
+			{
+				if (ev[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+					wake(ev[i].data.fd, CO_READ, 0);
+				if (ev[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+					wake(ev[i].data.fd, CO_WRITE, 0);
+			}
+			expire();
+		}
+		return 0;
+	}
+
+	void stop() noexcept
+	{
+		stopped_ = true;
+	}
+
+	/* Suspends h until fd is ready in direction dir (CO_READ, CO_WRITE). False, with
+	   the error kept for resumed(), if fd cannot be watched: h goes on at once. */
+	bool wait(int fd, int dir, int timeout_ms, std::coroutine_handle<> h)
+	{
+		if ((std::size_t)fd >= fds_.size())
+			fds_.resize(fd + 1);
+
+		fd_state &s = fds_[fd];
+
+		if (!s.registered)
+		{
+			struct epoll_event ev;
+
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.fd = fd;
+			if (epoll_ctl(ep_, EPOLL_CTL_ADD, fd, &ev) != 0 && errno != EEXIST)
+			{
+				s.err[dir] = errno;
+				return false;
+			}
+			s.registered = true;
+		}
+
+		s.h[dir] = h;
+		s.err[dir] = 0;
+		s.timer[dir] = timeout_ms >= 0 ? add_timer(timeout_ms, fd, dir, nullptr) : 0;
+		waiting_++;
+		return true;
+	}
+
+	/* After wait(): 0, or -1 with errno. */
+	int resumed(int fd, int dir) noexcept
+	{
+		int err = fds_[fd].err[dir];
+
+		fds_[fd].err[dir] = 0;
+		if (err != 0)
+		{
+			errno = err;
+			return -1;
+		}
+		return 0;
+	}
+
+	void sleep(int ms, std::coroutine_handle<> h)
+	{
+		add_timer(ms, -1, 0, h);
+	}
+
+	/* fd is about to be closed: whoever waits for it gets EBADF. */
+	void forget(int fd)
+	{
+		if ((std::size_t)fd >= fds_.size())
+			return;
+		wake(fd, CO_READ, EBADF);
+		wake(fd, CO_WRITE, EBADF);
+		fds_[fd] = fd_state();
+	}
+
+private:
+	struct fd_state
+	{
+		std::coroutine_handle<> h[2];
+		std::uint64_t timer[2] = {0, 0}; /* id of the timeout of each waiter (0 = none) */
+		int err[2] = {0, 0};
+		bool registered = false;
+	};
+
+	struct timer
+	{
+		std::uint64_t when, id;
+		int fd, dir;		   /* timeout of a waiter, or fd = -1 ... */
+		std::coroutine_handle<> h; /* ... a sleeping coroutine */
+
+		bool operator<(const timer &t) const noexcept
+		{
+			return when > t.when; /* earliest on top of the heap */
+		}
+	};
+
+	static inline thread_local executor *current_ = nullptr;
+
+	int ep_;
+	bool stopped_ = false;
+	std::size_t waiting_ = 0;
+	std::uint64_t next_id_ = 0;
+	std::vector<fd_state> fds_;
+	std::vector<timer> timers_;
+
+	static std::uint64_t now_ms() noexcept
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (std::uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	std::uint64_t add_timer(int ms, int fd, int dir, std::coroutine_handle<> h)
+	{
+		timers_.push_back(timer{now_ms() + ms, ++next_id_, fd, dir, h});
+		std::push_heap(timers_.begin(), timers_.end());
+		return next_id_;
+	}
+
+	bool stale(const timer &t) const noexcept
+	{
+		return t.fd >= 0 && fds_[t.fd].timer[t.dir] != t.id;
+	}
+
+	/* Timeouts of waiters already resumed are dropped lazily. */
+	bool live_timers()
+	{
+		while (!timers_.empty() && stale(timers_.front()))
+		{
+			std::pop_heap(timers_.begin(), timers_.end());
+			timers_.pop_back();
+		}
+		return !timers_.empty();
+	}
+
+	void wake(int fd, int dir, int err)
+	{
+		if ((std::size_t)fd >= fds_.size() || !fds_[fd].h[dir])
+			return;
+
+		std::coroutine_handle<> h = std::exchange(fds_[fd].h[dir], nullptr);
+
+		fds_[fd].timer[dir] = 0;
+		fds_[fd].err[dir] = err;
+		waiting_--;
+		h.resume();
+	}
+
+	void expire()
+	{
+		std::uint64_t now = now_ms();
+
+		while (!timers_.empty() && timers_.front().when <= now)
+		{
+			std::pop_heap(timers_.begin(), timers_.end());
+			timer t = timers_.back();
+			timers_.pop_back();
+
+			if (t.fd < 0)
+				t.h.resume();
+			else if (!stale(t))
+				wake(t.fd, t.dir, ETIMEDOUT);
+		}
+	}
+};
+
+/* co_await ready(fd, dir, timeout): 0 when fd is ready, -1 with errno. */
+struct ready
+{
+	int fd, dir, timeout_ms;
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		return executor::current()->wait(fd, dir, timeout_ms, h);
+	}
+
+	int await_resume() noexcept
+	{
+		return executor::current()->resumed(fd, dir);
+	}
+};
+
+struct sleep_for
+{
+	int ms;
+
+	bool await_ready() const noexcept
+	{
+		return ms <= 0;
+	}
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		executor::current()->sleep(ms, h);
+	}
+
+	void await_resume() noexcept
+	{
+	}
+};
+
+inline int set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Connected socket, non-blocking and close-on-exec; -1 with errno. */
+inline task<int> accept(int listenfd, struct sockaddr *sa, socklen_t *salen)
+{
+	int fd;
+
+	for (;;)
+	{
+		if ((fd = accept4(listenfd, sa, salen, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+			co_return fd;
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			co_return -1;
+		if (co_await ready{listenfd, CO_READ, -1} < 0)
+			co_return -1;
+	}
+}
+
+/* As recv(): the bytes available (at most n), 0 at end of stream. */
+inline task<ssize_t> recv(int fd, void *buf, std::size_t n, int timeout_ms = -1)
+{
+	ssize_t r;
+
+	for (;;)
+	{
+		if ((r = ::recv(fd, buf, n, MSG_DONTWAIT)) >= 0)
+			co_return r;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			co_return -1;
+		if (co_await ready{fd, CO_READ, timeout_ms} < 0)
+			co_return -1;
+	}
+}
+
+/* As sendn(): all n bytes, or -1. */
+inline task<ssize_t> sendn(int fd, const void *buf, std::size_t n, int flags = 0, int timeout_ms = -1)
+{
+	const char *p = static_cast<const char *>(buf);
+	std::size_t left = n;
+	ssize_t r;
+
+	while (left > 0)
+	{
+		if ((r = ::send(fd, p, left, flags | MSG_DONTWAIT | MSG_NOSIGNAL)) >= 0)
+		{
+			p += r;
+			left -= r;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			co_return -1;
+		if (co_await ready{fd, CO_WRITE, timeout_ms} < 0)
+			co_return -1;
+	}
+	co_return n;
+}
+
+/* As sendfilen(): n bytes of in_fd from offset, fewer if the file ends first, or -1. */
+inline task<ssize_t> sendfilen(int out_fd, int in_fd, off_t offset, std::size_t n, int timeout_ms = -1)
+{
+	std::size_t left = n;
+	ssize_t r;
+
+	while (left > 0)
+	{
+		if ((r = ::sendfile(out_fd, in_fd, &offset, left)) > 0)
+		{
+			left -= r;
+			continue;
+		}
+		if (r == 0)
+			break; /* EOF */
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			co_return -1;
+		if (co_await ready{out_fd, CO_WRITE, timeout_ms} < 0)
+			co_return -1;
+	}
+	co_return n - left;
+}
+
+/* Owned descriptor, closed (after waking its waiters) when it goes out of scope. */
+class unique_fd
+{
+public:
+	unique_fd() noexcept = default;
+
+	explicit unique_fd(int fd) noexcept : fd_(fd)
+	{
+	}
+
+	unique_fd(unique_fd &&o) noexcept : fd_(std::exchange(o.fd_, -1))
+	{
+	}
+
+	unique_fd &operator=(unique_fd &&o) noexcept
+	{
+		if (this != &o)
+		{
+			reset();
+			fd_ = std::exchange(o.fd_, -1);
+		}
+		return *this;
+	}
+
+	unique_fd(const unique_fd &) = delete;
+	unique_fd &operator=(const unique_fd &) = delete;
+
+	~unique_fd()
+	{
+		reset();
+	}
+
+	int get() const noexcept
+	{
+		return fd_;
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return fd_ >= 0;
+	}
+
+	int release() noexcept
+	{
+		return std::exchange(fd_, -1);
+	}
+
+	/* close() of the descriptor, if any: 0, or -1 with errno. */
+	int reset() noexcept
+	{
+		int fd = std::exchange(fd_, -1);
+
+		if (fd < 0)
+			return 0;
+		if (executor::current() != nullptr)
+			executor::current()->forget(fd);
+		return close(fd);
+	}
+
+private:
+	int fd_ = -1;
+};
+
+class socket : public unique_fd
+{
+public:
+	using unique_fd::unique_fd;
+
+	/* tcp_listen() on port, with the backlog raised for many clients; exits on error. */
+	static socket listen(const char *port)
+	{
+		socket s(tcp_listen(NULL, port, NULL));
+
+		if (::listen(s.get(), SOMAXCONN) != 0 || set_nonblock(s.get()) != 0)
+			err_sys("(%s) error - cannot set up the listening socket", prog_name);
+		return s;
+	}
+
+	/* tcp_connect_try() (blocking, RFC 8305); an invalid socket if it fails. */
+	static socket connect(const char *host, const char *port)
+	{
+		socket s(tcp_connect_try(host, port));
+
+		if (s && set_nonblock(s.get()) != 0)
+			s.reset();
+		return s;
+	}
+
+	task<socket> accept(struct sockaddr *sa, socklen_t *salen) const
+	{
+		co_return socket(co_await sockco::accept(get(), sa, salen));
+	}
+
+	task<ssize_t> recv(void *buf, std::size_t n, int timeout_ms = -1) const
+	{
+		return sockco::recv(get(), buf, n, timeout_ms);
+	}
+
+	task<ssize_t> sendn(const void *buf, std::size_t n, int flags = 0, int timeout_ms = -1) const
+	{
+		return sockco::sendn(get(), buf, n, flags, timeout_ms);
+	}
+
+	task<ssize_t> sendfilen(int in_fd, off_t offset, std::size_t n, int timeout_ms = -1) const
+	{
+		return sockco::sendfilen(get(), in_fd, offset, n, timeout_ms);
+	}
+};
+
+/* Buffered input of a socket, for line-oriented commands and fixed-size fields. */
+class reader
+{
+public:
+	explicit reader(int fd, int timeout_ms = -1) noexcept : fd_(fd), timeout_(timeout_ms)
+	{
+	}
+
+	/* As readline_buffered(): the line with its '\n' and a '\0' (at most max - 1
+	   bytes), 0 at end of stream, -1 with errno. */
+	task<ssize_t> readline(char *buf, std::size_t max)
+	{
+		std::size_t n = 0;
+		ssize_t r;
+
+		while (n + 1 < max)
+		{
+			if (head_ == tail_)
+			{
+				if ((r = co_await fill()) < 0)
+					co_return -1;
+				if (r == 0)
+					break;
+			}
+			if ((buf[n++] = buf_[head_++]) == '\n')
+				break;
+		}
+		buf[n] = '\0';
+		co_return n;
+	}
+
+	/* Up to n bytes: the buffered ones, or else from the socket (straight into buf
+	   if it is larger than the buffer). */
+	task<ssize_t> read(void *buf, std::size_t n)
+	{
+		ssize_t r;
+
+		if (head_ == tail_)
+		{
+			if (n >= sizeof(buf_))
+				co_return co_await sockco::recv(fd_, buf, n, timeout_);
+			if ((r = co_await fill()) <= 0)
+				co_return r;
+		}
+
+		std::size_t len = std::min(n, tail_ - head_);
+		std::memcpy(buf, buf_ + head_, len);
+		head_ += len;
+		co_return len;
+	}
+
+	/* As readn(): n bytes, fewer at end of stream, -1 with errno. */
+	task<ssize_t> readn(void *buf, std::size_t n)
+	{
+		char *p = static_cast<char *>(buf);
+		std::size_t got = 0;
+		ssize_t r;
+
+		while (got < n)
+		{
+			if ((r = co_await read(p + got, n - got)) < 0)
+				co_return -1;
+			if (r == 0)
+				break;
+			got += r;
+		}
+		co_return got;
+	}
+
+	/* Bytes already received and not consumed. */
+	std::size_t buffered() const noexcept
+	{
+		return tail_ - head_;
+	}
+
+	/* The buffered() bytes, to be parsed in place; valid until the next read. */
+	char *data() noexcept
+	{
+		return buf_ + head_;
+	}
+
+	void consume(std::size_t n) noexcept
+	{
+		head_ += std::min(n, tail_ - head_);
+	}
+
+	/* Receives more bytes after the buffered ones: their count, 0 at end of
+	   stream, -1 with errno (EMSGSIZE if the buffer is already full). */
+	task<ssize_t> more()
+	{
+		ssize_t r;
+
+		if (head_ > 0)
+		{
+			std::memmove(buf_, buf_ + head_, tail_ - head_);
+			tail_ -= head_;
+			head_ = 0;
+		}
+		if (tail_ == sizeof(buf_))
+		{
+			errno = EMSGSIZE;
+			co_return -1;
+		}
+		if ((r = co_await sockco::recv(fd_, buf_ + tail_, sizeof(buf_) - tail_, timeout_)) > 0)
+			tail_ += r;
+		co_return r;
+	}
+
+private:
+	int fd_, timeout_;
+	std::size_t head_ = 0, tail_ = 0;
+	char buf_[CO_READBUF];
+
+	task<ssize_t> fill()
+	{
+		ssize_t r = co_await sockco::recv(fd_, buf_, sizeof(buf_), timeout_);
+
+		head_ = 0;
+		tail_ = r > 0 ? r : 0;
+		co_return r;
+	}
+};
+
+} // namespace sockco
+
+#endif
@@ -16,21 +16,40 @@
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY, TCP_CONGESTION
 #include <arpa/inet.h> // inet_aton()
 #include <sys/un.h>	// unix sockets
+#include <sys/stat.h> // lstat()
 #include <netdb.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <sys/sendfile.h> // sendfile()
 #include <inttypes.h> // SCNu16
+#include <poll.h>
+#include <time.h> // clock_gettime()
 
 #include "errlib.h"
 #include "sockwrap.h"
 
 extern char *prog_name;
 
+/* TCP tuning profiles, selected with tcp_set_profile().
+   A value of 0 (or NULL) leaves the kernel default untouched: in particular
+   setting SO_SNDBUF/SO_RCVBUF disables the kernel buffer autotuning, so only
+   the profiles meant for long fat pipes fix them. */
+static const struct tcp_profile tcp_profiles[] = {
+	/* name       sndbuf    rcvbuf    nodelay  notsent_lowat  congestion  keepidle keepintvl keepcnt */
+	{"default",   0,        0,        0,       0,             NULL,       0,       0,        0},
+	{"bulk",      4 << 20,  4 << 20,  0,       0,             "cubic",    60,      10,       6},
+	{"latency",   0,        0,        1,       16 << 10,      NULL,       30,      5,        4},
+	{"wan",       16 << 20, 16 << 20, 1,       128 << 10,     "bbr",      60,      10,       6},
+};
+
+static const struct tcp_profile *tcp_profile = &tcp_profiles[0];
+
 int connect_nonb(int sockfd, const SA *saptr, socklen_t salen, int nsec)
 {
 	int flags, n, error;
@@ -89,41 +108,213 @@ done:
 	return (0);
 }
 
-int tcp_connect(const char *host, const char *serv)
+/* Resolutions cached by tcp_connect() (per process, not thread safe). */
+struct dns_entry
 {
-	int sockfd, n;
-	struct addrinfo hints, *res, *ressave;
+	char host[256], serv[32];
+	int naddrs;
+	struct sockaddr_storage addr[DNS_MAX_ADDRS];
+	socklen_t addrlen[DNS_MAX_ADDRS];
+	time_t expires;
+};
+
+static struct dns_entry dns_cache[DNS_CACHE_SIZE];
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Addresses of host:serv, from the cache or from getaddrinfo(). They are kept
+   in the order of getaddrinfo() (RFC 6724) but with the families interleaved,
+   starting with the preferred one (RFC 8305, section 4). Returns the entry,
+   NULL if the name cannot be resolved. */
+static struct dns_entry *dns_lookup(const char *host, const char *serv)
+{
+	struct addrinfo hints, *res, *ai;
+	struct dns_entry *e, *victim = &dns_cache[0];
+	const struct addrinfo *first[DNS_MAX_ADDRS], *other[DNS_MAX_ADDRS];
+	int nfirst = 0, nother = 0, i, j, n;
+	time_t now = time(NULL);
+
+	if (host == NULL || strlen(host) >= sizeof(victim->host) || strlen(serv) >= sizeof(victim->serv))
+		victim = NULL; /* not cached */
+	else
+		for (e = dns_cache; e < dns_cache + DNS_CACHE_SIZE; e++)
+		{
+			if (e->naddrs > 0 && e->expires > now && strcmp(e->host, host) == 0 && strcmp(e->serv, serv) == 0)
+				return e;
+			if (e->expires < victim->expires)
+				victim = e;
+		}
 
 	bzero(&hints, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 
 	if ((n = getaddrinfo(host, serv, &hints, &res)) != 0)
-		err_quit("tcp_connect error for %s, %s: %s",
-				 host, serv, gai_strerror(n));
-	ressave = res;
+	{
+		err_msg("(%s) error - getaddrinfo() for %s, %s: %s", prog_name, host, serv, gai_strerror(n));
+		return NULL;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next)
+		if (ai->ai_family == res->ai_family && nfirst < DNS_MAX_ADDRS)
+			first[nfirst++] = ai;
+		else if (ai->ai_family != res->ai_family && nother < DNS_MAX_ADDRS)
+			other[nother++] = ai;
 
-	do
+	if (victim == NULL)
 	{
-		sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (sockfd < 0)
-			continue; /* ignore this one */
+		static struct dns_entry uncached;
+		victim = &uncached;
+	}
+	for (i = j = n = 0; n < DNS_MAX_ADDRS && (i < nfirst || j < nother);)
+	{
+		ai = i < nfirst && (i <= j || j == nother) ? (struct addrinfo *)first[i++] : (struct addrinfo *)other[j++];
+		memcpy(&victim->addr[n], ai->ai_addr, ai->ai_addrlen);
+		victim->addrlen[n++] = ai->ai_addrlen;
+	}
+	freeaddrinfo(res);
+
+	victim->naddrs = n;
+	if (host != NULL)
+		snprintf(victim->host, sizeof(victim->host), "%s", host);
+	snprintf(victim->serv, sizeof(victim->serv), "%s", serv);
+	victim->expires = now + DNS_CACHE_TTL;
+	return victim;
+}
 
-		// connect() function replaced by connect_nonb() function.
-		if ((n = connect_nonb(sockfd, res->ai_addr, res->ai_addrlen, 5)) == 0)
-			break; /* success */
+static void connect_report(const struct dns_entry *e, int i, double start, const char *outcome)
+{
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
 
-		// If connect() went wrong, print an error message.
-		if (n == -1)
-			err_sys("(%s) connect() error", prog_name);
+	if (getnameinfo((SA *)&e->addr[i], e->addrlen[i], host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		strcpy(host, "?"), strcpy(serv, "?");
+	err_msg("(%s) --- connect to %s%s%s:%s: %s after %.1f ms", prog_name, e->addr[i].ss_family == AF_INET6 ? "[" : "", host,
+			e->addr[i].ss_family == AF_INET6 ? "]" : "", serv, outcome, now_ms() - start);
+}
 
-		Close(sockfd); /* ignore this one */
-	} while ((res = res->ai_next) != NULL);
+/* Happy eyeballs (RFC 8305): the addresses are tried in order, the next one
+   starting CONNECT_DELAY ms after the previous (at once if it fails) while the
+   previous ones are still in progress; the first to connect wins and the
+   others are abandoned. Each attempt is logged with its latency. Returns the
+   connected socket (blocking), -1 if every address failed. */
+int tcp_connect_try(const char *host, const char *serv)
+{
+	struct dns_entry *e;
+	struct pollfd pfd[DNS_MAX_ADDRS];
+	int fd[DNS_MAX_ADDRS], idx[DNS_MAX_ADDRS];
+	double start[DNS_MAX_ADDRS], next_start, t;
+	int next = 0, active = 0, winner = -1, i, n, err, timeout;
+	socklen_t len;
 
-	if (res == NULL) /* errno set from final connect() */
-		err_sys("tcp_connect error for %s, %s", host, serv);
+	if ((e = dns_lookup(host, serv)) == NULL)
+		return -1;
 
-	freeaddrinfo(ressave);
+	next_start = now_ms();
+	while (winner < 0)
+	{
+		t = now_ms();
+		if (next < e->naddrs && (active == 0 || t >= next_start))
+		{
+			i = next++;
+			start[i] = t;
+			if ((fd[i] = socket(e->addr[i].ss_family, SOCK_STREAM, 0)) < 0)
+			{
+				connect_report(e, i, t, strerror(errno));
+				continue;
+			}
+			tcp_tune(fd[i]); /* buffers must be sized before the SYN (window scale) */
+			fcntl(fd[i], F_SETFL, fcntl(fd[i], F_GETFL, 0) | O_NONBLOCK);
+			if (connect(fd[i], (SA *)&e->addr[i], e->addrlen[i]) == 0)
+				winner = i;
+			else if (errno == EINPROGRESS)
+			{
+				active++;
+				next_start = t + CONNECT_DELAY;
+			}
+			else
+			{
+				connect_report(e, i, t, strerror(errno));
+				close(fd[i]);
+				fd[i] = -1;
+			}
+			continue;
+		}
+		if (active == 0)
+			break; /* every address failed */
+
+		/* Wait for an attempt, until the next one is due or the oldest times out. */
+		for (i = n = 0; i < next; i++)
+			if (fd[i] >= 0)
+			{
+				pfd[n].fd = fd[i];
+				pfd[n].events = POLLOUT;
+				idx[n++] = i;
+			}
+		timeout = (int)(start[idx[0]] + CONNECT_TIMEOUT * 1000 - t) + 1;
+		if (next < e->naddrs && next_start - t < timeout)
+			timeout = (int)(next_start - t) + 1;
+		if (poll(pfd, n, timeout < 0 ? 0 : timeout) < 0 && errno != EINTR)
+			err_sys("(%s) error - poll() failed", prog_name);
+
+		t = now_ms();
+		for (i = 0; i < n && winner < 0; i++)
+		{
+			int k = idx[i];
+
+			if (pfd[i].revents != 0)
+			{
+				len = sizeof(err);
+				if (getsockopt(fd[k], SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+					err = errno;
+				if (err == 0)
+				{
+					winner = k;
+					active--;
+					break;
+				}
+				connect_report(e, k, start[k], strerror(err));
+			}
+			else if (t - start[k] >= CONNECT_TIMEOUT * 1000)
+				connect_report(e, k, start[k], "timeout");
+			else
+				continue;
+			close(fd[k]);
+			fd[k] = -1;
+			active--;
+			next_start = t; /* a failure starts the next address at once */
+		}
+	}
+
+	/* The attempts still in progress lost the race. */
+	for (i = 0; i < next; i++)
+		if (i != winner && fd[i] >= 0)
+		{
+			connect_report(e, i, start[i], "abandoned");
+			close(fd[i]);
+		}
+
+	if (winner < 0)
+	{
+		e->expires = 0; /* resolve again next time */
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	connect_report(e, winner, start[winner], "connected");
+	fcntl(fd[winner], F_SETFL, fcntl(fd[winner], F_GETFL, 0) & ~O_NONBLOCK);
+	return fd[winner];
+}
+
+int tcp_connect(const char *host, const char *serv)
+{
+	int sockfd;
+
+	if ((sockfd = tcp_connect_try(host, serv)) < 0)
+		err_quit("tcp_connect error for %s, %s", host, serv);
 
 	return (sockfd);
 }
@@ -151,6 +342,7 @@ int tcp_listen(const char *host, const char *serv, socklen_t *addrlenp)
 			continue; /* error, try next one */
 
 		Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		tcp_tune(listenfd); /* inherited by the accepted sockets */
 		if (bind(listenfd, res->ai_addr, res->ai_addrlen) == 0)
 			break; /* success */
 
@@ -170,6 +362,161 @@ int tcp_listen(const char *host, const char *serv, socklen_t *addrlenp)
 	return (listenfd);
 }
 
+/* AF_UNIX counterparts of tcp_listen() and tcp_connect(): path is the
+   filesystem name of the socket (a stale one is removed before the bind;
+   anything else at path makes the bind fail). */
+int unix_listen(const char *path, socklen_t *addrlenp)
+{
+	int listenfd, probefd;
+	struct sockaddr_un servaddr;
+	struct stat st;
+
+	if (strlen(path) >= sizeof(servaddr.sun_path))
+		err_quit("unix_listen error for %s: path too long", path);
+
+	listenfd = Socket(AF_UNIX, SOCK_STREAM, 0);
+
+	bzero(&servaddr, sizeof(servaddr));
+	servaddr.sun_family = AF_UNIX;
+	strcpy(servaddr.sun_path, path);
+
+	/* Stale: a socket nobody listens on any more. */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+	{
+		probefd = Socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (connect(probefd, (SA *)&servaddr, SUN_LEN(&servaddr)) == 0 || errno == EAGAIN)
+			err_quit("unix_listen error for %s: a running process is listening on it", path);
+		if (errno == ECONNREFUSED)
+			unlink(path);
+		close(probefd);
+	}
+
+	Bind(listenfd, (SA *)&servaddr, SUN_LEN(&servaddr));
+
+	Listen(listenfd, LISTENQ);
+
+	if (addrlenp)
+		*addrlenp = SUN_LEN(&servaddr);
+
+	return (listenfd);
+}
+
+int unix_connect(const char *path)
+{
+	int sockfd;
+	struct sockaddr_un servaddr;
+
+	if (strlen(path) >= sizeof(servaddr.sun_path))
+		err_quit("unix_connect error for %s: path too long", path);
+
+	sockfd = Socket(AF_UNIX, SOCK_STREAM, 0);
+
+	bzero(&servaddr, sizeof(servaddr));
+	servaddr.sun_family = AF_UNIX;
+	strcpy(servaddr.sun_path, path);
+	Connect(sockfd, (SA *)&servaddr, SUN_LEN(&servaddr));
+
+	return (sockfd);
+}
+
+int tcp_set_profile(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(tcp_profiles) / sizeof(tcp_profiles[0]); i++)
+		if (strcmp(tcp_profiles[i].name, name) == 0)
+		{
+			tcp_profile = &tcp_profiles[i];
+			return 0;
+		}
+	return -1;
+}
+
+const struct tcp_profile *tcp_get_profile(void)
+{
+	return tcp_profile;
+}
+
+/* Applies the current profile to sockfd and logs the values the kernel actually
+   accepted (read back with getsockopt(), e.g. SO_SNDBUF is doubled and capped
+   by net.core.wmem_max). Failures are not fatal: the option is left at default. */
+void tcp_tune(int sockfd)
+{
+	const struct tcp_profile *p = tcp_profile;
+	char info[MAXTUNESTR];
+	int val;
+	socklen_t len;
+	size_t n;
+
+	if (p->sndbuf == 0 && p->rcvbuf == 0 && !p->nodelay && p->notsent_lowat == 0 &&
+		p->congestion == NULL && p->keepidle == 0)
+		return; /* "default": nothing to do */
+
+	snprintf(info, sizeof(info), "(%s) --- tcp profile '%s' on fd %d:", prog_name, p->name, sockfd);
+	n = strlen(info);
+
+	if (p->sndbuf && setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &p->sndbuf, sizeof(p->sndbuf)) < 0)
+		err_ret("(%s) warning - setsockopt(SO_SNDBUF) failed", prog_name);
+	if (p->rcvbuf && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &p->rcvbuf, sizeof(p->rcvbuf)) < 0)
+		err_ret("(%s) warning - setsockopt(SO_RCVBUF) failed", prog_name);
+	len = sizeof(val);
+	if (getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &val, &len) == 0)
+		n += snprintf(info + n, sizeof(info) - n, " SO_SNDBUF=%d", val);
+	len = sizeof(val);
+	if (n < sizeof(info) && getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &val, &len) == 0)
+		n += snprintf(info + n, sizeof(info) - n, " SO_RCVBUF=%d", val);
+
+	val = p->nodelay;
+	if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)) < 0)
+		err_ret("(%s) warning - setsockopt(TCP_NODELAY) failed", prog_name);
+	len = sizeof(val);
+	if (n < sizeof(info) && getsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &val, &len) == 0)
+		n += snprintf(info + n, sizeof(info) - n, " TCP_NODELAY=%d", val != 0);
+
+#ifdef TCP_NOTSENT_LOWAT
+	if (p->notsent_lowat)
+	{
+		if (setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &p->notsent_lowat, sizeof(p->notsent_lowat)) < 0)
+			err_ret("(%s) warning - setsockopt(TCP_NOTSENT_LOWAT) failed", prog_name);
+		len = sizeof(val);
+		if (n < sizeof(info) && getsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val, &len) == 0)
+			n += snprintf(info + n, sizeof(info) - n, " TCP_NOTSENT_LOWAT=%d", val);
+	}
+#endif
+
+#ifdef TCP_CONGESTION
+	if (p->congestion)
+	{
+		char cc[16];
+
+		/* Fails with ENOENT if the module (e.g. tcp_bbr) is not loaded. */
+		if (setsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION, p->congestion, strlen(p->congestion)) < 0)
+			err_ret("(%s) warning - setsockopt(TCP_CONGESTION, %s) failed", prog_name, p->congestion);
+		len = sizeof(cc);
+		if (n < sizeof(info) && getsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION, cc, &len) == 0)
+			n += snprintf(info + n, sizeof(info) - n, " TCP_CONGESTION=%.*s", (int)strnlen(cc, len), cc);
+	}
+#endif
+
+	if (p->keepidle)
+	{
+		val = 1;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val)) < 0)
+			err_ret("(%s) warning - setsockopt(SO_KEEPALIVE) failed", prog_name);
+#ifdef TCP_KEEPIDLE
+		if (setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &p->keepidle, sizeof(p->keepidle)) < 0 ||
+			setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &p->keepintvl, sizeof(p->keepintvl)) < 0 ||
+			setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &p->keepcnt, sizeof(p->keepcnt)) < 0)
+			err_ret("(%s) warning - setsockopt(TCP_KEEP*) failed", prog_name);
+#endif
+		len = sizeof(val);
+		if (n < sizeof(info) && getsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &val, &len) == 0)
+			n += snprintf(info + n, sizeof(info) - n, " SO_KEEPALIVE=%d(%d/%d/%d)", val, p->keepidle, p->keepintvl, p->keepcnt);
+	}
+
+	err_msg("%s", info);
+}
+
 int Socket(int family, int type, int protocol)
 {
 	int n;
@@ -578,6 +925,103 @@ void Sendn(int fd, void *ptr, size_t nbytes, int flags)
 		err_sys("(%s) error - writen() failed", prog_name);
 }
 
+/* sends "n" bytes of in_fd starting at "offset" with sendfile() (no copy through
+   user space); returns less than n only if the file ended before */
+ssize_t sendfilen(int out_fd, int in_fd, off_t offset, size_t n)
+{
+	size_t nleft;
+	ssize_t nwritten;
+
+	nleft = n;
+	while (nleft > 0)
+	{
+		if ((nwritten = sendfile(out_fd, in_fd, &offset, nleft)) < 0)
+		{
+			if (INTERRUPTED_BY_SIGNAL)
+				continue; /* and call sendfile() again */
+			else
+				return -1;
+		}
+		else if (nwritten == 0)
+			break; /* EOF */
+		nleft -= nwritten;
+	}
+	return n - nleft;
+}
+
+/* Sends nbytes of data with the descriptor sendfd attached (SCM_RIGHTS):
+   the receiver gets a new descriptor for the same open file. */
+ssize_t write_fd(int fd, void *ptr, size_t nbytes, int sendfd)
+{
+	struct msghdr msg;
+	struct iovec iov[1];
+	union
+	{
+		struct cmsghdr cm;
+		char control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+	struct cmsghdr *cmptr;
+
+	bzero(&msg, sizeof(msg));
+	msg.msg_control = control_un.control;
+	msg.msg_controllen = sizeof(control_un.control);
+
+	cmptr = CMSG_FIRSTHDR(&msg);
+	cmptr->cmsg_len = CMSG_LEN(sizeof(int));
+	cmptr->cmsg_level = SOL_SOCKET;
+	cmptr->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmptr), &sendfd, sizeof(int));
+
+	iov[0].iov_base = ptr;
+	iov[0].iov_len = nbytes;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+
+	return (sendmsg(fd, &msg, MSG_NOSIGNAL));
+}
+
+/* Reads up to nbytes; *recvfd is the descriptor passed along with them, -1 if none. */
+ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd)
+{
+	struct msghdr msg;
+	struct iovec iov[1];
+	ssize_t n;
+	union
+	{
+		struct cmsghdr cm;
+		char control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+	struct cmsghdr *cmptr;
+
+	bzero(&msg, sizeof(msg));
+	msg.msg_control = control_un.control;
+	msg.msg_controllen = sizeof(control_un.control);
+
+	iov[0].iov_base = ptr;
+	iov[0].iov_len = nbytes;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+
+	*recvfd = -1;
+	if ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+		return (n);
+
+	if ((cmptr = CMSG_FIRSTHDR(&msg)) != NULL && cmptr->cmsg_len == CMSG_LEN(sizeof(int)) &&
+		cmptr->cmsg_level == SOL_SOCKET && cmptr->cmsg_type == SCM_RIGHTS)
+		memcpy(recvfd, CMSG_DATA(cmptr), sizeof(int));
+
+	return (n);
+}
+
+ssize_t Read_fd(int fd, void *ptr, size_t nbytes, int *recvfd)
+{
+	ssize_t n;
+
+	if ((n = read_fd(fd, ptr, nbytes, recvfd)) < 0)
+		err_sys("(%s) error - read_fd() failed", prog_name);
+	return (n);
+}
+
 int Select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout)
 {
 	int n;
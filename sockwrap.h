@@ -26,12 +26,49 @@
 #define LISTENQ 5 /* It's the second argument of the Listen function: specifies the maximum number \
                      of connections the kernel should queue for the socket. */
 
+#define MAXTUNESTR 256 /* Length of the tcp_tune() log line. */
+
+#define CONNECT_TIMEOUT 5   /* Seconds each connection attempt of tcp_connect() may take. */
+#define CONNECT_DELAY 250   /* Milliseconds before the next address is tried in parallel (RFC 8305). */
+#define DNS_CACHE_SIZE 16   /* Resolutions kept by tcp_connect(). */
+#define DNS_CACHE_TTL 60    /* Seconds a resolution is reused. */
+#define DNS_MAX_ADDRS 8     /* Addresses kept (and tried) per resolution. */
+
 typedef void Sigfunc(int); /* for signal handlers */
 
+/* TCP tuning profile: options applied by tcp_tune() to every socket created by
+   tcp_connect()/tcp_listen() and to the accepted ones. 0/NULL = kernel default. */
+struct tcp_profile
+{
+	const char *name;
+	int sndbuf;		/* SO_SNDBUF (bytes) */
+	int rcvbuf;		/* SO_RCVBUF (bytes) */
+	int nodelay;		/* TCP_NODELAY */
+	int notsent_lowat;	/* TCP_NOTSENT_LOWAT (bytes) */
+	const char *congestion; /* TCP_CONGESTION (e.g. "bbr") */
+	int keepidle;		/* SO_KEEPALIVE + TCP_KEEPIDLE (sec), 0 = keepalive off */
+	int keepintvl;		/* TCP_KEEPINTVL (sec) */
+	int keepcnt;		/* TCP_KEEPCNT */
+};
+
+#define TCP_PROFILES "default|bulk|latency|wan"
+
+int tcp_set_profile(const char *name);
+
+const struct tcp_profile *tcp_get_profile(void);
+
+void tcp_tune(int sockfd);
+
 int tcp_connect(const char *host, const char *serv);
 
+int tcp_connect_try(const char *host, const char *serv);
+
 int tcp_listen(const char *host, const char *serv, socklen_t *addrlenp);
 
+int unix_listen(const char *path, socklen_t *addrlenp);
+
+int unix_connect(const char *path);
+
 int connect_nonb(int sockfd, const SA *saptr, socklen_t salen, int nsec);
 
 int Socket(int family, int type, int protocol);
@@ -90,6 +127,14 @@ ssize_t sendn(int fd, const void *vptr, size_t n, int flags);
 
 void Sendn(int fd, void *ptr, size_t nbytes, int flags);
 
+ssize_t sendfilen(int out_fd, int in_fd, off_t offset, size_t n);
+
+ssize_t write_fd(int fd, void *ptr, size_t nbytes, int sendfd);
+
+ssize_t read_fd(int fd, void *ptr, size_t nbytes, int *recvfd);
+
+ssize_t Read_fd(int fd, void *ptr, size_t nbytes, int *recvfd);
+
 int Select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout);
 
 pid_t Fork(void);
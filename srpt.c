@@ -0,0 +1,230 @@
+/*
+
+module: srpt.c
+
+purpose: shortest-remaining-processing-time scheduling of the transfers of the
+         concurrent server. Every child registers its transfer in a MAP_SHARED
+         scoreboard; only the "slots" transfers with the fewest (aged) remaining
+         bytes may send, the others wait on a process-shared condition variable.
+
+         Aging: the priority key of a transfer is
+             remaining / (1 + waited / aging)
+         where waited is the time it spent blocked, so a large file that keeps
+         being overtaken eventually gets a key smaller than any new arrival.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "errlib.h"
+#include "srpt.h"
+
+extern char *prog_name;
+
+struct srpt_entry
+{
+	pid_t pid; /* 0 = free */
+	unsigned long long remaining;
+	double waited;	   /* seconds spent blocked so far */
+	double wait_start; /* != 0 while blocked */
+};
+
+struct srpt_board
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int generation; /* bumped on every arrival: forces a new decision */
+	struct srpt_entry entry[SRPT_MAX_ENTRIES];
+};
+
+static struct srpt_board *srpt = NULL;
+static int srpt_slots;
+static double srpt_aging;
+
+/* State of the calling process (one connection per child). */
+static int srpt_me = -1;
+static unsigned long long srpt_last;
+static unsigned int srpt_gen;
+
+static double srpt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void srpt_lock(void)
+{
+	/* A child killed while holding the lock must not freeze the others. */
+	if (pthread_mutex_lock(&srpt->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&srpt->lock);
+}
+
+static double srpt_key(const struct srpt_entry *e, double now)
+{
+	double waited = e->waited;
+
+	if (e->wait_start != 0)
+		waited += now - e->wait_start;
+	return (double)e->remaining / (1 + waited / srpt_aging);
+}
+
+/* Number of transfers that come before ours. Lock held. */
+static int srpt_rank(double now)
+{
+	double mine = srpt_key(&srpt->entry[srpt_me], now), k;
+	int i, rank = 0;
+
+	for (i = 0; i < SRPT_MAX_ENTRIES; i++)
+	{
+		if (i == srpt_me || srpt->entry[i].pid == 0)
+			continue;
+		k = srpt_key(&srpt->entry[i], now);
+		if (k < mine || (k == mine && i < srpt_me))
+			rank++;
+	}
+	return rank;
+}
+
+/* Must be called before fork(). slots = transfers allowed to send at the same time. */
+void srpt_init(int slots, double aging)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+
+	srpt = mmap(NULL, sizeof(struct srpt_board), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (srpt == MAP_FAILED)
+		err_sys("(%s) error - mmap() of the SRPT scoreboard failed", prog_name);
+	memset(srpt, 0, sizeof(struct srpt_board));
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&srpt->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&srpt->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	srpt_slots = slots;
+	srpt_aging = aging;
+
+	err_msg("(%s) --- SRPT scheduling: %d concurrent transfers, aging %.2f s", prog_name, slots, aging);
+}
+
+int srpt_enabled(void)
+{
+	return srpt != NULL;
+}
+
+/* Registers a new transfer of size bytes (the size returned by stat()). */
+void srpt_begin(unsigned long long size)
+{
+	int i;
+
+	if (srpt == NULL)
+		return;
+
+	srpt_lock();
+	if (srpt_me < 0)
+		for (i = 0; i < SRPT_MAX_ENTRIES; i++)
+			if (srpt->entry[i].pid == 0)
+			{
+				srpt_me = i;
+				break;
+			}
+	if (srpt_me >= 0)
+	{
+		srpt->entry[srpt_me].pid = getpid();
+		srpt->entry[srpt_me].remaining = size;
+		srpt->entry[srpt_me].waited = 0;
+		srpt->entry[srpt_me].wait_start = 0;
+	}
+	/* else: scoreboard full, the transfer runs unscheduled. */
+	__atomic_add_fetch(&srpt->generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&srpt->lock);
+
+	srpt_last = size + SRPT_QUANTUM; /* force a decision before the first chunk */
+}
+
+/* Called before every chunk with the bytes still to send: blocks while
+   srpt_slots shorter transfers are running. The lock is taken only once every
+   SRPT_QUANTUM bytes, or at once if a new transfer arrived (preemption). */
+void srpt_schedule(unsigned long long remaining)
+{
+	struct timespec ts;
+	double now;
+
+	if (srpt == NULL || srpt_me < 0)
+		return;
+	if (srpt_last - remaining < SRPT_QUANTUM && __atomic_load_n(&srpt->generation, __ATOMIC_ACQUIRE) == srpt_gen)
+		return;
+	srpt_last = remaining;
+	srpt_gen = __atomic_load_n(&srpt->generation, __ATOMIC_ACQUIRE);
+
+	srpt_lock();
+	srpt->entry[srpt_me].remaining = remaining;
+	for (;;)
+	{
+		now = srpt_now();
+		if (srpt_rank(now) < srpt_slots)
+			break;
+
+		if (srpt->entry[srpt_me].wait_start == 0)
+			srpt->entry[srpt_me].wait_start = now;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += SRPT_WAIT_MSEC * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		if (pthread_cond_timedwait(&srpt->cond, &srpt->lock, &ts) == EOWNERDEAD)
+			pthread_mutex_consistent(&srpt->lock);
+	}
+	if (srpt->entry[srpt_me].wait_start != 0)
+	{
+		srpt->entry[srpt_me].waited += now - srpt->entry[srpt_me].wait_start;
+		srpt->entry[srpt_me].wait_start = 0;
+	}
+	pthread_mutex_unlock(&srpt->lock);
+}
+
+/* The transfer is over (or failed): free the entry and wake up the waiting ones. */
+void srpt_end(void)
+{
+	if (srpt == NULL || srpt_me < 0)
+		return;
+
+	srpt_lock();
+	srpt->entry[srpt_me].pid = 0;
+	pthread_cond_broadcast(&srpt->cond);
+	pthread_mutex_unlock(&srpt->lock);
+	srpt_me = -1;
+}
+
+/* Called by the parent from the SIGCHLD handler: frees the entry of a child that
+   exited without srpt_end() (e.g. err_sys()). Lock-free on purpose, the waiting
+   transfers notice within SRPT_WAIT_MSEC. */
+void srpt_reap(pid_t pid)
+{
+	int i;
+
+	if (srpt == NULL)
+		return;
+
+	for (i = 0; i < SRPT_MAX_ENTRIES; i++)
+		if (__atomic_load_n(&srpt->entry[i].pid, __ATOMIC_RELAXED) == pid)
+			__atomic_store_n(&srpt->entry[i].pid, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,31 @@
+/*
+
+module: srpt.h
+
+purpose: definitions of functions in srpt.c
+
+*/
+
+#ifndef _SRPT_H
+
+#define _SRPT_H
+
+#include <sys/types.h>
+
+#define SRPT_MAX_ENTRIES 256	/* Transfers tracked in the shared scoreboard. */
+#define SRPT_QUANTUM 262144	/* Bytes sent between two scheduling decisions. */
+#define SRPT_WAIT_MSEC 10	/* Re-evaluation period of a waiting transfer (aging). */
+
+void srpt_init(int slots, double aging);
+
+int srpt_enabled(void);
+
+void srpt_begin(unsigned long long size);
+
+void srpt_schedule(unsigned long long remaining);
+
+void srpt_end(void);
+
+void srpt_reap(pid_t pid);
+
+#endif
@@ -0,0 +1,337 @@
+/*
+
+module: tls.c
+
+purpose: optional TLS for servers and client
+         the handshake is done by OpenSSL; with kTLS (SSL_OP_ENABLE_KTLS) the
+         library then hands the session keys to the kernel with
+         setsockopt(SOL_TLS), and from there on the socket is used as a plain
+         one: send(), recv() and sendfile() are encrypted and decrypted by the
+         kernel, so the zero-copy paths are kept.
+
+         kTLS is used only when both directions could be offloaded. Otherwise
+         (kernel without the tls module, cipher not supported, or -K) the
+         caller gets one end of a socketpair and a relay thread moves the data
+         between it and the TLS session in user space.
+
+         kTLS is requested with TLS 1.2 only: OpenSSL 3.0 cannot offload the
+         receive side of TLS 1.3, and the session tickets of TLS 1.3 arrive
+         after the handshake as records that a kTLS socket would not return to
+         recv(). On a kTLS socket the connection is closed without close_notify:
+         the protocol frames every response, so a truncation is always seen.
+
+         One connection per process (the servers handle one in each process).
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "errlib.h"
+#include "tls.h"
+
+extern char *prog_name;
+
+static SSL_CTX *tls_ctx = NULL;
+static int tls_server;
+
+/* Relay of the current connection. */
+static SSL *tls_ssl = NULL;
+static int tls_sock = -1, tls_app = -1;
+static pthread_t tls_tid;
+static int tls_relay_on = 0;
+static int tls_kernel_on = 0; /* the connection is a kTLS socket */
+
+static void tls_errors(const char *what)
+{
+	unsigned long e;
+	char buf[256];
+
+	while ((e = ERR_get_error()) != 0)
+	{
+		ERR_error_string_n(e, buf, sizeof(buf));
+		err_msg("(%s) error - %s: %s", prog_name, what, buf);
+	}
+}
+
+static SSL_CTX *tls_new_ctx(const SSL_METHOD *method, int ktls)
+{
+	SSL_CTX *ctx;
+
+	if ((ctx = SSL_CTX_new(method)) == NULL)
+	{
+		tls_errors("SSL_CTX_new()");
+		return NULL;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	if (ktls)
+	{
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+		SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+	}
+	return ctx;
+}
+
+/* certkey = "certificate.pem:key.pem" (PEM files). */
+int tls_server_init(const char *certkey, int ktls)
+{
+	char cert[4096], *key;
+
+	if (strlen(certkey) >= sizeof(cert))
+		return -1;
+	strcpy(cert, certkey);
+	if ((key = strchr(cert, ':')) == NULL)
+		return -1;
+	*key++ = '\0';
+
+	if ((tls_ctx = tls_new_ctx(TLS_server_method(), ktls)) == NULL)
+		return -1;
+	if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1 ||
+		SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(tls_ctx) != 1)
+	{
+		tls_errors("loading the certificate");
+		SSL_CTX_free(tls_ctx);
+		tls_ctx = NULL;
+		return -1;
+	}
+	tls_server = 1;
+
+	err_msg("(%s) --- TLS enabled (%s)", prog_name, ktls ? "kTLS when available" : "user space");
+	return 0;
+}
+
+/* The server certificate is verified against cafile (PEM). */
+int tls_client_init(const char *cafile, int ktls)
+{
+	if ((tls_ctx = tls_new_ctx(TLS_client_method(), ktls)) == NULL)
+		return -1;
+	if (SSL_CTX_load_verify_locations(tls_ctx, cafile, NULL) != 1)
+	{
+		tls_errors("loading the CA file");
+		SSL_CTX_free(tls_ctx);
+		tls_ctx = NULL;
+		return -1;
+	}
+	SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+	tls_server = 0;
+	return 0;
+}
+
+/* The connection of this process is encrypted by the kernel: sendfile() on
+   it sends encrypted records too. */
+int tls_kernel(void)
+{
+	return tls_kernel_on;
+}
+
+int tls_enabled(void)
+{
+	return tls_ctx != NULL;
+}
+
+static void tls_timeout(int sockfd, int sec)
+{
+	struct timeval tv;
+
+	tv.tv_sec = sec;
+	tv.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* Moves data between the application end of the socketpair and the TLS
+   session until the application closes its end or the session fails. */
+static void *tls_relay(void *arg)
+{
+	char up[TLS_RELAY_BUFL], down[TLS_RELAY_BUFL];
+	size_t up_len = 0, up_off = 0, down_len = 0, down_off = 0;
+	int app_eof = 0, ssl_eof = 0, progress, e, n;
+	fd_set rset, wset;
+
+	(void)arg;
+	fcntl(tls_sock, F_SETFL, fcntl(tls_sock, F_GETFL) | O_NONBLOCK);
+	fcntl(tls_app, F_SETFL, fcntl(tls_app, F_GETFL) | O_NONBLOCK);
+
+	for (;;)
+	{
+		FD_ZERO(&rset);
+		FD_ZERO(&wset);
+		progress = 0;
+
+		/* Network -> application. */
+		if (down_len == 0 && !ssl_eof)
+		{
+			if ((n = SSL_read(tls_ssl, down, sizeof(down))) > 0)
+			{
+				down_len = n;
+				down_off = 0;
+				progress = 1;
+			}
+			else if ((e = SSL_get_error(tls_ssl, n)) == SSL_ERROR_WANT_READ)
+				FD_SET(tls_sock, &rset);
+			else if (e == SSL_ERROR_WANT_WRITE)
+				FD_SET(tls_sock, &wset);
+			else
+			{
+				/* close_notify or connection closed: EOF for the application. */
+				ssl_eof = 1;
+				shutdown(tls_app, SHUT_WR);
+				progress = 1;
+			}
+		}
+		if (down_len > 0)
+		{
+			if ((n = send(tls_app, down + down_off, down_len, MSG_NOSIGNAL)) > 0)
+			{
+				down_off += n;
+				down_len -= n;
+				progress = 1;
+			}
+			else if (errno == EAGAIN)
+				FD_SET(tls_app, &wset);
+			else
+				break;
+		}
+
+		/* Application -> network. */
+		if (up_len == 0 && !app_eof)
+		{
+			if ((n = read(tls_app, up, sizeof(up))) > 0)
+			{
+				up_len = n;
+				up_off = 0;
+				progress = 1;
+			}
+			else if (n == 0)
+			{
+				app_eof = 1;
+				progress = 1;
+			}
+			else if (errno == EAGAIN)
+				FD_SET(tls_app, &rset);
+			else
+				app_eof = 1;
+		}
+		if (up_len > 0)
+		{
+			if ((n = SSL_write(tls_ssl, up + up_off, up_len)) > 0)
+			{
+				up_off += n;
+				up_len -= n;
+				progress = 1;
+			}
+			else if ((e = SSL_get_error(tls_ssl, n)) == SSL_ERROR_WANT_READ)
+				FD_SET(tls_sock, &rset);
+			else if (e == SSL_ERROR_WANT_WRITE)
+				FD_SET(tls_sock, &wset);
+			else
+				break;
+		}
+
+		if (app_eof && up_len == 0)
+		{
+			SSL_shutdown(tls_ssl);
+			break;
+		}
+		if (!progress && select(FD_SETSIZE, &rset, &wset, NULL, NULL) < 0 && errno != EINTR)
+			break;
+	}
+
+	close(tls_app);
+	close(tls_sock);
+	SSL_free(tls_ssl);
+	tls_ssl = NULL;
+	return NULL;
+}
+
+/* Handshake on the connected socket sockfd (host = name of the server, client
+   only). Returns the descriptor to use for the connection: sockfd itself with
+   kTLS, the application end of the relay otherwise; -1 on failure (sockfd is
+   left to the caller). */
+int tls_start(int sockfd, const char *host)
+{
+	struct in6_addr a;
+	SSL *ssl;
+	int pair[2], ktls;
+
+	if ((ssl = SSL_new(tls_ctx)) == NULL || SSL_set_fd(ssl, sockfd) != 1)
+	{
+		tls_errors("SSL_new()");
+		SSL_free(ssl);
+		return -1;
+	}
+	if (host != NULL)
+	{
+		if (inet_pton(AF_INET, host, &a) == 1 || inet_pton(AF_INET6, host, &a) == 1)
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+		else
+		{
+			SSL_set_tlsext_host_name(ssl, host);
+			SSL_set1_host(ssl, host);
+		}
+	}
+
+	tls_timeout(sockfd, TLS_TIMEOUT);
+	if ((tls_server ? SSL_accept(ssl) : SSL_connect(ssl)) != 1)
+	{
+		tls_errors(tls_server ? "SSL_accept()" : "SSL_connect()");
+		SSL_free(ssl);
+		return -1;
+	}
+	tls_timeout(sockfd, 0);
+
+	ktls = BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) && SSL_pending(ssl) == 0;
+	err_msg("(%s) --- %s %s, %s", prog_name, SSL_get_version(ssl), SSL_get_cipher_name(ssl), ktls ? "kTLS" : "user space relay");
+
+	if (ktls)
+	{
+		/* The keys are in the kernel: the session is no longer needed. */
+		SSL_free(ssl);
+		tls_kernel_on = 1;
+		return sockfd;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+	{
+		err_ret("(%s) error - socketpair() failed", prog_name);
+		SSL_free(ssl);
+		return -1;
+	}
+	tls_ssl = ssl;
+	tls_sock = sockfd;
+	tls_app = pair[1];
+	if (pthread_create(&tls_tid, NULL, tls_relay, NULL) != 0)
+	{
+		err_msg("(%s) error - pthread_create() of the TLS relay failed", prog_name);
+		close(pair[0]);
+		close(pair[1]);
+		SSL_free(ssl);
+		tls_ssl = NULL;
+		return -1;
+	}
+	tls_relay_on = 1;
+	return pair[0];
+}
+
+/* Waits for the relay to flush and close the connection; the caller must have
+   closed the descriptor returned by tls_start(). */
+void tls_end(void)
+{
+	tls_kernel_on = 0;
+	if (!tls_relay_on)
+		return;
+	pthread_join(tls_tid, NULL);
+	tls_relay_on = 0;
+}
@@ -0,0 +1,28 @@
+/*
+
+module: tls.h
+
+purpose: definitions of functions in tls.c
+
+*/
+
+#ifndef _TLS_H
+
+#define _TLS_H
+
+#define TLS_TIMEOUT 15	     /* Timeout of the handshake (sec). */
+#define TLS_RELAY_BUFL 16384 /* One TLS record. */
+
+int tls_server_init(const char *certkey, int ktls);
+
+int tls_client_init(const char *cafile, int ktls);
+
+int tls_enabled(void);
+
+int tls_kernel(void);
+
+int tls_start(int sockfd, const char *host);
+
+void tls_end(void);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+
+module: trace.c
+
+purpose: capture of the requests served, for bench/trace_replay
+         with -w file the server appends to file one record per request:
+         command, file name, arrival time, time until the server was ready
+         for the next command, bytes sent, and whether the client had
+         already pipelined it. OPEN and CLOS records keep the connection
+         structure. Each record is written with a single write() on a
+         descriptor opened with O_APPEND before fork(), so the children
+         never interleave inside a record.
+
+         An existing trace is continued (same start, new connection
+         numbers), so a server started with -H keeps writing the trace of
+         the one it replaces.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+
+#include "errlib.h"
+#include "trace.h"
+
+extern char *prog_name;
+
+static int tr_fd = -1;
+static uint64_t tr_start;
+static uint32_t *tr_next_conn; /* shared by all the processes */
+
+/* Connection of the calling process and its request still in progress. */
+static struct tr_record tr_cur;
+static char tr_cur_name[TR_MAXNAME];
+static int tr_pending = 0;
+static uint64_t tr_sent0;
+static uint16_t tr_queued;
+
+static uint64_t tr_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Bytes written so far on connfd (acknowledged + still queued), 0 if it is
+   not a TCP socket (AF_UNIX, TLS relay). */
+static uint64_t tr_sent(int connfd)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	int queued = 0;
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(connfd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0 || len < offsetof(struct tcp_info, tcpi_bytes_acked) + 8)
+		return 0;
+	ioctl(connfd, SIOCOUTQ, &queued);
+	return ti.tcpi_bytes_acked + queued;
+}
+
+static void tr_write(const struct tr_record *r, const char *name)
+{
+	char rec[sizeof(struct tr_record) + TR_MAXNAME];
+
+	memcpy(rec, r, sizeof(*r));
+	memcpy(rec + sizeof(*r), name, r->namelen);
+	if (write(tr_fd, rec, sizeof(*r) + r->namelen) != (ssize_t)(sizeof(*r) + r->namelen))
+		err_ret("(%s) error - write() of the trace failed", prog_name);
+}
+
+/* Opens a trace for reading: -1 if path is not a trace. */
+int tr_open(const char *path, struct tr_header *h)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	if (read(fd, h, sizeof(*h)) != sizeof(*h) || memcmp(h->magic, TR_MAGIC, sizeof(h->magic)) != 0)
+	{
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	return fd;
+}
+
+/* Next record and its name (TR_MAXNAME bytes, terminated). Returns 1, 0 at
+   the end of the trace, -1 if it is truncated. */
+int tr_read(int fd, struct tr_record *r, char *name)
+{
+	ssize_t n;
+
+	if ((n = read(fd, r, sizeof(*r))) == 0)
+		return 0;
+	if (n != sizeof(*r) || r->namelen >= TR_MAXNAME || read(fd, name, r->namelen) != r->namelen)
+		return -1;
+	name[r->namelen] = '\0';
+	return 1;
+}
+
+/* Must be called before fork(). */
+void tr_init(const char *path)
+{
+	struct tr_header h;
+	struct tr_record r;
+	char name[TR_MAXNAME];
+	uint32_t next = 0;
+	int fd;
+
+	if ((tr_next_conn = mmap(NULL, sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		err_sys("(%s) error - mmap() of the trace state failed", prog_name);
+
+	if ((fd = tr_open(path, &h)) >= 0)
+	{
+		/* Continued: connection numbers after the last one in the file. */
+		tr_start = h.start_us;
+		while (tr_read(fd, &r, name) > 0)
+			if (r.conn >= next)
+				next = r.conn + 1;
+		close(fd);
+		if ((tr_fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC)) < 0)
+			err_sys("(%s) error - cannot open the trace '%s'", prog_name, path);
+	}
+	else
+	{
+		if ((tr_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0)
+			err_sys("(%s) error - cannot create the trace '%s'", prog_name, path);
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, TR_MAGIC, sizeof(h.magic));
+		h.start_us = tr_start = tr_now();
+		if (write(tr_fd, &h, sizeof(h)) != sizeof(h))
+			err_sys("(%s) error - write() of the trace '%s' failed", prog_name, path);
+	}
+	*tr_next_conn = next;
+
+	err_msg("(%s) --- requests traced to '%s'%s", prog_name, path, next > 0 ? " (continued)" : "");
+}
+
+static void tr_event(const char *cmd)
+{
+	struct tr_record r;
+
+	memset(&r, 0, sizeof(r));
+	memcpy(r.cmd, cmd, 4);
+	r.conn = tr_cur.conn;
+	r.t_us = tr_now() - tr_start;
+	tr_write(&r, "");
+}
+
+/* Response of the request in progress over. */
+static void tr_finish(int connfd)
+{
+	uint64_t sent;
+
+	if (!tr_pending)
+		return;
+	sent = tr_sent(connfd);
+	tr_cur.service_us = tr_now() - tr_start - tr_cur.t_us;
+	tr_cur.bytes = sent > tr_sent0 ? sent - tr_sent0 : 0;
+	tr_write(&tr_cur, tr_cur_name);
+	tr_pending = 0;
+}
+
+/* A new connection. */
+void tr_begin(void)
+{
+	if (tr_fd < 0)
+		return;
+	memset(&tr_cur, 0, sizeof(tr_cur));
+	tr_cur.conn = __atomic_fetch_add(tr_next_conn, 1, __ATOMIC_RELAXED);
+	tr_pending = 0;
+	tr_queued = 0;
+	tr_event(TR_OPEN);
+}
+
+/* The server is going to wait for the next command; buffered if it has
+   already read pipelined commands from connfd (cmdscan.c). */
+void tr_wait(int connfd, int buffered)
+{
+	int queued = 0, after = tr_pending;
+
+	if (tr_fd < 0)
+		return;
+	tr_finish(connfd);
+	tr_queued = after && (buffered || (ioctl(connfd, FIONREAD, &queued) == 0 && queued > 0)) ? TR_QUEUED : 0;
+}
+
+/* The first 4 bytes of a command have arrived. */
+void tr_command(int connfd, const char *cmd)
+{
+	if (tr_fd < 0)
+		return;
+	tr_finish(connfd);
+	memcpy(tr_cur.cmd, cmd, 4);
+	tr_cur.t_us = tr_now() - tr_start;
+	tr_cur.flags = tr_queued;
+	tr_cur.namelen = 0;
+	tr_cur_name[0] = '\0';
+	tr_sent0 = tr_sent(connfd);
+	tr_pending = 1;
+}
+
+/* File name of the command in progress. */
+void tr_name(const char *name)
+{
+	size_t len;
+
+	if (tr_fd < 0 || !tr_pending)
+		return;
+	if ((len = strlen(name)) >= TR_MAXNAME)
+		len = TR_MAXNAME - 1;
+	memcpy(tr_cur_name, name, len);
+	tr_cur.namelen = len;
+}
+
+/* Connection over (connfd may already be closed). */
+void tr_end(int connfd)
+{
+	if (tr_fd < 0)
+		return;
+	tr_finish(connfd);
+	tr_event(TR_CLOSE);
+}
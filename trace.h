@@ -0,0 +1,71 @@
+/*
+
+module: trace.h
+
+purpose: definitions of the request trace (trace.c)
+
+         file:    header (TR_MAGIC, capture start) followed by one record
+                  per connection event, each record followed by its name:
+
+                      OPEN              connection accepted
+                      <command>         a request, written once its response
+                                        is over: the first 4 bytes of the
+                                        command ("GET ", "CGET", "MGET", ...)
+                                        and, for GET and CGET, the file name
+                      CLOS              connection closed
+
+         Integers are in host byte order. Records of different connections
+         are interleaved in the order they were completed; within one
+         connection they are in order.
+
+*/
+
+#ifndef _TRACE_H
+
+#define _TRACE_H
+
+#include <stdint.h>
+
+#define TR_MAGIC "SRVTRC1\n"
+#define TR_OPEN "OPEN"
+#define TR_CLOSE "CLOS"
+#define TR_MAXNAME 4096
+
+/* The request was already in the socket when the previous response was over
+   (the client pipelined it). */
+#define TR_QUEUED 1
+
+struct tr_header
+{
+	char magic[8];
+	uint64_t start_us; /* CLOCK_REALTIME */
+};
+
+struct tr_record
+{
+	char cmd[4];
+	uint32_t conn;	     /* connection number, unique in the file */
+	uint64_t t_us;	     /* arrival, from the start of the capture */
+	uint32_t service_us; /* until the server waited for the next command */
+	uint16_t flags;
+	uint16_t namelen;    /* bytes of name after the record */
+	uint64_t bytes;	     /* sent for the response (0 if unknown: not TCP, or closed) */
+};
+
+void tr_init(const char *path);
+
+void tr_begin(void);
+
+void tr_wait(int connfd, int buffered);
+
+void tr_command(int connfd, const char *cmd);
+
+void tr_name(const char *name);
+
+void tr_end(int connfd);
+
+int tr_open(const char *path, struct tr_header *h);
+
+int tr_read(int fd, struct tr_record *r, char *name);
+
+#endif